@@ -108,6 +108,11 @@
 #include "net/net_str_id.h"
 
 #include <mach/task.h>
+#include <mach/mach_vm.h>
+#include <mach/vm_map.h>
+#include <vm/vm_kern.h>
+#include <vm/vm_map.h>
+#include <vm/vm_protos.h>
 #include <libkern/section_keywords.h>
 
 #if CONFIG_MEMORYSTATUS
@@ -181,6 +186,12 @@ static void kqueue_interrupt(struct kqueue *kq);
 static int kevent_callback(struct kqueue *kq, struct kevent_internal_s *kevp,
 			   void *data);
 static void kevent_continue(struct kqueue *kq, void *data, int error);
+static int kevent_ring_enter(struct proc *p, int fd, unsigned int flags,
+			     int32_t *retval);
+static void kqueue_drain_activations(struct kqueue *kq);
+static boolean_t kqueue_activations_pending(struct kqueue *kq);
+static void knote_cancel_activation(struct kqueue *kq, struct knote *kn);
+static void kevent_ring_free(struct kqring *ring);
 static void kqueue_scan_continue(void *contp, wait_result_t wait_result);
 static int kqueue_process(struct kqueue *kq, kevent_callback_t callback, void *callback_data,
                           struct filt_process_s *process_data, int *countp, struct proc *p);
@@ -1145,7 +1156,7 @@ filt_procprocess(struct knote *kn, struct filt_process_s *data, struct kevent_in
 /*
  * Values stored in the knote at rest (using Mach absolute time units)
  *
- * kn->kn_hook          where the thread_call object is stored
+ * kn->kn_hook_data     index in the kqueue's timer heap while armed
  * kn->kn_ext[0]        next deadline or 0 if immediate expiration
  * kn->kn_ext[1]        leeway value
  * kn->kn_sdata         interval timer: the interval
@@ -1165,7 +1176,289 @@ static inline void filt_timer_assert_locked(void)
 
 /* state flags stored in kn_hookid */
 #define	TIMER_RUNNING           0x1
-#define	TIMER_CANCELWAIT        0x2
+
+/*
+ * Armed timers don't get a thread call each.  A kqueue's armed timer
+ * knotes are kept in a binary min-heap ordered by deadline, one heap for
+ * each of the two clocks, and each heap is driven by a single thread call
+ * armed for its earliest deadline.  When it pops, every knote that is due
+ * is delivered in the same pass and the call is re-armed for the next one.
+ *
+ * The pop is allowed the leeway of the earliest knote, narrowed so that
+ * it can't be late for any other knote due within that leeway: those get
+ * coalesced into the same pop instead of needing their own.
+ *
+ * The heaps have room for every timer knote attached to the kqueue, so
+ * arming a timer never has to allocate.  All of it is protected by the
+ * timer filter lock, and freed with the kqueue.
+ */
+struct kqtimer_heap {
+	struct knote    **kth_knotes;   /* heap of armed knotes */
+	uint32_t        kth_count;      /* knotes in the heap */
+	boolean_t       kth_continuous; /* deadlines are in continuous time */
+	thread_call_t   kth_callout;    /* armed for the earliest deadline */
+};
+
+struct kqtimer {
+	struct kqtimer_heap kqt_heaps[2];   /* absolute, continuous time */
+	uint32_t        kqt_nknotes;    /* timer knotes attached to the kqueue */
+	uint32_t        kqt_size;       /* slots in each heap */
+};
+
+#define KQTIMER_HEAP_MIN        16      /* initial slots in each heap */
+#define KQTIMER_COALESCE_SCAN   32      /* knotes considered for coalescing */
+
+static void filt_timerexpire(void *kthx, void *spare);
+
+static inline struct kqtimer_heap *
+filt_timer_heap(struct knote *kn)
+{
+	struct kqtimer *kqt = knote_get_kq(kn)->kq_timers;
+
+	return &kqt->kqt_heaps[(kn->kn_sfflags & NOTE_MACH_CONTINUOUS_TIME) ? 1 : 0];
+}
+
+static inline void
+filt_timer_heap_set(struct kqtimer_heap *kth, uint32_t i, struct knote *kn)
+{
+	kth->kth_knotes[i] = kn;
+	kn->kn_hook_data = i;
+}
+
+static void
+filt_timer_heap_up(struct kqtimer_heap *kth, uint32_t i)
+{
+	struct knote *kn = kth->kth_knotes[i];
+	uint32_t parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (kth->kth_knotes[parent]->kn_ext[0] <= kn->kn_ext[0])
+			break;
+		filt_timer_heap_set(kth, i, kth->kth_knotes[parent]);
+		i = parent;
+	}
+	filt_timer_heap_set(kth, i, kn);
+}
+
+static void
+filt_timer_heap_down(struct kqtimer_heap *kth, uint32_t i)
+{
+	struct knote *kn = kth->kth_knotes[i];
+	uint32_t child;
+
+	while ((child = 2 * i + 1) < kth->kth_count) {
+		if (child + 1 < kth->kth_count &&
+		    kth->kth_knotes[child + 1]->kn_ext[0] < kth->kth_knotes[child]->kn_ext[0])
+			child++;
+		if (kn->kn_ext[0] <= kth->kth_knotes[child]->kn_ext[0])
+			break;
+		filt_timer_heap_set(kth, i, kth->kth_knotes[child]);
+		i = child;
+	}
+	filt_timer_heap_set(kth, i, kn);
+}
+
+static void
+filt_timer_heap_remove(struct kqtimer_heap *kth, struct knote *kn)
+{
+	uint32_t i = (uint32_t)kn->kn_hook_data;
+	struct knote *last;
+
+	assert(i < kth->kth_count && kth->kth_knotes[i] == kn);
+
+	last = kth->kth_knotes[--kth->kth_count];
+	if (last != kn) {
+		filt_timer_heap_set(kth, i, last);
+		if (i > 0 && kth->kth_knotes[(i - 1) / 2]->kn_ext[0] > last->kn_ext[0])
+			filt_timer_heap_up(kth, i);
+		else
+			filt_timer_heap_down(kth, i);
+	}
+}
+
+/* thread call flags for a knote's timer */
+static unsigned int
+filt_timer_call_flags(struct knote *kn)
+{
+	if (kn->kn_sfflags & NOTE_CRITICAL)
+		return THREAD_CALL_DELAY_USER_CRITICAL;
+	else if (kn->kn_sfflags & NOTE_BACKGROUND)
+		return THREAD_CALL_DELAY_USER_BACKGROUND;
+	else
+		return THREAD_CALL_DELAY_USER_NORMAL;
+}
+
+static inline uint64_t
+filt_timer_latest(struct knote *kn)
+{
+	uint64_t latest;
+
+	if ((kn->kn_sfflags & NOTE_LEEWAY) == 0)
+		return kn->kn_ext[0];
+	if (os_add_overflow(kn->kn_ext[0], (uint64_t)kn->kn_ext[1], &latest))
+		return UINT64_MAX;
+	return latest;
+}
+
+/*
+ * Arm the heap's thread call for its earliest knote.
+ *
+ * The pop is put off to the latest deadline that every knote due by
+ * then still allows: walking the heap in deadline order, each knote
+ * joins the pop as long as its deadline is within the window the
+ * knotes before it left open, and narrows that window to its own
+ * leeway.  The pop is then armed at the last deadline taken, with what
+ * is left of the window as its leeway, and the most urgent of their
+ * priorities.  filt_timerexpire() only delivers knotes that are due,
+ * so none of them ever fires early.  The walk gives up after
+ * KQTIMER_COALESCE_SCAN knotes, which only makes the pop earlier.
+ */
+static void
+filt_timer_heap_arm(struct kqtimer_heap *kth)
+{
+	uint32_t frontier[KQTIMER_COALESCE_SCAN + 2];
+	uint32_t nfrontier = 0, visited = 0, i, best;
+	struct knote *kn = kth->kth_knotes[0];
+	uint64_t deadline = kn->kn_ext[0];
+	uint64_t latest = filt_timer_latest(kn);
+	unsigned int flags = filt_timer_call_flags(kn);
+
+	filt_timer_assert_locked();
+
+	/* the frontier holds the children of the knotes taken so far */
+	if (kth->kth_count > 1)
+		frontier[nfrontier++] = 1;
+	if (kth->kth_count > 2)
+		frontier[nfrontier++] = 2;
+
+	while (nfrontier > 0 && visited < KQTIMER_COALESCE_SCAN) {
+		/* the earliest knote left is always on the frontier */
+		for (best = 0, i = 1; i < nfrontier; i++) {
+			if (kth->kth_knotes[frontier[i]]->kn_ext[0] <
+			    kth->kth_knotes[frontier[best]]->kn_ext[0])
+				best = i;
+		}
+
+		kn = kth->kth_knotes[frontier[best]];
+		if (kn->kn_ext[0] > latest)
+			break;
+		visited++;
+
+		deadline = kn->kn_ext[0];
+		latest = MIN(latest, filt_timer_latest(kn));
+		if (filt_timer_call_flags(kn) == THREAD_CALL_DELAY_USER_CRITICAL ||
+		    flags == THREAD_CALL_DELAY_USER_BACKGROUND)
+			flags = filt_timer_call_flags(kn);
+
+		i = frontier[best];
+		frontier[best] = frontier[--nfrontier];
+		if (2 * i + 1 < kth->kth_count)
+			frontier[nfrontier++] = 2 * i + 1;
+		if (2 * i + 2 < kth->kth_count)
+			frontier[nfrontier++] = 2 * i + 2;
+	}
+
+	if (latest > deadline)
+		flags |= THREAD_CALL_DELAY_LEEWAY;
+	if (kth->kth_continuous)
+		flags |= THREAD_CALL_CONTINUOUS;
+
+	thread_call_enter_delayed_with_leeway(kth->kth_callout, NULL,
+	                                      deadline, latest - deadline,
+	                                      flags);
+}
+
+/*
+ * Make room in the kqueue's timer heaps for one more timer knote,
+ * setting them up with the kqueue's first one.
+ */
+static int
+filt_timer_reserve(struct kqueue *kq)
+{
+	struct kqtimer *kqt = kq->kq_timers;
+	struct knote **knotes[2];
+	uint32_t size;
+	int i;
+
+	filt_timer_assert_locked();
+
+	if (kqt == NULL) {
+		kqt = kalloc(sizeof(*kqt));
+		if (kqt == NULL)
+			return (ENOMEM);
+		bzero(kqt, sizeof(*kqt));
+
+		for (i = 0; i < 2; i++) {
+			kqt->kqt_heaps[i].kth_continuous = (i == 1);
+			kqt->kqt_heaps[i].kth_callout = thread_call_allocate_with_options(
+			                filt_timerexpire, (thread_call_param_t)&kqt->kqt_heaps[i],
+			                THREAD_CALL_PRIORITY_HIGH, THREAD_CALL_OPTIONS_ONCE);
+			if (kqt->kqt_heaps[i].kth_callout == NULL) {
+				if (i == 1)
+					thread_call_free(kqt->kqt_heaps[0].kth_callout);
+				kfree(kqt, sizeof(*kqt));
+				return (ENOMEM);
+			}
+		}
+		kq->kq_timers = kqt;
+	}
+
+	if (kqt->kqt_nknotes == kqt->kqt_size) {
+		size = kqt->kqt_size ? 2 * kqt->kqt_size : KQTIMER_HEAP_MIN;
+
+		for (i = 0; i < 2; i++) {
+			knotes[i] = kalloc(size * sizeof(struct knote *));
+			if (knotes[i] == NULL) {
+				if (i == 1)
+					kfree(knotes[0], size * sizeof(struct knote *));
+				return (ENOMEM);
+			}
+		}
+		for (i = 0; i < 2; i++) {
+			struct kqtimer_heap *kth = &kqt->kqt_heaps[i];
+
+			if (kth->kth_knotes != NULL) {
+				bcopy(kth->kth_knotes, knotes[i], kth->kth_count * sizeof(struct knote *));
+				kfree(kth->kth_knotes, kqt->kqt_size * sizeof(struct knote *));
+			}
+			kth->kth_knotes = knotes[i];
+		}
+		kqt->kqt_size = size;
+	}
+
+	kqt->kqt_nknotes++;
+	return (0);
+}
+
+/*
+ * Free the kqueue's timer heaps once all its knotes are gone,
+ * waiting out a pop that may still be running.
+ */
+static void
+filt_timer_kqueue_free(struct kqueue *kq)
+{
+	struct kqtimer *kqt = kq->kq_timers;
+	int i;
+
+	if (kqt == NULL)
+		return;
+
+	assert(kqt->kqt_nknotes == 0);
+
+	for (i = 0; i < 2; i++) {
+		struct kqtimer_heap *kth = &kqt->kqt_heaps[i];
+
+		assert(kth->kth_count == 0);
+		thread_call_cancel_wait(kth->kth_callout);
+		__assert_only boolean_t freed = thread_call_free(kth->kth_callout);
+		assert(freed);
+		if (kth->kth_knotes != NULL)
+			kfree(kth->kth_knotes, kqt->kqt_size * sizeof(struct knote *));
+	}
+	kfree(kqt, sizeof(*kqt));
+	kq->kq_timers = NULL;
+}
 
 /*
  * filt_timervalidate - process data from user
@@ -1368,82 +1661,67 @@ filt_timervalidate(struct knote *kn)
 /*
  * filt_timerexpire - the timer callout routine
  *
- * Just propagate the timer event into the knote
- * filter routine (by going through the knote
- * synchronization point).  Pass a hint to
- * indicate this is a real event, not just a
- * query from above.
+ * Take every knote that is due off the heap and propagate the
+ * timer event into each of them in one pass through the knote
+ * synchronization point.  Pass a hint to indicate this is a
+ * real event, not just a query from above.
  */
 static void
-filt_timerexpire(void *knx, __unused void *spare)
+filt_timerexpire(void *kthx, __unused void *spare)
 {
+	struct kqtimer_heap *kth = kthx;
 	struct klist timer_list;
-	struct knote *kn = knx;
+	struct knote *kn;
+	uint64_t now;
 
 	filt_timerlock();
 
-	kn->kn_hookid &= ~TIMER_RUNNING;
+	if (kth->kth_continuous)
+		now = mach_continuous_time();
+	else
+		now = mach_absolute_time();
 
 	/* no "object" for timers, so fake a list */
 	SLIST_INIT(&timer_list);
-	SLIST_INSERT_HEAD(&timer_list, kn, kn_selnext);
 
-	KNOTE(&timer_list, 1);
+	while (kth->kth_count > 0 && kth->kth_knotes[0]->kn_ext[0] < now) {
+		kn = kth->kth_knotes[0];
+		filt_timer_heap_remove(kth, kn);
+		kn->kn_hookid &= ~TIMER_RUNNING;
+		SLIST_INSERT_HEAD(&timer_list, kn, kn_selnext);
+	}
 
-	/* if someone is waiting for timer to pop */
-	if (kn->kn_hookid & TIMER_CANCELWAIT) {
-		struct kqueue *kq = knote_get_kq(kn);
-		waitq_wakeup64_all((struct waitq *)&kq->kq_wqs,
-				   CAST_EVENT64_T(&kn->kn_hook),
-				   THREAD_AWAKENED,
-				   WAITQ_ALL_PRIORITIES);
+	KNOTE(&timer_list, 1);
 
-		kn->kn_hookid &= ~TIMER_CANCELWAIT;
-	}
+	if (kth->kth_count > 0)
+		filt_timer_heap_arm(kth);
 
 	filt_timerunlock();
 }
 
 /*
- * Cancel a running timer (or wait for the pop).
+ * Cancel a running timer.
  * Timer filter lock is held.
- * May drop and retake the timer filter lock.
+ *
+ * The thread call stays armed if the knote was the earliest one:
+ * it finds nothing due and re-arms for the next.
  */
 static void
 filt_timercancel(struct knote *kn)
 {
 	filt_timer_assert_locked();
 
-	assert((kn->kn_hookid & TIMER_CANCELWAIT) == 0);
-
 	/* if no timer, then we're good */
 	if ((kn->kn_hookid & TIMER_RUNNING) == 0)
 		return;
 
-	thread_call_t callout = (thread_call_t)kn->kn_hook;
-
-	/* cancel the callout if we can */
-	if (thread_call_cancel(callout)) {
-		kn->kn_hookid &= ~TIMER_RUNNING;
-		return;
-	}
-
-	/* cancel failed, we have to wait for the in-flight expire routine */
-
-	kn->kn_hookid |= TIMER_CANCELWAIT;
-
-	struct kqueue *kq = knote_get_kq(kn);
+	struct kqtimer_heap *kth = filt_timer_heap(kn);
 
-	waitq_assert_wait64((struct waitq *)&kq->kq_wqs,
-	                    CAST_EVENT64_T(&kn->kn_hook),
-	                    THREAD_UNINT, TIMEOUT_WAIT_FOREVER);
-
-	filt_timerunlock();
-	thread_block(THREAD_CONTINUE_NULL);
-	filt_timerlock();
+	filt_timer_heap_remove(kth, kn);
+	kn->kn_hookid &= ~TIMER_RUNNING;
 
-	assert((kn->kn_hookid & TIMER_CANCELWAIT) == 0);
-	assert((kn->kn_hookid & TIMER_RUNNING) == 0);
+	if (kth->kth_count == 0)
+		thread_call_cancel(kth->kth_callout);
 }
 
 static void
@@ -1453,30 +1731,16 @@ filt_timerarm(struct knote *kn)
 
 	assert((kn->kn_hookid & TIMER_RUNNING) == 0);
 
-	thread_call_t callout = (thread_call_t)kn->kn_hook;
-
-	uint64_t deadline = kn->kn_ext[0];
-	uint64_t leeway   = kn->kn_ext[1];
-
-	int filter_flags = kn->kn_sfflags;
-	unsigned int timer_flags = 0;
-
-	if (filter_flags & NOTE_CRITICAL)
-		timer_flags |= THREAD_CALL_DELAY_USER_CRITICAL;
-	else if (filter_flags & NOTE_BACKGROUND)
-		timer_flags |= THREAD_CALL_DELAY_USER_BACKGROUND;
-	else
-		timer_flags |= THREAD_CALL_DELAY_USER_NORMAL;
+	struct kqtimer_heap *kth = filt_timer_heap(kn);
 
-	if (filter_flags & NOTE_LEEWAY)
-		timer_flags |= THREAD_CALL_DELAY_LEEWAY;
+	assert(kth->kth_count < knote_get_kq(kn)->kq_timers->kqt_size);
 
-	if (filter_flags & NOTE_MACH_CONTINUOUS_TIME)
-		timer_flags |= THREAD_CALL_CONTINUOUS;
+	filt_timer_heap_set(kth, kth->kth_count++, kn);
+	filt_timer_heap_up(kth, (uint32_t)kn->kn_hook_data);
 
-	thread_call_enter_delayed_with_leeway(callout, NULL,
-	                                      deadline, leeway,
-	                                      timer_flags);
+	/* only a new earliest deadline moves the thread call */
+	if (kth->kth_knotes[0] == kn)
+		filt_timer_heap_arm(kth);
 
 	kn->kn_hookid |= TIMER_RUNNING;
 }
@@ -1503,37 +1767,24 @@ filt_timer_is_ready(struct knote *kn)
 }
 
 /*
- * Allocate a thread call for the knote's lifetime, and kick off the timer.
+ * Make room for the knote in its kqueue's timer heaps, and kick off the timer.
  */
 static int
 filt_timerattach(struct knote *kn, __unused struct kevent_internal_s *kev)
 {
-	thread_call_t callout;
 	int error;
 
-	callout = thread_call_allocate_with_options(filt_timerexpire,
-	                (thread_call_param_t)kn, THREAD_CALL_PRIORITY_HIGH,
-	                THREAD_CALL_OPTIONS_ONCE);
-
-	if (NULL == callout) {
-		kn->kn_flags = EV_ERROR;
-		kn->kn_data = ENOMEM;
-		return 0;
-	}
-
 	filt_timerlock();
 
-	if ((error = filt_timervalidate(kn)) != 0) {
+	if ((error = filt_timervalidate(kn)) != 0 ||
+	    (error = filt_timer_reserve(knote_get_kq(kn))) != 0) {
 		kn->kn_flags = EV_ERROR;
 		kn->kn_data  = error;
 		filt_timerunlock();
-
-		__assert_only boolean_t freed = thread_call_free(callout);
-		assert(freed);
 		return 0;
 	}
 
-	kn->kn_hook = (void*)callout;
+	kn->kn_hook_data = 0;
 	kn->kn_hookid = 0;
 	kn->kn_flags |= EV_CLEAR;
 
@@ -1556,22 +1807,17 @@ filt_timerattach(struct knote *kn, __unused struct kevent_internal_s *kev)
 }
 
 /*
- * Shut down the timer if it's running, and free the callout.
+ * Shut down the timer if it's running, and give back its heap slot.
  */
 static void
 filt_timerdetach(struct knote *kn)
 {
-	thread_call_t callout;
-
 	filt_timerlock();
 
-	callout = (thread_call_t)kn->kn_hook;
 	filt_timercancel(kn);
+	knote_get_kq(kn)->kq_timers->kqt_nknotes--;
 
 	filt_timerunlock();
-
-	__assert_only boolean_t freed = thread_call_free(callout);
-	assert(freed);
 }
 
 /*
@@ -1605,10 +1851,7 @@ filt_timertouch(
 
 	filt_timerlock();
 
-	/*
-	 * cancel current call - drops and retakes lock
-	 * TODO: not safe against concurrent touches?
-	 */
+	/* cancel current timer */
 	filt_timercancel(kn);
 
 	/* clear if the timer had previously fired, the user no longer wants to see it */
@@ -1662,13 +1905,9 @@ filt_timerprocess(
 {
 	filt_timerlock();
 
-	if (kn->kn_data == 0 || (kn->kn_hookid & TIMER_CANCELWAIT)) {
+	if (kn->kn_data == 0) {
 		/*
-		 * kn_data = 0:
 		 * The timer hasn't yet fired, so there's nothing to deliver
-		 * TIMER_CANCELWAIT:
-		 * touch is in the middle of canceling the timer,
-		 * so don't deliver or re-arm anything
 		 *
 		 * This can happen if a touch resets a timer that had fired
 		 * without being processed
@@ -3112,6 +3351,9 @@ kqueue_dealloc(struct kqueue *kq)
 		}
 	}
 
+	/* all the timer knotes are gone, free their heaps */
+	filt_timer_kqueue_free(kq);
+
 	/*
 	 * waitq_set_deinit() remove the KQ's waitq set from
 	 * any select sets to which it may belong.
@@ -3134,6 +3376,8 @@ kqueue_dealloc(struct kqueue *kq)
 	} else {
 		struct kqfile *kqf = (struct kqfile *)kq;
 
+		if (kqf->kqf_ring != NULL)
+			kevent_ring_free(kqf->kqf_ring);
 		zfree(kqfile_zone, kqf);
 	}
 }
@@ -3217,6 +3461,44 @@ kqueue(struct proc *p, __unused struct kqueue_args *uap, int32_t *retval)
 	return (kqueue_body(p, fileproc_alloc_init, NULL, retval));
 }
 
+static void
+kevent_qos_to_internal(const struct kevent_qos_s *kevqos,
+    struct kevent_internal_s *kevp)
+{
+	bzero(kevp, sizeof (*kevp));
+	kevp->ident = kevqos->ident;
+	kevp->filter = kevqos->filter;
+	kevp->flags = kevqos->flags;
+	kevp->qos = kevqos->qos;
+//	kevp->xflags = kevqos->xflags;
+	kevp->udata = kevqos->udata;
+	kevp->fflags = kevqos->fflags;
+	kevp->data = kevqos->data;
+	kevp->ext[0] = kevqos->ext[0];
+	kevp->ext[1] = kevqos->ext[1];
+	kevp->ext[2] = kevqos->ext[2];
+	kevp->ext[3] = kevqos->ext[3];
+}
+
+static void
+kevent_internal_to_qos(const struct kevent_internal_s *kevp,
+    struct kevent_qos_s *kevqos)
+{
+	bzero(kevqos, sizeof (*kevqos));
+	kevqos->ident = kevp->ident;
+	kevqos->filter = kevp->filter;
+	kevqos->flags = kevp->flags;
+	kevqos->qos = kevp->qos;
+	kevqos->udata = kevp->udata;
+	kevqos->fflags = kevp->fflags;
+	kevqos->xflags = 0;
+	kevqos->data = (int64_t) kevp->data;
+	kevqos->ext[0] = kevp->ext[0];
+	kevqos->ext[1] = kevp->ext[1];
+	kevqos->ext[2] = kevp->ext[2];
+	kevqos->ext[3] = kevp->ext[3];
+}
+
 static int
 kevent_copyin(user_addr_t *addrp, struct kevent_internal_s *kevp, struct proc *p,
     unsigned int flags)
@@ -3275,24 +3557,11 @@ kevent_copyin(user_addr_t *addrp, struct kevent_internal_s *kevp, struct proc *p
 	} else {
 		struct kevent_qos_s kevqos;
 
-		bzero(kevp, sizeof (*kevp));
-
 		advance = sizeof (struct kevent_qos_s);
 		error = copyin(*addrp, (caddr_t)&kevqos, advance);
 		if (error)
 			return error;
-		kevp->ident = kevqos.ident;
-		kevp->filter = kevqos.filter;
-		kevp->flags = kevqos.flags;
-		kevp->qos = kevqos.qos;
-//		kevp->xflags = kevqos.xflags;
-		kevp->udata = kevqos.udata;
-		kevp->fflags = kevqos.fflags;
-		kevp->data = kevqos.data;
-		kevp->ext[0] = kevqos.ext[0];
-		kevp->ext[1] = kevqos.ext[1];
-		kevp->ext[2] = kevqos.ext[2];
-		kevp->ext[3] = kevqos.ext[3];
+		kevent_qos_to_internal(&kevqos, kevp);
 	}
 	if (!error)
 		*addrp += advance;
@@ -3372,19 +3641,7 @@ kevent_copyout(struct kevent_internal_s *kevp, user_addr_t *addrp, struct proc *
 		if (flags & KEVENT_FLAG_STACK_EVENTS) {
 			addr -= advance;
 		}
-		bzero(&kevqos, advance);
-		kevqos.ident = kevp->ident;
-		kevqos.filter = kevp->filter;
-		kevqos.flags = kevp->flags;
-		kevqos.qos = kevp->qos;
-		kevqos.udata = kevp->udata;
-		kevqos.fflags = kevp->fflags;
-		kevqos.xflags = 0;
-		kevqos.data = (int64_t) kevp->data;
-		kevqos.ext[0] = kevp->ext[0];
-		kevqos.ext[1] = kevp->ext[1];
-		kevqos.ext[2] = kevp->ext[2];
-		kevqos.ext[3] = kevp->ext[3];
+		kevent_internal_to_qos(kevp, &kevqos);
 		error = copyout((caddr_t)&kevqos, addr, advance);
 	}
 	if (!error) {
@@ -3542,6 +3799,15 @@ kevent_qos(struct proc *p, struct kevent_qos_args *uap, int32_t *retval)
 	/* restrict to user flags */
 	uap->flags &= KEVENT_FLAG_USER;
 
+	/* changes and events are in the kqueue's rings, not in lists */
+	if (uap->flags & KEVENT_FLAG_RING) {
+		if (uap->changelist != USER_ADDR_NULL || uap->nchanges != 0 ||
+		    uap->eventlist != USER_ADDR_NULL || uap->nevents != 0 ||
+		    uap->data_out != USER_ADDR_NULL || uap->data_available != USER_ADDR_NULL)
+			return EINVAL;
+		return kevent_ring_enter(p, uap->fd, uap->flags, retval);
+	}
+
 	return kevent_internal(p,
 	                       (kqueue_id_t)uap->fd, NULL,
 	                       uap->changelist, uap->nchanges,
@@ -4265,6 +4531,10 @@ kevent_internal(struct proc *p,
 	user_size_t data_resid;
 	thread_t thread = current_thread();
 
+	/* rings are only used through kevent_qos() */
+	if (flags & KEVENT_FLAG_RING)
+		return EINVAL;
+
 	/* Don't allow user-space threads to process output events from the workq kqs */
 	if (((flags & (KEVENT_FLAG_WORKQ | KEVENT_FLAG_KERNEL)) == KEVENT_FLAG_WORKQ) &&
 	    kevent_args_requesting_events(flags, nevents))
@@ -4469,6 +4739,332 @@ kevent_callback(__unused struct kqueue *kq, struct kevent_internal_s *kevp,
 	return (error);
 }
 
+/*
+ * kevent rings
+ *
+ *	A kqueue opened with kqueue() can be given a pair of rings it shares
+ *	with its process (kevent_ring_setup()).  The process queues changes
+ *	in the submission ring, and calling kevent_qos() with
+ *	KEVENT_FLAG_RING and no lists registers all of them, then processes
+ *	the kqueue straight into the completion ring, as many events as
+ *	fit, blocking only if none are pending.  Nothing is copied in or
+ *	out, and a process that drains the completion ring between calls
+ *	only needs to enter the kernel once it runs dry.
+ *
+ *	Events are posted by kqueue_process() in the calling thread rather
+ *	than as knotes are activated: activation happens with the kqueue
+ *	spinlock held, often from interrupt context, while the f_process
+ *	routines that produce the events may block.
+ *
+ *	Calls in ring mode are serialized by kring_lock.  The kernel keeps
+ *	its own copy of the ring geometry and of the indices it owns, and
+ *	only ever reads the indices owned by the process from the shared
+ *	header.
+ *
+ *	The rings are anonymous memory with a VM object of their own,
+ *	mapped once in the kernel and once in the process.  Each mapping
+ *	holds a reference on the object, so the kqueue going away only
+ *	removes the kernel's mapping, and the process keeps its pages
+ *	until it unmaps them.  They are pageable: the kernel only touches
+ *	them from the thread in kevent_qos(), with no spinlock held.
+ */
+struct kqring {
+	lck_mtx_t                 kring_lock;     /* serializes ring mode calls */
+	struct kevent_ring_header *kring_header;  /* kernel mapping of the rings */
+	struct kevent_qos_s       *kring_sq;      /* submission ring */
+	struct kevent_qos_s       *kring_cq;      /* completion ring */
+	mach_vm_offset_t          kring_kaddr;    /* kernel mapping */
+	mach_vm_size_t            kring_size;
+	uint32_t                  kring_entries;  /* per ring, a power of two */
+	uint32_t                  kring_sq_head;  /* next change to register */
+	uint32_t                  kring_cq_tail;  /* next event to post */
+};
+
+struct kevent_ring_scan {
+	struct kqring             *krs_ring;
+	uint32_t                  krs_space;      /* free completion entries */
+	int                       krs_posted;     /* events posted */
+};
+
+static void
+kevent_ring_free(struct kqring *ring)
+{
+	/* drops the kernel's reference, the process may still map the rings */
+	if (ring->kring_kaddr != 0)
+		mach_vm_deallocate(kernel_map, ring->kring_kaddr, ring->kring_size);
+	lck_mtx_destroy(&ring->kring_lock, kq_lck_grp);
+	kfree(ring, sizeof (*ring));
+}
+
+/*
+ * kevent_ring_setup - [syscall] share change and event rings with a kqueue
+ *
+ *	The rings stay mapped in the process until it unmaps them,
+ *	even once the kqueue is closed.
+ */
+int
+kevent_ring_setup(struct proc *p, struct kevent_ring_setup_args *uap,
+    __unused int32_t *retval)
+{
+	struct kevent_ring_header *hdr;
+	struct fileproc *fp;
+	struct kqueue *kq;
+	struct kqfile *kqf;
+	struct kqring *ring;
+	mach_port_t mem_entry = MACH_PORT_NULL;
+	mach_vm_offset_t user_addr = 0;
+	mach_vm_size_t size;
+	vm_map_t user_map = current_map();
+	uint32_t entries = uap->entries;
+	kern_return_t kr;
+	int error;
+
+	if (entries == 0 || entries > KEVENT_RING_ENTRIES_MAX ||
+	    (entries & (entries - 1)) != 0)
+		return EINVAL;
+
+	error = fp_getfkq(p, uap->fd, &fp, &kq);
+	if (error)
+		return error;
+	kqf = (struct kqfile *)kq;
+
+	/* events are posted to the rings in the kevent_qos_s format */
+	error = kevent_set_kq_mode(kq, KEVENT_FLAG_NONE);
+	if (error)
+		goto out;
+	if (kqf->kqf_ring != NULL) {
+		error = EBUSY;
+		goto out;
+	}
+
+	ring = (struct kqring *)kalloc(sizeof (*ring));
+	if (ring == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	bzero(ring, sizeof (*ring));
+
+	lck_mtx_init(&ring->kring_lock, kq_lck_grp, kq_lck_attr);
+
+	size = round_page(sizeof (*hdr) + 2 * entries * sizeof (struct kevent_qos_s));
+	kr = mach_make_memory_entry_64(VM_MAP_NULL, &size, 0,
+	                               MAP_MEM_NAMED_CREATE | VM_PROT_READ | VM_PROT_WRITE,
+	                               &mem_entry, MACH_PORT_NULL);
+	if (kr != KERN_SUCCESS) {
+		kevent_ring_free(ring);
+		error = ENOMEM;
+		goto out;
+	}
+	ring->kring_size = size;
+	ring->kring_entries = entries;
+
+	kr = mach_vm_map_kernel(kernel_map, &ring->kring_kaddr, size, 0,
+	                        VM_FLAGS_ANYWHERE, VM_KERN_MEMORY_FILE,
+	                        mem_entry, 0, FALSE,
+	                        VM_PROT_READ | VM_PROT_WRITE,
+	                        VM_PROT_READ | VM_PROT_WRITE,
+	                        VM_INHERIT_NONE);
+	if (kr == KERN_SUCCESS) {
+		/* the rings belong to this process, a child doesn't get them */
+		kr = mach_vm_map_kernel(user_map, &user_addr, size, 0,
+		                        VM_FLAGS_ANYWHERE, VM_KERN_MEMORY_NONE,
+		                        mem_entry, 0, FALSE,
+		                        VM_PROT_READ | VM_PROT_WRITE,
+		                        VM_PROT_READ | VM_PROT_WRITE,
+		                        VM_INHERIT_NONE);
+	} else {
+		ring->kring_kaddr = 0;
+	}
+	/* the mappings hold their own references on the object */
+	mach_memory_entry_port_release(mem_entry);
+	if (kr != KERN_SUCCESS) {
+		kevent_ring_free(ring);
+		error = ENOMEM;
+		goto out;
+	}
+
+	/* fresh anonymous memory is zero filled */
+	hdr = ring->kring_header = (struct kevent_ring_header *)ring->kring_kaddr;
+	ring->kring_sq = (struct kevent_qos_s *)(hdr + 1);
+	ring->kring_cq = ring->kring_sq + entries;
+	hdr->krh_entries = entries;
+	hdr->krh_sq_offset = sizeof (*hdr);
+	hdr->krh_cq_offset = sizeof (*hdr) + entries * sizeof (struct kevent_qos_s);
+
+	/* another thread may have set up rings in the meantime */
+	kqlock(kq);
+	if (kqf->kqf_ring == NULL) {
+		kqf->kqf_ring = ring;
+		ring = NULL;
+	}
+	kqunlock(kq);
+	if (ring != NULL) {
+		mach_vm_deallocate(user_map, user_addr, size);
+		kevent_ring_free(ring);
+		error = EBUSY;
+		goto out;
+	}
+
+	error = copyout(CAST_DOWN(void *, &user_addr), uap->ring,
+	                vm_map_is_64bit(user_map) ? 8 : 4);
+out:
+	fp_drop(p, uap->fd, fp, 0);
+	return error;
+}
+
+/*
+ * kevent_ring_post - post an event at the tail of the completion ring
+ *
+ *	called with the ring lock held, once there is room for it
+ */
+static void
+kevent_ring_post(struct kqring *ring, struct kevent_internal_s *kevp)
+{
+	uint32_t index = ring->kring_cq_tail++ & (ring->kring_entries - 1);
+
+	kevent_internal_to_qos(kevp, &ring->kring_cq[index]);
+
+	/* the event has to be visible before the tail that covers it */
+	OSMemoryBarrier();
+	ring->kring_header->krh_cq_tail = ring->kring_cq_tail;
+}
+
+/*
+ * kevent_ring_callback - callback for each event processed in ring mode
+ *
+ * called with nothing locked but the ring
+ * caller holds a reference on the kqueue
+ */
+static int
+kevent_ring_callback(__unused struct kqueue *kq, struct kevent_internal_s *kevp,
+    void *data)
+{
+	struct kevent_ring_scan *scan = (struct kevent_ring_scan *)data;
+
+	assert(scan->krs_space > 0);
+	kevent_ring_post(scan->krs_ring, kevp);
+	scan->krs_posted++;
+
+	/* stop processing once the completion ring is full */
+	if (--scan->krs_space == 0)
+		return EWOULDBLOCK;
+	return 0;
+}
+
+/*
+ * kevent_ring_enter - register the queued changes and collect events
+ *
+ *	Returns the number of events posted to the completion ring,
+ *	including the change errors and receipts.
+ */
+static int
+kevent_ring_enter(struct proc *p, int fd, unsigned int flags, int32_t *retval)
+{
+	struct kevent_ring_scan scan = { .krs_ring = NULL };
+	struct kevent_ring_header *hdr;
+	struct filt_process_s process_data;
+	struct kevent_internal_s kev;
+	struct kevent_qos_s kevqos;
+	struct fileproc *fp;
+	struct kqueue *kq;
+	struct kqring *ring;
+	struct timeval atv;
+	uint32_t mask, tail, used;
+	int error;
+
+	if (flags & ~(KEVENT_FLAG_RING | KEVENT_FLAG_IMMEDIATE | KEVENT_FLAG_ERROR_EVENTS))
+		return EINVAL;
+
+	error = kevent_get_timeout(p, USER_ADDR_NULL, flags, &atv);
+	if (error)
+		return error;
+
+	error = fp_getfkq(p, fd, &fp, &kq);
+	if (error)
+		return error;
+
+	kqlock(kq);
+	ring = ((struct kqfile *)kq)->kqf_ring;
+	kqunlock(kq);
+	if (ring == NULL) {
+		fp_drop(p, fd, fp, 0);
+		return EINVAL;
+	}
+
+	lck_mtx_lock(&ring->kring_lock);
+	hdr = ring->kring_header;
+	mask = ring->kring_entries - 1;
+
+	/* the process may have moved its indices anywhere */
+	tail = hdr->krh_sq_tail;
+	used = ring->kring_cq_tail - hdr->krh_cq_head;
+	if (tail - ring->kring_sq_head > ring->kring_entries ||
+	    used > ring->kring_entries) {
+		error = EINVAL;
+		goto out;
+	}
+	scan.krs_ring = ring;
+	scan.krs_space = ring->kring_entries - used;
+
+	/* don't read changes from before the tail was moved past them */
+	OSMemoryBarrier();
+
+	/* register all the changes the process queued */
+	while (ring->kring_sq_head != tail) {
+		/* work on a copy, the process could be rewriting the entry */
+		kevqos = ring->kring_sq[ring->kring_sq_head & mask];
+		ring->kring_sq_head++;
+		kevent_qos_to_internal(&kevqos, &kev);
+
+		/* Make sure user doesn't pass in any system flags */
+		kev.flags &= ~EV_SYSFLAGS;
+
+		kevent_register(kq, &kev, p);
+
+		if (scan.krs_space > 0 &&
+		    ((kev.flags & EV_ERROR) || (kev.flags & EV_RECEIPT))) {
+			if (kev.flags & EV_RECEIPT) {
+				kev.flags |= EV_ERROR;
+				kev.data = 0;
+			}
+			kevent_ring_post(ring, &kev);
+			scan.krs_space--;
+			scan.krs_posted++;
+		} else if (kev.flags & EV_ERROR) {
+			error = (int)kev.data;
+			break;
+		}
+	}
+	hdr->krh_sq_head = ring->kring_sq_head;
+
+	/* process pending events, without waiting if we already have some */
+	if (error == 0 && scan.krs_space > 0 &&
+	    (flags & KEVENT_FLAG_ERROR_EVENTS) == 0) {
+		if (scan.krs_posted > 0)
+			getmicrouptime(&atv);
+
+		bzero(&process_data, sizeof (process_data));
+		process_data.fp_fd = fd;
+		process_data.fp_flags = flags;
+
+		error = kqueue_scan(kq, kevent_ring_callback, NULL, &scan,
+		                    &process_data, &atv, p);
+	}
+
+out:
+	lck_mtx_unlock(&ring->kring_lock);
+	fp_drop(p, fd, fp, 0);
+
+	/* don't restart after signals... */
+	if (error == ERESTART)
+		error = EINTR;
+	else if (error == EWOULDBLOCK)
+		error = 0;
+	if (error == 0)
+		*retval = scan.krs_posted;
+	return (error);
+}
+
 /*
  * kevent_description - format a description of a kevent for diagnostic output
  *
@@ -4565,6 +5161,12 @@ restart:
 		if (kev->flags & EV_ADD) {
 			struct fileproc *knote_fp = NULL;
 
+			/* skipping events is only safe on sources f_event re-reads */
+			if ((kev->flags & EV_EXCLUSIVE) && !fops->f_level) {
+				error = EINVAL;
+				goto out;
+			}
+
 			/* grab a file reference for the new knote */
 			if (fops->f_isfd) {
 				if ((error = fp_lookup(p, kev->ident, &knote_fp, 0)) != 0) {
@@ -4598,6 +5200,8 @@ restart:
 				kn->kn_status |= KN_DISPATCH;
 			if (kev->flags & EV_UDATA_SPECIFIC)
 				kn->kn_status |= KN_UDATA_SPECIFIC;
+			if (kev->flags & EV_EXCLUSIVE)
+				kn->kn_status |= KN_EXCLUSIVE;
 
 			/*
 			 * copy the kevent state into knote
@@ -5889,6 +6493,8 @@ kqueue_process(struct kqueue *kq,
 		 */
 		start_index = end_index = THREAD_QOS_UNSPECIFIED;
 	} else {
+		/* pick up the knotes posted while the kq was locked */
+		kqueue_drain_activations(kq);
 		start_index = end_index = QOS_INDEX_KQFILE;
 	}
 	
@@ -5969,6 +6575,8 @@ kqueue_scan_continue(void *data, wait_result_t wait_result)
 			waitq_assert_wait64((struct waitq *)&kq->kq_wqs,
 					    KQ_EVENT, THREAD_ABORTSAFE,
 					    cont_args->deadline);
+			if (kqueue_activations_pending(kq))
+				clear_wait(current_thread(), THREAD_AWAKENED);
 			kq->kq_state |= KQ_SLEEP;
 			kqunlock(kq);
 			thread_block_parameter(kqueue_scan_continue, kq);
@@ -6102,6 +6710,13 @@ kqueue_scan(struct kqueue *kq,
 					   KQ_EVENT, THREAD_ABORTSAFE,
 					   TIMEOUT_URGENCY_USER_NORMAL,
 					   deadline, TIMEOUT_NO_LEEWAY);
+
+		/*
+		 * knote() only wakes us up for the first knote it queues
+		 * for activation, which may have just happened.
+		 */
+		if (kqueue_activations_pending(kq))
+			clear_wait(current_thread(), THREAD_AWAKENED);
 		kq->kq_state |= KQ_SLEEP;
 		kqunlock(kq);
 		wait_result = thread_block_parameter(cont, kq);
@@ -6179,6 +6794,8 @@ kqueue_select(struct fileproc *fp, int which, void *wq_link_id,
 
 	assert((kq->kq_state & KQ_WORKQ) == 0);
 
+	kqueue_drain_activations(kq);
+
 	/*
 	 * If this is the first pass, link the wait queue associated with the
 	 * the kqueue onto the wait queue set for the select().  Normally we
@@ -7759,6 +8376,248 @@ klist_init(struct klist *list)
 }
 
 
+/*
+ * Activation queue
+ *
+ *	knote() runs with the source's lock held and has to take the lock
+ *	of the kqueue of every knote on the source.  A hot source watched
+ *	by busy kqueues would spin on each of them in turn.  Instead, when
+ *	the lock of a plain kqueue is busy and the knote's filter has
+ *	f_level set, so that f_event(kn, 0) can re-read the source's state
+ *	later, knote() pushes the knote on the kqueue's activation queue
+ *	and moves on.
+ *
+ *	The queue is a stack: knote() pushes on it with compare-and-swap
+ *	and no kqueue lock, and everything else, popping knotes to
+ *	evaluate them or unlinking one being dropped, is done with the
+ *	kqueue locked.  kn_actpending keeps a knote from being pushed
+ *	twice.  A knote can't be pushed after its f_detach, since knote()
+ *	holds the source's lock, so unlinking it in kq_remove_knote() is
+ *	enough to keep it from being freed while queued.
+ *
+ *	Consumers evaluate queued knotes in kqueue_process() and
+ *	kqueue_select().  Pushing onto an empty queue wakes up the
+ *	kqueue's waiters.  Before sleeping, waiters check the queue again
+ *	once they are on the wait queue.
+ */
+static uint64_t kevent_activation_contended;	/* kq locks found busy */
+static uint64_t kevent_activation_spin_abstime;	/* time spent waiting for them */
+static uint64_t kevent_activation_deferred;	/* knotes queued instead */
+static uint64_t kevent_exclusive_skipped;	/* exclusive knotes not posted to */
+
+/*
+ * kern.kevent_activation_stats: kqueue locks knote() found busy, the
+ * time it spent spinning on them, the knotes it queued for activation
+ * instead, and the exclusive knotes it didn't post events to.
+ */
+static int
+sysctl_kevent_activation_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2, oidp)
+	uint64_t stats[4] = {
+		kevent_activation_contended,
+		kevent_activation_spin_abstime,
+		kevent_activation_deferred,
+		kevent_exclusive_skipped,
+	};
+
+	return SYSCTL_OUT(req, stats, sizeof(stats));
+}
+
+SYSCTL_PROC(_kern, OID_AUTO, kevent_activation_stats,
+	CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_LOCKED, 0, 0,
+	sysctl_kevent_activation_stats, "S", "knote activation lock statistics");
+
+/*
+ * Queue a knote for activation by the kqueue's consumers.
+ * Returns false if the knote has to be posted with the kqueue locked.
+ *
+ * Called with the source locked, and the kqueue not.
+ */
+static boolean_t
+knote_defer_activation(struct kqueue *kq, struct knote *kn)
+{
+	struct kqfile *kqf = (struct kqfile *)kq;
+	struct knote *head;
+
+	/*
+	 * Workq and workloop kqueues request threads on activation,
+	 * and kqueues inside others have to post to their parents.
+	 */
+	if ((kq->kq_state & (KQ_WORKQ | KQ_WORKLOOP)) ||
+	    !knote_fops(kn)->f_level ||
+	    !SLIST_EMPTY(&kqf->kqf_sel.si_note))
+		return FALSE;
+
+	OSAddAtomic64(1, &kevent_activation_deferred);
+
+	/* already queued, it will be evaluated after this event anyway */
+	if (!OSCompareAndSwap(0, 1, &kn->kn_actpending))
+		return TRUE;
+
+	do {
+		head = kqf->kqf_actpending;
+		kn->kn_actnext = head;
+	} while (!OSCompareAndSwapPtr(head, kn, (void * volatile *)&kqf->kqf_actpending));
+
+	if (head == NULL) {
+		waitq_wakeup64_all((struct waitq *)&kq->kq_wqs,
+		                   KQ_EVENT,
+		                   THREAD_AWAKENED,
+		                   WAITQ_ALL_PRIORITIES);
+	}
+	return TRUE;
+}
+
+static boolean_t
+kqueue_activations_pending(struct kqueue *kq)
+{
+	if (kq->kq_state & (KQ_WORKQ | KQ_WORKLOOP))
+		return FALSE;
+	return ((struct kqfile *)kq)->kqf_actpending != NULL;
+}
+
+/*
+ * Evaluate the knotes queued for activation.
+ *
+ *	kqueue locked on entry and exit - but may be dropped
+ */
+static void
+kqueue_drain_activations(struct kqueue *kq)
+{
+	struct kqfile *kqf = (struct kqfile *)kq;
+	struct knote *kn;
+
+	kqlock_held(kq);
+
+	if (kq->kq_state & (KQ_WORKQ | KQ_WORKLOOP))
+		return;
+
+	while ((kn = kqf->kqf_actpending) != NULL) {
+		/* only pushes race with us, and they just move the head */
+		if (!OSCompareAndSwapPtr(kn, kn->kn_actnext,
+		                         (void * volatile *)&kqf->kqf_actpending))
+			continue;
+		kn->kn_actnext = NULL;
+		kn->kn_actpending = 0;
+
+		/* detached from its source, or dropped, since it was queued */
+		if ((kn->kn_status & (KN_ATTACHED | KN_VANISHED | KN_DROPPING)) !=
+		    KN_ATTACHED)
+			continue;
+
+		assert(!knoteuse_needs_boost(kn, NULL));
+
+		/* the source isn't locked anymore, f_event locks it */
+		if (kqlock2knoteuse(kq, kn, KNUSE_NONE)) {
+			int result;
+
+			result = knote_fops(kn)->f_event(kn, 0);
+
+			if (knoteuse2kqlock(kq, kn, KNUSE_NONE) && result)
+				knote_activate(kn);
+		}
+	}
+}
+
+/*
+ * Take a knote being dropped off the activation queue.
+ *
+ *	called with the kqueue locked
+ */
+static void
+knote_cancel_activation(struct kqueue *kq, struct knote *kn)
+{
+	struct kqfile *kqf = (struct kqfile *)kq;
+	struct knote *prev;
+
+	kqlock_held(kq);
+
+	if (kn->kn_actpending == 0)
+		return;
+
+	if (!OSCompareAndSwapPtr(kn, kn->kn_actnext,
+	                         (void * volatile *)&kqf->kqf_actpending)) {
+		/* not at the head, and only the head changes under us */
+		prev = kqf->kqf_actpending;
+		while (prev->kn_actnext != kn)
+			prev = prev->kn_actnext;
+		prev->kn_actnext = kn->kn_actnext;
+	}
+	kn->kn_actnext = NULL;
+	kn->kn_actpending = 0;
+}
+
+/*
+ * Post an event to a knote of the source's list.
+ *
+ *	called with the source locked
+ */
+static void
+knote_post(struct knote *kn, long hint)
+{
+	struct kqueue *kq = knote_get_kq(kn);
+
+	if (!lck_spin_try_lock(&kq->kq_lock)) {
+		uint64_t start;
+
+		OSAddAtomic64(1, &kevent_activation_contended);
+		if (knote_defer_activation(kq, kn))
+			return;
+
+		start = mach_absolute_time();
+		kqlock(kq);
+		OSAddAtomic64(mach_absolute_time() - start, &kevent_activation_spin_abstime);
+	}
+
+	assert(!knoteuse_needs_boost(kn, NULL));
+
+	/* If we can get a use reference - deliver event */
+	if (kqlock2knoteuse(kq, kn, KNUSE_NONE)) {
+		int result;
+
+		/* call the event with only a use count */
+		result = knote_fops(kn)->f_event(kn, hint);
+
+		/* if its not going away and triggered */
+		if (knoteuse2kqlock(kq, kn, KNUSE_NONE) && result)
+			knote_activate(kn);
+		/* kq lock held */
+	}
+	kqunlock(kq);
+}
+
+/*
+ * Pick the exclusive knote of the list to post an event to.  A knote
+ * already queued will be serviced anyway.  Otherwise, prefer an enabled
+ * knote whose kqueue has a thread waiting for events.
+ *
+ * The kqueues aren't locked, the states are only hints.
+ */
+static struct knote *
+knote_pick_exclusive(struct klist *list)
+{
+	struct knote *kn, *idle = NULL, *ready = NULL, *any = NULL;
+
+	SLIST_FOREACH(kn, list, kn_selnext) {
+		if ((kn->kn_status & KN_EXCLUSIVE) == 0)
+			continue;
+		if (kn->kn_status & KN_QUEUED)
+			return kn;
+		if (any == NULL)
+			any = kn;
+		if (kn->kn_status & (KN_DISABLED | KN_SUPPRESSED | KN_DROPPING))
+			continue;
+		if (ready == NULL)
+			ready = kn;
+		if (idle == NULL && (knote_get_kq(kn)->kq_state & KQ_SLEEP))
+			idle = kn;
+	}
+	if (idle != NULL)
+		return idle;
+	return (ready != NULL) ? ready : any;
+}
+
 /*
  * Query/Post each knote in the object's list
  *
@@ -7770,32 +8629,30 @@ klist_init(struct klist *list)
  *	The object lock should also hold off pending
  *	detach/drop operations.  But we'll prevent it here
  *	too (by taking a use reference) - just in case.
+ *
+ *	Of the knotes registered with EV_EXCLUSIVE, only
+ *	one gets the event, so that a connection on a
+ *	listening socket shared by many processes doesn't
+ *	wake up all of them.
  */
 void
 knote(struct klist *list, long hint)
 {
 	struct knote *kn;
+	int nexclusive = 0;
 
 	SLIST_FOREACH(kn, list, kn_selnext) {
-		struct kqueue *kq = knote_get_kq(kn);
-
-		kqlock(kq);
-
-		assert(!knoteuse_needs_boost(kn, NULL));
-
-		/* If we can get a use reference - deliver event */
-		if (kqlock2knoteuse(kq, kn, KNUSE_NONE)) {
-			int result;
-
-			/* call the event with only a use count */
-			result = knote_fops(kn)->f_event(kn, hint);
-
-			/* if its not going away and triggered */
-			if (knoteuse2kqlock(kq, kn, KNUSE_NONE) && result)
-				knote_activate(kn);
-			/* kq lock held */
+		if (kn->kn_status & KN_EXCLUSIVE) {
+			nexclusive++;
+			continue;
 		}
-		kqunlock(kq);
+		knote_post(kn, hint);
+	}
+
+	if (nexclusive > 0) {
+		knote_post(knote_pick_exclusive(list), hint);
+		if (nexclusive > 1)
+			OSAddAtomic64(nexclusive - 1, &kevent_exclusive_skipped);
 	}
 }
 
@@ -7955,6 +8812,9 @@ restart:
 
 				assert(!knoteuse_needs_boost(kn, NULL));
 
+				/* the queued activation would outlive the fp */
+				knote_cancel_activation(kq, kn);
+
 				/* get detach reference (also marks vanished) */
 				if (kqlock2knotedetach(kq, kn, KNUSE_NONE)) {
 					/* detach knote and drop fp use reference */
@@ -7964,6 +8824,8 @@ restart:
 
 					/* activate it if it's still in existence */
 					if (knoteuse2kqlock(kq, kn, KNUSE_NONE)) {
+						/* queued again before f_detach unhooked it */
+						knote_cancel_activation(kq, kn);
 						knote_activate(kn);
 					}
 					kqunlock(kq);
@@ -8202,6 +9064,8 @@ kq_remove_knote(struct kqueue *kq, struct knote *kn, struct proc *p,
 	SLIST_REMOVE(list, kn, knote, kn_link);
 
 	kqlock(kq);
+	/* detached from its source, nobody can queue it anymore */
+	knote_cancel_activation(kq, kn);
 	*kn_status = kn->kn_status;
 	*kq_state = kq->kq_state;
 	kqunlock(kq);
@@ -973,6 +973,12 @@ madvise(__unused proc_t p, struct madvise_args *uap, __unused int32_t *retval)
 #else /* MACH_ASSERT */
 			return ENOTSUP;
 #endif /* MACH_ASSERT */
+		case MADV_SUPERPAGE:
+			new_behavior = VM_BEHAVIOR_SUPERPAGE;
+			break;
+		case MADV_NOSUPERPAGE:
+			new_behavior = VM_BEHAVIOR_NOSUPERPAGE;
+			break;
 		default:
 			return(EINVAL);
 	}
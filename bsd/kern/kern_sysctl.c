@@ -478,6 +478,30 @@ SYSCTL_PROC(_kern, OID_AUTO, sched_stats_enable, CTLFLAG_LOCKED | CTLFLAG_WR, 0,
 extern uint32_t sched_debug_flags;
 SYSCTL_INT(_debug, OID_AUTO, sched, CTLFLAG_RW | CTLFLAG_LOCKED, &sched_debug_flags, 0, "scheduler debug");
 
+/* cross-pset work stealing, see sched_dualq_steal_thread() */
+extern int sched_steal_batch_max;
+
+STATIC int
+sysctl_sched_steal(__unused struct sysctl_oid *oidp, __unused void *arg1, int arg2, struct sysctl_req *req)
+{
+	uint64_t value = sched_steal_statistics(arg2);
+
+	return SYSCTL_OUT(req, &value, sizeof(value));
+}
+
+SYSCTL_PROC(_kern, OID_AUTO, sched_steal_attempts, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+	0, SCHED_STEAL_ATTEMPTS, sysctl_sched_steal, "Q", "");
+SYSCTL_PROC(_kern, OID_AUTO, sched_steal_count, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+	0, SCHED_STEAL_COUNT, sysctl_sched_steal, "Q", "");
+SYSCTL_PROC(_kern, OID_AUTO, sched_steal_migrations, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+	0, SCHED_STEAL_MIGRATIONS, sysctl_sched_steal, "Q", "");
+SYSCTL_PROC(_kern, OID_AUTO, sched_steal_remote, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+	0, SCHED_STEAL_REMOTE, sysctl_sched_steal, "Q", "");
+/* only accumulates while kern.sched_stats_enable is set */
+SYSCTL_PROC(_kern, OID_AUTO, sched_steal_abstime, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+	0, SCHED_STEAL_ABSTIME, sysctl_sched_steal, "Q", "");
+SYSCTL_INT(_kern, OID_AUTO, sched_steal_batch_max, CTLFLAG_RW | CTLFLAG_LOCKED, &sched_steal_batch_max, 0, "");
+
 #if (DEBUG || DEVELOPMENT)
 extern boolean_t doprnt_hide_pointers;
 SYSCTL_INT(_debug, OID_AUTO, hide_kernel_pointers, CTLFLAG_RW | CTLFLAG_LOCKED, &doprnt_hide_pointers, 0, "hide kernel pointers from log");
@@ -2875,6 +2899,90 @@ SYSCTL_STRING(_vm, OID_AUTO, swapfileprefix, CTLFLAG_RW | CTLFLAG_KERN | CTLFLAG
 
 SYSCTL_INT(_vm, OID_AUTO, compressor_timing_enabled, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_compressor_time_thread, 0, "");
 
+SYSCTL_INT(_vm, OID_AUTO, compressor_thread_count, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_compressor_thread_count, 0, "");
+
+/* swap-in readahead, latency histograms from <vm/vm_protos.h> */
+extern uint32_t vm_swapin_readahead_max, vm_swapin_readahead_window;
+extern uint64_t vm_swapin_readahead_queued;
+extern int64_t vm_swapin_readahead_done, vm_swapin_readahead_hits;
+
+SYSCTL_UINT(_vm, OID_AUTO, swapin_readahead_max, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_swapin_readahead_max, 0, "Segments queued for readahead per faulting swap-in");
+SYSCTL_UINT(_vm, OID_AUTO, swapin_readahead_window, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_swapin_readahead_window, 0, "Max creation time distance (secs) of segments read ahead");
+SYSCTL_QUAD(_vm, OID_AUTO, swapin_readahead_queued, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_swapin_readahead_queued, "");
+SYSCTL_QUAD(_vm, OID_AUTO, swapin_readahead_done, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_swapin_readahead_done, "");
+SYSCTL_QUAD(_vm, OID_AUTO, swapin_readahead_hits, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_swapin_readahead_hits, "");
+SYSCTL_OPAQUE(_vm, OID_AUTO, swapin_fault_latency, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_swapin_fault_latency, sizeof(vm_swapin_fault_latency), "Q", "log2(usecs) histogram of swap-ins by faults");
+SYSCTL_OPAQUE(_vm, OID_AUTO, swapin_readahead_latency, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_swapin_readahead_latency, sizeof(vm_swapin_readahead_latency), "Q", "log2(usecs) histogram of readahead swap-ins");
+
+/* pages sharing identical compressed data */
+extern boolean_t vm_compressor_dedup_enabled;
+extern uint32_t vm_compressor_dedup_max_bytes;
+extern uint32_t c_segment_dd_pages, c_segment_dd_entries;
+extern uint64_t c_segment_dd_bytes, c_segment_dd_hits, c_segment_dd_collisions, c_segment_dd_promotions;
+extern uint64_t c_segment_dd_evictions;
+extern int64_t c_segment_dd_bytes_saved;
+
+SYSCTL_INT(_vm, OID_AUTO, compressor_dedup_enabled, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_compressor_dedup_enabled, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, compressor_dedup_max_bytes, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_compressor_dedup_max_bytes, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, compressor_dedup_pages, CTLFLAG_RD | CTLFLAG_LOCKED, &c_segment_dd_pages, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, compressor_dedup_entries, CTLFLAG_RD | CTLFLAG_LOCKED, &c_segment_dd_entries, 0, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_dedup_bytes, CTLFLAG_RD | CTLFLAG_LOCKED, &c_segment_dd_bytes, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_dedup_bytes_saved, CTLFLAG_RD | CTLFLAG_LOCKED, &c_segment_dd_bytes_saved, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_dedup_hits, CTLFLAG_RD | CTLFLAG_LOCKED, &c_segment_dd_hits, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_dedup_collisions, CTLFLAG_RD | CTLFLAG_LOCKED, &c_segment_dd_collisions, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_dedup_promotions, CTLFLAG_RD | CTLFLAG_LOCKED, &c_segment_dd_promotions, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_dedup_evictions, CTLFLAG_RD | CTLFLAG_LOCKED, &c_segment_dd_evictions, "");
+
+/* cost of minor and major compactions of the compressed segments */
+extern int64_t c_seg_minor_compactions, c_seg_compact_moved_runs, c_seg_compact_moved_bytes;
+extern int64_t c_seg_compact_reclaimed_bytes, c_seg_compact_abstime;
+
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_minor_compactions, CTLFLAG_RD | CTLFLAG_LOCKED, &c_seg_minor_compactions, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_compact_moved_runs, CTLFLAG_RD | CTLFLAG_LOCKED, &c_seg_compact_moved_runs, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_compact_moved_bytes, CTLFLAG_RD | CTLFLAG_LOCKED, &c_seg_compact_moved_bytes, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_compact_reclaimed_bytes, CTLFLAG_RD | CTLFLAG_LOCKED, &c_seg_compact_reclaimed_bytes, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_compact_abstime, CTLFLAG_RD | CTLFLAG_LOCKED, &c_seg_compact_abstime, "mach_absolute_time units spent compacting");
+
+STATIC int
+sysctl_compressor_queue_depth SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2, oidp)
+	unsigned int	depth = vm_compressor_queue_depth();
+
+	return SYSCTL_OUT(req, &depth, sizeof(depth));
+}
+
+SYSCTL_PROC(_vm, OID_AUTO, compressor_queue_depth,
+		CTLTYPE_INT | CTLFLAG_RD | CTLFLAG_LOCKED,
+		0, 0, sysctl_compressor_queue_depth, "IU", "Pages queued for the compressor threads");
+SYSCTL_UINT(_vm, OID_AUTO, compressor_queue_depth_max, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_compressor_queue_depth_max, 0, "");
+
+/*
+ * pages compressed and batches taken off the compressor queue, as
+ * a pair of uint64_t per compressor thread
+ */
+STATIC int
+sysctl_compressor_thread_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2, oidp)
+	uint64_t	pages[MAX_COMPRESSOR_THREAD_COUNT];
+	uint64_t	batches[MAX_COMPRESSOR_THREAD_COUNT];
+	uint64_t	stats[2 * MAX_COMPRESSOR_THREAD_COUNT];
+	int		i, count;
+
+	count = vm_compressor_thread_stats(pages, batches, MAX_COMPRESSOR_THREAD_COUNT);
+
+	for (i = 0; i < count; i++) {
+		stats[2 * i] = pages[i];
+		stats[2 * i + 1] = batches[i];
+	}
+	return sysctl_io_opaque(req, stats, 2 * count * sizeof(stats[0]), NULL);
+}
+
+SYSCTL_PROC(_vm, OID_AUTO, compressor_thread_stats,
+		CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_LOCKED,
+		0, 0, sysctl_compressor_thread_stats, "Q", "");
+
 #if DEVELOPMENT || DEBUG
 SYSCTL_QUAD(_vm, OID_AUTO, compressor_thread_runtime0, CTLFLAG_RD | CTLFLAG_LOCKED, &vmct_stats.vmct_runtimes[0], "");
 SYSCTL_QUAD(_vm, OID_AUTO, compressor_thread_runtime1, CTLFLAG_RD | CTLFLAG_LOCKED, &vmct_stats.vmct_runtimes[1], "");
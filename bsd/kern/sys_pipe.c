@@ -102,11 +102,22 @@
 /*
  * This code create half duplex pipe buffers for facilitating file like
  * operations on pipes. The initial buffer is very small, but this can
- * dynamically change to larger sizes based on usage. The buffer size is never
- * reduced. The total amount of kernel memory used is governed by maxpipekva.
+ * dynamically change to larger sizes based on usage. The buffer size is only
+ * reduced back from past BIG_PIPE_SIZE, see below. The total amount of kernel
+ * memory used is governed by maxpipekva.
  * In case of dynamic expansion limit is reached, the output thread is blocked
  * until the pipe buffer empties enough to continue. 
  *
+ * Buffers normally stop growing at BIG_PIPE_SIZE.  A writer that keeps
+ * finding the buffer full, while the reader never runs dry, gets it
+ * doubled again, up to PIPE_MAXSIZE.  Such a buffer goes back to
+ * BIG_PIPE_SIZE as soon as the reader finds it empty.
+ *
+ * Large writes (PIPE_MINDIRECT and up) from blocking writers bypass the
+ * buffer altogether: the writer wires its pages in a UPL and sleeps, and
+ * the reader copies straight out of them.  The data is copied once
+ * instead of twice, and the writer returns once it has all been read.
+ *
  * In order to limit the resource use of pipes, two sysctls exist:
  *
  * kern.ipc.maxpipekva - This is a hard limit on the amount of pageable
@@ -137,6 +148,8 @@
 #include <sys/pipe.h>
 #include <sys/sysproto.h>
 #include <sys/proc_info.h>
+#include <sys/uio_internal.h>
+#include <sys/ubc.h>
 
 #include <security/audit/audit.h>
 
@@ -144,7 +157,9 @@
 
 #include <kern/zalloc.h>
 #include <kern/kalloc.h>
+#include <mach/memory_object_types.h>
 #include <vm/vm_kern.h>
+#include <vm/vm_map.h>
 #include <libkern/OSAtomic.h>
 #include <libkern/section_keywords.h>
 
@@ -241,6 +256,10 @@ static int pipe_create(struct pipe **cpipep);
 static int pipespace(struct pipe *cpipe, int size);
 static int choose_pipespace(unsigned long current, unsigned long expected);
 static int expand_pipespace(struct pipe *p, int target_size);
+static int pipe_grow(struct pipe *wpipe);
+static void pipe_shrink(struct pipe *rpipe);
+static int pipe_direct_write(struct pipe *wpipe, struct uio *uio, int *fallback);
+static int pipe_direct_copyout(struct pipe *rpipe, u_int size, struct uio *uio);
 static void pipeselwakeup(struct pipe *cpipe, struct pipe *spipe);
 static __inline int pipeio_lock(struct pipe *cpipe, int catch);
 static __inline void pipeio_unlock(struct pipe *cpipe);
@@ -256,6 +275,12 @@ static zone_t pipe_zone;
 
 #define MAX_PIPESIZE(pipe)  		( MAX(PIPE_SIZE, (pipe)->pipe_buffer.size) )
 
+/* bytes waiting to be read, buffered or from a direct write */
+#define PIPE_CNT(pipe)			( (pipe)->pipe_buffer.cnt + (pipe)->pipe_map.cnt )
+
+/* how many times the writer must find a big buffer full before it grows */
+#define PIPE_GROW_STALLS		8
+
 #define	PIPE_GARBAGE_AGE_LIMIT		5000	/* In milliseconds */
 #define PIPE_GARBAGE_QUEUE_LIMIT	32000
 
@@ -407,6 +432,54 @@ expand_pipespace(struct pipe *p, int target_size)
 	return 0;
 }
 
+/*
+ * The writer found the buffer full: if it keeps happening without the
+ * reader ever running dry, double the buffer past BIG_PIPE_SIZE, as
+ * long as pipes overall stay well under maxpipekva.
+ * Required: PIPE_LOCK held by caller.
+ * returns 1 if the buffer grew.
+ */
+static int
+pipe_grow(struct pipe *wpipe)
+{
+	u_int size = wpipe->pipe_buffer.size;
+	int error;
+
+	if (size < BIG_PIPE_SIZE || size >= PIPE_MAXSIZE ||
+	    wpipe->pipe_buffer.cnt < size)
+		return 0;
+
+	if (++wpipe->pipe_wstalls < PIPE_GROW_STALLS)
+		return 0;
+
+	if (amountpipekva + 2 * size > (unsigned)maxpipekva / 2)
+		return 0;
+
+	wpipe->pipe_wstalls = 0;
+
+	if (pipeio_lock(wpipe, 1) != 0)
+		return 0;
+	error = expand_pipespace(wpipe, 2 * size);
+	pipeio_unlock(wpipe);
+
+	return (error == 0 && wpipe->pipe_buffer.size > size);
+}
+
+/*
+ * The reader ran dry: a buffer pipe_grow() took past BIG_PIPE_SIZE is
+ * no longer needed, so give it back.  Keep it if the smaller one can't
+ * be had.
+ * Required: PIPE_LOCK and io lock held by caller, buffer empty.
+ */
+static void
+pipe_shrink(struct pipe *rpipe)
+{
+	if (rpipe->pipe_buffer.size <= BIG_PIPE_SIZE || rpipe->pipe_buffer.cnt != 0)
+		return;
+
+	(void)pipespace(rpipe, BIG_PIPE_SIZE);
+}
+
 /*
  * The pipe system call for the DTYPE_PIPE type of pipes
  * 
@@ -470,6 +543,8 @@ pipe(proc_t p, __unused struct pipe_args *uap, int32_t *retval)
 
 	rpipe->pipe_peer = wpipe;
 	wpipe->pipe_peer = rpipe;
+	rpipe->pipe_state |= PIPE_DIRECTOK;
+	wpipe->pipe_state |= PIPE_DIRECTOK;
 	/* both structures share the same mutex */
 	rpipe->pipe_mtxp = wpipe->pipe_mtxp = pmtx; 
 
@@ -532,13 +607,13 @@ pipe_stat(struct pipe *cpipe, void *ub, int isstat64)
 	        if (cpipe->pipe_peer) {
 		        /* the peer still exists, use it's info */
 		        pipe_size  = MAX_PIPESIZE(cpipe->pipe_peer);
-			pipe_count = cpipe->pipe_peer->pipe_buffer.cnt;
+			pipe_count = PIPE_CNT(cpipe->pipe_peer);
 		} else {
 			pipe_count = 0;
 		}
 	} else {
 	        pipe_size  = MAX_PIPESIZE(cpipe);
-		pipe_count = cpipe->pipe_buffer.cnt;
+		pipe_count = PIPE_CNT(cpipe);
 	}
 	/*
 	 * since peer's buffer is setup ouside of lock
@@ -727,6 +802,196 @@ pipeselwakeup(struct pipe *cpipe, struct pipe *spipe)
         }
 }
 
+/*
+ * Hand the current iovec of a large write (up to PIPE_MAXDIRECT bytes of
+ * it) to the reader without buffering it: the pages are wired in a UPL,
+ * and the writer sleeps until the reader has copied out of them.
+ * Sets *fallback if the pages couldn't be wired, in which case the write
+ * should go through the buffer.
+ * Required: PIPE_LOCK held by caller, writer is the current process.
+ */
+static int
+pipe_direct_write(struct pipe *wpipe, struct uio *uio, int *fallback)
+{
+	upl_t upl = NULL;
+	upl_page_info_t *pl;
+	upl_size_t upl_size;
+	unsigned int pages_in_pl, i;
+	int upl_flags;
+	user_addr_t iov_base;
+	u_int size, offset, moved;
+	kern_return_t kret;
+	int error;
+
+	*fallback = 0;
+
+	/* one direct write at a time */
+	while (wpipe->pipe_state & PIPE_DIRECTW) {
+		if (wpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF))
+			return (EPIPE);
+		if (wpipe->pipe_state & PIPE_WANTR) {
+			wpipe->pipe_state &= ~PIPE_WANTR;
+			wakeup(wpipe);
+		}
+		wpipe->pipe_state |= PIPE_WANTW;
+		error = msleep(wpipe, PIPE_MTX(wpipe), PRIBIO | PCATCH, "pipdww", 0);
+		if (error != 0)
+			return (error);
+	}
+
+	if ((error = pipeio_lock(wpipe, 1)) != 0)
+		return (error);
+
+	if (wpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF)) {
+		pipeio_unlock(wpipe);
+		return (EPIPE);
+	}
+	if (wpipe->pipe_state & PIPE_DIRECTW) {
+		/* someone beat us to it while we waited for the io lock */
+		pipeio_unlock(wpipe);
+		return (0);
+	}
+
+	iov_base = uio_curriovbase(uio);
+	size = (u_int)MIN(uio_curriovlen(uio), PIPE_MAXDIRECT);
+	offset = (u_int)(iov_base & PAGE_MASK);
+
+	upl_size = (upl_size_t)round_page(offset + size);
+	upl_flags = UPL_FILE_IO | UPL_COPYOUT_FROM | UPL_NO_SYNC |
+	            UPL_CLEAN_IN_PLACE | UPL_SET_INTERNAL | UPL_SET_LITE | UPL_SET_IO_WIRE;
+
+	PIPE_UNLOCK(wpipe); /* we still hold io lock */
+
+	pages_in_pl = 0;
+	kret = vm_map_get_upl(current_map(),
+			      (vm_map_offset_t)(iov_base & ~((user_addr_t)PAGE_MASK)),
+			      &upl_size, &upl, NULL, &pages_in_pl, &upl_flags,
+			      VM_KERN_MEMORY_BSD, 0);
+	if (kret == KERN_SUCCESS) {
+		pl = ubc_upl_pageinfo(upl);
+		pages_in_pl = upl_size / PAGE_SIZE;
+
+		for (i = 0; i < pages_in_pl; i++) {
+			if (!upl_valid_page(pl, i))
+				break;
+		}
+		/* use the leading pages we got a hold of, if any */
+		if (i * PAGE_SIZE <= offset) {
+			ubc_upl_abort(upl, 0);
+			*fallback = 1;
+		} else if (i * PAGE_SIZE < offset + size) {
+			size = i * PAGE_SIZE - offset;
+		}
+	} else {
+		*fallback = 1;
+	}
+
+	PIPE_LOCK(wpipe);
+
+	if (*fallback) {
+		pipeio_unlock(wpipe);
+		return (0);
+	}
+
+	wpipe->pipe_map.upl = upl;
+	wpipe->pipe_map.offset = offset;
+	wpipe->pipe_map.cnt = size;
+	wpipe->pipe_map.pos = 0;
+	wpipe->pipe_state |= PIPE_DIRECTW;
+	pipeio_unlock(wpipe);
+
+	if (wpipe->pipe_state & PIPE_WANTR) {
+		wpipe->pipe_state &= ~PIPE_WANTR;
+		wakeup(wpipe);
+	}
+	pipeselwakeup(wpipe, wpipe);
+
+	while (wpipe->pipe_map.cnt > 0) {
+		if (wpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF)) {
+			error = EPIPE;
+			break;
+		}
+		wpipe->pipe_state |= PIPE_WANTW;
+		error = msleep(wpipe, PIPE_MTX(wpipe), PRIBIO | PCATCH, "pipdwt", 0);
+		if (error != 0)
+			break;
+	}
+
+	/*
+	 * The reader copies out of the pages holding only the io lock:
+	 * take it so that they're not released under its feet.
+	 */
+	(void)pipeio_lock(wpipe, 0);
+	moved = wpipe->pipe_map.pos;
+	bzero(&wpipe->pipe_map, sizeof(wpipe->pipe_map));
+	wpipe->pipe_state &= ~PIPE_DIRECTW;
+	pipeio_unlock(wpipe);
+
+	/* other writers wait for the direct write to be over */
+	if (wpipe->pipe_state & PIPE_WANTW) {
+		wpipe->pipe_state &= ~PIPE_WANTW;
+		wakeup(wpipe);
+	}
+	/* and so do select, poll and EVFILT_WRITE */
+	pipeselwakeup(wpipe, wpipe);
+
+	PIPE_UNLOCK(wpipe);
+	ubc_upl_abort(upl, 0);
+	PIPE_LOCK(wpipe);
+
+	uio_update(uio, moved);
+
+	return (error);
+}
+
+/*
+ * Copy 'size' bytes of a direct write out to the reader, through the
+ * physical addresses of the writer's pages.
+ * Required: io lock held by caller.
+ */
+static int
+pipe_direct_copyout(struct pipe *rpipe, u_int size, struct uio *uio)
+{
+	upl_page_info_t *pl = ubc_upl_pageinfo(rpipe->pipe_map.upl);
+	u_int offset = rpipe->pipe_map.offset + rpipe->pipe_map.pos;
+	int segflg = uio->uio_segflg;
+	int error = 0;
+
+	switch (segflg) {
+	case UIO_USERSPACE32:
+	case UIO_USERISPACE32:
+		uio->uio_segflg = UIO_PHYS_USERSPACE32;
+		break;
+	case UIO_USERSPACE:
+	case UIO_USERISPACE:
+		uio->uio_segflg = UIO_PHYS_USERSPACE;
+		break;
+	case UIO_USERSPACE64:
+	case UIO_USERISPACE64:
+		uio->uio_segflg = UIO_PHYS_USERSPACE64;
+		break;
+	case UIO_SYSSPACE:
+		uio->uio_segflg = UIO_PHYS_SYSSPACE;
+		break;
+	}
+
+	while (size > 0 && error == 0) {
+		u_int pg_offset = offset & PAGE_MASK;
+		u_int csize = MIN(PAGE_SIZE - pg_offset, size);
+		addr64_t paddr;
+
+		paddr = ((addr64_t)upl_phys_page(pl, offset / PAGE_SIZE) << PAGE_SHIFT) + pg_offset;
+		error = uiomove64(paddr, csize, uio);
+
+		offset += csize;
+		size -= csize;
+	}
+
+	uio->uio_segflg = segflg;
+
+	return (error);
+}
+
 /*
  * Read n bytes from the buffer. Semantics are similar to file read.
  * returns: number of bytes read from the buffer
@@ -796,7 +1061,35 @@ pipe_read(struct fileproc *fp, struct uio *uio, __unused int flags,
 				rpipe->pipe_buffer.out = 0;
 			}
 			nread += size;
+		} else if (rpipe->pipe_map.cnt > 0) {
+			/*
+			 * direct write: copy straight out of the writer's pages
+			 */
+			size = rpipe->pipe_map.cnt;
+			if (size > (u_int) uio_resid(uio))
+				size = (u_int) uio_resid(uio);
+
+			PIPE_UNLOCK(rpipe); /* we still hold io lock.*/
+			error = pipe_direct_copyout(rpipe, size, uio);
+			PIPE_LOCK(rpipe);
+			if (error)
+				break;
+
+			rpipe->pipe_map.pos += size;
+			rpipe->pipe_map.cnt -= size;
+
+			/* the writer is waiting for us to be done */
+			if (rpipe->pipe_map.cnt == 0 &&
+			    (rpipe->pipe_state & PIPE_WANTW)) {
+				rpipe->pipe_state &= ~PIPE_WANTW;
+				wakeup(rpipe);
+			}
+			nread += size;
 		} else {
+			/* we ran dry: the writer isn't outpacing us */
+			rpipe->pipe_wstalls = 0;
+			pipe_shrink(rpipe);
+
 			/*
 			 * detect EOF condition
 			 * read returns 0 on EOF, no need to set error
@@ -966,6 +1259,23 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 
 	while (uio_resid(uio)) {
 
+		/*
+		 * Large writes bypass the buffer, unless we can't wait
+		 * for the reader to be done with them.
+		 */
+		if ((wpipe->pipe_state & PIPE_DIRECTOK) &&
+		    (fp->f_flag & FNONBLOCK) == 0 &&
+		    UIO_SEG_IS_USER_SPACE(uio->uio_segflg) &&
+		    uio_curriovlen(uio) >= PIPE_MINDIRECT) {
+			int fallback;
+
+			error = pipe_direct_write(wpipe, uio, &fallback);
+			if (error)
+				break;
+			if (!fallback)
+				continue;
+		}
+
 	retrywrite:
 		space = wpipe->pipe_buffer.size - wpipe->pipe_buffer.cnt;
 
@@ -973,6 +1283,10 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 		if ((space < uio_resid(uio)) && (orig_resid <= PIPE_BUF))
 			space = 0;
 
+		/* Wait for a direct write to be over before buffering more */
+		if (wpipe->pipe_state & PIPE_DIRECTW)
+			space = 0;
+
 		if (space > 0) {
 
 			if ((error = pipeio_lock(wpipe,1)) == 0) {
@@ -1093,6 +1407,14 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 				break;
 			}	
 
+			/*
+			 * The buffer is full: under sustained throughput,
+			 * grow it rather than wait.
+			 */
+			if ((wpipe->pipe_state & PIPE_DIRECTW) == 0 &&
+			    pipe_grow(wpipe))
+				continue;
+
 			/*
 			 * We have no more space and have something to offer,
 			 * wake up select/poll.
@@ -1178,7 +1500,7 @@ pipe_ioctl(struct fileproc *fp, u_long cmd, caddr_t data,
 		return (0);
 
 	case FIONREAD:
-		*(int *)data = mpipe->pipe_buffer.cnt;
+		*(int *)data = PIPE_CNT(mpipe);
 		PIPE_UNLOCK(mpipe);
 		return (0);
 
@@ -1229,7 +1551,7 @@ pipe_select(struct fileproc *fp, int which, void *wql, vfs_context_t ctx)
         switch (which) {
 
         case FREAD:
-		if ((rpipe->pipe_state & PIPE_DIRECTW) ||
+		if ((rpipe->pipe_map.cnt > 0) ||
 		    (rpipe->pipe_buffer.cnt > 0) ||
 		    (rpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF))) {
 
@@ -1393,7 +1715,7 @@ filt_piperead_common(struct knote *kn, struct pipe *rpipe)
 	 */
 
 	wpipe = rpipe->pipe_peer;
-	kn->kn_data = rpipe->pipe_buffer.cnt;
+	kn->kn_data = PIPE_CNT(rpipe);
 	if ((rpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF)) ||
 	    (wpipe == NULL) || (wpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF))) {
 		kn->kn_flags |= EV_EOF;
@@ -1480,7 +1802,10 @@ filt_pipewrite_common(struct knote *kn, struct pipe *rpipe)
 		kn->kn_flags |= EV_EOF; 
 		return (1);
 	}
-	kn->kn_data = MAX_PIPESIZE(wpipe) - wpipe->pipe_buffer.cnt;
+	if (wpipe->pipe_state & PIPE_DIRECTW)
+		kn->kn_data = 0;
+	else
+		kn->kn_data = MAX_PIPESIZE(wpipe) - wpipe->pipe_buffer.cnt;
 
 	int64_t lowwat = PIPE_BUF;
 	if (kn->kn_sfflags & NOTE_LOWAT) {
@@ -1662,13 +1987,13 @@ fill_pipeinfo(struct pipe * cpipe, struct pipe_info * pinfo)
 			 * the peer still exists, use it's info
 			 */
 		        pipe_size  = MAX_PIPESIZE(cpipe->pipe_peer);
-			pipe_count = cpipe->pipe_peer->pipe_buffer.cnt;
+			pipe_count = PIPE_CNT(cpipe->pipe_peer);
 		} else {
 			pipe_count = 0;
 		}
 	} else {
 	        pipe_size  = MAX_PIPESIZE(cpipe);
-		pipe_count = cpipe->pipe_buffer.cnt;
+		pipe_count = PIPE_CNT(cpipe);
 	}
 	/*
 	 * since peer's buffer is setup ouside of lock
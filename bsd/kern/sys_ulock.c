@@ -36,6 +36,9 @@
 #include <sys/stat.h>
 #include <sys/malloc.h>
 #include <sys/sysproto.h>
+#include <sys/user.h>
+#include <sys/sysctl.h>
+#include <sys/mcache.h>
 #include <sys/pthread_shims.h>
 
 #include <mach/mach_types.h>
@@ -84,13 +87,20 @@
  * ownership/priority boost to the new thread.  Instead, it selects the
  * waiting thread with the highest base priority to be woken next, and
  * relies on that thread to carry the torch for the other waiting threads.
+ *
+ * UL_RW_LOCK does the same while the lock is write-held; readers are not
+ * tracked, so waiting on a read-held lock (ULF_WAIT_READ_HELD) promotes
+ * nobody.  Whether the lock is read-held is passed as a flag rather than
+ * encoded in the value, whose low bits userland is free to use, the same
+ * way os_unfair_lock does.
+ *
+ * ULF_WAKE_REQUEUE moves waiters from one ulock to another without waking
+ * them.  Each waiter finds out which ulock it ended up on (and so which
+ * one it holds a reference on and is counted in) through its uthread's
+ * uu_ulock_wait_data, which the requeue updates under the thread lock.
  */
 
 static lck_grp_t *ull_lck_grp;
-static lck_mtx_t ull_table_lock;
-
-#define ull_global_lock()       lck_mtx_lock(&ull_table_lock)
-#define ull_global_unlock()     lck_mtx_unlock(&ull_table_lock)
 
 #define ull_lock(ull)           lck_mtx_lock(&ull->ull_lock)
 #define ull_unlock(ull)         lck_mtx_unlock(&ull->ull_lock)
@@ -158,11 +168,63 @@ ull_dump(ull_t *ull)
 }
 #endif
 
+/*
+ * Each hash bucket has its own spinlock, which protects the bucket's
+ * chain as well as the ull_key and ull_refcount of the ulocks on it.
+ * It nests inside ull_lock, never the other way around.  Buckets get
+ * a cache line each so that hot, unrelated ulocks don't false share.
+ */
+typedef struct ull_bucket {
+	queue_head_t	ulb_head;
+	lck_spin_t	ulb_lock;
+	uint64_t	ulb_acquired;	/* times the bucket lock was taken */
+	uint64_t	ulb_contended;	/* ... and had to be waited for */
+} __attribute__((aligned(MAX_CPU_CACHE_LINE_SIZE))) ull_bucket_t;
+
 static int ull_hash_buckets;
-static queue_head_t *ull_bucket;
+static ull_bucket_t *ull_bucket;
 static uint32_t ull_nzalloc = 0;
 static zone_t ull_zone;
 
+static inline void
+ull_bucket_lock(uint i)
+{
+	ull_bucket_t *ulb = &ull_bucket[i];
+
+	if (!lck_spin_try_lock(&ulb->ulb_lock)) {
+		lck_spin_lock(&ulb->ulb_lock);
+		ulb->ulb_contended++;
+	}
+	ulb->ulb_acquired++;
+}
+
+#define ull_bucket_unlock(i)	lck_spin_unlock(&ull_bucket[i].ulb_lock)
+
+/*
+ * kern.ulock_bucket_stats: bucket lock acquisitions, how many of them
+ * were contended, and the contended count of the worst bucket.
+ */
+static int
+sysctl_ulock_bucket_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2, oidp)
+	uint64_t stats[3] = { 0, 0, 0 };
+
+	for (int i = 0; i < ull_hash_buckets; i++) {
+		stats[0] += ull_bucket[i].ulb_acquired;
+		stats[1] += ull_bucket[i].ulb_contended;
+		if (ull_bucket[i].ulb_contended > stats[2]) {
+			stats[2] = ull_bucket[i].ulb_contended;
+		}
+	}
+
+	return SYSCTL_OUT(req, stats, sizeof(stats));
+}
+
+SYSCTL_PROC(_kern, OID_AUTO, ulock_bucket_stats,
+	CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_LOCKED, 0, 0,
+	sysctl_ulock_bucket_stats, "S", "ulock hash bucket lock statistics");
+
 static __inline__ uint32_t
 ull_hash_index(char *key, size_t length)
 {
@@ -185,7 +247,6 @@ void
 ulock_initialize(void)
 {
 	ull_lck_grp = lck_grp_alloc_init("ulocks", NULL);
-	lck_mtx_init(&ull_table_lock, ull_lck_grp, NULL);
 
 	assert(thread_max > 16);
 	/* Size ull_hash_buckets based on thread_max.
@@ -196,11 +257,15 @@ ulock_initialize(void)
 	kprintf("%s>thread_max=%d, ull_hash_buckets=%d\n", __FUNCTION__, thread_max, ull_hash_buckets);
 	assert(ull_hash_buckets >= thread_max/4);
 
-	ull_bucket = (queue_head_t *)kalloc(sizeof(queue_head_t) * ull_hash_buckets);
+	/* a power of 2 multiple of the cache line: naturally aligned by kalloc */
+	ull_bucket = (ull_bucket_t *)kalloc(sizeof(ull_bucket_t) * ull_hash_buckets);
 	assert(ull_bucket != NULL);
 
 	for (int i = 0; i < ull_hash_buckets; i++) {
-		queue_init(&ull_bucket[i]);
+		queue_init(&ull_bucket[i].ulb_head);
+		lck_spin_init(&ull_bucket[i].ulb_lock, ull_lck_grp, NULL);
+		ull_bucket[i].ulb_acquired = 0;
+		ull_bucket[i].ulb_contended = 0;
 	}
 
 	ull_zone = zinit(sizeof(ull_t),
@@ -218,30 +283,31 @@ static int
 ull_hash_dump(pid_t pid)
 {
 	int count = 0;
-	ull_global_lock();
 	if (pid == 0) {
 		kprintf("%s>total number of ull_t allocated %d\n", __FUNCTION__, ull_nzalloc);
 		kprintf("%s>BEGIN\n", __FUNCTION__);
 	}
 	for (int i = 0; i < ull_hash_buckets; i++) {
-		if (!queue_empty(&ull_bucket[i])) {
+		ull_bucket_lock(i);
+		if (!queue_empty(&ull_bucket[i].ulb_head)) {
 			ull_t *elem;
 			if (pid == 0) {
-				kprintf("%s>index %d:\n", __FUNCTION__, i);
+				kprintf("%s>index %d: acquired %llu contended %llu\n", __FUNCTION__, i,
+				        ull_bucket[i].ulb_acquired, ull_bucket[i].ulb_contended);
 			}
-			qe_foreach_element(elem, &ull_bucket[i], ull_hash_link) {
+			qe_foreach_element(elem, &ull_bucket[i].ulb_head, ull_hash_link) {
 				if ((pid == 0) || (pid == elem->ull_key.ulk_pid)) {
 					ull_dump(elem);
 					count++;
 				}
 			}
 		}
+		ull_bucket_unlock(i);
 	}
 	if (pid == 0) {
 		kprintf("%s>END\n", __FUNCTION__);
 		ull_nzalloc = 0;
 	}
-	ull_global_unlock();
 	return count;
 }
 #endif
@@ -264,7 +330,7 @@ ull_alloc(ulk_t *key)
 
 	lck_mtx_init(&ull->ull_lock, ull_lck_grp, NULL);
 
-	ull_nzalloc++;
+	hw_atomic_add(&ull_nzalloc, 1);
 	return ull;
 }
 
@@ -283,75 +349,114 @@ ull_free(ull_t *ull)
 /* Finds an existing ulock structure (ull_t), or creates a new one.
  * If MUST_EXIST flag is set, returns NULL instead of creating a new one.
  * The ulock structure is returned with ull_lock locked
- *
- * TODO: Per-bucket lock to reduce contention on global lock
  */
 static ull_t *
 ull_get(ulk_t *key, uint32_t flags)
 {
-	ull_t *ull = NULL;
+	ull_t *ull;
+	ull_t *new_ull = NULL;
 	uint i = ULL_INDEX(key);
 	ull_t *elem;
-	ull_global_lock();
-	qe_foreach_element(elem, &ull_bucket[i], ull_hash_link) {
-		ull_lock(elem);
+
+again:
+	ull = NULL;
+	ull_bucket_lock(i);
+	qe_foreach_element(elem, &ull_bucket[i].ulb_head, ull_hash_link) {
 		if (ull_key_match(&elem->ull_key, key)) {
 			ull = elem;
 			break;
-		} else {
-			ull_unlock(elem);
 		}
 	}
 	if (ull == NULL) {
 		if (flags & ULL_MUST_EXIST) {
 			/* Must already exist (called from wake) */
-			ull_global_unlock();
+			ull_bucket_unlock(i);
 			return NULL;
 		}
 
-		/* NRG maybe drop the ull_global_lock before the kalloc,
-		 * then take the lock and check again for a key match
-		 * and either use the new ull_t or free it.
-		 */
+		if (new_ull == NULL) {
+			/* can't allocate with the bucket spinlock held */
+			ull_bucket_unlock(i);
+			new_ull = ull_alloc(key);
+			if (new_ull == NULL) {
+				return NULL;
+			}
+			goto again;
+		}
 
-		ull = ull_alloc(key);
+		ull = new_ull;
+		new_ull = NULL;
+		enqueue(&ull_bucket[i].ulb_head, &ull->ull_hash_link);
+	}
 
-		if (ull == NULL) {
-			ull_global_unlock();
-			return NULL;
-		}
+	ull->ull_refcount++;
 
-		ull_lock(ull);
+	ull_bucket_unlock(i);
 
-		enqueue(&ull_bucket[i], &ull->ull_hash_link);
+	if (new_ull != NULL) {
+		/* someone else installed the key while we were allocating */
+		ull_free(new_ull);
+		new_ull = NULL;
 	}
 
-	ull->ull_refcount++;
+	ull_lock(ull);
 
-	ull_global_unlock();
+	if (!ull_key_match(&ull->ull_key, key)) {
+		/*
+		 * Its last waiter retired the ulock between our lookup
+		 * and taking ull_lock: a new one is needed.
+		 */
+		ull_put(ull);
+		goto again;
+	}
 
 	return ull; /* still locked */
 }
 
+/*
+ * Retire the ulock's key, dropping the reference held by the hash table,
+ * once it has no waiters left.
+ * Must be called with ull_lock held
+ */
+static void
+ull_retire_key(ull_t *ull)
+{
+	uint i = ULL_INDEX(&ull->ull_saved_key);
+
+	ull_assert_owned(ull);
+
+	ull_bucket_lock(i);
+	ull->ull_key.ulk_pid = 0;
+	ull->ull_key.ulk_addr = 0;
+	ull->ull_refcount--;
+	assert(ull->ull_refcount > 0);
+	ull_bucket_unlock(i);
+}
+
 /*
  * Must be called with ull_lock held
  */
 static void
 ull_put(ull_t *ull)
 {
+	uint i = ULL_INDEX(&ull->ull_saved_key);
+	int refcount;
+
 	ull_assert_owned(ull);
-	int refcount = --ull->ull_refcount;
-	assert(refcount == 0 ? (ull->ull_key.ulk_pid == 0 && ull->ull_key.ulk_addr == 0) : 1);
 	ull_unlock(ull);
 
+	ull_bucket_lock(i);
+	refcount = --ull->ull_refcount;
+	assert(refcount == 0 ? (ull->ull_key.ulk_pid == 0 && ull->ull_key.ulk_addr == 0) : 1);
+	if (refcount == 0) {
+		remqueue(&ull->ull_hash_link);
+	}
+	ull_bucket_unlock(i);
+
 	if (refcount > 0) {
 		return;
 	}
 
-	ull_global_lock();
-	remqueue(&ull->ull_hash_link);
-	ull_global_unlock();
-
 #if DEVELOPMENT || DEBUG
 	if (ull_debug) {
 		kprintf("%s>", __FUNCTION__);
@@ -386,12 +491,21 @@ ulock_wait(struct proc *p, struct ulock_wait_args *args, int32_t *retval)
 		goto munge_retval;
 	}
 
+	if ((flags & ULF_WAIT_READ_HELD) && opcode != UL_RW_LOCK) {
+		ret = EINVAL;
+		goto munge_retval;
+	}
+
 	boolean_t set_owner = FALSE;
 
 	switch (opcode) {
 	case UL_UNFAIR_LOCK:
 		set_owner = TRUE;
 		break;
+	case UL_RW_LOCK:
+		/* only a writer can be promoted */
+		set_owner = !(flags & ULF_WAIT_READ_HELD);
+		break;
 	case UL_COMPARE_AND_WAIT:
 		break;
 	default:
@@ -404,7 +518,7 @@ ulock_wait(struct proc *p, struct ulock_wait_args *args, int32_t *retval)
 		goto munge_retval;
 	}
 
-	/* 32-bit lock type for UL_COMPARE_AND_WAIT and UL_UNFAIR_LOCK */
+	/* 32-bit lock type for UL_COMPARE_AND_WAIT, UL_UNFAIR_LOCK and UL_RW_LOCK */
 	uint32_t value = 0;
 
 	if ((args->addr == 0) || (args->addr % _Alignof(_Atomic(typeof(value))))) {
@@ -427,6 +541,9 @@ ulock_wait(struct proc *p, struct ulock_wait_args *args, int32_t *retval)
 	}
 	/* ull is locked */
 
+	uthread_t uth = get_bsdthread_info(self);
+	uth->uu_kevent.uu_ulock_wait_data.ull = ull;
+
 	ull->ull_nwaiters++;
 
 	if (ull->ull_nwaiters > ull->ull_max_nwaiters) {
@@ -558,6 +675,8 @@ ulock_wait(struct proc *p, struct ulock_wait_args *args, int32_t *retval)
 	}
 
 out:
+	/* a requeue may have moved us (and our reference) to another ulock */
+	ull = uth->uu_kevent.uu_ulock_wait_data.ull;
 	ull_lock(ull);
 	*retval = --ull->ull_nwaiters;
 	if (ull->ull_nwaiters == 0) {
@@ -572,10 +691,7 @@ out:
 
 		assert(ull->ull_owner == THREAD_NULL);
 
-		ull->ull_key.ulk_pid = 0;
-		ull->ull_key.ulk_addr = 0;
-		ull->ull_refcount--;
-		assert(ull->ull_refcount > 0);
+		ull_retire_key(ull);
 	}
 	ull_put(ull);
 
@@ -605,8 +721,119 @@ munge_retval:
 	return ret;
 }
 
+/*
+ * Called, with the thread locked, for each waiter moved by a requeue
+ */
+static void
+ull_requeue_cb(void *ctx, thread_t thread)
+{
+	uthread_t uth = get_bsdthread_info(thread);
+
+	uth->uu_kevent.uu_ulock_wait_data.ull = ctx;
+}
+
+/*
+ * Move 'n' references from one ulock to another, on behalf of the
+ * waiters that were requeued from the former to the latter.
+ */
+static void
+ull_transfer_refs(ull_t *from, ull_t *to, int n)
+{
+	uint i;
+
+	i = ULL_INDEX(&to->ull_saved_key);
+	ull_bucket_lock(i);
+	to->ull_refcount += n;
+	ull_bucket_unlock(i);
+
+	i = ULL_INDEX(&from->ull_saved_key);
+	ull_bucket_lock(i);
+	from->ull_refcount -= n;
+	assert(from->ull_refcount > 0);
+	ull_bucket_unlock(i);
+}
+
+/*
+ * Wake one waiter of 'ull' and move the others over to the ulock for
+ * 'dst_key', which is created if need be.  Returns the number of
+ * waiters moved in *retval.
+ *
+ * Must be called with ull_lock held, returns with it held
+ */
+static int
+ull_requeue(ull_t *ull, ulk_t *dst_key, int32_t *retval)
+{
+	ull_t *dst;
+	int nmoved;
+
+	ull_assert_owned(ull);
+
+again:
+	ull_unlock(ull);
+
+	dst = ull_get(dst_key, 0);
+	if (dst == NULL) {
+		ull_lock(ull);
+		return ENOMEM;
+	}
+	/* dst is locked */
+
+	/* take both ulock mutexes in address order */
+	if (dst < ull) {
+		ull_lock(ull);
+	} else {
+		ull_unlock(dst);
+		ull_lock(ull);
+		ull_lock(dst);
+
+		if (!ull_key_match(&dst->ull_key, dst_key)) {
+			/* its last waiter retired dst while it was unlocked */
+			ull_put(dst);
+			goto again;
+		}
+	}
+
+	nmoved = 0;
+
+	/* the last waiter may have left while ull was unlocked */
+	if (ull_key_match(&ull->ull_key, &ull->ull_saved_key)) {
+		thread_wakeup_one_with_pri(ULOCK_TO_EVENT(ull), WAITQ_SELECT_MAX_PRI);
+
+		nmoved = thread_requeue(ULOCK_TO_EVENT(ull), ULOCK_TO_EVENT(dst),
+		                        -1, ull_requeue_cb, dst);
+	}
+
+	if (nmoved > 0) {
+		ull->ull_nwaiters -= nmoved;
+		assert(ull->ull_nwaiters >= 0);
+
+		dst->ull_nwaiters += nmoved;
+		if (dst->ull_nwaiters > dst->ull_max_nwaiters) {
+			dst->ull_max_nwaiters = dst->ull_nwaiters;
+		}
+
+		ull_transfer_refs(ull, dst, nmoved);
+
+		if (ull->ull_nwaiters == 0) {
+			/* no one is left to retire ull */
+			assert(ull->ull_owner == THREAD_NULL);
+			ull_retire_key(ull);
+		}
+	}
+
+	if (dst->ull_nwaiters == 0) {
+		/* dst was created for the requeue, but got no waiters */
+		assert(dst->ull_owner == THREAD_NULL);
+		ull_retire_key(dst);
+	}
+	ull_put(dst);
+
+	*retval = nmoved;
+	return 0;
+}
+
 int
-ulock_wake(struct proc *p, struct ulock_wake_args *args, __unused int32_t *retval)
+ulock_wake(struct proc *p, struct ulock_wake_args *args, int32_t *retval)
 {
 	uint opcode = args->operation & UL_OPCODE_MASK;
 	uint flags = args->operation & UL_FLAGS_MASK;
@@ -646,11 +873,30 @@ ulock_wake(struct proc *p, struct ulock_wake_args *args, __unused int32_t *retva
 		goto munge_retval;
 	}
 
-	if (flags & ULF_WAKE_THREAD) {
-		if (flags & ULF_WAKE_ALL) {
+	/* the wake modes are mutually exclusive */
+	if (__builtin_popcount(flags & (ULF_WAKE_ALL | ULF_WAKE_THREAD |
+	    ULF_WAKE_N | ULF_WAKE_REQUEUE)) > 1) {
+		ret = EINVAL;
+		goto munge_retval;
+	}
+
+	if ((flags & ULF_WAKE_N) &&
+	    (args->wake_value == 0 || args->wake_value > INT32_MAX)) {
+		ret = EINVAL;
+		goto munge_retval;
+	}
+
+	if (flags & ULF_WAKE_REQUEUE) {
+		if (opcode != UL_COMPARE_AND_WAIT ||
+		    (user_addr_t)args->wake_value == 0 ||
+		    (user_addr_t)args->wake_value == args->addr ||
+		    (args->wake_value % _Alignof(_Atomic(uint32_t)))) {
 			ret = EINVAL;
 			goto munge_retval;
 		}
+	}
+
+	if (flags & ULF_WAKE_THREAD) {
 		mach_port_name_t wake_thread_name = (mach_port_name_t)(args->wake_value);
 		wake_thread = port_name_to_thread_for_ulock(wake_thread_name);
 		if (wake_thread == THREAD_NULL) {
@@ -676,6 +922,7 @@ ulock_wake(struct proc *p, struct ulock_wake_args *args, __unused int32_t *retva
 
 	switch (opcode) {
 	case UL_UNFAIR_LOCK:
+	case UL_RW_LOCK:
 		clear_owner = TRUE;
 		break;
 	case UL_COMPARE_AND_WAIT:
@@ -689,7 +936,8 @@ ulock_wake(struct proc *p, struct ulock_wake_args *args, __unused int32_t *retva
 		goto out_locked;
 	}
 
-	if (opcode != ull->ull_opcode) {
+	/* a ulock that only holds requeued waiters has no opcode yet */
+	if (ull->ull_opcode != 0 && opcode != ull->ull_opcode) {
 		if (ull_debug) {
 			kprintf("[%d]%s>EDOM - opcode mismatch - opcode %d addr 0x%llx flags 0x%x\n",
 			        id, __FUNCTION__, opcode, (unsigned long long)(args->addr), flags);
@@ -704,6 +952,28 @@ ulock_wake(struct proc *p, struct ulock_wake_args *args, __unused int32_t *retva
 
 	if (flags & ULF_WAKE_ALL) {
 		thread_wakeup(ULOCK_TO_EVENT(ull));
+	} else if (flags & ULF_WAKE_N) {
+		/*
+		 * Woken threads can't come back to wait before we drop ull_lock,
+		 * so there is no point looking for more than ull_nwaiters.
+		 */
+		int nwake = (int)MIN(args->wake_value, (uint64_t)ull->ull_nwaiters);
+		int nwoken = 0;
+
+		while (nwoken < nwake &&
+		       thread_wakeup_one_with_pri(ULOCK_TO_EVENT(ull),
+		                                  WAITQ_SELECT_MAX_PRI) == KERN_SUCCESS) {
+			nwoken++;
+		}
+		*retval = nwoken;
+	} else if (flags & ULF_WAKE_REQUEUE) {
+		ulk_t dst_key;
+
+		dst_key.ulk_pid = p->p_pid;
+		dst_key.ulk_addr = (user_addr_t)args->wake_value;
+
+		ret = ull_requeue(ull, &dst_key, retval);
+		/* ull is still locked */
 	} else if (flags & ULF_WAKE_THREAD) {
 		kern_return_t kr = thread_wakeup_thread(ULOCK_TO_EVENT(ull), wake_thread);
 		if (kr != KERN_SUCCESS) {
@@ -800,10 +1070,12 @@ kdp_ulock_find_owner(__unused struct waitq * waitq, event64_t event, thread_wait
 	ull_t *ull = EVENT_TO_ULOCK(event);
 	assert(kdp_is_in_zone(ull, "ulocks"));
 
-	if (ull->ull_opcode == UL_UNFAIR_LOCK) {// owner is only set if it's an os_unfair_lock
+	if (ull->ull_opcode == UL_UNFAIR_LOCK ||
+	    ull->ull_opcode == UL_RW_LOCK) { // owner is only set if it's an os_unfair_lock or a write-held rwlock
 		waitinfo->owner = thread_tid(ull->ull_owner);
 		waitinfo->context = ull->ull_key.ulk_addr;
-	} else if (ull->ull_opcode == UL_COMPARE_AND_WAIT) { // otherwise, this is a spinlock
+	} else if (ull->ull_opcode == UL_COMPARE_AND_WAIT ||
+	           ull->ull_opcode == 0) { // otherwise, this is a spinlock, or only has requeued waiters
 		waitinfo->owner = 0;
 		waitinfo->context = ull->ull_key.ulk_addr;
 	} else {
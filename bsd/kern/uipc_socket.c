@@ -183,6 +183,7 @@ static int sooptcopyout_timeval(struct sockopt *, const struct timeval *);
 
 SECURITY_READ_ONLY_EARLY(struct filterops) soread_filtops = {
 	.f_isfd = 1,
+	.f_level = true,
 	.f_attach = filt_sorattach,
 	.f_detach = filt_sordetach,
 	.f_event = filt_soread,
@@ -192,6 +193,7 @@ SECURITY_READ_ONLY_EARLY(struct filterops) soread_filtops = {
 
 SECURITY_READ_ONLY_EARLY(struct filterops) sowrite_filtops = {
 	.f_isfd = 1,
+	.f_level = true,
 	.f_attach = filt_sowattach,
 	.f_detach = filt_sowdetach,
 	.f_event = filt_sowrite,
@@ -109,8 +109,9 @@ fq_detect_dequeue_stall(fq_if_t *fqs, fq_t *flowq, fq_if_classq_t *fq_cl,
     u_int64_t *now)
 {
 	u_int64_t maxgetqtime;
+	/* a paced flow is idle by design until its next release time */
 	if (FQ_IS_DELAYHIGH(flowq) || flowq->fq_getqtime == 0 ||
-	    fq_empty(flowq) ||
+	    fq_empty(flowq) || (flowq->fq_flags & FQF_PACED) ||
 	    flowq->fq_bytes < FQ_MIN_FC_THRESHOLD_BYTES)
 		return;
 	maxgetqtime = flowq->fq_getqtime + fqs->fqs_update_interval;
@@ -158,6 +159,8 @@ fq_addq(fq_if_t *fqs, pktsched_pkt_t *pkt, fq_if_classq_t *fq_cl)
 	uint32_t *pkt_flags;
 	uint32_t pkt_flowid, pkt_tx_start_seq;
 	uint8_t pkt_proto, pkt_flowsrc;
+	struct timespec now_ts;
+	boolean_t paced = FALSE;
 
 	pktsched_get_pkt_vars(pkt, &pkt_flags, &pkt_timestamp, &pkt_flowid,
 	    &pkt_flowsrc, &pkt_proto, &pkt_tx_start_seq);
@@ -168,10 +171,22 @@ fq_addq(fq_if_t *fqs, pktsched_pkt_t *pkt, fq_if_classq_t *fq_cl)
 		*pkt_flags |= PKTF_PRIV_GUARDED;
 	}
 
-	if (*pkt_timestamp > 0) {
+	if (*pkt_flags & PKTF_TS_VALID) {
+		/*
+		 * The timestamp was set by the sender rather than by dlil
+		 * at enqueue: if it is in the future, the transport paced
+		 * this packet and it is held in the flow until then.
+		 */
+		*pkt_flags &= ~PKTF_TS_VALID;
+		nanouptime(&now_ts);
+		now = (now_ts.tv_sec * NSEC_PER_SEC) + now_ts.tv_nsec;
+		if (*pkt_timestamp > now)
+			paced = TRUE;
+		else
+			now = *pkt_timestamp;
+	} else if (*pkt_timestamp > 0) {
 		now = *pkt_timestamp;
 	} else {
-		struct timespec now_ts;
 		nanouptime(&now_ts);
 		now = (now_ts.tv_sec * NSEC_PER_SEC) + now_ts.tv_nsec;
 		*pkt_timestamp = now;
@@ -280,6 +295,8 @@ fq_addq(fq_if_t *fqs, pktsched_pkt_t *pkt, fq_if_classq_t *fq_cl)
 		uint32_t pkt_len = pktsched_get_pkt_len(pkt);
 		fq_enqueue(fq, pkt->pktsched_pkt);
 		fq->fq_bytes += pkt_len;
+		if (paced)
+			fq->fq_flags |= FQF_PACED;
 		fq_cl->fcl_stat.fcl_byte_cnt += pkt_len;
 		fq_cl->fcl_stat.fcl_pkt_cnt++;
 
@@ -334,8 +351,10 @@ fq_getq_flow_internal(fq_if_t *fqs, fq_t *fq, pktsched_pkt_t *pkt)
 	IFCQ_DEC_BYTES(ifq, plen);
 
 	/* Reset getqtime so that we don't count idle times */
-	if (fq_empty(fq))
+	if (fq_empty(fq)) {
 		fq->fq_getqtime = 0;
+		fq->fq_flags &= ~FQF_PACED;
+	}
 
 	return (p);
 }
@@ -130,6 +130,7 @@ struct ifclassq {
 	u_int32_t	ifcq_target_qdelay; /* target queue delay */
 	u_int32_t	ifcq_bytes;	/* bytes count */
 	u_int32_t	ifcq_pkt_drop_limit;
+	u_int64_t	ifcq_release_ts; /* earliest release time held by the last dequeue (ns) */
 	void		*ifcq_disc;	/* for scheduler-specific use */
 	/*
 	 * ifcq_disc_slots[] represents the leaf classes configured for the
@@ -531,6 +531,9 @@ SYSCTL_PROC(_net_link_generic_system, OID_AUTO, sndq_maxlen,
     CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED, &if_sndq_maxlen, IFQ_MAXLEN,
     sysctl_sndq_maxlen, "I", "Default transmit queue max length");
 
+/* shortest sleep of the starter thread while paced packets are due */
+#define	IFNET_START_PACING_MIN_NSEC	(50ULL * 1000)		/* 50 us */
+
 #define	IF_RCVQ_MINLEN	32
 #define	IF_RCVQ_MAXLEN	256
 u_int32_t if_rcvq_maxlen = IF_RCVQ_MAXLEN;
@@ -2803,6 +2806,7 @@ ifnet_start_thread_fn(void *v, wait_result_t w)
 	struct timespec *ts = NULL;
 	struct ifclassq *ifq = &ifp->if_snd;
 	struct timespec delay_start_ts;
+	struct timespec release_ts;
 
 	/* Construct the name for this thread, and then apply it. */
 	bzero(thread_name, sizeof(thread_name));
@@ -2932,6 +2936,34 @@ ifnet_start_thread_fn(void *v, wait_result_t w)
 			ts = &delay_start_ts;
 		}
 
+		/*
+		 * If the scheduler held paced packets during the last
+		 * dequeue pass, wake up when the earliest of them may be
+		 * released, but no sooner than IFNET_START_PACING_MIN_NSEC.
+		 * A flow controlled driver is restarted by ifnet_start()
+		 * once it resumes, and a release time already past belongs
+		 * to packets dequeued since.
+		 */
+		if (ts == NULL && !IFCQ_IS_EMPTY(ifq) &&
+		    !(ifp->if_start_flags & IFSF_FLOW_CONTROLLED)) {
+			struct timespec now;
+			u_int64_t now_nsec, release;
+
+			IFCQ_LOCK_SPIN(ifq);
+			release = ifq->ifcq_release_ts;
+			IFCQ_UNLOCK(ifq);
+
+			nanouptime(&now);
+			net_timernsec(&now, &now_nsec);
+			if (release > now_nsec) {
+				release = MAX(release - now_nsec,
+				    IFNET_START_PACING_MIN_NSEC);
+				release_ts.tv_sec = release / NSEC_PER_SEC;
+				release_ts.tv_nsec = release % NSEC_PER_SEC;
+				ts = &release_ts;
+			}
+		}
+
 		if (ts != NULL && ts->tv_sec == 0 && ts->tv_nsec == 0)
 			ts = NULL;
 	}
@@ -3308,8 +3340,10 @@ ifnet_enqueue_common(struct ifnet *ifp, void *p, classq_pkt_type_t ptype,
 	/*
 	 * If packet already carries a timestamp, either from dlil_output()
 	 * or from flowswitch, use it here.  Otherwise, record timestamp.
-	 * PKTF_TS_VALID is always cleared prior to entering classq, i.e.
-	 * the timestamp value is used internally there.
+	 * PKTF_TS_VALID is cleared prior to entering classq, i.e.
+	 * the timestamp value is used internally there; fq_codel keeps
+	 * it on timestamps set by the caller, which may be the release
+	 * time of a paced packet, and clears it itself.
 	 */
 	switch (ptype) {
 	case QP_MBUF:
@@ -3321,8 +3355,10 @@ ifnet_enqueue_common(struct ifnet *ifp, void *p, classq_pkt_type_t ptype,
 			nanouptime(&now);
 			net_timernsec(&now, &now_nsec);
 			m->m_pkthdr.pkt_timestamp = now_nsec;
+			m->m_pkthdr.pkt_flags &= ~PKTF_TS_VALID;
+		} else if (ifp->if_snd.ifcq_type != PKTSCHEDT_FQ_CODEL) {
+			m->m_pkthdr.pkt_flags &= ~PKTF_TS_VALID;
 		}
-		m->m_pkthdr.pkt_flags &= ~PKTF_TS_VALID;
 		/*
 		 * If the packet service class is not background,
 		 * update the timestamp to indicate recent activity
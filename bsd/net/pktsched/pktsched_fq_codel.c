@@ -100,10 +100,36 @@ fq_getq_flow_mbuf(fq_if_t *fqs, fq_if_classq_t *fq_cl, fq_t *fq,
 	boolean_t limit_reached = FALSE;
 	struct ifclassq *ifq = fqs->fqs_ifq;
 	struct ifnet *ifp = ifq->ifcq_ifp;
+	u_int64_t now = 0;
 
 	while (fq->fq_deficit > 0 && limit_reached == FALSE &&
 	    !MBUFQ_EMPTY(&fq->fq_mbufq)) {
 
+		/*
+		 * A paced packet stays at the head of its flow until its
+		 * release time; note the earliest one so that the starter
+		 * thread can come back for it.
+		 */
+		if (fq->fq_flags & FQF_PACED) {
+			m = MBUFQ_FIRST(&fq->fq_mbufq);
+			if (now == 0) {
+				struct timespec now_ts;
+
+				nanouptime(&now_ts);
+				now = (now_ts.tv_sec * NSEC_PER_SEC) +
+				    now_ts.tv_nsec;
+			}
+			if (m->m_pkthdr.pkt_timestamp > now) {
+				if (ifq->ifcq_release_ts == 0 ||
+				    m->m_pkthdr.pkt_timestamp <
+				    ifq->ifcq_release_ts)
+					ifq->ifcq_release_ts =
+					    m->m_pkthdr.pkt_timestamp;
+				fq_cl->fcl_stat.fcl_pacing_held++;
+				break;
+			}
+		}
+
 		_PKTSCHED_PKT_INIT(&pkt);
 		m = fq_getq_flow(fqs, fq, &pkt);
 		ASSERT(pkt.pktsched_ptype == QP_MBUF);
@@ -392,6 +418,8 @@ fq_if_dequeue_classq_multi(struct ifclassq *ifq, u_int32_t maxpktcnt,
 	fq_if_classq_t *fq_cl;
 	int pri;
 	fq_if_append_pkt_t append_pkt;
+	pktsched_bitmap_t retried = 0, held = 0;
+	u_int32_t pacing_held;
 
 	IFCQ_LOCK_ASSERT_HELD(ifq);
 
@@ -412,6 +440,9 @@ fq_if_dequeue_classq_multi(struct ifclassq *ifq, u_int32_t maxpktcnt,
 	total_pktcnt = total_bytecnt = 0;
 	*ptype = fqs->fqs_ptype;
 
+	/* only the paced packets held during this pass count */
+	ifq->ifcq_release_ts = 0;
+
 	for (;;) {
 		classq_pkt_type_t tmp_ptype;
 		if (fqs->fqs_bitmaps[FQ_IF_ER] == 0 &&
@@ -446,9 +477,27 @@ fq_if_dequeue_classq_multi(struct ifclassq *ifq, u_int32_t maxpktcnt,
 			if (fq_cl->fcl_budget <= 0)
 				goto state_change;
 		}
+		pacing_held = fq_cl->fcl_stat.fcl_pacing_held;
 		fq_if_dequeue(fqs, fq_cl, (maxpktcnt - total_pktcnt),
 		    (maxbytecnt - total_bytecnt), &top, &tail, &pktcnt,
 		    &bytecnt, FALSE, &tmp_ptype);
+		if (top == NULL &&
+		    fq_cl->fcl_stat.fcl_pacing_held != pacing_held) {
+			/*
+			 * Flows are waiting for their release time. Try once
+			 * more, as other flows had their deficit replenished;
+			 * if that yields nothing either, set the class aside
+			 * for the rest of this dequeue.
+			 */
+			if (pktsched_bit_tst(pri, &retried)) {
+				pktsched_bit_clr(pri,
+				    &fqs->fqs_bitmaps[FQ_IF_ER]);
+				pktsched_bit_set(pri, &held);
+			} else {
+				pktsched_bit_set(pri, &retried);
+			}
+			continue;
+		}
 		if (top != NULL) {
 			ASSERT(tmp_ptype == *ptype);
 			ASSERT(pktcnt > 0 && bytecnt > 0);
@@ -491,6 +540,9 @@ state_change:
 		if (total_pktcnt >= maxpktcnt || total_bytecnt >= maxbytecnt)
 			break;
 	}
+	/* Classes set aside for pacing are still eligible next time */
+	fqs->fqs_bitmaps[FQ_IF_ER] |= held;
+
 	if (first != NULL) {
 		if (first_packet != NULL)
 			*first_packet = first;
@@ -527,6 +579,7 @@ fq_if_dequeue_sc_classq_multi(struct ifclassq *ifq, mbuf_svc_class_t svc,
 	fq_if_classq_t *fq_cl;
 	void *first = NULL, *last = NULL;
 	fq_if_append_pkt_t append_pkt;
+	boolean_t retried = FALSE;
 
 	switch (fqs->fqs_ptype) {
 	case QP_MBUF:
@@ -551,9 +604,19 @@ fq_if_dequeue_sc_classq_multi(struct ifclassq *ifq, mbuf_svc_class_t svc,
 	    fq_cl->fcl_stat.fcl_pkt_cnt > 0) {
 		void *top, *tail;
 		u_int32_t pktcnt = 0, bytecnt = 0;
+		u_int32_t pacing_held = fq_cl->fcl_stat.fcl_pacing_held;
 		fq_if_dequeue(fqs, fq_cl, (maxpktcnt - total_pktcnt),
 		    (maxbytecnt - total_bytecnt), &top, &tail, &pktcnt,
 		    &bytecnt, TRUE, ptype);
+		if (top == NULL) {
+			/* stop once only flows waiting for release are left */
+			if (fq_cl->fcl_stat.fcl_pacing_held != pacing_held) {
+				if (retried)
+					break;
+				retried = TRUE;
+			}
+			continue;
+		}
 		if (first == NULL) {
 			first = top;
 			total_pktcnt = pktcnt;
@@ -1119,6 +1182,11 @@ fq_if_dequeue(fq_if_t *fqs, fq_if_classq_t *fq_cl, u_int32_t pktlimit,
 		    pktlimit, top, &last, &bytecnt, &pktcnt, &qempty,
 		    PKTF_NEW_FLOW);
 
+		if (!qempty && fq->fq_deficit > 0 && !limit_reached) {
+			/* held for pacing; it keeps its deficit */
+			fq_if_empty_new_flow(fq, fq_cl, true);
+			continue;
+		}
 		if (fq->fq_deficit <= 0 || qempty)
 			fq_if_empty_new_flow(fq, fq_cl, true);
 		fq->fq_deficit += fq_cl->fcl_quantum;
@@ -1245,6 +1313,7 @@ fq_if_getqstats_ifclassq(struct ifclassq *ifq, u_int32_t qid,
 	fcls->fcls_throttle_off = fq_cl->fcl_stat.fcl_throttle_off;
 	fcls->fcls_throttle_drops = fq_cl->fcl_stat.fcl_throttle_drops;
 	fcls->fcls_dup_rexmts = fq_cl->fcl_stat.fcl_dup_rexmts;
+	fcls->fcls_pacing_held = fq_cl->fcl_stat.fcl_pacing_held;
 
 	/* Gather per flow stats */
 	flowstat_cnt = min((fcls->fcls_newflows_cnt +
@@ -61,6 +61,7 @@ struct fcl_stat {
 	u_int32_t fcl_throttle_off;
 	u_int32_t fcl_throttle_drops;
 	u_int32_t fcl_dup_rexmts;
+	u_int32_t fcl_pacing_held;
 };
 
 /*
@@ -181,6 +182,7 @@ struct fq_codel_classstats {
 	u_int32_t	fcls_dup_rexmts;
 	u_int32_t	fcls_flowstats_cnt;
 	struct fq_codel_flowstats fcls_flowstats[FQ_IF_MAX_FLOWSTATS];
+	u_int32_t	fcls_pacing_held;
 };
 
 #ifdef BSD_KERNEL_PRIVATE
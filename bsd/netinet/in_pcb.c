@@ -496,11 +496,47 @@ inpcb_timer_sched(struct inpcbinfo *ipi, u_int32_t type)
 	lck_mtx_unlock(&inpcb_timeout_lock);
 }
 
+/*
+ * Allocate the striped locks covering the connection hash; the number of
+ * stripes follows the size of the hash, capped at INPCB_HASHLOCK_MAX.
+ */
+static void
+in_pcbhash_locks_init(struct inpcbinfo *ipi)
+{
+	u_long i, nlocks;
+
+	VERIFY(ipi->ipi_hashbase != NULL && ipi->ipi_hashlocks == NULL);
+
+	nlocks = MIN(ipi->ipi_hashmask + 1, INPCB_HASHLOCK_MAX);
+	VERIFY(powerof2(nlocks));
+
+	/*
+	 * Align the stripes on the CPU cache boundary; the unaligned
+	 * address is kept in ipi_hashlocks_buf.
+	 */
+	MALLOC(ipi->ipi_hashlocks_buf, void *,
+	    nlocks * sizeof (struct inpcbhashlock) + MAX_CPU_CACHE_LINE_SIZE,
+	    M_PCB, M_WAITOK | M_ZERO);
+	VERIFY(ipi->ipi_hashlocks_buf != NULL);
+	ipi->ipi_hashlocks = (struct inpcbhashlock *)
+	    P2ROUNDUP((intptr_t)ipi->ipi_hashlocks_buf,
+	    MAX_CPU_CACHE_LINE_SIZE);
+	ipi->ipi_hashlockmask = nlocks - 1;
+
+	for (i = 0; i < nlocks; i++) {
+		lck_rw_init(&ipi->ipi_hashlocks[i].ihl_lock,
+		    ipi->ipi_lock_grp, ipi->ipi_lock_attr);
+	}
+	bzero(&ipi->ipi_hashstat, sizeof (ipi->ipi_hashstat));
+}
+
 void
 in_pcbinfo_attach(struct inpcbinfo *ipi)
 {
 	struct inpcbinfo *ipi0;
 
+	in_pcbhash_locks_init(ipi);
+
 	lck_mtx_lock(&inpcb_lock);
 	TAILQ_FOREACH(ipi0, &inpcb_head, ipi_entry) {
 		if (ipi0 == ipi) {
@@ -1461,6 +1497,7 @@ in_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p,
 	struct in_addr laddr;
 	struct sockaddr_in *sin = (struct sockaddr_in *)(void *)nam;
 	struct inpcb *pcb;
+	struct in_addr *new_laddr = NULL;
 	int error;
 	struct socket *so = inp->inp_socket;
 
@@ -1503,7 +1540,7 @@ in_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p,
 			lck_rw_lock_exclusive(inp->inp_pcbinfo->ipi_lock);
 			socket_lock(so, 0);
 		}
-		inp->inp_laddr = laddr;
+		new_laddr = &laddr;
 		/* no reference needed */
 		inp->inp_last_outifp = (outif != NULL) ? *outif : NULL;
 		inp->inp_flags |= INP_INADDR_ANY;
@@ -1528,11 +1565,9 @@ in_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p,
 			socket_lock(so, 0);
 		}
 	}
-	inp->inp_faddr = sin->sin_addr;
-	inp->inp_fport = sin->sin_port;
+	in_pcbrehash_tuple(inp, new_laddr, sin->sin_addr, sin->sin_port);
 	if (nstat_collect && SOCK_PROTO(so) == IPPROTO_UDP)
 		nstat_pcb_invalidate_cache(inp);
-	in_pcbrehash(inp);
 	lck_rw_done(inp->inp_pcbinfo->ipi_lock);
 	return (0);
 }
@@ -1541,13 +1576,11 @@ void
 in_pcbdisconnect(struct inpcb *inp)
 {
 	struct socket *so = inp->inp_socket;
+	struct in_addr faddr;
 
 	if (nstat_collect && SOCK_PROTO(so) == IPPROTO_UDP)
 		nstat_pcb_cache(inp);
 
-	inp->inp_faddr.s_addr = INADDR_ANY;
-	inp->inp_fport = 0;
-
 	if (!lck_rw_try_lock_exclusive(inp->inp_pcbinfo->ipi_lock)) {
 		/* lock inversion issue, mostly with udp multicast packets */
 		socket_unlock(so, 0);
@@ -1555,7 +1588,8 @@ in_pcbdisconnect(struct inpcb *inp)
 		socket_lock(so, 0);
 	}
 
-	in_pcbrehash(inp);
+	faddr.s_addr = INADDR_ANY;
+	in_pcbrehash_tuple(inp, NULL, faddr, 0);
 	lck_rw_done(inp->inp_pcbinfo->ipi_lock);
 	/*
 	 * A multipath subflow socket would have its SS_NOFDREF set by default,
@@ -2135,18 +2169,17 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 #if INET6
 	struct inpcb *local_wild_mapped = NULL;
 #endif /* INET6 */
+	u_int32_t element;
 
 	/*
-	 * We may have found the pcb in the last lookup - check this first.
-	 */
-
-	lck_rw_lock_shared(pcbinfo->ipi_lock);
-
-	/*
-	 * First look for an exact match.
+	 * First look for an exact match.  Established flows are resolved
+	 * here holding only the lock of their hash stripe, so input does
+	 * not serialize against binds and detaches on ipi_lock.
 	 */
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr.s_addr, lport, fport,
-	    pcbinfo->ipi_hashmask)];
+	element = INP_PCBHASH(faddr.s_addr, lport, fport,
+	    pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[element];
+	in_pcbhash_lock_shared(pcbinfo, element);
 	LIST_FOREACH(inp, head, inp_hash) {
 #if INET6
 		if (!(inp->inp_vflag & INP_IPV4))
@@ -2164,24 +2197,30 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 			 */
 			if (in_pcb_checkstate(inp, WNT_ACQUIRE, 0) !=
 			    WNT_STOPUSING) {
-				lck_rw_done(pcbinfo->ipi_lock);
+				in_pcbhash_unlock(pcbinfo, element);
 				return (inp);
 			} else {
 				/* it's there but dead, say it isn't found */
-				lck_rw_done(pcbinfo->ipi_lock);
+				in_pcbhash_unlock(pcbinfo, element);
 				return (NULL);
 			}
 		}
 	}
+	in_pcbhash_unlock(pcbinfo, element);
 
 	if (!wildcard) {
 		/*
 		 * Not found.
 		 */
-		lck_rw_done(pcbinfo->ipi_lock);
 		return (NULL);
 	}
 
+	/*
+	 * Wildcard matches weigh several listeners against each other;
+	 * do that under ipi_lock, which excludes every hash writer.
+	 */
+	lck_rw_lock_shared(pcbinfo->ipi_lock);
+
 	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
 	    pcbinfo->ipi_hashmask)];
 	LIST_FOREACH(inp, head, inp_hash) {
@@ -2242,6 +2281,43 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 	return (NULL);
 }
 
+/*
+ * Take the stripe lock covering hash chain `element' for a lookup.  The
+ * lock is tried first so that contention can be accounted for.
+ */
+void
+in_pcbhash_lock_shared(struct inpcbinfo *ipi, u_int32_t element)
+{
+	lck_rw_t *lck = INP_PCBHASHLOCK(ipi, element);
+
+	if (!lck_rw_try_lock_shared(lck)) {
+		atomic_add_64(&ipi->ipi_hashstat.ihs_lookup_contended, 1);
+		lck_rw_lock_shared(lck);
+	}
+}
+
+void
+in_pcbhash_unlock(struct inpcbinfo *ipi, u_int32_t element)
+{
+	lck_rw_done(INP_PCBHASHLOCK(ipi, element));
+}
+
+/*
+ * Exclusive counterpart of in_pcbhash_lock_shared(), used when a hash
+ * chain is modified; the caller must also hold ipi_lock exclusive.
+ */
+static void
+in_pcbhash_lock_exclusive(struct inpcbinfo *ipi, u_int32_t element)
+{
+	lck_rw_t *lck = INP_PCBHASHLOCK(ipi, element);
+
+	LCK_RW_ASSERT(ipi->ipi_lock, LCK_RW_ASSERT_EXCLUSIVE);
+	if (!lck_rw_try_lock_exclusive(lck)) {
+		atomic_add_64(&ipi->ipi_hashstat.ihs_update_contended, 1);
+		lck_rw_lock_exclusive(lck);
+	}
+}
+
 /*
  * @brief	Insert PCB onto various hash lists.
  *
@@ -2330,7 +2406,9 @@ in_pcbinshash(struct inpcb *inp, int locked)
 
 	inp->inp_phd = phd;
 	LIST_INSERT_HEAD(&phd->phd_pcblist, inp, inp_portlist);
+	in_pcbhash_lock_exclusive(pcbinfo, inp->inp_hash_element);
 	LIST_INSERT_HEAD(pcbhash, inp, inp_hash);
+	in_pcbhash_unlock(pcbinfo, inp->inp_hash_element);
 	inp->inp_flags2 |= INP2_INHASHLIST;
 
 	if (!locked)
@@ -2344,17 +2422,75 @@ in_pcbinshash(struct inpcb *inp, int locked)
 	return (0);
 }
 
+/*
+ * Take the hash stripe locks needed to move a PCB to bucket "new_element".
+ * Hold both stripes across the move so that a lockless lookup never
+ * observes the PCB missing from the hash, nor a half-written 4-tuple;
+ * take them in index order to avoid deadlocking against another rehash.
+ */
+static void
+in_pcbrehash_lock(struct inpcb *inp, u_int32_t new_element)
+{
+	struct inpcbinfo *ipi = inp->inp_pcbinfo;
+	u_int32_t old_element = inp->inp_hash_element;
+	u_int32_t old_stripe, new_stripe;
+
+	old_stripe = old_element & ipi->ipi_hashlockmask;
+	new_stripe = new_element & ipi->ipi_hashlockmask;
+	if (!(inp->inp_flags2 & INP2_INHASHLIST) || old_stripe == new_stripe) {
+		in_pcbhash_lock_exclusive(ipi, new_element);
+	} else if (old_stripe < new_stripe) {
+		in_pcbhash_lock_exclusive(ipi, old_element);
+		in_pcbhash_lock_exclusive(ipi, new_element);
+	} else {
+		in_pcbhash_lock_exclusive(ipi, new_element);
+		in_pcbhash_lock_exclusive(ipi, old_element);
+	}
+}
+
+/*
+ * Move the PCB to bucket "new_element" and drop the stripe locks taken
+ * by in_pcbrehash_lock().
+ */
+static void
+in_pcbrehash_move(struct inpcb *inp, u_int32_t new_element)
+{
+	struct inpcbinfo *ipi = inp->inp_pcbinfo;
+	u_int32_t old_element = inp->inp_hash_element;
+
+	if (inp->inp_flags2 & INP2_INHASHLIST) {
+		LIST_REMOVE(inp, inp_hash);
+		inp->inp_flags2 &= ~INP2_INHASHLIST;
+		if ((old_element & ipi->ipi_hashlockmask) !=
+		    (new_element & ipi->ipi_hashlockmask))
+			in_pcbhash_unlock(ipi, old_element);
+	}
+
+	VERIFY(!(inp->inp_flags2 & INP2_INHASHLIST));
+	inp->inp_hash_element = new_element;
+	LIST_INSERT_HEAD(&ipi->ipi_hashbase[new_element], inp, inp_hash);
+	inp->inp_flags2 |= INP2_INHASHLIST;
+	in_pcbhash_unlock(ipi, new_element);
+
+#if NECP
+	// This call catches updates to the remote addresses
+	inp_update_necp_policy(inp, NULL, NULL, 0);
+#endif /* NECP */
+}
+
 /*
  * Move PCB to the proper hash bucket when { faddr, fport } have  been
  * changed. NOTE: This does not handle the case of the lport changing (the
  * hashed port list would have to be updated as well), so the lport must
  * not change after in_pcbinshash() has been called.
+ *
+ * The PCB must not be visible to lookups yet, or the caller must hold
+ * the new tuple back and use in_pcbrehash_tuple() instead.
  */
 void
 in_pcbrehash(struct inpcb *inp)
 {
-	struct inpcbhead *head;
-	u_int32_t hashkey_faddr;
+	u_int32_t hashkey_faddr, new_element;
 
 #if INET6
 	if (inp->inp_vflag & INP_IPV6)
@@ -2363,24 +2499,55 @@ in_pcbrehash(struct inpcb *inp)
 #endif /* INET6 */
 		hashkey_faddr = inp->inp_faddr.s_addr;
 
-	inp->inp_hash_element = INP_PCBHASH(hashkey_faddr, inp->inp_lport,
+	new_element = INP_PCBHASH(hashkey_faddr, inp->inp_lport,
 	    inp->inp_fport, inp->inp_pcbinfo->ipi_hashmask);
-	head = &inp->inp_pcbinfo->ipi_hashbase[inp->inp_hash_element];
+	in_pcbrehash_lock(inp, new_element);
+	in_pcbrehash_move(inp, new_element);
+}
 
-	if (inp->inp_flags2 & INP2_INHASHLIST) {
-		LIST_REMOVE(inp, inp_hash);
-		inp->inp_flags2 &= ~INP2_INHASHLIST;
-	}
+/*
+ * Set { laddr, faddr, fport } and move the PCB to the matching hash
+ * bucket.  The tuple is written under the stripe locks, so that lookups
+ * running under the shared stripe lock see either the old or the new one.
+ * A NULL laddr leaves the local address alone.
+ * Must be called with the pcbinfo lock held in exclusive mode.
+ */
+void
+in_pcbrehash_tuple(struct inpcb *inp, const struct in_addr *laddr,
+    struct in_addr faddr, in_port_t fport)
+{
+	u_int32_t new_element;
 
-	VERIFY(!(inp->inp_flags2 & INP2_INHASHLIST));
-	LIST_INSERT_HEAD(head, inp, inp_hash);
-	inp->inp_flags2 |= INP2_INHASHLIST;
+	new_element = INP_PCBHASH(faddr.s_addr, inp->inp_lport, fport,
+	    inp->inp_pcbinfo->ipi_hashmask);
+	in_pcbrehash_lock(inp, new_element);
+	if (laddr != NULL)
+		inp->inp_laddr = *laddr;
+	inp->inp_faddr = faddr;
+	inp->inp_fport = fport;
+	in_pcbrehash_move(inp, new_element);
+}
 
-#if NECP
-	// This call catches updates to the remote addresses
-	inp_update_necp_policy(inp, NULL, NULL, 0);
-#endif /* NECP */
+#if INET6
+/*
+ * IPv6 version of in_pcbrehash_tuple().
+ */
+void
+in6_pcbrehash_tuple(struct inpcb *inp, const struct in6_addr *laddr,
+    const struct in6_addr *faddr, in_port_t fport)
+{
+	u_int32_t new_element;
+
+	new_element = INP_PCBHASH(faddr->s6_addr32[3] /* XXX */,
+	    inp->inp_lport, fport, inp->inp_pcbinfo->ipi_hashmask);
+	in_pcbrehash_lock(inp, new_element);
+	if (laddr != NULL)
+		inp->in6p_laddr = *laddr;
+	inp->in6p_faddr = *faddr;
+	inp->inp_fport = fport;
+	in_pcbrehash_move(inp, new_element);
 }
+#endif /* INET6 */
 
 /*
  * Remove PCB from various lists.
@@ -2401,9 +2568,12 @@ in_pcbremlists(struct inpcb *inp)
 
 		VERIFY(phd != NULL && inp->inp_lport > 0);
 
+		in_pcbhash_lock_exclusive(inp->inp_pcbinfo,
+		    inp->inp_hash_element);
 		LIST_REMOVE(inp, inp_hash);
 		inp->inp_hash.le_next = NULL;
 		inp->inp_hash.le_prev = NULL;
+		in_pcbhash_unlock(inp->inp_pcbinfo, inp->inp_hash_element);
 
 		LIST_REMOVE(inp, inp_portlist);
 		inp->inp_portlist.le_next = NULL;
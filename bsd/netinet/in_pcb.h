@@ -78,6 +78,7 @@
 #include <sys/tree.h>
 #include <kern/locks.h>
 #include <kern/zalloc.h>
+#include <sys/mcache.h>
 #include <netinet/in_stat.h>
 #endif /* BSD_KERNEL_PRIVATE */
 
@@ -529,6 +530,26 @@ struct intimercount {
 
 typedef void (*inpcb_timer_func_t)(struct inpcbinfo *);
 
+/*
+ * Lock guarding a stripe of the connection hash (ipi_hashbase).  Each
+ * lock is padded out to its own cache line so that lookups landing on
+ * neighbouring stripes don't bounce the same line between CPUs.
+ */
+struct inpcbhashlock {
+	decl_lck_rw_data(, ihl_lock);
+} __attribute__((aligned(MAX_CPU_CACHE_LINE_SIZE)));
+
+#define	INPCB_HASHLOCK_MAX	1024	/* upper bound on hash lock stripes */
+
+/*
+ * Contention counters for the connection hash locks; updated atomically
+ * and only on the slow path.
+ */
+struct inpcbhashstat {
+	u_int64_t	ihs_lookup_contended;	/* lookups that had to block */
+	u_int64_t	ihs_update_contended;	/* inserts/removes that blocked */
+};
+
 /*
  * Global data structure for each high-level protocol (UDP, TCP, ...) in both
  * IPv4 and IPv6.  Holds inpcb lists and information for managing them.  Each
@@ -589,6 +610,17 @@ struct inpcbinfo {
 	struct inpcbhead	*ipi_hashbase;
 	u_long			ipi_hashmask;
 
+	/*
+	 * Striped locks for ipi_hashbase.  A hash chain is only modified
+	 * with both ipi_lock and the chain's stripe held exclusive, so
+	 * exact-match lookups may walk a chain holding just its stripe
+	 * shared, without touching ipi_lock.
+	 */
+	struct inpcbhashlock	*ipi_hashlocks;
+	u_long			ipi_hashlockmask;
+	void			*ipi_hashlocks_buf;
+	struct inpcbhashstat	ipi_hashstat;
+
 	/*
 	 * Per-protocol hash of pcbs, hashed by only local port number.
 	 */
@@ -611,6 +643,8 @@ struct inpcbinfo {
 	(((faddr) ^ ((faddr) >> 16) ^ ntohs((lport) ^ (fport))) & (mask))
 #define	INP_PCBPORTHASH(lport, mask) \
 	(ntohs((lport)) & (mask))
+#define	INP_PCBHASHLOCK(ipi, element) \
+	(&(ipi)->ipi_hashlocks[(element) & (ipi)->ipi_hashlockmask].ihl_lock)
 
 #define	INP_IS_FLOW_CONTROLLED(_inp_) \
 	((_inp_)->inp_flags & INP_FLOW_CONTROLLED)
@@ -776,6 +810,12 @@ extern int in_pcblookup_hash_exists(struct inpcbinfo *, struct in_addr,
 extern void in_pcbnotifyall(struct inpcbinfo *, struct in_addr, int,
     void (*)(struct inpcb *, int));
 extern void in_pcbrehash(struct inpcb *);
+extern void in_pcbrehash_tuple(struct inpcb *, const struct in_addr *,
+    struct in_addr, in_port_t);
+extern void in6_pcbrehash_tuple(struct inpcb *, const struct in6_addr *,
+    const struct in6_addr *, in_port_t);
+extern void in_pcbhash_lock_shared(struct inpcbinfo *, u_int32_t);
+extern void in_pcbhash_unlock(struct inpcbinfo *, u_int32_t);
 extern int in_getpeeraddr(struct socket *, struct sockaddr **);
 extern int in_getsockaddr(struct socket *, struct sockaddr **);
 extern int in_getsockaddr_s(struct socket *, struct sockaddr_in *);
@@ -298,6 +298,8 @@ struct tcp_notify_ack_complete {
 #define	TCP_RXT_MINIMUM_TIMEOUT_LIMIT	(5 * 60) /* Limit is 5 minutes */
 
 #define MPTCP_ALTERNATE_PORT		0x216
+#define	TCP_USE_BBR			0x217	/* Use BBR congestion control */
+#define	TCP_PACING_RATE			0x218	/* Max pacing rate, bytes per sec */
 
 /*
  * The TCP_INFO socket option is a private API and is subject to change
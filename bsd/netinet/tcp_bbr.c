@@ -0,0 +1,633 @@
+/*
+ * Copyright (c) 2017 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Model based congestion control in the style of BBR.
+ *
+ * Instead of reacting to packet loss, the sender keeps an estimate of the
+ * bottleneck bandwidth (windowed max of the delivery rate measured once
+ * per round trip) and of the propagation delay (windowed min of the RTT).
+ * Transmissions are paced at a gain times the bandwidth estimate and the
+ * congestion window is only a cap on the data in flight, set to a small
+ * multiple of the estimated bandwidth-delay product.
+ *
+ * The connection goes through the following modes:
+ * - STARTUP: pace at 2/ln(2) times the bandwidth estimate to double the
+ *   delivery rate every round until it stops growing.
+ * - DRAIN: pace at the inverse gain to drain the queue built in STARTUP.
+ * - PROBE_BW: cycle the pacing gain through 5/4, 3/4 and six phases of 1
+ *   to probe for more bandwidth and drain what the probe queued.
+ * - PROBE_RTT: if the min RTT was not refreshed for 10 seconds, hold the
+ *   window at 4 segments for at least 200ms and a round trip to let the
+ *   queues drain and measure the propagation delay again.
+ *
+ * Rates are kept in bytes per millisecond and times in tcp_now units.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/protosw.h>
+#include <sys/socketvar.h>
+
+#include <net/route.h>
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+
+#if INET6
+#include <netinet/ip6.h>
+#endif /* INET6 */
+
+#include <netinet/ip_var.h>
+#include <netinet/tcp.h>
+#include <netinet/tcp_timer.h>
+#include <netinet/tcp_var.h>
+#include <netinet/tcp_fsm.h>
+#include <netinet/tcp_cc.h>
+#include <netinet/tcpip.h>
+#include <netinet/tcp_seq.h>
+#include <libkern/OSAtomic.h>
+#include <dev/random/randomdev.h>
+
+static int tcp_bbr_init(struct tcpcb *tp);
+static int tcp_bbr_cleanup(struct tcpcb *tp);
+static void tcp_bbr_cwnd_init(struct tcpcb *tp);
+static void tcp_bbr_congestion_avd(struct tcpcb *tp, struct tcphdr *th);
+static void tcp_bbr_ack_rcvd(struct tcpcb *tp, struct tcphdr *th);
+static void tcp_bbr_pre_fr(struct tcpcb *tp);
+static void tcp_bbr_post_fr(struct tcpcb *tp, struct tcphdr *th);
+static void tcp_bbr_after_idle(struct tcpcb *tp);
+static void tcp_bbr_after_timeout(struct tcpcb *tp);
+static int tcp_bbr_delay_ack(struct tcpcb *tp, struct tcphdr *th);
+static void tcp_bbr_switch_cc(struct tcpcb *tp, uint16_t old_cc_index);
+static inline void tcp_bbr_clear_state(struct tcpcb *tp);
+
+struct tcp_cc_algo tcp_cc_bbr = {
+	.name = "bbr",
+	.init = tcp_bbr_init,
+	.cleanup = tcp_bbr_cleanup,
+	.cwnd_init = tcp_bbr_cwnd_init,
+	.congestion_avd = tcp_bbr_congestion_avd,
+	.ack_rcvd = tcp_bbr_ack_rcvd,
+	.pre_fr = tcp_bbr_pre_fr,
+	.post_fr = tcp_bbr_post_fr,
+	.after_idle = tcp_bbr_after_idle,
+	.after_timeout = tcp_bbr_after_timeout,
+	.delay_ack = tcp_bbr_delay_ack,
+	.switch_to = tcp_bbr_switch_cc
+};
+
+/* Modes of the state machine */
+#define	TCP_BBR_STARTUP		0
+#define	TCP_BBR_DRAIN		1
+#define	TCP_BBR_PROBE_BW	2
+#define	TCP_BBR_PROBE_RTT	3
+
+/* Flags in bbr_flags */
+#define	TCP_BBR_FULL_PIPE	0x01	/* bandwidth stopped growing */
+#define	TCP_BBR_APP_LIMITED	0x02	/* ran out of data this round */
+#define	TCP_BBR_PROBE_RTT_ROUND	0x04	/* a round passed in PROBE_RTT */
+
+/* Gains are fixed point with 8 fractional bits */
+#define	TCP_BBR_SCALE		8
+#define	TCP_BBR_UNIT		(1 << TCP_BBR_SCALE)
+#define	TCP_BBR_HIGH_GAIN	739	/* 2/ln(2) */
+#define	TCP_BBR_DRAIN_GAIN	88	/* ln(2)/2 */
+#define	TCP_BBR_CWND_GAIN	(2 * TCP_BBR_UNIT)
+#define	TCP_BBR_FULL_BW_THRESH	(TCP_BBR_UNIT * 5 / 4)
+#define	TCP_BBR_FULL_BW_CNT	3
+
+#define	TCP_BBR_CYCLE_LEN	8
+static const u_int16_t tcp_bbr_cycle_gain[TCP_BBR_CYCLE_LEN] = {
+	TCP_BBR_UNIT * 5 / 4,
+	TCP_BBR_UNIT * 3 / 4,
+	TCP_BBR_UNIT, TCP_BBR_UNIT, TCP_BBR_UNIT,
+	TCP_BBR_UNIT, TCP_BBR_UNIT, TCP_BBR_UNIT
+};
+
+#define	TCP_BBR_BW_WIN		10	/* rounds in the max bw filter */
+#define	TCP_BBR_MIN_RTT_WIN	(10 * TCP_RETRANSHZ)
+#define	TCP_BBR_PROBE_RTT_TIME	(TCP_RETRANSHZ / 5)
+#define	TCP_BBR_MIN_CWND_SEGS	4
+
+#define	TCP_BBR_MIN_CWND(_tp_) (TCP_BBR_MIN_CWND_SEGS * (_tp_)->t_maxseg)
+
+SYSCTL_INT(_net_inet_tcp, OID_AUTO, bbr_sockets,
+	CTLFLAG_RD | CTLFLAG_LOCKED, &tcp_cc_bbr.num_sockets,
+	0, "Number of sockets using BBR");
+
+SYSCTL_SKMEM_TCP_INT(OID_AUTO, bbr_pacing, CTLFLAG_RW | CTLFLAG_LOCKED,
+	static int, tcp_bbr_pacing, 1, "Pace transmissions of BBR sockets");
+
+static int
+tcp_bbr_init(struct tcpcb *tp)
+{
+	OSIncrementAtomic((volatile SInt32 *)&tcp_cc_bbr.num_sockets);
+
+	VERIFY(tp->t_ccstate != NULL);
+	tcp_bbr_clear_state(tp);
+	return (0);
+}
+
+static int
+tcp_bbr_cleanup(struct tcpcb *tp)
+{
+	tp->t_pacing_rate = 0;
+	OSDecrementAtomic((volatile SInt32 *)&tcp_cc_bbr.num_sockets);
+	return (0);
+}
+
+/*
+ * Running max of the bandwidth samples over the last TCP_BBR_BW_WIN
+ * rounds.  Three samples are kept, the best, second best and third best
+ * in the window, so that the max can fall back to a recent value when
+ * the best one ages out without storing every sample.
+ */
+static void
+tcp_bbr_bw_filter(struct tcpcb *tp, u_int32_t bw)
+{
+	struct tcp_ccstate *cc = tp->t_ccstate;
+	u_int32_t round = cc->bbr_round_cnt;
+
+	if (bw >= cc->bbr_bw[0] ||
+	    round - cc->bbr_bw_round[2] > TCP_BBR_BW_WIN) {
+		/* New max, or the whole window has expired */
+		cc->bbr_bw[0] = cc->bbr_bw[1] = cc->bbr_bw[2] = bw;
+		cc->bbr_bw_round[0] = cc->bbr_bw_round[1] =
+		    cc->bbr_bw_round[2] = round;
+		return;
+	}
+	if (bw >= cc->bbr_bw[1]) {
+		cc->bbr_bw[1] = cc->bbr_bw[2] = bw;
+		cc->bbr_bw_round[1] = cc->bbr_bw_round[2] = round;
+	} else if (bw >= cc->bbr_bw[2]) {
+		cc->bbr_bw[2] = bw;
+		cc->bbr_bw_round[2] = round;
+	}
+
+	/* Age out the best samples */
+	if (round - cc->bbr_bw_round[0] > TCP_BBR_BW_WIN) {
+		cc->bbr_bw[0] = cc->bbr_bw[1];
+		cc->bbr_bw_round[0] = cc->bbr_bw_round[1];
+		cc->bbr_bw[1] = cc->bbr_bw[2];
+		cc->bbr_bw_round[1] = cc->bbr_bw_round[2];
+		cc->bbr_bw[2] = bw;
+		cc->bbr_bw_round[2] = round;
+		if (round - cc->bbr_bw_round[0] > TCP_BBR_BW_WIN) {
+			cc->bbr_bw[0] = cc->bbr_bw[1];
+			cc->bbr_bw_round[0] = cc->bbr_bw_round[1];
+			cc->bbr_bw[1] = cc->bbr_bw[2];
+			cc->bbr_bw_round[1] = cc->bbr_bw_round[2];
+		}
+	} else if (cc->bbr_bw_round[1] == cc->bbr_bw_round[0] &&
+	    round - cc->bbr_bw_round[1] > TCP_BBR_BW_WIN / 4) {
+		/* Keep the second best sample from a later quarter */
+		cc->bbr_bw[1] = cc->bbr_bw[2] = bw;
+		cc->bbr_bw_round[1] = cc->bbr_bw_round[2] = round;
+	} else if (cc->bbr_bw_round[2] == cc->bbr_bw_round[1] &&
+	    round - cc->bbr_bw_round[2] > TCP_BBR_BW_WIN / 2) {
+		cc->bbr_bw[2] = bw;
+		cc->bbr_bw_round[2] = round;
+	}
+}
+
+/*
+ * Estimated bandwidth-delay product scaled by gain, in bytes.  Before
+ * the first bandwidth and RTT samples there is no model, so fall back
+ * to the current congestion window.
+ */
+static u_int32_t
+tcp_bbr_bdp(struct tcpcb *tp, u_int32_t gain)
+{
+	struct tcp_ccstate *cc = tp->t_ccstate;
+	u_int64_t bdp;
+
+	if (cc->bbr_bw[0] == 0 || cc->bbr_min_rtt == 0)
+		return (tp->snd_cwnd);
+
+	bdp = (u_int64_t)cc->bbr_bw[0] * cc->bbr_min_rtt;
+	bdp = (bdp * gain) >> TCP_BBR_SCALE;
+	return ((u_int32_t)MIN(bdp, TCP_MAXWIN << TCP_MAX_WINSHIFT));
+}
+
+/*
+ * Target for the congestion window: the gained BDP plus a few segments
+ * to absorb delayed and stretched acks.
+ */
+static u_int32_t
+tcp_bbr_target_cwnd(struct tcpcb *tp, u_int32_t gain)
+{
+	u_int32_t target;
+
+	target = tcp_bbr_bdp(tp, gain) + 3 * tp->t_maxseg;
+	return (max(target, TCP_BBR_MIN_CWND(tp)));
+}
+
+static void
+tcp_bbr_set_pacing_rate(struct tcpcb *tp)
+{
+	struct tcp_ccstate *cc = tp->t_ccstate;
+	u_int64_t rate;
+	u_int32_t srtt;
+
+	if (!tcp_bbr_pacing) {
+		tp->t_pacing_rate = 0;
+		return;
+	}
+
+	if (cc->bbr_bw[0] != 0) {
+		rate = ((u_int64_t)cc->bbr_bw[0] * cc->bbr_pacing_gain) >>
+		    TCP_BBR_SCALE;
+	} else {
+		/* No bandwidth sample yet, derive a rate from cwnd/srtt */
+		srtt = tp->t_srtt >> TCP_RTT_SHIFT;
+		if (srtt == 0)
+			return;
+		rate = ((u_int64_t)(tp->snd_cwnd / srtt) *
+		    TCP_BBR_HIGH_GAIN) >> TCP_BBR_SCALE;
+	}
+	rate = MAX(rate, 1);
+
+	/*
+	 * In STARTUP the bandwidth samples lag the sending rate; do not
+	 * slow down until the pipe is known to be full.
+	 */
+	if ((cc->bbr_flags & TCP_BBR_FULL_PIPE) || rate > tp->t_pacing_rate)
+		tp->t_pacing_rate = (u_int32_t)MIN(rate, UINT32_MAX);
+}
+
+static void
+tcp_bbr_enter_probe_bw(struct tcpcb *tp)
+{
+	struct tcp_ccstate *cc = tp->t_ccstate;
+
+	cc->bbr_mode = TCP_BBR_PROBE_BW;
+	cc->bbr_cwnd_gain = TCP_BBR_CWND_GAIN;
+	/*
+	 * Start at a random phase other than the draining one so that
+	 * flows sharing a bottleneck do not probe in lockstep: pick one
+	 * of 1..7, then advance past it, as the draining phase (1) only
+	 * makes sense right after the probing one.
+	 */
+	cc->bbr_cycle_idx = TCP_BBR_CYCLE_LEN - 1 -
+	    (RandomULong() % (TCP_BBR_CYCLE_LEN - 1));
+	cc->bbr_cycle_idx = (cc->bbr_cycle_idx + 1) % TCP_BBR_CYCLE_LEN;
+	cc->bbr_pacing_gain = tcp_bbr_cycle_gain[cc->bbr_cycle_idx];
+	cc->bbr_cycle_ts = tcp_now;
+}
+
+static void
+tcp_bbr_enter_startup(struct tcpcb *tp)
+{
+	struct tcp_ccstate *cc = tp->t_ccstate;
+
+	cc->bbr_mode = TCP_BBR_STARTUP;
+	cc->bbr_pacing_gain = TCP_BBR_HIGH_GAIN;
+	cc->bbr_cwnd_gain = TCP_BBR_HIGH_GAIN;
+}
+
+/*
+ * Advance the gain cycle of PROBE_BW once the current phase has lasted
+ * a min RTT.  The probing phase also waits until it has actually put
+ * the extra data in flight, and the draining phase ends early once the
+ * queue it was meant to drain is gone.
+ */
+static void
+tcp_bbr_update_cycle(struct tcpcb *tp, u_int32_t inflight)
+{
+	struct tcp_ccstate *cc = tp->t_ccstate;
+	boolean_t full_length, advance;
+
+	full_length = (timer_diff(tcp_now, 0, cc->bbr_cycle_ts, 0) >
+	    (int32_t)cc->bbr_min_rtt);
+
+	if (cc->bbr_pacing_gain > TCP_BBR_UNIT)
+		advance = full_length &&
+		    inflight >= tcp_bbr_bdp(tp, cc->bbr_pacing_gain);
+	else if (cc->bbr_pacing_gain < TCP_BBR_UNIT)
+		advance = full_length ||
+		    inflight <= tcp_bbr_bdp(tp, TCP_BBR_UNIT);
+	else
+		advance = full_length;
+
+	if (advance) {
+		cc->bbr_cycle_idx = (cc->bbr_cycle_idx + 1) %
+		    TCP_BBR_CYCLE_LEN;
+		cc->bbr_pacing_gain = tcp_bbr_cycle_gain[cc->bbr_cycle_idx];
+		cc->bbr_cycle_ts = tcp_now;
+	}
+}
+
+/*
+ * Update the path model with this ack: the min RTT, the per round
+ * delivery rate and the state machine that depends on them.
+ */
+static void
+tcp_bbr_update_model(struct tcpcb *tp, struct tcphdr *th, u_int32_t acked)
+{
+	struct tcp_ccstate *cc = tp->t_ccstate;
+	struct socket *so = tp->t_inpcb->inp_socket;
+	u_int32_t rtt, inflight, bw, elapsed;
+	boolean_t round_start = FALSE, rtt_expired;
+
+	inflight = tp->snd_max - th->th_ack;
+
+	/* Windowed min RTT */
+	rtt = tp->t_rttcur;
+	rtt_expired = (cc->bbr_min_rtt_ts != 0 &&
+	    TSTMP_GT(tcp_now, cc->bbr_min_rtt_ts + TCP_BBR_MIN_RTT_WIN));
+	if (rtt > 0 && (cc->bbr_min_rtt == 0 || rtt <= cc->bbr_min_rtt ||
+	    rtt_expired)) {
+		cc->bbr_min_rtt = rtt;
+		cc->bbr_min_rtt_ts = tcp_now;
+	}
+
+	/*
+	 * Delivery rate, sampled once per round trip: the bytes acked
+	 * since the round started over the time it took.  Rounds where
+	 * the sender ran out of data only count if they raise the max.
+	 */
+	if (so->so_snd.sb_cc <= tp->snd_max - tp->snd_una)
+		cc->bbr_flags |= TCP_BBR_APP_LIMITED;
+	cc->bbr_round_acked += acked;
+	if (SEQ_GEQ(th->th_ack, cc->bbr_round_end)) {
+		elapsed = max(timer_diff(tcp_now, 0, cc->bbr_round_ts, 0), 1);
+		bw = cc->bbr_round_acked / elapsed;
+		cc->bbr_round_cnt++;
+		if (bw > 0 && (!(cc->bbr_flags & TCP_BBR_APP_LIMITED) ||
+		    bw > cc->bbr_bw[0]))
+			tcp_bbr_bw_filter(tp, bw);
+
+		/* Check whether the pipe is full once per round */
+		if (!(cc->bbr_flags & (TCP_BBR_FULL_PIPE |
+		    TCP_BBR_APP_LIMITED))) {
+			if (cc->bbr_bw[0] >= (u_int32_t)(((u_int64_t)
+			    cc->bbr_full_bw * TCP_BBR_FULL_BW_THRESH) >>
+			    TCP_BBR_SCALE)) {
+				cc->bbr_full_bw = cc->bbr_bw[0];
+				cc->bbr_full_bw_cnt = 0;
+			} else if (++cc->bbr_full_bw_cnt >=
+			    TCP_BBR_FULL_BW_CNT) {
+				cc->bbr_flags |= TCP_BBR_FULL_PIPE;
+			}
+		}
+
+		cc->bbr_round_end = tp->snd_max;
+		cc->bbr_round_ts = tcp_now;
+		cc->bbr_round_acked = 0;
+		cc->bbr_flags &= ~TCP_BBR_APP_LIMITED;
+		round_start = TRUE;
+	}
+
+	switch (cc->bbr_mode) {
+	case TCP_BBR_STARTUP:
+		if (cc->bbr_flags & TCP_BBR_FULL_PIPE) {
+			cc->bbr_mode = TCP_BBR_DRAIN;
+			cc->bbr_pacing_gain = TCP_BBR_DRAIN_GAIN;
+			cc->bbr_cwnd_gain = TCP_BBR_HIGH_GAIN;
+		}
+		break;
+	case TCP_BBR_DRAIN:
+		if (inflight <= tcp_bbr_bdp(tp, TCP_BBR_UNIT))
+			tcp_bbr_enter_probe_bw(tp);
+		break;
+	case TCP_BBR_PROBE_BW:
+		tcp_bbr_update_cycle(tp, inflight);
+		break;
+	case TCP_BBR_PROBE_RTT:
+		if (cc->bbr_probe_rtt_ts == 0) {
+			/* Wait for the flight to drain to the minimum */
+			if (inflight <= TCP_BBR_MIN_CWND(tp)) {
+				cc->bbr_probe_rtt_ts = tcp_now +
+				    TCP_BBR_PROBE_RTT_TIME;
+				if (cc->bbr_probe_rtt_ts == 0)
+					cc->bbr_probe_rtt_ts = 1;
+				cc->bbr_flags &= ~TCP_BBR_PROBE_RTT_ROUND;
+				cc->bbr_round_end = tp->snd_max;
+			}
+		} else {
+			if (round_start)
+				cc->bbr_flags |= TCP_BBR_PROBE_RTT_ROUND;
+			if ((cc->bbr_flags & TCP_BBR_PROBE_RTT_ROUND) &&
+			    TSTMP_GEQ(tcp_now, cc->bbr_probe_rtt_ts)) {
+				cc->bbr_min_rtt_ts = tcp_now;
+				tp->snd_cwnd = max(tp->snd_cwnd,
+				    cc->bbr_prior_cwnd);
+				if (cc->bbr_flags & TCP_BBR_FULL_PIPE)
+					tcp_bbr_enter_probe_bw(tp);
+				else
+					tcp_bbr_enter_startup(tp);
+			}
+		}
+		break;
+	}
+
+	if (rtt_expired && cc->bbr_mode != TCP_BBR_PROBE_RTT) {
+		/* The min RTT is stale, go and measure it again */
+		cc->bbr_mode = TCP_BBR_PROBE_RTT;
+		cc->bbr_pacing_gain = TCP_BBR_UNIT;
+		cc->bbr_cwnd_gain = TCP_BBR_UNIT;
+		cc->bbr_prior_cwnd = tp->snd_cwnd;
+		cc->bbr_probe_rtt_ts = 0;
+	}
+}
+
+static void
+tcp_bbr_update_cwnd(struct tcpcb *tp, u_int32_t acked)
+{
+	struct tcp_ccstate *cc = tp->t_ccstate;
+	u_int32_t target;
+
+	target = tcp_bbr_target_cwnd(tp, cc->bbr_cwnd_gain);
+	if (cc->bbr_flags & TCP_BBR_FULL_PIPE)
+		tp->snd_cwnd = min(tp->snd_cwnd + acked, target);
+	else if (tp->snd_cwnd < target ||
+	    tp->t_bytes_acked < TCP_CC_CWND_INIT_BYTES)
+		tp->snd_cwnd += acked;
+
+	tp->snd_cwnd = max(tp->snd_cwnd, TCP_BBR_MIN_CWND(tp));
+	if (cc->bbr_mode == TCP_BBR_PROBE_RTT)
+		tp->snd_cwnd = min(tp->snd_cwnd, TCP_BBR_MIN_CWND(tp));
+	tp->snd_cwnd = min(tp->snd_cwnd, TCP_MAXWIN << tp->snd_scale);
+}
+
+static void
+tcp_bbr_ack_rcvd(struct tcpcb *tp, struct tcphdr *th)
+{
+	u_int32_t acked;
+
+	acked = BYTES_ACKED(th, tp);
+	tp->t_bytes_acked += acked;
+
+	tcp_bbr_update_model(tp, th, acked);
+	tcp_bbr_update_cwnd(tp, acked);
+	tcp_bbr_set_pacing_rate(tp);
+}
+
+/*
+ * BBR has no separate congestion avoidance phase; every in-sequence ack
+ * updates the model the same way.
+ */
+static void
+tcp_bbr_congestion_avd(struct tcpcb *tp, struct tcphdr *th)
+{
+	tcp_bbr_ack_rcvd(tp, th);
+}
+
+static void
+tcp_bbr_cwnd_init(struct tcpcb *tp)
+{
+	struct tcp_ccstate *cc = tp->t_ccstate;
+
+	VERIFY(cc != NULL);
+
+	tcp_cc_cwnd_init_or_reset(tp);
+	tp->t_bytes_acked = 0;
+	tp->snd_ssthresh = TCP_MAXWIN << TCP_MAX_WINSHIFT;
+
+	cc->bbr_round_end = tp->snd_max;
+	cc->bbr_round_ts = tcp_now;
+	cc->bbr_round_acked = 0;
+	tp->t_pacing_tokens = 0;
+	tp->t_pacing_ts = tcp_now;
+	tcp_bbr_set_pacing_rate(tp);
+}
+
+/*
+ * Loss does not change the model.  For the recovery episode, fall back
+ * to packet conservation by letting the window follow the data that
+ * was in flight when the loss was detected, and remember the window to
+ * restore afterwards.
+ */
+static void
+tcp_bbr_pre_fr(struct tcpcb *tp)
+{
+	struct tcp_ccstate *cc = tp->t_ccstate;
+	u_int32_t flight;
+
+	if (cc->bbr_mode == TCP_BBR_PROBE_RTT)
+		cc->bbr_prior_cwnd = max(cc->bbr_prior_cwnd, tp->snd_cwnd);
+	else
+		cc->bbr_prior_cwnd = tp->snd_cwnd;
+
+	flight = tp->snd_max - tp->snd_una;
+	tp->snd_ssthresh = max(flight, TCP_BBR_MIN_CWND(tp));
+}
+
+static void
+tcp_bbr_post_fr(struct tcpcb *tp, struct tcphdr *th)
+{
+#pragma unused(th)
+	struct tcp_ccstate *cc = tp->t_ccstate;
+
+	tp->snd_ssthresh = TCP_MAXWIN << TCP_MAX_WINSHIFT;
+	tp->snd_cwnd = max(cc->bbr_prior_cwnd, TCP_BBR_MIN_CWND(tp));
+	if (cc->bbr_mode == TCP_BBR_PROBE_RTT)
+		tp->snd_cwnd = TCP_BBR_MIN_CWND(tp);
+	tp->t_bytes_acked = 0;
+}
+
+/*
+ * After an idle period the model is still valid; pacing keeps the
+ * restart from bursting, so keep the window and reset the pacing budget.
+ */
+static void
+tcp_bbr_after_idle(struct tcpcb *tp)
+{
+	struct tcp_ccstate *cc = tp->t_ccstate;
+
+	if (cc->bbr_bw[0] == 0) {
+		tcp_bbr_cwnd_init(tp);
+		return;
+	}
+	tp->snd_cwnd = tcp_bbr_target_cwnd(tp, cc->bbr_cwnd_gain);
+	cc->bbr_round_end = tp->snd_max;
+	cc->bbr_round_ts = tcp_now;
+	cc->bbr_round_acked = 0;
+	tp->t_pacing_tokens = 0;
+	tp->t_pacing_ts = tcp_now;
+}
+
+static void
+tcp_bbr_after_timeout(struct tcpcb *tp)
+{
+	struct tcp_ccstate *cc = tp->t_ccstate;
+
+	VERIFY(cc != NULL);
+
+	/*
+	 * Avoid adjusting congestion window due to SYN retransmissions.
+	 * If more than one byte (SYN) is outstanding then it is still
+	 * needed to adjust the window.
+	 */
+	if (tp->t_state < TCPS_ESTABLISHED &&
+	    ((int)(tp->snd_max - tp->snd_una) <= 1))
+		return;
+
+	if (!IN_FASTRECOVERY(tp))
+		cc->bbr_prior_cwnd = max(cc->bbr_prior_cwnd, tp->snd_cwnd);
+
+	/*
+	 * A retransmit timeout means the model may be badly off.  Restart
+	 * from one segment and regrow towards the target on each ack.
+	 */
+	tp->snd_cwnd = tp->t_maxseg;
+	cc->bbr_round_end = tp->snd_max;
+	cc->bbr_round_ts = tcp_now;
+	cc->bbr_round_acked = 0;
+}
+
+static int
+tcp_bbr_delay_ack(struct tcpcb *tp, struct tcphdr *th)
+{
+	return (tcp_cc_delay_ack(tp, th));
+}
+
+/*
+ * Switching to BBR from another algorithm starts a fresh model, the
+ * same as a new connection.
+ */
+static void
+tcp_bbr_switch_cc(struct tcpcb *tp, uint16_t old_cc_index)
+{
+#pragma unused(old_cc_index)
+	tcp_bbr_clear_state(tp);
+	tcp_bbr_cwnd_init(tp);
+
+	OSIncrementAtomic((volatile SInt32 *)&tcp_cc_bbr.num_sockets);
+}
+
+static inline void
+tcp_bbr_clear_state(struct tcpcb *tp)
+{
+	bzero(&tp->t_ccstate->__u__._bbr_state_,
+	    sizeof(tp->t_ccstate->__u__._bbr_state_));
+	tcp_bbr_enter_startup(tp);
+	tp->t_pacing_rate = 0;
+}
@@ -73,6 +73,14 @@ struct tcp_cc_debug_state {
 		struct {
 			u_int32_t led_base_rtt;
 		} ledbat_state;
+		struct {
+			u_int32_t ccd_bw;
+			u_int32_t ccd_min_rtt;
+			u_int32_t ccd_pacing_rate;
+			u_int16_t ccd_pacing_gain;
+			u_int8_t ccd_mode;
+			u_int8_t ccd_flags;
+		} bbr_state;
 	} u;
 };
 
@@ -94,10 +102,16 @@ SYSCTL_INT(_net_inet_tcp, OID_AUTO, cubic_sockets,
 	CTLFLAG_RD | CTLFLAG_LOCKED,&tcp_cc_cubic.num_sockets, 
 	0, "Number of sockets using cubic");
 
+extern struct tcp_cc_algo tcp_cc_bbr;
+
 SYSCTL_SKMEM_TCP_INT(OID_AUTO, use_newreno,
 	CTLFLAG_RW | CTLFLAG_LOCKED, int, tcp_use_newreno, 0,
 	"Use TCP NewReno by default");
 
+SYSCTL_SKMEM_TCP_INT(OID_AUTO, use_bbr,
+	CTLFLAG_RW | CTLFLAG_LOCKED, int, tcp_use_bbr, 0,
+	"Use BBR by default");
+
 static int tcp_check_cwnd_nonvalidated = 1;
 #if (DEBUG || DEVELOPMENT)
 SYSCTL_INT(_net_inet_tcp, OID_AUTO, cwnd_nonvalidated,
@@ -140,6 +154,7 @@ tcp_cc_init(void)
 	tcp_cc_algo_list[TCP_CC_ALGO_NEWRENO_INDEX] = &tcp_cc_newreno;
 	tcp_cc_algo_list[TCP_CC_ALGO_BACKGROUND_INDEX] = &tcp_cc_ledbat;
 	tcp_cc_algo_list[TCP_CC_ALGO_CUBIC_INDEX] = &tcp_cc_cubic;
+	tcp_cc_algo_list[TCP_CC_ALGO_BBR_INDEX] = &tcp_cc_bbr;
 
 	tcp_cc_control_register();
 }
@@ -262,6 +277,20 @@ tcp_ccdbg_trace(struct tcpcb *tp, struct tcphdr *th, int32_t event)
 			dbg_state.u.ledbat_state.led_base_rtt =
 			    get_base_rtt(tp);
 			break;
+		    case TCP_CC_ALGO_BBR_INDEX:
+			dbg_state.u.bbr_state.ccd_bw =
+			    tp->t_ccstate->bbr_bw[0];
+			dbg_state.u.bbr_state.ccd_min_rtt =
+			    tp->t_ccstate->bbr_min_rtt;
+			dbg_state.u.bbr_state.ccd_pacing_rate =
+			    tp->t_pacing_rate;
+			dbg_state.u.bbr_state.ccd_pacing_gain =
+			    tp->t_ccstate->bbr_pacing_gain;
+			dbg_state.u.bbr_state.ccd_mode =
+			    tp->t_ccstate->bbr_mode;
+			dbg_state.u.bbr_state.ccd_flags =
+			    tp->t_ccstate->bbr_flags;
+			break;
 		    default:
 			break;
 		}
@@ -375,7 +404,8 @@ tcp_cc_delay_ack(struct tcpcb *tp, struct tcphdr *th)
 void
 tcp_cc_allocate_state(struct tcpcb *tp)
 {
-	if (tp->tcp_cc_index == TCP_CC_ALGO_CUBIC_INDEX &&
+	if ((tp->tcp_cc_index == TCP_CC_ALGO_CUBIC_INDEX ||
+	    tp->tcp_cc_index == TCP_CC_ALGO_BBR_INDEX) &&
 		tp->t_ccstate == NULL) {
 		tp->t_ccstate = (struct tcp_ccstate *)zalloc(tcp_cc_zone);
 
@@ -391,6 +421,23 @@ tcp_cc_allocate_state(struct tcpcb *tp)
 	}
 }
 
+/*
+ * Pick the congestion control algorithm for a connection that is not
+ * using background transport. A socket that asked for BBR gets it;
+ * otherwise the system wide defaults apply.
+ */
+uint16_t
+tcp_cc_foreground_index(struct tcpcb *tp)
+{
+	if (tp->t_flagsext & TF_BBR)
+		return (TCP_CC_ALGO_BBR_INDEX);
+	if (tcp_use_newreno)
+		return (TCP_CC_ALGO_NEWRENO_INDEX);
+	if (tcp_use_bbr)
+		return (TCP_CC_ALGO_BBR_INDEX);
+	return (TCP_CC_ALGO_CUBIC_INDEX);
+}
+
 /*
  * If stretch ack was disabled automatically on long standing connections, 
  * re-evaluate the situation after 15 minutes to enable it.
@@ -70,7 +70,8 @@
 #define	TCP_CC_ALGO_NEWRENO_INDEX	1
 #define	TCP_CC_ALGO_BACKGROUND_INDEX	2 /* CC for background transport */
 #define	TCP_CC_ALGO_CUBIC_INDEX		3 /* default CC algorithm */
-#define	TCP_CC_ALGO_COUNT		4 /* Count of CC algorithms */
+#define	TCP_CC_ALGO_BBR_INDEX		4 /* model-based CC, paced */
+#define	TCP_CC_ALGO_COUNT		5 /* Count of CC algorithms */
 
 #define TCP_CA_NAME_MAX 16		/* Maximum characters in the name of a CC algorithm */
 
@@ -153,6 +154,7 @@ extern uint32_t tcp_cc_is_cwnd_nonvalidated(struct tcpcb *tp);
 extern void tcp_cc_adjust_nonvalidated_cwnd(struct tcpcb *tp);
 extern u_int32_t tcp_get_max_pipeack(struct tcpcb *tp);
 extern void tcp_clear_pipeack_state(struct tcpcb *tp);
+extern uint16_t tcp_cc_foreground_index(struct tcpcb *tp);
 
 #endif /* KERNEL */
 #endif /* _NETINET_CC_H_ */
@@ -2588,7 +2588,10 @@ findpcb:
 				struct tcpcb *, tp, int32_t, TCPS_LISTEN);
 			tp->t_state = TCPS_LISTEN;
 			tp->t_flags |= tp0->t_flags & (TF_NOPUSH|TF_NOOPT|TF_NODELAY);
-			tp->t_flagsext |= (tp0->t_flagsext & (TF_RXTFINDROP|TF_NOTIMEWAIT|TF_FASTOPEN));
+			tp->t_flagsext |= (tp0->t_flagsext & (TF_RXTFINDROP|TF_NOTIMEWAIT|TF_FASTOPEN|TF_BBR));
+			if ((tp->t_flagsext & TF_BBR) &&
+			    tp->tcp_cc_index != TCP_CC_ALGO_BACKGROUND_INDEX)
+				tcp_set_foreground_cc(so);
 			tp->t_keepinit = tp0->t_keepinit;
 			tp->t_keepcnt = tp0->t_keepcnt;
 			tp->t_keepintvl = tp0->t_keepintvl;
@@ -6229,10 +6232,7 @@ tcp_set_background_cc(struct socket *so)
 void
 tcp_set_foreground_cc(struct socket *so)
 {
-	if (tcp_use_newreno)
-		tcp_set_new_cc(so, TCP_CC_ALGO_NEWRENO_INDEX);
-	else
-		tcp_set_new_cc(so, TCP_CC_ALGO_CUBIC_INDEX);
+	tcp_set_new_cc(so, tcp_cc_foreground_index(sototcpcb(so)));
 }
 
 static void
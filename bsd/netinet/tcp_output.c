@@ -278,6 +278,14 @@ SYSCTL_SKMEM_TCP_INT(OID_AUTO, enable_tlp,
 	CTLFLAG_RW | CTLFLAG_LOCKED,
 	int32_t, tcp_enable_tlp, 1, "Enable Tail loss probe");
 
+SYSCTL_SKMEM_TCP_INT(OID_AUTO, pacing_release,
+	CTLFLAG_RW | CTLFLAG_LOCKED, int32_t, tcp_pacing_release, 1,
+	"Let the interface queue release paced segments");
+
+SYSCTL_SKMEM_TCP_INT(OID_AUTO, pacing_horizon,
+	CTLFLAG_RW | CTLFLAG_LOCKED, uint32_t, tcp_pacing_horizon, 10,
+	"Max ms of paced data queued ahead of its release time");
+
 static int32_t packchain_newlist = 0;
 static int32_t packchain_looped = 0;
 static int32_t packchain_sent = 0;
@@ -522,6 +530,116 @@ check_heuristic:
 	}
 }
 
+/*
+ * The rate asked for by the congestion control module, limited by
+ * TCP_PACING_RATE if the application set one.
+ */
+static inline u_int32_t
+tcp_pacing_rate(struct tcpcb *tp)
+{
+	if (tp->t_pacing_maxrate == 0)
+		return (tp->t_pacing_rate);
+	if (tp->t_pacing_rate == 0)
+		return (tp->t_pacing_maxrate);
+	return (min(tp->t_pacing_rate, tp->t_pacing_maxrate));
+}
+
+/*
+ * Paced segments may be handed to the interface ahead of time if its
+ * send queue is fq_codel, which holds each packet until the release
+ * time stamped in its header.
+ */
+static inline boolean_t
+tcp_pacing_release_ok(struct inpcb *inp)
+{
+	struct ifnet *ifp = inp->inp_last_outifp;
+
+	return (tcp_pacing_release && ifp != NULL &&
+	    !(ifp->if_flags & IFF_LOOPBACK) &&
+	    (ifp->if_eflags & IFEF_TXSTART) &&
+	    ifp->if_snd.ifcq_type == PKTSCHEDT_FQ_CODEL);
+}
+
+/*
+ * Return the number of bytes a paced connection may queue at the
+ * interface when the interface releases them: whatever the rate allows
+ * up to tcp_pacing_horizon ms past now, less what is already queued
+ * ahead. With nothing in flight at least two segments may go.
+ */
+static int32_t
+tcp_pacing_release_budget(struct tcpcb *tp, u_int32_t rate, u_int64_t now)
+{
+	u_int64_t horizon, ahead, budget;
+
+	horizon = (u_int64_t)tcp_pacing_horizon * NSEC_PER_MSEC;
+	if (tp->snd_max == tp->snd_una || tp->t_pacing_next <= now)
+		ahead = 0;
+	else
+		ahead = tp->t_pacing_next - now;
+	if (ahead >= horizon)
+		return (0);
+	budget = MIN((u_int64_t)rate * (horizon - ahead) / NSEC_PER_MSEC,
+	    TCP_MAXWIN << TCP_MAX_WINSHIFT);
+	if (ahead == 0)
+		budget = MAX(budget, 2 * tp->t_maxseg);
+	return ((int32_t)budget);
+}
+
+/*
+ * Stamp a paced segment with its release time and advance the release
+ * time of the next one by the time this one takes at the pacing rate.
+ * Segments that may leave right away go out unstamped and are counted
+ * as bursts.
+ */
+static void
+tcp_pacing_stamp(struct tcpcb *tp, struct mbuf *m, int32_t len,
+    u_int32_t rate, u_int64_t now)
+{
+	if (tp->t_pacing_next > now) {
+		m->m_pkthdr.pkt_timestamp = tp->t_pacing_next;
+		m->m_pkthdr.pkt_flags |= PKTF_TS_VALID;
+		tcpstat.tcps_paced_sends++;
+	} else {
+		tp->t_pacing_next = now;
+		tcpstat.tcps_burst_sends++;
+	}
+	tp->t_pacing_next += (u_int64_t)len * NSEC_PER_MSEC / rate;
+}
+
+/*
+ * Return the number of bytes a paced connection may send now.
+ *
+ * The budget refills at the pacing rate in bytes per millisecond of tcp_now
+ * and is capped at a quarter of the smoothed RTT worth of data (at least
+ * two segments), so that a burst never exceeds what the rate allows over
+ * a fraction of a round trip. When nothing is in flight there is no ack
+ * clock to release held data, so the budget is refilled to the cap.
+ */
+static int32_t
+tcp_pacing_budget(struct tcpcb *tp, u_int32_t rate)
+{
+	u_int64_t tokens;
+	u_int32_t burst_ms, cap;
+	int32_t elapsed;
+
+	burst_ms = max((tp->t_srtt >> TCP_RTT_SHIFT) >> 2, 1);
+	cap = (u_int32_t)MIN((u_int64_t)rate * burst_ms,
+	    TCP_MAXWIN << TCP_MAX_WINSHIFT);
+	cap = max(cap, 2 * tp->t_maxseg);
+
+	if (tp->snd_max == tp->snd_una) {
+		tokens = cap;
+	} else {
+		elapsed = timer_diff(tcp_now, 0, tp->t_pacing_ts, 0);
+		if (elapsed <= 0)
+			return ((int32_t)min(tp->t_pacing_tokens, cap));
+		tokens = tp->t_pacing_tokens + (u_int64_t)rate * elapsed;
+	}
+	tp->t_pacing_tokens = (u_int32_t)MIN(tokens, cap);
+	tp->t_pacing_ts = tcp_now;
+	return ((int32_t)tp->t_pacing_tokens);
+}
+
 /*
  * Tcp output routine: figure out what should be sent and send it.
  *
@@ -596,6 +714,9 @@ tcp_output(struct tcpcb *tp)
 	boolean_t wired = FALSE;
 	boolean_t sack_rescue_rxt = FALSE;
 	int sotc = so->so_traffic_class;
+	u_int32_t pacing_rate = 0;
+	u_int64_t pacing_now = 0;
+	boolean_t pacing_release = FALSE;
 
 	/*
 	 * Determine length of data that should be transmitted,
@@ -1141,6 +1262,44 @@ after_sack_rexmit:
 		tso = 0;
 	}
 
+	/*
+	 * If this connection is paced, send only what the pacing budget
+	 * allows, in whole segments. The rest goes out when a later ack
+	 * refills the budget. When the interface queue honors release
+	 * times, segments are stamped and queued up to the pacing horizon
+	 * instead of being held here. SACK retransmits, probes and forced
+	 * sends are not held back.
+	 */
+	pacing_rate = tcp_pacing_rate(tp);
+	pacing_release = FALSE;
+	if (len > 0 && pacing_rate > 0 && !sack_rxmit &&
+	    !(tp->t_flagsext & (TF_FORCE | TF_SENT_TLPROBE))) {
+		int32_t budget;
+
+		if (tcp_pacing_release_ok(inp)) {
+			struct timespec now_ts;
+
+			nanouptime(&now_ts);
+			net_timernsec(&now_ts, &pacing_now);
+			pacing_release = TRUE;
+			budget = tcp_pacing_release_budget(tp, pacing_rate,
+			    pacing_now);
+		} else {
+			budget = tcp_pacing_budget(tp, pacing_rate);
+		}
+
+		if (len > budget) {
+			if (budget >= (int32_t)tp->t_maxseg)
+				len = budget - (budget % tp->t_maxseg);
+			else
+				len = 0;
+			sendalot = 0;
+			if (len <= (int32_t)tp->t_maxseg)
+				tso = 0;
+			tcpstat.tcps_pacing_held++;
+		}
+	}
+
 #if MPTCP
 	if ((so->so_flags & SOF_MP_SUBFLOW) &&
 	    !(tp->t_mpflags & TMPF_TCP_FALLBACK)) {
@@ -1832,6 +1991,14 @@ send:
 		}
 	}
 
+	/* Charge what is sent against the pacing budget */
+	if (len > 0 && !pacing_release && tcp_pacing_rate(tp) > 0) {
+		if (tp->t_pacing_tokens > (u_int32_t)len)
+			tp->t_pacing_tokens -= len;
+		else
+			tp->t_pacing_tokens = 0;
+	}
+
  	if (max_linkhdr + hdrlen > MCLBYTES)
 		panic("tcphdr too big");
 
@@ -2446,6 +2613,9 @@ timer:
 	m->m_pkthdr.pkt_flags |= (PKTF_FLOW_ID | PKTF_FLOW_LOCALSRC | PKTF_FLOW_ADV);
 	m->m_pkthdr.pkt_proto = IPPROTO_TCP;
 
+	if (pacing_release && len > 0)
+		tcp_pacing_stamp(tp, m, len, pacing_rate, pacing_now);
+
 	m->m_nextpkt = NULL;
 
 	if (inp->inp_last_outifp != NULL &&
@@ -124,6 +124,8 @@ static int tcp_detect_reordering = 1;
 static int tcp_dsack_ignore_hw_duplicates = 0;
 
 #if (DEVELOPMENT || DEBUG)
+static int tcp_sack_verify_hint = 0;
+
 SYSCTL_INT(_net_inet_tcp, OID_AUTO, detect_reordering,
     CTLFLAG_RW | CTLFLAG_LOCKED,
     &tcp_detect_reordering, 0, "");
@@ -131,10 +133,58 @@ SYSCTL_INT(_net_inet_tcp, OID_AUTO, detect_reordering,
 SYSCTL_INT(_net_inet_tcp, OID_AUTO, ignore_hw_duplicates,
     CTLFLAG_RW | CTLFLAG_LOCKED,
     &tcp_dsack_ignore_hw_duplicates, 0, "");
+
+SYSCTL_INT(_net_inet_tcp, OID_AUTO, sack_verify_hint,
+    CTLFLAG_RW | CTLFLAG_LOCKED,
+    &tcp_sack_verify_hint, 0,
+    "Cross-check the SACK retransmit hint against a scoreboard walk");
 #endif /* (DEVELOPMENT || DEBUG) */
 
 extern struct zone *sack_hole_zone;
 
+/*
+ * The scoreboard is kept both as a list ordered by sequence number and
+ * as a red-black tree on the start of each hole.  The list is used to
+ * step to neighbouring holes; the tree lets tcp_sack_doack() jump to the
+ * hole a SACK block lands on instead of walking to it, which matters on
+ * long fat paths where the scoreboard can hold thousands of holes.
+ * Holes never overlap, so adjusting their edges keeps the tree ordered.
+ */
+static int sackhole_cmp(const struct sackhole *, const struct sackhole *);
+RB_PROTOTYPE(sackhole_tree, sackhole, scbtree, sackhole_cmp);
+RB_GENERATE(sackhole_tree, sackhole, scbtree, sackhole_cmp);
+
+static int
+sackhole_cmp(const struct sackhole *h1, const struct sackhole *h2)
+{
+	if (SEQ_LT(h1->start, h2->start))
+		return (-1);
+	if (SEQ_GT(h1->start, h2->start))
+		return (1);
+	return (0);
+}
+
+/*
+ * Return the highest hole starting before seq, i.e. the last hole that a
+ * SACK block ending at seq can cover any part of.
+ */
+static struct sackhole *
+tcp_sackhole_lookup(struct tcpcb *tp, tcp_seq seq)
+{
+	struct sackhole *hole, *match = NULL;
+
+	hole = RB_ROOT(&tp->snd_holes_tree);
+	while (hole != NULL) {
+		if (SEQ_LT(hole->start, seq)) {
+			match = hole;
+			hole = RB_RIGHT(hole, scbtree);
+		} else {
+			hole = RB_LEFT(hole, scbtree);
+		}
+	}
+	return (match);
+}
+
 #define	TCP_VALIDATE_SACK_SEQ_NUMBERS(_tp_, _sb_, _ack_) \
     (SEQ_GT((_sb_)->end, (_sb_)->start) && \
     SEQ_GT((_sb_)->start, (_tp_)->snd_una) && \
@@ -308,6 +358,8 @@ tcp_sackhole_insert(struct tcpcb *tp, tcp_seq start, tcp_seq end,
 		TAILQ_INSERT_AFTER(&tp->snd_holes, after, hole, scblink);
 	else
 		TAILQ_INSERT_TAIL(&tp->snd_holes, hole, scblink);
+	RB_INSERT(sackhole_tree, &tp->snd_holes_tree, hole);
+	tp->sackhint.sack_hole_bytes += (end - start);
 
 	/* Update SACK hint. */
 	if (tp->sackhint.nexthole == NULL)
@@ -328,6 +380,8 @@ tcp_sackhole_remove(struct tcpcb *tp, struct sackhole *hole)
 
 	/* Remove this SACK hole. */
 	TAILQ_REMOVE(&tp->snd_holes, hole, scblink);
+	RB_REMOVE(sackhole_tree, &tp->snd_holes_tree, hole);
+	tp->sackhint.sack_hole_bytes -= (hole->end - hole->start);
 
 	/* Free this SACK hole. */
 	tcp_sackhole_free(tp, hole);
@@ -552,9 +606,9 @@ tcp_sack_doack(struct tcpcb *tp, struct tcpopt *to, struct tcphdr *th,
 		if (SEQ_LEQ(sblkp->end, cur->start)) {
 			/*
 			 * SACKs data before the current hole.
-			 * Go to the previous hole.
+			 * Skip straight to the last hole it can touch.
 			 */
-			cur = TAILQ_PREV(cur, sackhole_head, scblink);
+			cur = tcp_sackhole_lookup(tp, sblkp->end);
 			continue;
 		}
 		tp->sackhint.sack_bytes_rexmit -= (cur->rxmit - cur->start);
@@ -579,6 +633,8 @@ tcp_sack_doack(struct tcpcb *tp, struct tcpopt *to, struct tcphdr *th,
 				*newbytes_acked += (sblkp->end - cur->start);
 				tcp_sack_detect_reordering(tp, cur,
 				    sblkp->end, old_snd_fack);
+				tp->sackhint.sack_hole_bytes -=
+				    (sblkp->end - cur->start);
 				cur->start = sblkp->end;
 				cur->rxmit = SEQ_MAX(cur->rxmit, cur->start);
 			}
@@ -589,6 +645,8 @@ tcp_sack_doack(struct tcpcb *tp, struct tcpopt *to, struct tcphdr *th,
 				*newbytes_acked += (cur->end - sblkp->start);
 				tcp_sack_detect_reordering(tp, cur,
 				    cur->end, old_snd_fack);
+				tp->sackhint.sack_hole_bytes -=
+				    (cur->end - sblkp->start);
 				cur->end = sblkp->start;
 				cur->rxmit = SEQ_MIN(cur->rxmit, cur->end);
 			} else {
@@ -608,6 +666,8 @@ tcp_sack_doack(struct tcpcb *tp, struct tcpopt *to, struct tcphdr *th,
 							+= (temp->rxmit
 							    - temp->start);
 					}
+					tp->sackhint.sack_hole_bytes -=
+					    (cur->end - sblkp->start);
 					cur->end = sblkp->start;
 					cur->rxmit = SEQ_MIN(cur->rxmit,
 							     cur->end);
@@ -645,6 +705,7 @@ tcp_free_sackholes(struct tcpcb *tp)
 	while ((q = TAILQ_FIRST(&tp->snd_holes)) != NULL)
 		tcp_sackhole_remove(tp, q);
 	tp->sackhint.sack_bytes_rexmit = 0;
+	tp->sackhint.sack_hole_bytes = 0;
 	tp->sackhint.nexthole = NULL;
 	tp->sack_newdata = 0;
 
@@ -692,9 +753,10 @@ tcp_sack_partialack(struct tcpcb *tp, struct tcphdr *th)
 	(void) tcp_output(tp);
 }
 
+#if (DEVELOPMENT || DEBUG)
 /*
- * Debug version of tcp_sack_output() that walks the scoreboard. Used for
- * now to sanity check the hint.
+ * Debug version of tcp_sack_output() that walks the scoreboard. Used to
+ * sanity check the hint when net.inet.tcp.sack_verify_hint is set.
  */
 static struct sackhole *
 tcp_sack_output_debug(struct tcpcb *tp, int *sack_bytes_rexmt)
@@ -714,6 +776,7 @@ tcp_sack_output_debug(struct tcpcb *tp, int *sack_bytes_rexmt)
 	}
 	return (p);
 }
+#endif /* (DEVELOPMENT || DEBUG) */
 
 /*
  * Returns the next hole to retransmit and the number of retransmitted bytes
@@ -735,10 +798,8 @@ tcp_sack_output_debug(struct tcpcb *tp, int *sack_bytes_rexmt)
 struct sackhole *
 tcp_sack_output(struct tcpcb *tp, int *sack_bytes_rexmt)
 {
-	struct sackhole *hole = NULL, *dbg_hole = NULL;
-	int dbg_bytes_rexmt;
+	struct sackhole *hole = NULL;
 
-	dbg_hole = tcp_sack_output_debug(tp, &dbg_bytes_rexmt);
 	*sack_bytes_rexmt = tp->sackhint.sack_bytes_rexmit;
 	hole = tp->sackhint.nexthole;
 	if (hole == NULL || SEQ_LT(hole->rxmit, hole->end))
@@ -750,16 +811,24 @@ tcp_sack_output(struct tcpcb *tp, int *sack_bytes_rexmt)
 		}
 	}
 out:
-	if (dbg_hole != hole) {
-		printf("%s: Computed sack hole not the same as cached value\n", __func__);
-		hole = dbg_hole;
-	}
-	if (*sack_bytes_rexmt != dbg_bytes_rexmt) {
-		printf("%s: Computed sack_bytes_retransmitted (%d) not "
-		       "the same as cached value (%d)\n",
-		       __func__, dbg_bytes_rexmt, *sack_bytes_rexmt);
-		*sack_bytes_rexmt = dbg_bytes_rexmt;
+#if (DEVELOPMENT || DEBUG)
+	if (tcp_sack_verify_hint) {
+		struct sackhole *dbg_hole;
+		int dbg_bytes_rexmt;
+
+		dbg_hole = tcp_sack_output_debug(tp, &dbg_bytes_rexmt);
+		if (dbg_hole != hole) {
+			printf("%s: Computed sack hole not the same as cached value\n", __func__);
+			hole = dbg_hole;
+		}
+		if (*sack_bytes_rexmt != dbg_bytes_rexmt) {
+			printf("%s: Computed sack_bytes_retransmitted (%d) not "
+			       "the same as cached value (%d)\n",
+			       __func__, dbg_bytes_rexmt, *sack_bytes_rexmt);
+			*sack_bytes_rexmt = dbg_bytes_rexmt;
+		}
 	}
+#endif /* (DEVELOPMENT || DEBUG) */
 	return (hole);
 }
 
@@ -771,9 +840,9 @@ out:
 void
 tcp_sack_adjust(struct tcpcb *tp)
 {
-	struct sackhole *p, *cur = TAILQ_FIRST(&tp->snd_holes);
+	struct sackhole *p, *cur;
 
-	if (cur == NULL)
+	if (TAILQ_EMPTY(&tp->snd_holes))
 		return; /* No holes */
 	if (SEQ_GEQ(tp->snd_nxt, tp->snd_fack))
 		return; /* We're already beyond any SACKed blocks */
@@ -781,20 +850,18 @@ tcp_sack_adjust(struct tcpcb *tp)
 	 * Two cases for which we want to advance snd_nxt:
 	 * i) snd_nxt lies between end of one hole and beginning of another
 	 * ii) snd_nxt lies between end of last hole and snd_fack
+	 *
+	 * Find the last hole starting at or before snd_nxt; if snd_nxt
+	 * is past its end, move it up to the start of the next hole.
 	 */
-	while ((p = TAILQ_NEXT(cur, scblink)) != NULL) {
-		if (SEQ_LT(tp->snd_nxt, cur->end))
-			return;
-		if (SEQ_GEQ(tp->snd_nxt, p->start))
-			cur = p;
-		else {
-			tp->snd_nxt = p->start;
-			return;
-		}
-	}
+	if ((cur = tcp_sackhole_lookup(tp, tp->snd_nxt + 1)) == NULL)
+		return; /* snd_nxt is before the first hole */
 	if (SEQ_LT(tp->snd_nxt, cur->end))
 		return;
-	tp->snd_nxt = tp->snd_fack;
+	if ((p = TAILQ_NEXT(cur, scblink)) != NULL)
+		tp->snd_nxt = p->start;
+	else
+		tp->snd_nxt = tp->snd_fack;
 	return;
 }
 
@@ -805,18 +872,14 @@ tcp_sack_adjust(struct tcpcb *tp)
 boolean_t
 tcp_sack_byte_islost(struct tcpcb *tp)
 {
-	u_int32_t unacked_bytes, sndhole_bytes = 0;
-	struct sackhole *sndhole;
+	u_int32_t unacked_bytes, sndhole_bytes;
 	if (!SACK_ENABLED(tp) || IN_FASTRECOVERY(tp) ||
 	    TAILQ_EMPTY(&tp->snd_holes) ||
 	    (tp->t_flagsext & TF_PKTS_REORDERED))
 		return (FALSE);
 
 	unacked_bytes = tp->snd_max - tp->snd_una;
-
-	TAILQ_FOREACH(sndhole, &tp->snd_holes, scblink) {
-		sndhole_bytes += (sndhole->end - sndhole->start);
-	}
+	sndhole_bytes = tp->sackhint.sack_hole_bytes;
 
 	VERIFY(unacked_bytes >= sndhole_bytes);
 	return ((unacked_bytes - sndhole_bytes) >
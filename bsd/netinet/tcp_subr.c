@@ -228,6 +228,16 @@ SYSCTL_INT(_net_inet_tcp, OID_AUTO, pcbcount, CTLFLAG_RD | CTLFLAG_LOCKED,
 SYSCTL_INT(_net_inet_tcp, OID_AUTO, tw_pcbcount, CTLFLAG_RD | CTLFLAG_LOCKED,
 	&tcbinfo.ipi_twcount, 0, "Number of pcbs in time-wait state");
 
+SYSCTL_QUAD(_net_inet_tcp, OID_AUTO, pcbhash_lookup_contended,
+	CTLFLAG_RD | CTLFLAG_LOCKED,
+	&tcbinfo.ipi_hashstat.ihs_lookup_contended,
+	"Number of PCB hash lookups that blocked on a bucket lock");
+
+SYSCTL_QUAD(_net_inet_tcp, OID_AUTO, pcbhash_update_contended,
+	CTLFLAG_RD | CTLFLAG_LOCKED,
+	&tcbinfo.ipi_hashstat.ihs_update_contended,
+	"Number of PCB hash updates that blocked on a bucket lock");
+
 SYSCTL_SKMEM_TCP_INT(OID_AUTO, icmp_may_rst, CTLFLAG_RW | CTLFLAG_LOCKED,
 	static int, icmp_may_rst, 1,
 	"Certain ICMP unreachable messages may abort connections in SYN_SENT");
@@ -459,6 +469,7 @@ tcp_init(struct protosw *pp, struct domain *dp)
 	static int tcp_initialized = 0;
 	vm_size_t str_size;
 	struct inpcbinfo *pcbinfo;
+	int i;
 
 	VERIFY((pp->pr_flags & (PR_INITIALIZED|PR_ATTACHED)) == PR_ATTACHED);
 
@@ -598,7 +609,9 @@ tcp_init(struct protosw *pp, struct domain *dp)
 	TAILQ_INIT(&tcp_tw_tailq);
 
 	bzero(&tcp_timer_list, sizeof(tcp_timer_list));
-	LIST_INIT(&tcp_timer_list.lhead);
+	for (i = 0; i < TCP_TIMERWHEEL_SLOTS; i++)
+		LIST_INIT(&tcp_timer_list.wheel[i].lhead);
+	tcp_timer_list.wheel_time = tcp_now & ~(TCP_TIMERWHEEL_GRAN - 1);
 	/*
 	 * allocate lock group attribute, group and attribute for
 	 * the tcp timer list
@@ -1075,6 +1088,7 @@ tcp_newtcpcb(struct inpcb *inp)
 		tp->t_flagsext |= TF_SACK_ENABLE;
 
 	TAILQ_INIT(&tp->snd_holes);
+	RB_INIT(&tp->snd_holes_tree);
 	SLIST_INIT(&tp->t_rxt_segments);
 	SLIST_INIT(&tp->t_notify_ack);
 	tp->t_inpcb = inp;
@@ -1089,11 +1103,7 @@ tcp_newtcpcb(struct inpcb *inp)
 	tp->t_rttmin = tcp_TCPTV_MIN;
 	tp->t_rxtcur = TCPTV_RTOBASE;
 
-	if (tcp_use_newreno)
-		/* use newreno by default */
-		tp->tcp_cc_index = TCP_CC_ALGO_NEWRENO_INDEX;
-	else
-		tp->tcp_cc_index = TCP_CC_ALGO_CUBIC_INDEX;
+	tp->tcp_cc_index = tcp_cc_foreground_index(tp);
 
 	tcp_cc_allocate_state(tp);
 
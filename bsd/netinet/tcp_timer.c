@@ -256,6 +256,11 @@ SYSCTL_INT(_net_inet_tcp, OID_AUTO, tcp_resched_timerlist,
     CTLFLAG_RD | CTLFLAG_LOCKED, &tcp_resched_timerlist, 0,
     "Number of times timer list was rescheduled as part of processing a packet");
 
+static int tcp_timerwheel_moved = 0;
+SYSCTL_INT(_net_inet_tcp, OID_AUTO, tcp_timerwheel_moved,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &tcp_timerwheel_moved, 0,
+    "Number of times a timer entry moved to an earlier wheel slot");
+
 SYSCTL_SKMEM_TCP_INT(OID_AUTO, pmtud_blackhole_detection,
     CTLFLAG_RW | CTLFLAG_LOCKED, int, tcp_pmtud_black_hole_detect, 1,
     "Path MTU Discovery Black Hole Detection");
@@ -1575,6 +1580,69 @@ fc_output:
 	return (tp);
 }
 
+#define	TCP_TIMERWHEEL_SLOT(listp, t) \
+	(&(listp)->wheel[((t) >> TCP_TIMERWHEEL_SHIFT) & \
+	(TCP_TIMERWHEEL_SLOTS - 1)])
+
+/*
+ * Put a timer entry in the wheel slot covering its runtime.  Deadlines
+ * that are already behind the wheel go in the next slot to be processed;
+ * those beyond the span of the wheel go in the last slot and are
+ * re-slotted when it comes up.
+ */
+static void
+tcp_timerwheel_insert(struct tcptimerlist *listp, struct tcptimerentry *te)
+{
+	struct tcptimerslot *slot;
+	uint32_t slottime;
+
+	LCK_MTX_ASSERT(listp->mtx, LCK_MTX_ASSERT_OWNED);
+
+	slottime = te->runtime & ~(TCP_TIMERWHEEL_GRAN - 1);
+	if (TSTMP_LT(slottime, listp->wheel_time)) {
+		slottime = listp->wheel_time;
+	} else if (TSTMP_GEQ(slottime,
+	    listp->wheel_time + TCP_TIMERWHEEL_SPAN)) {
+		slottime = listp->wheel_time + TCP_TIMERWHEEL_SPAN -
+		    TCP_TIMERWHEEL_GRAN;
+	}
+
+	te->slottime = slottime;
+	slot = TCP_TIMERWHEEL_SLOT(listp, slottime);
+	LIST_INSERT_HEAD(&slot->lhead, te, le);
+	slot->mode |= te->mode;
+}
+
+/*
+ * Find the next slot holding entries and return the offset from tcp_now
+ * at which the timer list has to run for it.  The modes of the entries
+ * due within the slowest quantum are returned in mode, so that a slow
+ * entry in an earlier slot can't hold back a faster one behind it.
+ */
+static uint32_t
+tcp_timerwheel_next(struct tcptimerlist *listp, u_int16_t *mode)
+{
+	struct tcptimerslot *slot;
+	uint32_t i, t, offset = 0;
+
+	LCK_MTX_ASSERT(listp->mtx, LCK_MTX_ASSERT_OWNED);
+
+	for (i = 0, t = listp->wheel_time; i < TCP_TIMERWHEEL_SLOTS;
+	    i++, t += TCP_TIMERWHEEL_GRAN) {
+		slot = TCP_TIMERWHEEL_SLOT(listp, t);
+		if (LIST_EMPTY(&slot->lhead))
+			continue;
+		if (offset == 0) {
+			offset = TSTMP_GT(t, tcp_now) ?
+			    timer_diff(t, 0, tcp_now, 0) : 1;
+		}
+		if (TSTMP_GEQ(t, tcp_now + offset + TCP_TIMER_500MS_QUANTUM))
+			break;
+		*mode |= slot->mode;
+	}
+	return (offset);
+}
+
 /* Remove a timer entry from timer list */
 void
 tcp_remove_timer(struct tcpcb *tp)
@@ -1853,76 +1921,111 @@ tcp_run_timerlist(void * arg1, void * arg2)
 
 	listp->running = TRUE;
 
-	LIST_FOREACH_SAFE(te, &listp->lhead, le, next_te) {
-		uint32_t offset = 0;
-		uint32_t runtime = te->runtime;
-		if (te->index < TCPT_NONE && TSTMP_GT(runtime, tcp_now)) {
-			offset = timer_diff(runtime, 0, tcp_now, 0);
-			if (next_timer == 0 || offset < next_timer) {
-				next_timer = offset;
-			}
-			list_mode |= te->mode;
-			continue;
+	/*
+	 * Process every wheel slot that has come due.  Each slot is moved
+	 * to a local list first, so that entries re-slotted while it is
+	 * being worked on are not visited again in the same pass.
+	 */
+	while (TSTMP_LEQ(listp->wheel_time, tcp_now)) {
+		struct timerlisthead expired;
+		struct tcptimerslot *slot;
+
+		if (listp->entries == 0) {
+			/* Nothing is armed; bring the wheel up to date */
+			listp->wheel_time =
+			    tcp_now & ~(TCP_TIMERWHEEL_GRAN - 1);
+			break;
 		}
 
-		tp = TIMERENTRY_TO_TP(te);
+		slot = TCP_TIMERWHEEL_SLOT(listp, listp->wheel_time);
+		LIST_INIT(&expired);
+		if ((te = LIST_FIRST(&slot->lhead)) != NULL) {
+			LIST_FIRST(&expired) = te;
+			te->le.le_prev = &LIST_FIRST(&expired);
+			LIST_INIT(&slot->lhead);
+		}
+		slot->mode = 0;
+		listp->wheel_time += TCP_TIMERWHEEL_GRAN;
+
+		LIST_FOREACH_SAFE(te, &expired, le, next_te) {
+			uint32_t offset = 0;
+			uint32_t runtime = te->runtime;
+			if (te->index < TCPT_NONE &&
+			    TSTMP_GT(runtime, tcp_now)) {
+				/* Not due yet, move it further along */
+				LIST_REMOVE(te, le);
+				tcp_timerwheel_insert(listp, te);
+				continue;
+			}
+
+			tp = TIMERENTRY_TO_TP(te);
 
-		/*
-		 * Acquire an inp wantcnt on the inpcb so that the socket
-		 * won't get detached even if tcp_close is called
-		 */
-		if (in_pcb_checkstate(tp->t_inpcb, WNT_ACQUIRE, 0)
-		    == WNT_STOPUSING) {
 			/*
-			 * Some how this pcb went into dead state while
-			 * on the timer list, just take it off the list.
-			 * Since the timer list entry pointers are
-			 * protected by the timer list lock, we can
-			 * do it here without the socket lock.
+			 * Acquire an inp wantcnt on the inpcb so that the
+			 * socket won't get detached even if tcp_close is
+			 * called
 			 */
-			if (TIMER_IS_ON_LIST(tp)) {
-				tp->t_flags &= ~(TF_TIMER_ONLIST);
-				LIST_REMOVE(&tp->tentry, le);
-				listp->entries--;
+			if (in_pcb_checkstate(tp->t_inpcb, WNT_ACQUIRE, 0)
+			    == WNT_STOPUSING) {
+				/*
+				 * Some how this pcb went into dead state
+				 * while on the timer list, just take it off
+				 * the list.  Since the timer list entry
+				 * pointers are protected by the timer list
+				 * lock, we can do it here without the
+				 * socket lock.
+				 */
+				if (TIMER_IS_ON_LIST(tp)) {
+					tp->t_flags &= ~(TF_TIMER_ONLIST);
+					LIST_REMOVE(&tp->tentry, le);
+					listp->entries--;
 
-				tp->tentry.le.le_next = NULL;
-				tp->tentry.le.le_prev = NULL;
+					tp->tentry.le.le_next = NULL;
+					tp->tentry.le.le_prev = NULL;
+				}
+				continue;
 			}
-			continue;
-		}
-		active_count++;
+			active_count++;
 
-		/*
-		 * Store the next timerentry pointer before releasing the
-		 * list lock. If that entry has to be removed when we
-		 * release the lock, this pointer will be updated to the
-		 * element after that.
-		 */
-		listp->next_te = next_te;
+			/*
+			 * Store the next timerentry pointer before
+			 * releasing the list lock. If that entry has to be
+			 * removed when we release the lock, this pointer
+			 * will be updated to the element after that.
+			 */
+			listp->next_te = next_te;
 
-		VERIFY_NEXT_LINK(&tp->tentry, le);
-		VERIFY_PREV_LINK(&tp->tentry, le);
+			VERIFY_NEXT_LINK(&tp->tentry, le);
+			VERIFY_PREV_LINK(&tp->tentry, le);
 
-		lck_mtx_unlock(listp->mtx);
+			lck_mtx_unlock(listp->mtx);
 
-		offset = tcp_run_conn_timer(tp, &te_mode,
-		    listp->probe_if_index);
+			offset = tcp_run_conn_timer(tp, &te_mode,
+			    listp->probe_if_index);
 
-		lck_mtx_lock(listp->mtx);
+			lck_mtx_lock(listp->mtx);
 
-		next_te = listp->next_te;
-		listp->next_te = NULL;
+			next_te = listp->next_te;
+			listp->next_te = NULL;
 
-		if (offset > 0 && te_mode != 0) {
-			list_mode |= te_mode;
+			if (offset > 0 && te_mode != 0)
+				list_mode |= te_mode;
+		}
 
-			if (next_timer == 0 || offset < next_timer)
-				next_timer = offset;
+		/*
+		 * Whatever is left still has timers pending; put it back
+		 * on the wheel according to its new runtime.
+		 */
+		while ((te = LIST_FIRST(&expired)) != NULL) {
+			LIST_REMOVE(te, le);
+			tcp_timerwheel_insert(listp, te);
 		}
 	}
 
-	if (!LIST_EMPTY(&listp->lhead)) {
+	if (listp->entries > 0) {
 		u_int16_t next_mode = 0;
+
+		next_timer = tcp_timerwheel_next(listp, &list_mode);
 		if ((list_mode & TCP_TIMERLIST_10MS_MODE) ||
 			(listp->pref_mode & TCP_TIMERLIST_10MS_MODE))
 			next_mode = TCP_TIMERLIST_10MS_MODE;
@@ -2022,7 +2125,7 @@ tcp_sched_timers(struct tcpcb *tp)
 		}
 
 		if (!TIMER_IS_ON_LIST(tp)) {
-			LIST_INSERT_HEAD(&listp->lhead, te, le);
+			tcp_timerwheel_insert(listp, te);
 			tp->t_flags |= TF_TIMER_ONLIST;
 
 			listp->entries++;
@@ -2035,6 +2138,29 @@ tcp_sched_timers(struct tcpcb *tp)
 		}
 	}
 
+	/*
+	 * If the deadline moved ahead of the wheel slot holding this entry,
+	 * move it; its slot would otherwise be processed too late.  Entries
+	 * already in the next slot to be processed can't go any earlier.
+	 */
+	if (TSTMP_LT(te->runtime, te->slottime) &&
+	    TSTMP_GT(te->slottime, listp->wheel_time)) {
+		if (!list_locked) {
+			lck_mtx_lock(listp->mtx);
+			list_locked = TRUE;
+		}
+
+		if (TIMER_IS_ON_LIST(tp) &&
+		    TSTMP_LT(te->runtime, te->slottime) &&
+		    TSTMP_GT(te->slottime, listp->wheel_time)) {
+			if (listp->next_te == te)
+				listp->next_te = LIST_NEXT(te, le);
+			LIST_REMOVE(te, le);
+			tcp_timerwheel_insert(listp, te);
+			tcp_timerwheel_moved++;
+		}
+	}
+
 	/*
 	 * Timer entry is currently on the list, check if the list needs
 	 * to be rescheduled.
@@ -2474,6 +2600,8 @@ tcp_enable_read_probe(struct tcpcb *tp, struct ifnet *ifp)
 					tp->tentry.runtime++;
 			}
 		}
+		/* Make sure the wheel holds the entry where it'll be seen */
+		tcp_sched_timers(tp);
 	}
 }
 
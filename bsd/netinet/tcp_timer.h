@@ -238,12 +238,36 @@ struct tcptimerentry {
 	uint16_t index;		/* index of lowest timer that needs to run first */
 	uint16_t mode;		/* Bit-wise OR of timers that are active */
 	uint32_t runtime;	/* deadline at which the first timer has to fire */
+	uint32_t slottime;	/* start time of the wheel slot holding it */
 };
 
 LIST_HEAD(timerlisthead, tcptimerentry);
 
+/*
+ * Connections with pending timers are kept on a hashed timing wheel.
+ * Each slot covers TCP_TIMERWHEEL_GRAN ms of tcp_now; an entry sits in
+ * the slot starting at or before its runtime (clamped to the span of
+ * the wheel), so arming and cancelling are O(1) and a run of the timer
+ * list only visits the slots that have come due.  An entry whose
+ * deadline moves later is left where it is and re-slotted when its
+ * slot comes up; one whose deadline moves earlier is moved right away.
+ *
+ * The slot width is kept below TCP_TIMER_10MS_QUANTUM, the coalescing
+ * slack the timer list already allows for its fastest mode.
+ */
+#define TCP_TIMERWHEEL_SHIFT	3
+#define TCP_TIMERWHEEL_GRAN	(1 << TCP_TIMERWHEEL_SHIFT)	/* 8 ms */
+#define TCP_TIMERWHEEL_SLOTS	1024	/* power of 2 */
+#define TCP_TIMERWHEEL_SPAN	(TCP_TIMERWHEEL_SLOTS * TCP_TIMERWHEEL_GRAN)
+
+struct tcptimerslot {
+	struct timerlisthead lhead;	/* entries in this slot */
+	uint16_t mode;		/* modes of entries added since last run */
+};
+
 struct tcptimerlist {
-	struct timerlisthead lhead;	/* head of the list */
+	struct tcptimerslot wheel[TCP_TIMERWHEEL_SLOTS];	/* timer wheel */
+	uint32_t wheel_time;	/* start time of the next slot to process */
 	lck_mtx_t *mtx;		/* lock to protect the list */
 	lck_attr_t *mtx_attr;	/* mutex attributes */
 	lck_grp_t *mtx_grp;	/* mutex group definition */
@@ -1301,7 +1301,7 @@ tcp_connect(struct tcpcb *tp, struct sockaddr *nam, struct proc *p)
 	struct socket *so = inp->inp_socket;
 	struct tcpcb *otp;
 	struct sockaddr_in *sin = (struct sockaddr_in *)(void *)nam;
-	struct in_addr laddr;
+	struct in_addr laddr, *new_laddr = NULL;
 	int error = 0;
 	struct ifnet *outif = NULL;
 
@@ -1366,15 +1366,13 @@ skip_oinp:
 		socket_lock(inp->inp_socket, 0);
 	}
 	if (inp->inp_laddr.s_addr == INADDR_ANY) {
-		inp->inp_laddr = laddr;
+		new_laddr = &laddr;
 		/* no reference needed */
 		inp->inp_last_outifp = outif;
 
 		inp->inp_flags |= INP_INADDR_ANY;
 	}
-	inp->inp_faddr = sin->sin_addr;
-	inp->inp_fport = sin->sin_port;
-	in_pcbrehash(inp);
+	in_pcbrehash_tuple(inp, new_laddr, sin->sin_addr, sin->sin_port);
 	lck_rw_done(inp->inp_pcbinfo->ipi_lock);
 
 	if (inp->inp_flowhash == 0)
@@ -1406,7 +1404,7 @@ tcp6_connect(struct tcpcb *tp, struct sockaddr *nam, struct proc *p)
 	struct socket *so = inp->inp_socket;
 	struct tcpcb *otp;
 	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)(void *)nam;
-	struct in6_addr addr6;
+	struct in6_addr addr6, *new_laddr = NULL;
 	int error = 0;
 	struct ifnet *outif = NULL;
 
@@ -1454,15 +1452,13 @@ tcp6_connect(struct tcpcb *tp, struct sockaddr *nam, struct proc *p)
 		socket_lock(inp->inp_socket, 0);
 	}
 	if (IN6_IS_ADDR_UNSPECIFIED(&inp->in6p_laddr)) {
-		inp->in6p_laddr = addr6;
+		new_laddr = &addr6;
 		inp->in6p_last_outifp = outif;	/* no reference needed */
 		inp->in6p_flags |= INP_IN6ADDR_ANY;
 	}
-	inp->in6p_faddr = sin6->sin6_addr;
-	inp->inp_fport = sin6->sin6_port;
 	if ((sin6->sin6_flowinfo & IPV6_FLOWINFO_MASK) != 0)
 		inp->inp_flow = sin6->sin6_flowinfo;
-	in_pcbrehash(inp);
+	in6_pcbrehash_tuple(inp, new_laddr, &sin6->sin6_addr, sin6->sin6_port);
 	lck_rw_done(inp->inp_pcbinfo->ipi_lock);
 
 	if (inp->inp_flowhash == 0)
@@ -2301,6 +2297,37 @@ tcp_ctloutput(struct socket *so, struct sockopt *sopt)
 				tp->t_flagsext &= ~TF_FASTOPEN_HEUR;
 
 			break;
+		case TCP_USE_BBR:
+			error = sooptcopyin(sopt, &optval, sizeof(optval),
+				sizeof(optval));
+			if (error)
+				break;
+			if (optval < 0 || optval > 1) {
+				error = EINVAL;
+				break;
+			}
+			if (optval)
+				tp->t_flagsext |= TF_BBR;
+			else
+				tp->t_flagsext &= ~TF_BBR;
+
+			/* Background transport keeps using LEDBAT */
+			if (tp->tcp_cc_index != TCP_CC_ALGO_BACKGROUND_INDEX)
+				tcp_set_foreground_cc(so);
+			break;
+		case TCP_PACING_RATE:
+			error = sooptcopyin(sopt, &optval, sizeof(optval),
+				sizeof(optval));
+			if (error)
+				break;
+			if (optval < 0) {
+				error = EINVAL;
+				break;
+			}
+			/* Kept in bytes per ms, rounded up so it never reads 0 */
+			tp->t_pacing_maxrate = (optval == 0) ? 0 :
+			    howmany((u_int32_t)optval, 1000);
+			break;
 		case TCP_ENABLE_ECN:
 			error = sooptcopyin(sopt, &optval, sizeof optval,
 					    sizeof optval);
@@ -2473,6 +2500,13 @@ tcp_ctloutput(struct socket *so, struct sockopt *sopt)
 		case TCP_FASTOPEN_FORCE_HEURISTICS:
 			optval = (tp->t_flagsext & TF_FASTOPEN_HEUR) ? 1 : 0;
 			break;
+		case TCP_USE_BBR:
+			optval = (tp->t_flagsext & TF_BBR) ? 1 : 0;
+			break;
+		case TCP_PACING_RATE:
+			optval = (int)MIN((u_int64_t)tp->t_pacing_maxrate * 1000,
+			    INT32_MAX);
+			break;
 		case TCP_MEASURE_SND_BW:
 			optval = tp->t_flagsext & TF_MEASURESNDBW;
 			break;
@@ -66,6 +66,9 @@
 #include <sys/types.h>
 #include <sys/appleapiopts.h>
 #include <sys/queue.h>
+#ifdef KERNEL_PRIVATE
+#include <sys/tree.h>
+#endif /* KERNEL_PRIVATE */
 #include <netinet/in_pcb.h>
 #include <netinet/tcp.h>
 #include <netinet/tcp_timer.h>
@@ -169,11 +172,15 @@ struct sackhole {
 	tcp_seq rxmit;		/* next seq. no in hole to be retransmitted */
 	u_int32_t rxmit_start;	/* timestamp of first retransmission */
 	TAILQ_ENTRY(sackhole) scblink;	/* scoreboard linkage */
+	RB_ENTRY(sackhole) scbtree;	/* scoreboard lookup by start */
 };
 
+RB_HEAD(sackhole_tree, sackhole);
+
 struct sackhint {
 	struct sackhole	*nexthole;
 	int	sack_bytes_rexmit;
+	u_int32_t	sack_hole_bytes;	/* bytes covered by all holes */
 };
 
 struct tcp_rxt_seg {
@@ -242,6 +249,44 @@ struct tcp_ccstate {
 #define cub_target_win __u__._cubic_state_.tc_target_win
 #define cub_avg_lastmax __u__._cubic_state_.tc_avg_lastmax
 #define cub_mean_dev __u__._cubic_state_.tc_mean_deviation
+		struct tcp_bbr_state {
+			u_int8_t  tb_mode;	/* startup, drain, probe bw/rtt */
+			u_int8_t  tb_cycle_idx;	/* phase of the probe bw cycle */
+			u_int8_t  tb_full_bw_cnt; /* rounds without bw growth */
+			u_int8_t  tb_flags;
+			u_int16_t tb_pacing_gain; /* in units of 1/256 */
+			u_int16_t tb_cwnd_gain;	/* in units of 1/256 */
+			u_int32_t tb_bw[3];	/* windowed max bw, bytes/ms */
+			u_int32_t tb_bw_round[3]; /* round of each bw sample */
+			u_int32_t tb_full_bw;	/* bw at last growth check */
+			u_int32_t tb_min_rtt;	/* windowed min rtt, ms */
+			u_int32_t tb_min_rtt_ts; /* TS when min rtt was taken */
+			u_int32_t tb_round_cnt;	/* number of round trips */
+			tcp_seq   tb_round_end;	/* snd_max at round start */
+			u_int32_t tb_round_ts;	/* TS at round start */
+			u_int32_t tb_round_acked; /* bytes acked in this round */
+			u_int32_t tb_cycle_ts;	/* TS at start of cycle phase */
+			u_int32_t tb_probe_rtt_ts; /* TS when probe rtt may end */
+			u_int32_t tb_prior_cwnd; /* cwnd before recovery */
+		} _bbr_state_;
+#define bbr_mode __u__._bbr_state_.tb_mode
+#define bbr_cycle_idx __u__._bbr_state_.tb_cycle_idx
+#define bbr_full_bw_cnt __u__._bbr_state_.tb_full_bw_cnt
+#define bbr_flags __u__._bbr_state_.tb_flags
+#define bbr_pacing_gain __u__._bbr_state_.tb_pacing_gain
+#define bbr_cwnd_gain __u__._bbr_state_.tb_cwnd_gain
+#define bbr_bw __u__._bbr_state_.tb_bw
+#define bbr_bw_round __u__._bbr_state_.tb_bw_round
+#define bbr_full_bw __u__._bbr_state_.tb_full_bw
+#define bbr_min_rtt __u__._bbr_state_.tb_min_rtt
+#define bbr_min_rtt_ts __u__._bbr_state_.tb_min_rtt_ts
+#define bbr_round_cnt __u__._bbr_state_.tb_round_cnt
+#define bbr_round_end __u__._bbr_state_.tb_round_end
+#define bbr_round_ts __u__._bbr_state_.tb_round_ts
+#define bbr_round_acked __u__._bbr_state_.tb_round_acked
+#define bbr_cycle_ts __u__._bbr_state_.tb_cycle_ts
+#define bbr_probe_rtt_ts __u__._bbr_state_.tb_probe_rtt_ts
+#define bbr_prior_cwnd __u__._bbr_state_.tb_prior_cwnd
 	} __u__;
 };
 
@@ -424,6 +469,7 @@ struct tcpcb {
 					   episode starts at this seq number */
 	TAILQ_HEAD(sackhole_head, sackhole) snd_holes;
 						/* SACK scoreboard (sorted) */
+	struct sackhole_tree snd_holes_tree;	/* same holes, by start seq */
 	tcp_seq	snd_fack;		/* last seq number(+1) sack'd by rcv'r*/
 	int	rcv_numsacks;		/* # distinct sack blks present */
 	struct sackblk sackblks[MAX_SACK_BLKS]; /* seq nos. of sack blocks */
@@ -484,6 +530,7 @@ struct tcpcb {
 #define	TF_FASTOPEN		0x400000	/* TCP Fastopen is enabled */
 #define	TF_REASS_INPROG		0x800000	/* Reassembly is in progress */
 #define	TF_FASTOPEN_HEUR	0x1000000	/* Make sure that heuristics get never skipped */
+#define	TF_BBR			0x2000000	/* Use BBR in the foreground */
 
 #if TRAFFIC_MGT
 	/* Inter-arrival jitter related state */
@@ -516,6 +563,12 @@ struct tcpcb {
 	tcp_seq		t_pipeack_lastuna; /* una when pipeack measurement started */
 	u_int32_t	t_pipeack;
 	u_int32_t	t_lossflightsize;
+/* pacing state, set by the congestion control module */
+	u_int32_t	t_pacing_rate;		/* bytes per ms, 0 if not paced */
+	u_int32_t	t_pacing_tokens;	/* bytes that may be sent now */
+	u_int32_t	t_pacing_ts;		/* TS of last token refill */
+	u_int32_t	t_pacing_maxrate;	/* TCP_PACING_RATE, bytes per ms */
+	u_int64_t	t_pacing_next;		/* next release time, ns uptime */
 
 #if MPTCP
 	u_int32_t	t_mpflags;		/* flags for multipath TCP */
@@ -1202,6 +1255,11 @@ struct	tcpstat {
 	u_int32_t	tcps_mptcp_back_to_wifi;	/* Total number of connections that succeed to move traffic away from cell (when starting on cell) */
 	u_int32_t	tcps_mptcp_wifi_proxy;		/* Total number of new subflows that fell back to regular TCP on cell */
 	u_int32_t	tcps_mptcp_cell_proxy;		/* Total number of new subflows that fell back to regular TCP on WiFi */
+
+	/* TCP pacing */
+	u_int32_t	tcps_paced_sends;	/* segments released later by the interface queue */
+	u_int32_t	tcps_burst_sends;	/* paced segments that could leave immediately */
+	u_int32_t	tcps_pacing_held;	/* sends deferred by the pacing budget */
 };
 
 
@@ -1499,6 +1557,7 @@ extern int tcp_do_rfc3465;
 extern int tcp_do_rfc3465_lim2;
 extern int maxseg_unacked;
 extern int tcp_use_newreno;
+extern int tcp_use_bbr;
 extern struct zone *tcp_reass_zone;
 extern struct zone *tcp_rxt_seg_zone;
 extern int tcp_ecn_outbound;
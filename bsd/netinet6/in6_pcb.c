@@ -526,7 +526,7 @@ in6_pcbladdr(struct inpcb *inp, struct sockaddr *nam,
 int
 in6_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 {
-	struct in6_addr addr6;
+	struct in6_addr addr6, *new_laddr = NULL;
 	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)(void *)nam;
 	struct inpcb *pcb;
 	int error = 0;
@@ -569,7 +569,7 @@ in6_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 			if (error)
 				goto done;
 		}
-		inp->in6p_laddr = addr6;
+		new_laddr = &addr6;
 		inp->in6p_last_outifp = outif;	/* no reference needed */
 		inp->in6p_flags |= INP_IN6ADDR_ANY;
 	}
@@ -579,11 +579,9 @@ in6_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 		lck_rw_lock_exclusive(inp->inp_pcbinfo->ipi_lock);
 		socket_lock(so, 0);
 	}
-	inp->in6p_faddr = sin6->sin6_addr;
-	inp->inp_fport = sin6->sin6_port;
+	in6_pcbrehash_tuple(inp, new_laddr, &sin6->sin6_addr, sin6->sin6_port);
 	if (nstat_collect && SOCK_PROTO(so) == IPPROTO_UDP)
 		nstat_pcb_invalidate_cache(inp);
-	in_pcbrehash(inp);
 	lck_rw_done(inp->inp_pcbinfo->ipi_lock);
 
 done:
@@ -606,11 +604,9 @@ in6_pcbdisconnect(struct inpcb *inp)
 	}
 	if (nstat_collect && SOCK_PROTO(so) == IPPROTO_UDP)
 		nstat_pcb_cache(inp);
-	bzero((caddr_t)&inp->in6p_faddr, sizeof (inp->in6p_faddr));
-	inp->inp_fport = 0;
+	in6_pcbrehash_tuple(inp, NULL, &in6addr_any, 0);
 	/* clear flowinfo - RFC 6437 */
 	inp->inp_flow &= ~IPV6_FLOWLABEL_MASK;
-	in_pcbrehash(inp);
 	lck_rw_done(inp->inp_pcbinfo->ipi_lock);
 	/*
 	 * A multipath subflow socket would have its SS_NOFDREF set by default,
@@ -1196,14 +1192,16 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 	struct inpcbhead *head;
 	struct inpcb *inp;
 	u_short fport = fport_arg, lport = lport_arg;
-
-	lck_rw_lock_shared(pcbinfo->ipi_lock);
+	u_int32_t element;
 
 	/*
-	 * First look for an exact match.
+	 * First look for an exact match, holding only the lock of the
+	 * hash stripe; see in_pcblookup_hash().
 	 */
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr->s6_addr32[3] /* XXX */,
-	    lport, fport, pcbinfo->ipi_hashmask)];
+	element = INP_PCBHASH(faddr->s6_addr32[3] /* XXX */, lport, fport,
+	    pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[element];
+	in_pcbhash_lock_shared(pcbinfo, element);
 	LIST_FOREACH(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV6))
 			continue;
@@ -1220,18 +1218,21 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 			 */
 			if (in_pcb_checkstate(inp, WNT_ACQUIRE, 0) !=
 			    WNT_STOPUSING) {
-				lck_rw_done(pcbinfo->ipi_lock);
+				in_pcbhash_unlock(pcbinfo, element);
 				return (inp);
 			} else {
 				/* it's there but dead, say it isn't found */
-				lck_rw_done(pcbinfo->ipi_lock);
+				in_pcbhash_unlock(pcbinfo, element);
 				return (NULL);
 			}
 		}
 	}
+	in_pcbhash_unlock(pcbinfo, element);
+
 	if (wildcard) {
 		struct inpcb *local_wild = NULL;
 
+		lck_rw_lock_shared(pcbinfo->ipi_lock);
 		head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
 		    pcbinfo->ipi_hashmask)];
 		LIST_FOREACH(inp, head, inp_hash) {
@@ -1273,7 +1274,6 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 	/*
 	 * Not found.
 	 */
-	lck_rw_done(pcbinfo->ipi_lock);
 	return (NULL);
 }
 
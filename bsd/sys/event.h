@@ -163,6 +163,30 @@ struct kevent_qos_s {
  */
 typedef uint64_t kqueue_id_t;
 
+/*
+ * Header of the change and event rings shared by a kqueue and its
+ * process (see kevent_ring_setup()).  It is followed by the submission
+ * ring, then the completion ring, each of krh_entries kevent_qos_s.
+ *
+ * The process queues changes at krh_sq_tail and the kernel consumes them
+ * up to it, advancing krh_sq_head.  The kernel posts events at
+ * krh_cq_tail and the process consumes them, advancing krh_cq_head.
+ * Indices only grow and wrap around; each one is written by one side
+ * only, and index i designates entry (i & (krh_entries - 1)).
+ */
+struct kevent_ring_header {
+	volatile uint32_t	krh_sq_head;	/* next change the kernel consumes */
+	volatile uint32_t	krh_sq_tail;	/* next change the process queues */
+	volatile uint32_t	krh_cq_head;	/* next event the process consumes */
+	volatile uint32_t	krh_cq_tail;	/* next event the kernel posts */
+	uint32_t		krh_entries;	/* entries in each ring */
+	uint32_t		krh_sq_offset;	/* offset of the submission ring */
+	uint32_t		krh_cq_offset;	/* offset of the completion ring */
+	uint32_t		krh_reserved;
+};
+
+#define KEVENT_RING_ENTRIES_MAX		4096
+
 #endif /* PRIVATE */
 
 #define EV_SET(kevp, a, b, c, d, e, f) do {	\
@@ -214,6 +238,7 @@ typedef uint64_t kqueue_id_t;
 #define KEVENT_FLAG_DYNAMIC_KQ_MUST_EXIST        0x20000 /* kq lookup by id must exist */
 #define KEVENT_FLAG_DYNAMIC_KQ_MUST_NOT_EXIST    0x40000 /* kq lookup by id must not exist */
 #define KEVENT_FLAG_WORKLOOP_NO_WQ_THREAD        0x80000 /* do not create workqueue threads for this worloop */
+#define KEVENT_FLAG_RING                         0x100000 /* changes and events go through the kq's rings */
 
 #ifdef XNU_KERNEL_PRIVATE
 
@@ -228,7 +253,7 @@ typedef uint64_t kqueue_id_t;
                           KEVENT_FLAG_WORKQ | KEVENT_FLAG_WORKLOOP | \
                           KEVENT_FLAG_WORKLOOP_SERVICER_ATTACH | KEVENT_FLAG_WORKLOOP_SERVICER_DETACH | \
                           KEVENT_FLAG_DYNAMIC_KQ_MUST_EXIST | KEVENT_FLAG_DYNAMIC_KQ_MUST_NOT_EXIST | \
-			  KEVENT_FLAG_WORKLOOP_NO_WQ_THREAD)
+			  KEVENT_FLAG_WORKLOOP_NO_WQ_THREAD | KEVENT_FLAG_RING)
 
 /*
  * Since some filter ops are not part of the standard sysfilt_ops, we use
@@ -285,6 +310,12 @@ typedef uint64_t kqueue_id_t;
 #define EV_VANISHED         0x0200		/* report that source has vanished  */
                                   		/* ... only valid with EV_DISPATCH2 */
 
+#ifdef PRIVATE
+#define EV_EXCLUSIVE        0x0800		/* wake one of the exclusive knotes */
+                                  		/* ... sharing a source, such as a */
+                                  		/* listening socket, per event */
+#endif /* PRIVATE */
+
 #define EV_SYSFLAGS         0xF000		/* reserved by system */
 #define EV_FLAG0            0x1000		/* filter-specific flag */
 #define EV_FLAG1            0x2000		/* filter-specific flag */
@@ -694,6 +725,7 @@ typedef uint16_t kn_status_t;
 #define KN_STOLENDROP	   0x1000		/* someone stole the drop privilege */
 #define KN_REQVANISH       0x2000       /* requested EV_VANISH */
 #define KN_VANISHED        0x4000       /* has vanished */
+#define KN_EXCLUSIVE       0x8000       /* requested EV_EXCLUSIVE */
 
 #define KN_DISPATCH2		(KN_DISPATCH | KN_UDATA_SPECIFIC)
 					/* combination defines deferred-delete mode enabled */
@@ -728,6 +760,8 @@ struct knote {
 	int                      kn_hookid;
 	uint16_t                 kn_inuse;          /* inuse count */
 	kn_status_t              kn_status;         /* status bits */
+	volatile uint32_t        kn_actpending;     /* on its kq's activation queue */
+	struct knote             *kn_actnext;       /* activation queue linkage */
 
 #define kn_id		kn_kevent.ident
 #define kn_filter	kn_kevent.filter
@@ -940,6 +974,7 @@ typedef struct filt_process_s *filt_process_data_t;
 struct filterops {
 	bool    f_isfd;		/* true if ident == filedescriptor */
 	bool    f_adjusts_qos; /* true if the filter can override the knote */
+	bool    f_level;	/* true if f_event recomputes the state from the source, whatever the hint */
 	bool    (*f_needs_boost)(struct kevent_internal_s *kev);
 	int     (*f_attach)(struct knote *kn, struct kevent_internal_s *kev);
 	int     (*f_post_attach)(struct knote *kn, struct kevent_internal_s *kev);
@@ -1048,6 +1083,9 @@ int     kevent_id(kqueue_id_t id,
 		   struct kevent_qos_s *eventlist, int nevents,
 		   void *data_out, size_t *data_available,
 		   unsigned int flags);
+
+int     kevent_ring_setup(int kq, unsigned int entries,
+		   struct kevent_ring_header **ring);
 #endif /* PRIVATE */
 
 __END_DECLS
@@ -100,6 +100,9 @@ typedef void (*kqueue_continue_t)(struct kqueue *, void *, int);
 
 #define KQEXTENT	256		/* linear growth by this amount */
 
+struct kqtimer;
+struct kqring;
+
 /*
  * kqueue - common core definition of a kqueue
  *
@@ -114,6 +117,7 @@ struct kqueue {
 	uint16_t            kq_level;     /* nesting level of the kq */
 	uint32_t            kq_count;     /* number of queued events */
 	struct proc         *kq_p;        /* process containing kqueue */
+	struct kqtimer      *kq_timers;   /* armed EVFILT_TIMER knotes */
 	struct kqtailq      kq_queue[1];  /* variable array of kqtailq structs */
 };
 
@@ -141,6 +145,8 @@ struct kqfile {
 	struct kqueue       kqf_kqueue;     /* common kqueue core */
 	struct kqtailq      kqf_suppressed; /* suppression queue */
 	struct selinfo      kqf_sel;        /* parent select/kqueue info */
+	struct kqring       *kqf_ring;      /* rings shared with the process */
+	struct knote        * volatile kqf_actpending; /* knotes posted while locked */
 };
 
 #define kqf_wqs      kqf_kqueue.kq_wqs
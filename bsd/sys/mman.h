@@ -193,6 +193,8 @@
 #define MADV_FREE_REUSE		8	/* caller wants to reuse those pages */
 #define MADV_CAN_REUSE		9
 #define MADV_PAGEOUT		10	/* page out now (internal only) */
+#define MADV_SUPERPAGE		11	/* back with transparent superpages */
+#define MADV_NOSUPERPAGE	12	/* don't use transparent superpages */
 
 /*
  * Return bits from mincore
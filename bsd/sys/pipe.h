@@ -84,14 +84,26 @@
 #endif
 
 /*
- * PIPE_MINDIRECT MUST be smaller than PIPE_SIZE and MUST be bigger
- * than PIPE_BUF.
+ * Writes of at least PIPE_MINDIRECT bytes are handed to the reader
+ * directly from the writer's (wired) pages, up to PIPE_MAXDIRECT bytes
+ * at a time.  PIPE_MINDIRECT MUST be bigger than PIPE_BUF, so that
+ * atomic writes always go through the buffer.
  */
 #ifndef PIPE_MINDIRECT
-#define PIPE_MINDIRECT	8192
+#define PIPE_MINDIRECT	(64*1024)
 #endif
 
-#define PIPENPAGES	(BIG_PIPE_SIZE / PAGE_SIZE + 1)
+#ifndef PIPE_MAXDIRECT
+#define PIPE_MAXDIRECT	(1024*1024)
+#endif
+
+/*
+ * Under sustained throughput the buffer may grow past BIG_PIPE_SIZE,
+ * up to this size, until the reader drains it.
+ */
+#ifndef PIPE_MAXSIZE
+#define PIPE_MAXSIZE	(512*1024)
+#endif
 
 /*
  * Pipe buffer information.
@@ -107,16 +119,18 @@ struct pipebuf {
 };
 
 
-#ifdef PIPE_DIRECT
+#ifdef	KERNEL
+struct upl;
+
 /*
  * Information to support direct transfers between processes for pipes.
+ * Direct write is active when the mapping cnt field is set.
  */
 struct pipemapping {
-	vm_offset_t	kva;		/* kernel virtual address */
-	vm_size_t	cnt;		/* number of chars in buffer */
-	vm_size_t	pos;		/* current position of transfer */
-	int		npages;		/* number of pages */
-	vm_page_t	ms[PIPENPAGES];	/* pages in source process */
+	struct upl	*upl;		/* writer's pages, wired */
+	u_int		offset;		/* offset of the data in the first page */
+	u_int		cnt;		/* number of chars left to transfer */
+	u_int		pos;		/* current position of transfer */
 };
 #endif
 
@@ -149,9 +163,8 @@ struct label;
  */
 struct pipe {
 	struct	pipebuf pipe_buffer;	/* data storage */
-#ifdef PIPE_DIRECT
 	struct	pipemapping pipe_map;	/* pipe mapping for direct I/O */
-#endif
+	u_int	pipe_wstalls;		/* writer found the buffer full, reader never starved */
 	struct	selinfo pipe_sel;	/* for compat with select */
 	pid_t	pipe_pgid;		/* information for async I/O */
 	struct	pipe *pipe_peer;	/* link with other direction */
@@ -68,9 +68,17 @@ extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
  */
 #define UL_COMPARE_AND_WAIT				1
 #define UL_UNFAIR_LOCK					2
+#define UL_RW_LOCK					3
 /* obsolete names */
 #define UL_OSSPINLOCK					UL_COMPARE_AND_WAIT
 #define UL_HANDOFFLOCK					UL_UNFAIR_LOCK
+/*
+ * A write-held UL_RW_LOCK value holds the writer's thread port name, like
+ * UL_UNFAIR_LOCK: its two least significant bits are free for userland
+ * flags.  The encoding of a read-held lock is up to userland; a waiter
+ * that found the lock read-held says so with ULF_WAIT_READ_HELD, since
+ * there is no single owner to promote then.
+ */
 /* These operation code are only implemented in (DEVELOPMENT || DEBUG) kernels */
 #define UL_DEBUG_SIMULATE_COPYIN_FAULT	253
 #define UL_DEBUG_HASH_DUMP_ALL			254
@@ -81,6 +89,13 @@ extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
  */
 #define ULF_WAKE_ALL					0x00000100
 #define ULF_WAKE_THREAD					0x00000200
+/* wake_value is the maximum number of waiters to wake */
+#define ULF_WAKE_N					0x00000400
+/*
+ * UL_COMPARE_AND_WAIT only: wake one waiter and move the rest, without
+ * waking them, to the address passed in wake_value
+ */
+#define ULF_WAKE_REQUEUE				0x00000800
 
 /*
  * operation bits [23, 16] contain the flags for __ulock_wait
@@ -90,6 +105,8 @@ extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
  * waiters on this lock.
  */
 #define ULF_WAIT_WORKQ_DATA_CONTENTION	0x00010000
+/* UL_RW_LOCK only: the lock is read-held, the value is not a port name */
+#define ULF_WAIT_READ_HELD				0x00020000
 
 /*
  * operation bits [31, 24] contain the generic flags
@@ -104,10 +121,13 @@ extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
 #define ULF_GENERIC_MASK	0xFFFF0000
 
 #define ULF_WAIT_MASK		(ULF_NO_ERRNO | \
-							 ULF_WAIT_WORKQ_DATA_CONTENTION)
+							 ULF_WAIT_WORKQ_DATA_CONTENTION | \
+							 ULF_WAIT_READ_HELD)
 
 #define ULF_WAKE_MASK		(ULF_WAKE_ALL | \
 							 ULF_WAKE_THREAD | \
+							 ULF_WAKE_N | \
+							 ULF_WAKE_REQUEUE | \
 							 ULF_NO_ERRNO)
 
 #endif /* PRIVATE */
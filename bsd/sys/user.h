@@ -167,6 +167,10 @@ struct uthread {
 			struct wait4_nocancel_args *args;	/* original syscall arguments */
 			int32_t *retval;			/* place to store return val */
 		} uu_wait4_data;
+
+		struct _ulock_wait_data {
+			void *ull;			/* ulock being waited on, updated by requeue */
+		} uu_ulock_wait_data;
 	} uu_kevent;
 
 	/* Persistent memory allocations across system calls */
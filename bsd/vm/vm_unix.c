@@ -91,6 +91,7 @@
 #include <vm/vm_map.h>
 #include <vm/vm_kern.h>
 #include <vm/vm_pageout.h>
+#include <vm/vm_fault.h>
 
 #include <mach/shared_region.h>
 #include <vm/vm_shared_region.h>
@@ -262,6 +263,64 @@ SYSCTL_INT(_vm, OID_AUTO, vm_shadow_max_enabled, CTLFLAG_RW | CTLFLAG_LOCKED, &v
 
 #endif /* VM_SCAN_FOR_SHADOW_CHAIN */
 
+#if __x86_64__
+/* transparent superpages: 0 never, 1 MADV_SUPERPAGE ranges only, 2 always */
+extern unsigned int vm_superpage_mode;
+extern unsigned int vm_superpage_pool_target;
+extern unsigned int vm_superpage_pool_runs;
+extern unsigned int vm_superpage_promotions;
+extern unsigned int vm_superpage_promote_failures;
+extern unsigned int vm_superpage_demotions;
+
+static int
+sysctl_vm_superpage_mode SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2)
+	int error;
+	int value = (int) vm_superpage_mode;
+
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error || !req->newptr)
+		return (error);
+	if (value < 0 || value > 2)
+		return (EINVAL);
+	vm_superpage_mode = (unsigned int) value;
+	return (0);
+}
+SYSCTL_PROC(_vm, OID_AUTO, superpage_mode, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_LOCKED,
+    0, 0, &sysctl_vm_superpage_mode, "I", "");
+SYSCTL_UINT(_vm, OID_AUTO, superpage_pool_target, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_superpage_pool_target, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, superpage_pool_runs, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_superpage_pool_runs, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, superpage_promotions, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_superpage_promotions, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, superpage_promote_failures, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_superpage_promote_failures, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, superpage_demotions, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_superpage_demotions, 0, "");
+#endif /* __x86_64__ */
+
+/* fault-around: number of pages mapped around a fault on a file mapping */
+extern unsigned int vm_fault_around_pages;
+extern unsigned int vm_fault_around_prefaulted;
+extern unsigned int vm_fault_around_used;
+
+static int
+sysctl_vm_fault_around_pages SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2)
+	int error;
+	int value = (int) vm_fault_around_pages;
+
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error || !req->newptr)
+		return (error);
+	if (value < 0 || value > VM_FAULT_AROUND_MAX)
+		return (EINVAL);
+	vm_fault_around_pages = (unsigned int) value;
+	return (0);
+}
+SYSCTL_PROC(_vm, OID_AUTO, fault_around_pages, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_LOCKED,
+    0, 0, &sysctl_vm_fault_around_pages, "I", "");
+SYSCTL_UINT(_vm, OID_AUTO, fault_around_prefaulted, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_fault_around_prefaulted, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, fault_around_used, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_fault_around_used, 0, "");
+
 SYSCTL_INT(_vm, OID_AUTO, vm_debug_events, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_debug_events, 0, "");
 
 __attribute__((noinline)) int __KERNEL_WAITING_ON_TASKGATED_CHECK_ACCESS_UPCALL__(
@@ -2041,6 +2100,43 @@ extern unsigned int vm_page_free_count, vm_page_speculative_count;
 SYSCTL_UINT(_vm, OID_AUTO, page_free_count, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_page_free_count, 0, "");
 SYSCTL_UINT(_vm, OID_AUTO, page_speculative_count, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_page_speculative_count, 0, "");
 
+/* per-processor free page magazines */
+extern unsigned int vm_page_free_local_count(void);
+static int
+sysctl_vm_page_free_local_count SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2, oidp)
+	unsigned int value = vm_page_free_local_count();
+
+	return SYSCTL_OUT(req, &value, sizeof(value));
+}
+SYSCTL_PROC(_vm, OID_AUTO, page_free_local_count, CTLTYPE_INT|CTLFLAG_RD|CTLFLAG_LOCKED,
+    0, 0, &sysctl_vm_page_free_local_count, "IU", "Free pages in per-CPU magazines");
+
+extern unsigned int vm_free_magazine_refill_min, vm_free_magazine_refill_limit;
+extern uint64_t vm_free_magazine_refills, vm_free_magazine_refill_pages;
+extern uint64_t vm_free_magazine_drains, vm_free_magazine_drain_pages;
+extern uint64_t vm_page_free_lock_hold_abstime, vm_page_free_lock_hold_max_abstime;
+SYSCTL_UINT(_vm, OID_AUTO, free_magazine_refill_min, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_free_magazine_refill_min, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, free_magazine_refill_limit, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_free_magazine_refill_limit, 0, "");
+SYSCTL_QUAD(_vm, OID_AUTO, free_magazine_refills, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_free_magazine_refills, "");
+SYSCTL_QUAD(_vm, OID_AUTO, free_magazine_refill_pages, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_free_magazine_refill_pages, "");
+SYSCTL_QUAD(_vm, OID_AUTO, free_magazine_drains, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_free_magazine_drains, "");
+SYSCTL_QUAD(_vm, OID_AUTO, free_magazine_drain_pages, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_free_magazine_drain_pages, "");
+SYSCTL_QUAD(_vm, OID_AUTO, page_free_lock_hold_abstime, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_page_free_lock_hold_abstime, "Time spent refilling/draining magazines under the free queue lock");
+SYSCTL_QUAD(_vm, OID_AUTO, page_free_lock_hold_max_abstime, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_page_free_lock_hold_max_abstime, "");
+
+/* per-CPU batches of page activations from the fault path */
+extern unsigned int vm_page_activate_batch_enabled;
+extern uint64_t vm_page_activate_batches, vm_page_activate_batch_pages, vm_page_activate_batch_skipped;
+SYSCTL_UINT(_vm, OID_AUTO, page_activate_batch_enabled, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_page_activate_batch_enabled, 0, "");
+SYSCTL_QUAD(_vm, OID_AUTO, page_activate_batches, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_page_activate_batches, "");
+SYSCTL_QUAD(_vm, OID_AUTO, page_activate_batch_pages, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_page_activate_batch_pages, "");
+SYSCTL_QUAD(_vm, OID_AUTO, page_activate_batch_skipped, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_page_activate_batch_skipped, "");
+SYSCTL_QUAD(_vm, OID_AUTO, page_queue_fault_lock_count, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_page_queue_fault_lock_count, "Page queues lock acquisitions from the fault path");
+SYSCTL_QUAD(_vm, OID_AUTO, page_queue_fault_lock_abstime, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_page_queue_fault_lock_abstime, "Time spent holding the page queues lock in the fault path");
+SYSCTL_QUAD(_vm, OID_AUTO, page_queue_fault_lock_max_abstime, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_page_queue_fault_lock_max_abstime, "");
+
 extern unsigned int vm_page_cleaned_count;
 SYSCTL_UINT(_vm, OID_AUTO, page_cleaned_count, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_page_cleaned_count, 0, "Cleaned queue size");
 
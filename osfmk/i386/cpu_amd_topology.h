@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2018 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * AMD (family 17h and later) topology decoding.
+ *
+ * These parts don't describe their topology through the Intel leaves 4
+ * and 0xB.  Instead, CPUID 0x8000001D gives the number of logical cpus
+ * sharing each cache, 0x8000001E the threads per core and the node, and
+ * 0x80000008 the width of the core part of the APIC ID.  The APIC ID of
+ * each logical cpu is laid out as package:L3 domain (CCX):core:thread,
+ * each field a power of two wide, so a CCX of 3 cores still takes the
+ * APIC IDs of 4 and a package with 6 CCXs those of 8.  Dividing APIC IDs
+ * by the number of cpus sharing the cache, as the Intel path does, gets
+ * the domains wrong; shifting them by the field widths doesn't.
+ *
+ * First generation parts (family 17h, models 00h-1Fh) always place the
+ * CCX at APIC ID bit 3, whatever the number of cores enabled in it.
+ *
+ * This header only depends on the register values, so the same code is
+ * used by the topology test harness in tools/tests/cpu_topology.
+ */
+
+#ifndef _I386_CPU_AMD_TOPOLOGY_H_
+#define _I386_CPU_AMD_TOPOLOGY_H_
+
+#include <stdint.h>
+
+#define AMD_TOPO_LEAF_ADDR_SIZES	0x80000008
+#define AMD_TOPO_LEAF_CACHE		0x8000001D
+#define AMD_TOPO_LEAF_IDS		0x8000001E
+
+typedef struct amd_topology {
+	uint32_t	thread_shift;	/* APIC ID bits of the thread within its core */
+	uint32_t	llc_shift;	/* APIC ID bits below the L3 domain */
+	uint32_t	pkg_shift;	/* APIC ID bits below the package */
+	uint32_t	llc_sharing;	/* logical cpus sharing an L3, as reported */
+	uint32_t	threads_per_core;
+	uint32_t	threads_per_pkg;
+	uint32_t	nodes_per_pkg;
+} amd_topology_t;
+
+/* smallest n such that (1 << n) >= count */
+static inline uint32_t
+amd_topo_order(uint32_t count)
+{
+	uint32_t	n = 0;
+
+	while (n < 31 && (1U << n) < count)
+		n++;
+	return n;
+}
+
+#define AMD_TOPO_BITS(reg, hi, lo)	(((reg) >> (lo)) & ((1U << ((hi) - (lo) + 1)) - 1))
+
+#define AMD_TOPO_ZEN1_LLC_SHIFT	3
+
+/*
+ * Decode the topology from the registers returned on any one cpu:
+ *	signature	CPUID 1 eax
+ *	addr_sizes	CPUID 0x80000008
+ *	l3		CPUID 0x8000001D for the subleaf describing the L3
+ *	ids		CPUID 0x8000001E
+ * Returns 0 if the leaves don't describe a usable topology.
+ */
+static inline int
+amd_topo_decode(uint32_t signature, const uint32_t addr_sizes[4],
+		const uint32_t l3[4], const uint32_t ids[4], amd_topology_t *topo)
+{
+	uint32_t	family, model, core_bits;
+
+	family = AMD_TOPO_BITS(signature, 11, 8);
+	model = AMD_TOPO_BITS(signature, 7, 4);
+	if (family == 0xf) {
+		family += AMD_TOPO_BITS(signature, 27, 20);
+		model |= AMD_TOPO_BITS(signature, 19, 16) << 4;
+	}
+	if (family < 0x17)
+		return 0;
+
+	/* eax[4:0] cache type 3 = unified, eax[7:5] level */
+	if (AMD_TOPO_BITS(l3[0], 4, 0) != 3 || AMD_TOPO_BITS(l3[0], 7, 5) != 3)
+		return 0;
+
+	topo->threads_per_pkg = AMD_TOPO_BITS(addr_sizes[2], 7, 0) + 1;
+	core_bits = AMD_TOPO_BITS(addr_sizes[2], 15, 12);
+	if (core_bits == 0)
+		core_bits = amd_topo_order(topo->threads_per_pkg);
+
+	topo->llc_sharing = AMD_TOPO_BITS(l3[0], 25, 14) + 1;
+	topo->threads_per_core = AMD_TOPO_BITS(ids[1], 15, 8) + 1;
+	topo->nodes_per_pkg = AMD_TOPO_BITS(ids[2], 10, 8) + 1;
+
+	topo->thread_shift = amd_topo_order(topo->threads_per_core);
+	if (family == 0x17 && model <= 0x1f)
+		topo->llc_shift = AMD_TOPO_ZEN1_LLC_SHIFT;
+	else
+		topo->llc_shift = amd_topo_order(topo->llc_sharing);
+	topo->pkg_shift = core_bits;
+
+	if (topo->llc_shift < topo->thread_shift || topo->llc_shift > topo->pkg_shift)
+		return 0;
+
+	return 1;
+}
+
+static inline uint32_t
+amd_topo_core_id(const amd_topology_t *topo, uint32_t apicid)
+{
+	return apicid >> topo->thread_shift;
+}
+
+static inline uint32_t
+amd_topo_llc_id(const amd_topology_t *topo, uint32_t apicid)
+{
+	return apicid >> topo->llc_shift;
+}
+
+static inline uint32_t
+amd_topo_pkg_id(const amd_topology_t *topo, uint32_t apicid)
+{
+	return apicid >> topo->pkg_shift;
+}
+
+#endif /* _I386_CPU_AMD_TOPOLOGY_H_ */
@@ -31,6 +31,7 @@
 #include <mach/machine.h>
 #include <i386/cpu_threads.h>
 #include <i386/cpuid.h>
+#include <i386/cpu_amd_topology.h>
 #include <i386/machine_cpu.h>
 #include <i386/pmCPU.h>
 #include <i386/bit_routines.h>
@@ -63,6 +64,13 @@ static uint32_t		num_caches	= 0;
 static boolean_t	topoParmsInited	= FALSE;
 x86_topology_parameters_t	topoParms;
 
+/*
+ * On AMD parts the package, L3 domain and core of a logical cpu are
+ * taken from its APIC ID fields, see cpu_amd_topology.h.
+ */
+static boolean_t	amd_topo_valid	= FALSE;
+static amd_topology_t	amd_topo;
+
 decl_simple_lock_data(, x86_topo_lock);
  
 static struct cpu_cache {
@@ -166,6 +174,73 @@ x86_LLC_info(void)
 	topoParms.nLCPUsSharingLLC = cpuinfo->thread_count;
 }
 
+/*
+ * Decode the AMD topology leaves on the boot processor.  All logical
+ * cpus report the same field widths, only their APIC IDs differ.
+ */
+static void
+x86_amd_topology_info(void)
+{
+    uint32_t		signature[4], addr_sizes[4], l3[4], ids[4];
+    uint32_t		i;
+
+    if (!IsAmdCPU() || cpuid_info()->cpuid_family < 23 ||
+	cpuid_info()->cpuid_max_ext < AMD_TOPO_LEAF_IDS)
+	return;
+
+    do_cpuid(1, signature);
+    do_cpuid(AMD_TOPO_LEAF_ADDR_SIZES, addr_sizes);
+    do_cpuid(AMD_TOPO_LEAF_IDS, ids);
+
+    for (i = 0; i < MAX_CACHE_DEPTH + 1; i++) {
+	l3[eax] = AMD_TOPO_LEAF_CACHE;
+	l3[ebx] = 0;
+	l3[ecx] = i;
+	l3[edx] = 0;
+	cpuid(l3);
+
+	/* no more caches */
+	if (AMD_TOPO_BITS(l3[eax], 4, 0) == 0)
+	    return;
+	if (AMD_TOPO_BITS(l3[eax], 7, 5) == 3)
+	    break;
+    }
+    if (i == MAX_CACHE_DEPTH + 1)
+	return;
+
+    amd_topo_valid = amd_topo_decode(signature[eax], addr_sizes, l3, ids, &amd_topo);
+
+    TOPO_DBG("\nAMD Topology:\n");
+    TOPO_DBG("\tvalid:               %d\n", amd_topo_valid);
+    TOPO_DBG("\tThreads sharing L3:  %d\n", amd_topo.llc_sharing);
+    TOPO_DBG("\tAPIC shifts:         thread %d L3 %d package %d\n",
+	     amd_topo.thread_shift, amd_topo.llc_shift, amd_topo.pkg_shift);
+}
+
+static uint32_t
+x86_phys_core_num(cpu_data_t *cpup)
+{
+    if (amd_topo_valid)
+	return amd_topo_core_id(&amd_topo, cpup->cpu_phys_number);
+    return cpup->cpu_phys_number / topoParms.nPThreadsPerCore;
+}
+
+static uint32_t
+x86_phys_die_num(cpu_data_t *cpup)
+{
+    if (amd_topo_valid)
+	return amd_topo_llc_id(&amd_topo, cpup->cpu_phys_number);
+    return cpup->cpu_phys_number / topoParms.nPThreadsPerDie;
+}
+
+static uint32_t
+x86_phys_pkg_num(cpu_data_t *cpup)
+{
+    if (amd_topo_valid)
+	return amd_topo_pkg_id(&amd_topo, cpup->cpu_phys_number);
+    return cpup->cpu_phys_number / topoParms.nPThreadsPerPackage;
+}
+
 static void
 initTopoParms(void)
 {
@@ -181,6 +256,7 @@ initTopoParms(void)
      * We need to start with getting the LLC information correct.
      */
     x86_LLC_info();
+    x86_amd_topology_info();
 
     /*
      * Compute the number of threads (logical CPUs) per core.
@@ -377,7 +453,7 @@ x86_core_alloc(int cpu)
 
     bzero((void *) core, sizeof(x86_core_t));
 
-    core->pcore_num = cpup->cpu_phys_number / topoParms.nPThreadsPerCore;
+    core->pcore_num = x86_phys_core_num(cpup);
     core->lcore_num = core->pcore_num % topoParms.nPCoresPerPackage;
 
     core->flags = X86CORE_FL_PRESENT | X86CORE_FL_READY
@@ -404,7 +480,7 @@ x86_package_find(int cpu)
 
     cpup = cpu_datap(cpu);
 
-    pkg_num = cpup->cpu_phys_number / topoParms.nPThreadsPerPackage;
+    pkg_num = x86_phys_pkg_num(cpup);
 
     pkg = x86_pkgs;
     while (pkg != NULL) {
@@ -426,7 +502,7 @@ x86_die_find(int cpu)
 
     cpup = cpu_datap(cpu);
 
-    die_num = cpup->cpu_phys_number / topoParms.nPThreadsPerDie;
+    die_num = x86_phys_die_num(cpup);
 
     pkg = x86_package_find(cpu);
     if (pkg == NULL)
@@ -452,7 +528,7 @@ x86_core_find(int cpu)
 
     cpup = cpu_datap(cpu);
 
-    core_num = cpup->cpu_phys_number / topoParms.nPThreadsPerCore;
+    core_num = x86_phys_core_num(cpup);
 
     die = x86_die_find(cpu);
     if (die == NULL)
@@ -520,7 +596,7 @@ x86_die_alloc(int cpu)
 
     bzero((void *) die, sizeof(x86_die_t));
 
-    die->pdie_num = cpup->cpu_phys_number / topoParms.nPThreadsPerDie;
+    die->pdie_num = x86_phys_die_num(cpup);
 
     die->ldie_num = num_dies;
     atomic_incl((long *) &num_dies, 1);
@@ -562,7 +638,7 @@ x86_package_alloc(int cpu)
 
     bzero((void *) pkg, sizeof(x86_pkg_t));
 
-    pkg->ppkg_num = cpup->cpu_phys_number / topoParms.nPThreadsPerPackage;
+    pkg->ppkg_num = x86_phys_pkg_num(cpup);
 
     pkg->lpkg_num = topoParms.nPackages;
     atomic_incl((long *) &topoParms.nPackages, 1);
@@ -161,6 +161,8 @@ cpu_topology_sort(int ncpus)
 					pset_create(pset_node_root());
 			if (aset->pset == PROCESSOR_SET_NULL)
 				panic("cpu_topology_start: pset_create");
+			/* affinity sets in one package are the cheapest steal victims */
+			aset->pset->pset_domain_id = lcpup->package->lpkg_num;
 			TOPO_DBG("\tnew set %p(%d) pset %p for cache %p\n",
 				aset, aset->num, aset->pset, aset->cache);
 		}
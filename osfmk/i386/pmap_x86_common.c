@@ -47,6 +47,18 @@ void		pmap_remove_range_options(
 			pt_entry_t	*epte,
 			int		options);
 
+static int	pmap_remove_range_freeze(
+			pmap_t		pmap,
+			pt_entry_t	*spte,
+			pt_entry_t	*epte);
+
+static void	pmap_remove_range_release(
+			pmap_t		pmap,
+			vm_map_offset_t	va,
+			pt_entry_t	*spte,
+			pt_entry_t	*epte,
+			int		options);
+
 void		pmap_reusable_range(
 			pmap_t		pmap,
 			vm_map_offset_t	va,
@@ -490,6 +502,7 @@ pmap_enter_options(
 	boolean_t		old_pa_locked;
 	/* 2MiB mappings are confined to x86_64 by VM */
 	boolean_t		superpage = flags & VM_MEM_SUPERPAGE;
+	int			npages = superpage ? SUPERPAGE_NBASEPAGES : 1;
 	vm_object_t		delpage_pm_obj = NULL;
 	uint64_t		delpage_pde_index = 0;
 	pt_entry_t		old_pte;
@@ -556,6 +569,22 @@ Retry:
 			PMAP_LOCK(pmap);
 		}
 	} else {
+		pt_entry_t	*pde = pmap64_pde(pmap, vaddr);
+
+		if (pde != PD_ENTRY_NULL && (*pde & PTE_PS) &&
+		    pmap != kernel_pmap) {
+			vm_map_offset_t	sp_start = vaddr & ~(pde_mapped_size - 1);
+
+			/*
+			 * Entering a base page inside a transparent superpage:
+			 * drop the 2MB mapping, the VM layer faults the rest
+			 * of the range back in 4K at a time.  Other cpus must
+			 * stop using the large translation before the PDE
+			 * turns into a page table pointer.
+			 */
+			pmap_remove_range(pmap, sp_start, pde, pde + 1);
+			PMAP_UPDATE_TLBS(pmap, sp_start, sp_start + pde_mapped_size);
+		}
 		while ((pte = pmap_pte(pmap, vaddr)) == PT_ENTRY_NULL) {
 			/*
 			 * Must unlock to expand the pmap
@@ -959,23 +988,24 @@ dont_update_pte:
 
 		/*
 	         * only count the mapping
-	         * for 'managed memory'
+	         * for 'managed memory'; a superpage
+	         * counts for all of its base pages
 	         */
-		pmap_ledger_credit(pmap, task_ledgers.phys_mem, PAGE_SIZE);
-		OSAddAtomic(+1,  &pmap->stats.resident_count);
+		pmap_ledger_credit(pmap, task_ledgers.phys_mem, ptoa_64(npages));
+		OSAddAtomic(npages,  &pmap->stats.resident_count);
 		if (pmap->stats.resident_count > pmap->stats.resident_max) {
 			pmap->stats.resident_max = pmap->stats.resident_count;
 		}
 		if (pmap != kernel_pmap) {
 			/* update pmap stats */
 			if (IS_REUSABLE_PAGE(pai)) {
-				OSAddAtomic(+1, &pmap->stats.reusable);
+				OSAddAtomic(npages, &pmap->stats.reusable);
 				PMAP_STATS_PEAK(pmap->stats.reusable);
 			} else if (IS_INTERNAL_PAGE(pai)) {
-				OSAddAtomic(+1, &pmap->stats.internal);
+				OSAddAtomic(npages, &pmap->stats.internal);
 				PMAP_STATS_PEAK(pmap->stats.internal);
 			} else {
-				OSAddAtomic(+1, &pmap->stats.external);
+				OSAddAtomic(npages, &pmap->stats.external);
 				PMAP_STATS_PEAK(pmap->stats.external);
 			}
 
@@ -983,8 +1013,8 @@ dont_update_pte:
 			if (is_altacct) {
 				/* internal but also alternate accounting */
 				assert(IS_INTERNAL_PAGE(pai));
-				pmap_ledger_credit(pmap, task_ledgers.internal, PAGE_SIZE);
-				pmap_ledger_credit(pmap, task_ledgers.alternate_accounting, PAGE_SIZE);
+				pmap_ledger_credit(pmap, task_ledgers.internal, ptoa_64(npages));
+				pmap_ledger_credit(pmap, task_ledgers.alternate_accounting, ptoa_64(npages));
 				/* alternate accounting, so not in footprint */
 			} else if (IS_REUSABLE_PAGE(pai)) {
 				assert(!is_altacct);
@@ -994,8 +1024,8 @@ dont_update_pte:
 				assert(!is_altacct);
 				assert(!IS_REUSABLE_PAGE(pai));
 				/* internal: add to footprint */
-				pmap_ledger_credit(pmap, task_ledgers.internal, PAGE_SIZE);
-				pmap_ledger_credit(pmap, task_ledgers.phys_footprint, PAGE_SIZE);
+				pmap_ledger_credit(pmap, task_ledgers.internal, ptoa_64(npages));
+				pmap_ledger_credit(pmap, task_ledgers.phys_footprint, ptoa_64(npages));
 			} else {
 				/* not internal: not in footprint */
 			}
@@ -1151,57 +1181,46 @@ pmap_remove_range_options(
 	pt_entry_t		*spte,
 	pt_entry_t		*epte,
 	int			options)
+{
+	/* invalidate the PTEs first to "freeze" them */
+	if (pmap_remove_range_freeze(pmap, spte, epte)) {
+		/* propagate the invalidates to other CPUs */
+		PMAP_UPDATE_TLBS(pmap, start_vaddr,
+				 start_vaddr + (epte - spte) * PAGE_SIZE_64);
+	}
+	pmap_remove_range_release(pmap, start_vaddr, spte, epte, options);
+}
+
+/*
+ *	First half of pmap_remove_range_options(): clear the valid bit of
+ *	every mapped PTE in the range so that no CPU can establish a new
+ *	translation for it, and drop the wired counts.  Unmanaged pages are
+ *	removed outright.  Returns the number of mappings found; if it is
+ *	non-zero the TLBs must be flushed for the range before calling
+ *	pmap_remove_range_release() on it.
+ *
+ *	The pmap must be locked.
+ */
+static int
+pmap_remove_range_freeze(
+	pmap_t			pmap,
+	pt_entry_t		*spte,
+	pt_entry_t		*epte)
 {
 	pt_entry_t		*cpte;
-	pv_hashed_entry_t       pvh_et = PV_HASHED_ENTRY_NULL;
-	pv_hashed_entry_t       pvh_eh = PV_HASHED_ENTRY_NULL;
-	pv_hashed_entry_t       pvh_e;
-	int			pvh_cnt = 0;
-	int			num_removed, num_unwired, num_found, num_invalid;
-	int			stats_external, stats_internal, stats_reusable;
-	uint64_t		stats_compressed;
-	int			ledgers_internal, ledgers_alt_internal;
-	uint64_t		ledgers_compressed, ledgers_alt_compressed;
+	int			num_unwired, num_found;
 	ppnum_t			pai;
 	pmap_paddr_t		pa;
-	vm_map_offset_t		vaddr;
 	boolean_t		is_ept = is_ept_pmap(pmap);
-	boolean_t		was_altacct;
 
-	num_removed = 0;
 	num_unwired = 0;
 	num_found   = 0;
-	num_invalid = 0;
-	stats_external = 0;
-	stats_internal = 0;
-	stats_reusable = 0;
-	stats_compressed = 0;
-	ledgers_internal = 0;
-	ledgers_compressed = 0;
-	ledgers_alt_internal = 0;
-	ledgers_alt_compressed = 0;
-	/* invalidate the PTEs first to "freeze" them */
-	for (cpte = spte, vaddr = start_vaddr;
-	     cpte < epte;
-	     cpte++, vaddr += PAGE_SIZE_64) {
+	for (cpte = spte; cpte < epte; cpte++) {
 		pt_entry_t p = *cpte;
 
 		pa = pte_to_pa(p);
 		if (pa == 0) {
-			if ((options & PMAP_OPTIONS_REMOVE) &&
-			    (PTE_IS_COMPRESSED(p))) {
-				assert(pmap != kernel_pmap);
-				/* one less "compressed"... */
-				stats_compressed++;
-				ledgers_compressed++;
-				if (p & PTE_COMPRESSED_ALT) {
-					/* ... but it used to be "ALTACCT" */
-					ledgers_alt_compressed++;
-				}
-				/* clear marker(s) */
-				/* XXX probably does not need to be atomic! */
-				pmap_update_pte(cpte, INTEL_PTE_COMPRESSED_MASK, 0);
-			}
+			/* "compressed" markers are cleared on release */
 			continue;
 		}
 		num_found++;
@@ -1220,21 +1239,75 @@ pmap_remove_range_options(
 			continue;
 		}
 
-		if ((p & PTE_VALID_MASK(is_ept)) == 0)
-			num_invalid++;
-
 		/* invalidate the PTE */
 		pmap_update_pte(cpte, PTE_VALID_MASK(is_ept), 0);
 	}
 
-	if (num_found == 0) {
-		/* nothing was changed: we're done */
-	        goto update_counts;
+	if (num_unwired) {
+#if TESTING
+		if (pmap->stats.wired_count < num_unwired)
+		        panic("pmap_remove_range: wired_count");
+#endif
+		PMAP_STATS_ASSERTF((pmap->stats.wired_count >= num_unwired,
+				    "pmap=%p num_unwired=%d stats.wired_count=%d",
+				    pmap, num_unwired, pmap->stats.wired_count));
+		OSAddAtomic(-num_unwired,  &pmap->stats.wired_count);
+		pmap_ledger_debit(pmap, task_ledgers.wired_mem, machine_ptob(num_unwired));
 	}
 
-	/* propagate the invalidates to other CPUs */
+	return num_found;
+}
 
-	PMAP_UPDATE_TLBS(pmap, start_vaddr, vaddr);
+/*
+ *	Second half of pmap_remove_range_options(): with the TLBs flushed,
+ *	take the frozen PTEs off their pv lists, harvest the ref/mod bits,
+ *	clear them and update the pmap stats and ledgers.
+ *
+ *	The pmap must be locked.
+ */
+static void
+pmap_remove_range_release(
+	pmap_t			pmap,
+	vm_map_offset_t		start_vaddr,
+	pt_entry_t		*spte,
+	pt_entry_t		*epte,
+	int			options)
+{
+	pt_entry_t		*cpte;
+	pv_hashed_entry_t       pvh_et = PV_HASHED_ENTRY_NULL;
+	pv_hashed_entry_t       pvh_eh = PV_HASHED_ENTRY_NULL;
+	pv_hashed_entry_t       pvh_e;
+	int			pvh_cnt = 0;
+	int			num_removed;
+	int			stats_external, stats_internal, stats_reusable;
+	uint64_t		stats_compressed;
+	int			ledgers_internal, ledgers_alt_internal;
+	uint64_t		ledgers_compressed, ledgers_alt_compressed;
+	ppnum_t			pai;
+	pmap_paddr_t		pa;
+	vm_map_offset_t		vaddr;
+	boolean_t		is_ept = is_ept_pmap(pmap);
+	boolean_t		was_altacct;
+	int			npages;
+
+	/*
+	 * A single level 2 entry is a superpage (see pmap_remove_options());
+	 * its mapping accounts for all of its base pages.
+	 */
+	if (epte == spte + 1 && pmap64_pde(pmap, start_vaddr) == spte)
+		npages = SUPERPAGE_NBASEPAGES;
+	else
+		npages = 1;
+
+	num_removed = 0;
+	stats_external = 0;
+	stats_internal = 0;
+	stats_reusable = 0;
+	stats_compressed = 0;
+	ledgers_internal = 0;
+	ledgers_compressed = 0;
+	ledgers_alt_internal = 0;
+	ledgers_alt_compressed = 0;
 
 	for (cpte = spte, vaddr = start_vaddr;
 	     cpte < epte;
@@ -1245,8 +1318,8 @@ pmap_remove_range_options(
 		check_pte_for_compressed_marker:
 			/*
 			 * This PTE could have been replaced with a
-			 * "compressed" marker after our first "freeze"
-			 * loop above, so check again.
+			 * "compressed" marker after it was "frozen"
+			 * (or never held anything else), so check.
 			 */
 			if ((options & PMAP_OPTIONS_REMOVE) &&
 			    (PTE_IS_COMPRESSED(*cpte))) {
@@ -1278,21 +1351,21 @@ pmap_remove_range_options(
 		 */
 		pvh_e = pmap_pv_remove(pmap, vaddr, (ppnum_t *) &pai, cpte, &was_altacct);
 
-		num_removed++;
+		num_removed += npages;
 		/* update pmap stats */
 		if (IS_REUSABLE_PAGE(pai)) {
-			stats_reusable++;
+			stats_reusable += npages;
 		} else if (IS_INTERNAL_PAGE(pai)) {
-			stats_internal++;
+			stats_internal += npages;
 		} else {
-			stats_external++;
+			stats_external += npages;
 		}
 		/* update ledgers */
 		if (was_altacct) {
 			/* internal and alternate accounting */
 			assert(IS_INTERNAL_PAGE(pai));
-			ledgers_internal++;
-			ledgers_alt_internal++;
+			ledgers_internal += npages;
+			ledgers_alt_internal += npages;
 		} else if (IS_REUSABLE_PAGE(pai)) {
 			/* internal but reusable */
 			assert(!was_altacct);
@@ -1301,7 +1374,7 @@ pmap_remove_range_options(
 			/* internal */
 			assert(!was_altacct);
 			assert(!IS_REUSABLE_PAGE(pai));
-			ledgers_internal++;
+			ledgers_internal += npages;
 		} else {
 			/* not internal */
 		}
@@ -1338,7 +1411,6 @@ pmap_remove_range_options(
 	if (pvh_eh != PV_HASHED_ENTRY_NULL) {
 		PV_HASHED_FREE_LIST(pvh_eh, pvh_et, pvh_cnt);
 	}
-update_counts:
 	/*
 	 *	Update the counts
 	 */
@@ -1406,16 +1478,6 @@ update_counts:
 						ledgers_alt_compressed)));
 	}
 
-#if TESTING
-	if (pmap->stats.wired_count < num_unwired)
-	        panic("pmap_remove_range: wired_count");
-#endif
-	PMAP_STATS_ASSERTF((pmap->stats.wired_count >= num_unwired,
-			    "pmap=%p num_unwired=%d stats.wired_count=%d",
-			    pmap, num_unwired, pmap->stats.wired_count));
-	OSAddAtomic(-num_unwired,  &pmap->stats.wired_count);
-	pmap_ledger_debit(pmap, task_ledgers.wired_mem, machine_ptob(num_unwired));
-
 	return;
 }
 
@@ -1436,6 +1498,12 @@ pmap_remove(
 	pmap_remove_options(map, s64, e64, PMAP_OPTIONS_REMOVE);
 }
 
+/*
+ * Maximum number of page table pages pmap_remove_options() freezes
+ * before flushing the TLBs for all of them at once.
+ */
+#define PMAP_REMOVE_BATCH	16
+
 void
 pmap_remove_options(
 	pmap_t		map,
@@ -1445,9 +1513,14 @@ pmap_remove_options(
 {
 	pt_entry_t     *pde;
 	pt_entry_t     *spte, *epte;
-	addr64_t        l64;
+	addr64_t        l64, batch_start;
 	uint64_t        deadline;
 	boolean_t	is_ept;
+	int		i, nbatch, num_found;
+	struct {
+		addr64_t	va;
+		pt_entry_t	*spte, *epte;
+	}		batch[PMAP_REMOVE_BATCH];
 
 	pmap_intr_assert();
 
@@ -1497,30 +1570,57 @@ pmap_remove_options(
 	deadline = rdtsc64() + max_preemption_latency_tsc;
 
 	while (s64 < e64) {
-		l64 = (s64 + pde_mapped_size) & ~(pde_mapped_size - 1);
-		if (l64 > e64)
-			l64 = e64;
-		pde = pmap_pde(map, s64);
-
-		if (pde && (*pde & PTE_VALID_MASK(is_ept))) {
-			if (*pde & PTE_PS) {
-				/*
-				 * If we're removing a superpage, pmap_remove_range()
-				 * must work on level 2 instead of level 1; and we're
-				 * only passing a single level 2 entry instead of a
-				 * level 1 range.
-				 */
-				spte = pde;
-				epte = spte+1; /* excluded */
-			} else {
-				spte = pmap_pte(map, (s64 & ~(pde_mapped_size - 1)));
-				spte = &spte[ptenum(s64)];
-				epte = &spte[intel_btop(l64 - s64)];
+		/*
+		 * Freeze up to PMAP_REMOVE_BATCH page table pages worth of
+		 * mappings, shoot them all down with a single TLB flush and
+		 * only then release them: a large or fragmented range
+		 * doesn't pay for one round of IPIs per page table page.
+		 */
+		batch_start = s64;
+		nbatch = 0;
+		num_found = 0;
+		while (s64 < e64 && nbatch < PMAP_REMOVE_BATCH) {
+			l64 = (s64 + pde_mapped_size) & ~(pde_mapped_size - 1);
+			if (l64 > e64)
+				l64 = e64;
+			pde = pmap_pde(map, s64);
+
+			if (pde && (*pde & PTE_VALID_MASK(is_ept))) {
+				if (*pde & PTE_PS) {
+					/*
+					 * If we're removing a superpage, pmap_remove_range()
+					 * must work on level 2 instead of level 1; and we're
+					 * only passing a single level 2 entry instead of a
+					 * level 1 range.
+					 */
+					spte = pde;
+					epte = spte+1; /* excluded */
+				} else {
+					spte = pmap_pte(map, (s64 & ~(pde_mapped_size - 1)));
+					spte = &spte[ptenum(s64)];
+					epte = &spte[intel_btop(l64 - s64)];
+				}
+				num_found += pmap_remove_range_freeze(map, spte, epte);
+				batch[nbatch].va = s64;
+				batch[nbatch].spte = spte;
+				batch[nbatch].epte = epte;
+				nbatch++;
 			}
-			pmap_remove_range_options(map, s64, spte, epte,
+			s64 = l64;
+
+			if (rdtsc64() >= deadline)
+				break;
+		}
+
+		if (num_found) {
+			/* propagate the invalidates to other CPUs */
+			PMAP_UPDATE_TLBS(map, batch_start, s64);
+		}
+		for (i = 0; i < nbatch; i++) {
+			pmap_remove_range_release(map, batch[i].va,
+						  batch[i].spte, batch[i].epte,
 						  options);
 		}
-		s64 = l64;
 
 		if (s64 < e64 && rdtsc64() >= deadline) {
 			PMAP_UNLOCK(map)
@@ -721,6 +721,168 @@ mach_msg_trap(
 }
  
 
+/*
+ *	Routine:	mach_msg_vector_trap [mach trap]
+ *	Purpose:
+ *		Send and/or receive a batch of messages in one trap.
+ *
+ *		With MACH_SEND_MSG, the messages of the vector
+ *		entries are sent in order, stopping at the first
+ *		one that fails.  With MACH_RCV_MSG, messages are
+ *		then received from rcv_name into the buffers of the
+ *		entries, in order.  Only the first receive waits
+ *		(up to the timeout, if any); the following ones
+ *		stop at the first entry that finds the port empty.
+ *		The receive right or port set is looked up once
+ *		for the whole batch.
+ *
+ *		Each entry handled gets the result of its operation
+ *		in msgv_return, and received entries the size of
+ *		their message in msgv_size.
+ *	Conditions:
+ *		Nothing locked.
+ *	Returns:
+ *		MACH_MSG_SUCCESS	All the messages were sent, and
+ *			at least one message received if asked for.
+ *		MACH_SEND_INVALID_DATA	Couldn't access the vector.
+ *		MACH_RCV_INVALID_DATA	Couldn't access the vector.
+ *		All of mach_msg_send and mach_msg_receive error codes.
+ */
+
+mach_msg_return_t
+mach_msg_vector_trap(
+	struct mach_msg_vector_trap_args *args)
+{
+	mach_vm_address_t	vector_addr = args->vector;
+	mach_msg_size_t		count = args->count;
+	mach_msg_option_t	option = args->option;
+	mach_port_name_t	rcv_name = args->rcv_name;
+	mach_msg_timeout_t	msg_timeout = args->timeout;
+
+	mach_msg_return_t  mr = MACH_MSG_SUCCESS;
+	ipc_space_t space = current_space();
+	vm_map_t map = current_map();
+	mach_msg_vector_t vec;
+	mach_vm_address_t entry_addr;
+	mach_msg_size_t i;
+
+	/*
+	 * Only accept options allowed by the user.  Batches don't
+	 * link special reply ports, which is a per-receive affair.
+	 */
+	option &= MACH_MSG_OPTION_USER;
+	option &= ~(MACH_RCV_SYNC_WAIT | MACH_SEND_SYNC_OVERRIDE);
+
+	if (count == 0 || count > MACH_MSG_VECTOR_MAX)
+		return (option & MACH_SEND_MSG) ? MACH_SEND_INVALID_DATA : MACH_RCV_INVALID_DATA;
+
+	if (option & MACH_SEND_MSG) {
+		mach_msg_option_t send_option;
+		ipc_kmsg_t kmsg;
+
+		for (i = 0; i < count; i++) {
+			entry_addr = vector_addr + i * sizeof(vec);
+			if (copyin(entry_addr, (char *)&vec, sizeof(vec)))
+				return MACH_SEND_INVALID_DATA;
+
+			KDBG(MACHDBG_CODE(DBG_MACH_IPC,MACH_IPC_KMSG_INFO) | DBG_FUNC_START);
+
+			/* ipc_kmsg_copyin() may adjust the options of each message */
+			send_option = option;
+			mr = ipc_kmsg_get(vec.msgv_data, vec.msgv_send_size, &kmsg);
+			if (mr == MACH_MSG_SUCCESS) {
+				KERNEL_DEBUG_CONSTANT(MACHDBG_CODE(DBG_MACH_IPC,MACH_IPC_KMSG_LINK) | DBG_FUNC_NONE,
+						      (uintptr_t)vec.msgv_data,
+						      VM_KERNEL_ADDRPERM((uintptr_t)kmsg),
+						      0, 0,
+						      0);
+
+				mr = ipc_kmsg_copyin(kmsg, space, map,
+						     MACH_MSG_PRIORITY_UNSPECIFIED, &send_option);
+				if (mr != MACH_MSG_SUCCESS) {
+					ipc_kmsg_free(kmsg);
+				} else {
+					mr = ipc_kmsg_send(kmsg, send_option, msg_timeout);
+					if (mr != MACH_MSG_SUCCESS) {
+						mr |= ipc_kmsg_copyout_pseudo(kmsg, space, map, MACH_MSG_BODY_NULL);
+						(void) ipc_kmsg_put(kmsg, send_option, vec.msgv_data,
+								    vec.msgv_send_size, 0, NULL);
+					}
+				}
+			}
+			if (mr != MACH_MSG_SUCCESS)
+				KDBG(MACHDBG_CODE(DBG_MACH_IPC,MACH_IPC_KMSG_INFO) | DBG_FUNC_END, mr);
+
+			vec.msgv_return = mr;
+			if (copyout((char *)&vec.msgv_return,
+				    entry_addr + offsetof(mach_msg_vector_t, msgv_return),
+				    sizeof(vec.msgv_return)))
+				return MACH_SEND_INVALID_DATA;
+			if (mr != MACH_MSG_SUCCESS)
+				return mr;
+		}
+	}
+
+	if (option & MACH_RCV_MSG) {
+		thread_t self = current_thread();
+		mach_msg_size_t size;
+		ipc_object_t object;
+		ipc_mqueue_t mqueue;
+
+		mr = ipc_mqueue_copyin(space, rcv_name, &mqueue, &object);
+		if (mr != MACH_MSG_SUCCESS) {
+			return mr;
+		}
+		/* hold ref for object, and take one more per receive */
+
+		for (i = 0; i < count; i++) {
+			entry_addr = vector_addr + i * sizeof(vec);
+			if (copyin(entry_addr, (char *)&vec, sizeof(vec))) {
+				mr = MACH_RCV_INVALID_DATA;
+				break;
+			}
+
+			io_reference(object);
+			self->ith_msg_addr = vec.msgv_data;
+			self->ith_object = object;
+			self->ith_rsize = vec.msgv_rcv_size;
+			self->ith_msize = 0;
+			self->ith_option = option;
+			self->ith_receiver_name = MACH_PORT_NULL;
+			/* block on this stack, the batch goes on after the first receive */
+			self->ith_continuation = NULL;
+			self->ith_knote = ITH_KNOTE_NULL;
+
+			ipc_mqueue_receive(mqueue, option, vec.msgv_rcv_size, msg_timeout, THREAD_ABORTSAFE);
+			size = 0;
+			mr = mach_msg_receive_results(&size);
+
+			vec.msgv_return = mr;
+			vec.msgv_size = size;
+			if (copyout((char *)&vec.msgv_return,
+				    entry_addr + offsetof(mach_msg_vector_t, msgv_return),
+				    sizeof(vec.msgv_return) + sizeof(vec.msgv_size))) {
+				mr = MACH_RCV_INVALID_DATA;
+				break;
+			}
+
+			if (mr != MACH_MSG_SUCCESS) {
+				/* the port was drained by the earlier receives */
+				if (i > 0 && mr == MACH_RCV_TIMED_OUT)
+					mr = MACH_MSG_SUCCESS;
+				break;
+			}
+
+			/* only take the messages already queued from now on */
+			option |= MACH_RCV_TIMEOUT;
+			msg_timeout = 0;
+		}
+		io_release(object);
+	}
+
+	return mr;
+}
+
 /*
  *	Routine:	msg_receive_error	[internal]
  *	Purpose:
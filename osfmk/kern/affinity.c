@@ -29,6 +29,7 @@
 #include <kern/affinity.h>
 #include <kern/task.h>
 #include <kern/kalloc.h>
+#include <kern/processor.h>
 #include <machine/cpu_affinity.h>
 
 /*
@@ -513,11 +514,42 @@ affinity_set_find(affinity_space_t space, uint32_t tag)
 	return NULL;
 }
 
+/*
+ * Return the first unoccupied cpu affinity in the same domain (package)
+ * as the pset of the given affinity set, or num_cpu_asets if none.
+ * Each cpu affinity is an L3 domain on x86, so threads of one task with
+ * different tags still get caches of their own but keep sharing memory
+ * locality with each other.
+ */
+static unsigned int
+affinity_set_domain_vacancy(
+	affinity_set_t	aset,
+	unsigned int	*set_occupancy,
+	unsigned int	num_cpu_asets)
+{
+	processor_set_t	pset;
+	unsigned int	i;
+
+	if (aset->aset_pset == PROCESSOR_SET_NULL)
+		return num_cpu_asets;
+
+	for (i = 0; i < num_cpu_asets; i++) {
+		if (set_occupancy[i] != 0)
+			continue;
+		pset = ml_affinity_to_pset(i);
+		if (pset != PROCESSOR_SET_NULL &&
+		    pset->pset_domain_id == aset->aset_pset->pset_domain_id)
+			return i;
+	}
+	return num_cpu_asets;
+}
+
 /*
  * affinity_set_place() assigns an affinity set to a suitable processor_set.
  * The selection criteria is:
- *  - the set currently occupied by the least number of affinities
- *    belonging to the owning the task.
+ *  - an empty set in the domain of the task's other affinity sets,
+ *  - otherwise the set currently occupied by the least number of
+ *    affinities belonging to the owning the task.
  * The caller must have the space locked.
  */
 static void
@@ -555,6 +587,16 @@ affinity_set_place(affinity_space_t aspc, affinity_set_t new_aset)
 		i_least_occupied = 0;
 	else
 		i_least_occupied = (unsigned int)(((uintptr_t)aspc % 127) % num_cpu_asets);
+
+	if (affinity_sets_mapping != 0 && !queue_empty(&aspc->aspc_affinities)) {
+		aset = (affinity_set_t) queue_first(&aspc->aspc_affinities);
+		i = affinity_set_domain_vacancy(aset, set_occupancy, num_cpu_asets);
+		if (i < num_cpu_asets) {
+			i_least_occupied = i;
+			goto found;
+		}
+	}
+
 	for (i = 0; i < num_cpu_asets; i++) {
 		unsigned int	j = (i_least_occupied + i) % num_cpu_asets;
 		if (set_occupancy[j] == 0) {
@@ -564,6 +606,7 @@ affinity_set_place(affinity_space_t aspc, affinity_set_t new_aset)
 		if (set_occupancy[j] < set_occupancy[i_least_occupied])
 			i_least_occupied = j;
 	}
+found:
 	new_aset->aset_num = i_least_occupied;
 	new_aset->aset_pset = ml_affinity_to_pset(i_least_occupied);
 
@@ -87,6 +87,8 @@
 #include <kern/task.h>
 #include <kern/thread.h>
 
+#include <vm/vm_page.h>
+
 #include <machine/commpage.h>
 
 #if HIBERNATION
@@ -247,6 +249,9 @@ processor_shutdown(
 
 	cpu_exit_wait(processor->cpu_id);
 
+	/* hand the pages it held back for activation to the global queues */
+	vm_page_reactivate_local(processor->cpu_id, TRUE, FALSE);
+
 	return (KERN_SUCCESS);
 }
 
@@ -351,6 +351,7 @@ pset_init(
 	pset->node = node;
 	pset->pset_cluster_type = PSET_SMP;
 	pset->pset_cluster_id = 0;
+	pset->pset_domain_id = 0;
 }
 
 kern_return_t
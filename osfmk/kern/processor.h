@@ -140,6 +140,7 @@ struct processor_set {
 	pset_node_t		node;
 	uint32_t		pset_cluster_id;
 	pset_cluster_type_t	pset_cluster_type;
+	uint32_t		pset_domain_id;		/* psets sharing a package/memory domain */
 };
 
 extern struct processor_set	pset0;
@@ -55,6 +55,15 @@ struct processor_sched_statistics {
 	uint32_t		quantum_timer_expirations;
 };
 
+/* cross-pset work stealing, only ever updated by the processor itself */
+struct processor_steal_statistics {
+	uint64_t		attempts;	/* times this processor went looking */
+	uint64_t		count;		/* attempts that came back with a thread */
+	uint64_t		migrations;	/* count, plus processors kicked to steal too */
+	uint64_t		remote;		/* steals from another domain */
+	uint64_t		abstime;	/* time spent looking, if sched_stats_active */
+};
+
 struct processor_data {
 	/* Processor state statistics */
 	timer_data_t			idle_state;
@@ -93,7 +102,11 @@ struct processor_data {
 	int						start_color;
 	unsigned long			page_grab_count;
 	void					*free_pages;
+	unsigned int			free_pages_count;	/* pages on free_pages */
+	unsigned int			free_pages_refill;	/* next refill batch size */
+	uint64_t				free_pages_refill_time;	/* time of the last refill */
 	struct processor_sched_statistics sched_stats;
+	struct processor_steal_statistics steal_stats;
 	uint64_t	timer_call_ttd; /* current timer call time-to-deadline */
 	uint64_t	wakeups_issued_total; /* Count of thread wakeups issued
 					       * by this processor
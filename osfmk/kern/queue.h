@@ -1030,6 +1030,20 @@ MACRO_END
 /*
  *	Define macros for queues with locks.
  */
+/*
+ *	Timer queues are indexed by a small hierarchical timing wheel,
+ *	maintained by kern/timer_call.c: each slot in use points at the
+ *	latest queued entry whose deadline falls in the slot.
+ */
+#define MPQUEUE_WHEEL_LEVELS	5
+#define MPQUEUE_WHEEL_SLOT_BITS	6
+#define MPQUEUE_WHEEL_SLOTS	(1 << MPQUEUE_WHEEL_SLOT_BITS)
+
+struct mpqueue_wheel_slot {
+	queue_entry_t		last;		/* latest entry in the slot */
+	uint64_t		key;		/* deadline of the entries, in slots */
+};
+
 struct mpqueue_head {
 	struct queue_entry	head;		/* header for queue */
 	uint64_t		earliest_soft_deadline;
@@ -1038,6 +1052,8 @@ struct mpqueue_head {
 #if defined(__i386__) || defined(__x86_64__)
 	lck_mtx_ext_t		lock_data_ext;
 #endif
+	uint64_t		wheel_map[MPQUEUE_WHEEL_LEVELS];	/* slots in use */
+	struct mpqueue_wheel_slot wheel[MPQUEUE_WHEEL_LEVELS][MPQUEUE_WHEEL_SLOTS];
 };
 
 typedef struct mpqueue_head	mpqueue_head_t;
@@ -1056,6 +1072,7 @@ MACRO_BEGIN						\
 			 lck_attr);			\
 	(q)->earliest_soft_deadline = UINT64_MAX;	\
 	(q)->count = 0;					\
+	bzero((q)->wheel_map, sizeof((q)->wheel_map));	\
 MACRO_END
 
 #else
@@ -1066,6 +1083,7 @@ MACRO_BEGIN						\
         lck_mtx_init(&(q)->lock_data,			\
 		      lck_grp,				\
 		      lck_attr);			\
+	bzero((q)->wheel_map, sizeof((q)->wheel_map));	\
 MACRO_END
 #endif
 
@@ -34,6 +34,7 @@
 #include <machine/machine_cpu.h>
 
 #include <kern/kern_types.h>
+#include <kern/clock.h>
 #include <kern/debug.h>
 #include <kern/machine.h>
 #include <kern/misc_protos.h>
@@ -46,6 +47,7 @@
 
 #include <sys/kdebug.h>
 
+
 static void
 sched_dualq_init(void);
 
@@ -383,32 +385,162 @@ sched_dualq_processor_queue_remove(
 	return (processor != PROCESSOR_NULL);
 }
 
+/*
+ * Pick the pset to steal from: the most loaded pset (by its
+ * load average per online processor) that has work queued,
+ * preferring psets in our own domain so that stolen threads
+ * stay close to their caches and memory.
+ *
+ * The counts are read without the pset locks; the caller
+ * re-checks the victim once it is locked.
+ */
+static processor_set_t
+sched_dualq_steal_victim(processor_set_t pset)
+{
+	processor_set_t cset, victim = PROCESSOR_SET_NULL;
+	boolean_t       local, victim_local = FALSE;
+	int             load, victim_load = 0;
+
+	for (cset = next_pset(pset); cset != pset; cset = next_pset(cset)) {
+		if (cset->pset_runq.count == 0)
+			continue;
+
+		local = (cset->pset_domain_id == pset->pset_domain_id);
+		if (victim_local && !local)
+			continue;
+
+		load = cset->load_average / MAX(cset->online_processor_count, 1);
+
+		if (victim == PROCESSOR_SET_NULL || (local && !victim_local) || load > victim_load) {
+			victim = cset;
+			victim_load = load;
+			victim_local = local;
+		}
+	}
+
+	return (victim);
+}
+
+/*
+ * Bring an idle processor in pset out of idle with nothing to run, so
+ * that it goes through thread_select() and steals a thread of its own.
+ * The IPI is left for the caller to send once pset is unlocked.
+ *
+ * pset is locked and has an idle processor.
+ */
+static processor_t
+sched_dualq_steal_kick(processor_set_t pset, sched_ipi_type_t *ipi_type)
+{
+	processor_t processor;
+
+	assert(!queue_empty(&pset->idle_queue));
+	processor = qe_queue_first(&pset->idle_queue, struct processor, processor_queue);
+
+	re_queue_tail(&pset->active_queue, &processor->processor_queue);
+	pset->active_processor_count++;
+
+	processor->next_thread = THREAD_NULL;
+	processor_state_update_idle(processor);
+	processor->deadline = UINT64_MAX;
+	processor->state = PROCESSOR_DISPATCHING;
+
+	*ipi_type = sched_ipi_action(processor, THREAD_NULL, TRUE, SCHED_IPI_EVENT_REBALANCE);
+
+	return (processor);
+}
+
+/* bounds the on-stack kick list, sched_steal_batch_max is clamped to it */
+#define SCHED_DUALQ_STEAL_BATCH_LIMIT	16
+
+/* how often to pick another victim when the chosen one drained meanwhile */
+#define SCHED_DUALQ_STEAL_RETRIES	3
+
+/*
+ * Called with pset locked by an idle processor, returns with it
+ * unlocked.  Steals one thread from the pset picked by
+ * sched_dualq_steal_victim() for the caller.
+ *
+ * Only the thread handed back changes run queues here: it leaves the
+ * victim with runq == PROCESSOR_NULL, which is all
+ * thread_run_queue_remove() expects to race with, and the caller's
+ * thread lock keeps us from locking any other thread.  For up to half
+ * of the victim's remaining backlog, other idle processors of pset are
+ * kicked out of idle instead, to steal a thread each the same way.
+ */
 static thread_t
 sched_dualq_steal_thread(processor_set_t pset)
 {
-	processor_set_t nset, cset = pset;
-	thread_t        thread;
+	processor_set_t  victim;
+	processor_t      processor = current_processor();
+	processor_t      kicked[SCHED_DUALQ_STEAL_BATCH_LIMIT];
+	sched_ipi_type_t ipi_types[SCHED_DUALQ_STEAL_BATCH_LIMIT];
+	struct processor_steal_statistics *stats;
+	thread_t         thread = THREAD_NULL;
+	uint64_t         ctime = 0;
+	int              batch, nkicked = 0, tries = 0, i;
+
+	if (pset->pset_runq.count > 0) {
+		thread = run_queue_dequeue(&pset->pset_runq, SCHED_HEADQ);
+		pset_unlock(pset);
+		return (thread);
+	}
 
-	do {
-		if (cset->pset_runq.count > 0) {
-			thread = run_queue_dequeue(&cset->pset_runq, SCHED_HEADQ);
-			pset_unlock(cset);
-			return (thread);
+	pset_unlock(pset);
+
+	stats = &PROCESSOR_DATA(processor, steal_stats);
+	if (__improbable(sched_stats_active))
+		ctime = mach_absolute_time();
+
+	while (tries++ < SCHED_DUALQ_STEAL_RETRIES &&
+	       (victim = sched_dualq_steal_victim(pset)) != PROCESSOR_SET_NULL) {
+		/* psets are otherwise only ever locked one at a time */
+		if (pset < victim) {
+			pset_lock(pset);
+			pset_lock(victim);
+		} else {
+			pset_lock(victim);
+			pset_lock(pset);
+		}
+
+		if (victim->pset_runq.count == 0) {
+			pset_unlock(victim);
+			pset_unlock(pset);
+			continue;
 		}
 
-		nset = next_pset(cset);
+		thread = run_queue_dequeue(&victim->pset_runq, SCHED_HEADQ);
 
-		if (nset != pset) {
-			pset_unlock(cset);
+		batch = MIN(sched_steal_batch_max, SCHED_DUALQ_STEAL_BATCH_LIMIT);
+		batch = MIN((victim->pset_runq.count + 1) / 2, batch - 1);
 
-			cset = nset;
-			pset_lock(cset);
+		while (nkicked < batch && !queue_empty(&pset->idle_queue)) {
+			kicked[nkicked] = sched_dualq_steal_kick(pset, &ipi_types[nkicked]);
+			nkicked++;
 		}
-	} while (nset != pset);
 
-	pset_unlock(cset);
+		sched_update_pset_load_average(victim);
+		sched_update_pset_load_average(pset);
+
+		pset_unlock(victim);
+		pset_unlock(pset);
+
+		if (victim->pset_domain_id != pset->pset_domain_id)
+			stats->remote++;
+		break;
+	}
+
+	for (i = 0; i < nkicked; i++)
+		sched_ipi_perform(kicked[i], ipi_types[i]);
+
+	stats->attempts++;
+	if (thread != THREAD_NULL) {
+		stats->count++;
+		stats->migrations += 1 + nkicked;
+	}
+	if (__improbable(sched_stats_active) && ctime != 0)
+		stats->abstime += mach_absolute_time() - ctime;
 
-	return (THREAD_NULL);
+	return (thread);
 }
 
 static void
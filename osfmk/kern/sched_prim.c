@@ -1491,6 +1491,30 @@ thread_wakeup_identify(event_t  event,
 	return waitq_wakeup64_identify(wq, CAST_EVENT64_T(event), THREAD_AWAKENED, priority);
 }
 
+/*
+ * Move up to 'max' threads waiting on an event over to another event,
+ * without waking them.  'cb' is called, with the thread locked, for
+ * each thread moved.
+ *
+ * Returns the number of threads moved.
+ */
+int
+thread_requeue(event_t  event,
+               event_t  new_event,
+               int      max,
+               void     (*cb)(void *ctx, thread_t thread),
+               void     *ctx)
+{
+	if (__improbable(event == NO_EVENT || new_event == NO_EVENT))
+		panic("%s() called with NO_EVENT", __func__);
+
+	struct waitq *wq = global_eventq(event);
+	struct waitq *new_wq = global_eventq(new_event);
+
+	return waitq_requeue64(wq, CAST_EVENT64_T(event),
+	                       new_wq, CAST_EVENT64_T(new_event), max, cb, ctx);
+}
+
 /*
  *	thread_bind:
  *
@@ -1719,6 +1743,45 @@ sched_vm_group_maintenance(void)
 int sched_smt_balance = 1;
 #endif
 
+int		sched_steal_batch_max = 8;
+
+uint64_t
+sched_steal_statistics(int which)
+{
+	processor_t processor;
+	struct processor_steal_statistics *stats;
+	uint64_t sum = 0;
+
+	simple_lock(&processor_list_lock);
+
+	for (processor = processor_list; processor != PROCESSOR_NULL;
+	     processor = processor->processor_list) {
+		stats = &PROCESSOR_DATA(processor, steal_stats);
+
+		switch (which) {
+		case SCHED_STEAL_ATTEMPTS:
+			sum += stats->attempts;
+			break;
+		case SCHED_STEAL_COUNT:
+			sum += stats->count;
+			break;
+		case SCHED_STEAL_MIGRATIONS:
+			sum += stats->migrations;
+			break;
+		case SCHED_STEAL_REMOTE:
+			sum += stats->remote;
+			break;
+		case SCHED_STEAL_ABSTIME:
+			sum += stats->abstime;
+			break;
+		}
+	}
+
+	simple_unlock(&processor_list_lock);
+
+	return (sum);
+}
+
 #if __SMP__
 /* Invoked with pset locked, returns with pset unlocked */
 void
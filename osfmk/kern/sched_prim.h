@@ -441,6 +441,8 @@ extern perfcontrol_class_t thread_get_perfcontrol_class(
 extern int sched_get_pset_load_average(processor_set_t pset);
 extern void sched_update_pset_load_average(processor_set_t pset);
 
+extern int	sched_steal_batch_max;	/* most processors one steal sets stealing */
+
 /* Generic routine for Non-AMP schedulers to calculate parallelism */
 extern uint32_t sched_qos_max_parallelism(int qos, uint64_t options);
 
@@ -478,6 +480,19 @@ extern char sched_string[SCHED_STRING_MAX_LENGTH];
 
 extern thread_t port_name_to_thread_for_ulock(mach_port_name_t	thread_name);
 
+/*
+ * Cross-pset work stealing statistics, kept per processor by schedulers
+ * that steal and exported through the kern.sched_steal_* sysctls.
+ */
+#define SCHED_STEAL_ATTEMPTS	0
+#define SCHED_STEAL_COUNT	1
+#define SCHED_STEAL_MIGRATIONS	2
+#define SCHED_STEAL_REMOTE	3
+#define SCHED_STEAL_ABSTIME	4
+
+/* Sum one of the above over all processors */
+extern uint64_t	sched_steal_statistics(int which);
+
 /* Attempt to context switch to a specific runnable thread */
 extern wait_result_t thread_handoff(thread_t thread);
 
@@ -487,6 +502,10 @@ extern kern_return_t thread_wakeup_one_with_pri(event_t event, int priority);
 
 extern thread_t thread_wakeup_identify(event_t event, int priority);
 
+/* Move threads waiting on an event to another event without waking them */
+extern int thread_requeue(event_t event, event_t new_event, int max,
+                          void (*cb)(void *ctx, thread_t thread), void *ctx);
+
 #endif	/* XNU_KERNEL_PRIVATE */
 
 #ifdef KERNEL_PRIVATE
@@ -440,6 +440,15 @@ struct thread {
 		struct task				*task;
 		vm_map_t				map;
 
+		/* last entry vm_map_lookup_locked() found for this thread */
+		struct vm_map_lookup_hint {
+			uint64_t			serial;		/* map->map_serial */
+			uint64_t			generation;	/* map->map_generation when saved */
+			vm_map_offset_t			start;
+			vm_map_offset_t			end;
+			struct vm_map_entry		*entry;
+		} map_lookup_hint;
+
 		decl_lck_mtx_data(,mutex)
 
 
@@ -37,6 +37,7 @@
 #include <kern/timer_call.h>
 #include <kern/timer_queue.h>
 #include <kern/call_entry.h>
+#include <kern/bits.h>
 #include <kern/thread.h>
 #include <kern/policy_internal.h>
 
@@ -278,6 +279,178 @@ timer_call_setup(
 	simple_lock_init(&(call)->lock, 0);
 	call->async_dequeue = FALSE;
 }
+
+/*
+ * Timer queues are kept sorted by deadline: expiry, coalescing, migration
+ * and the longterm scan all rely on that.  So that arming a timer on a
+ * queue holding many of them doesn't walk the list, each queue carries a
+ * hierarchical timing wheel indexing it.  A slot at level n covers
+ * 2^TIMER_WHEEL_SHIFT(n) units of absolute time, MPQUEUE_WHEEL_SLOTS of
+ * them make up one slot of level n+1, and a slot in use points at the
+ * latest entry whose deadline falls in it.  An insertion starts from the
+ * nearest slot at or before its deadline and only walks the entries
+ * sharing its finest slot; a removal only fixes up the slots pointing at
+ * the entry.  The wheel is an index, not the queue: when ranges collide
+ * on a slot, it goes to the one last armed in, and entries in the others
+ * are found by walking from a coarser slot.  That makes for longer walks,
+ * never for a misplaced entry.
+ *
+ * With a nanosecond timebase the levels' slots are 16us, 1ms, 67ms, 4.3s
+ * and 275s wide.
+ *
+ * Must be called with the queue locked.
+ */
+#define TIMER_WHEEL_SHIFT(level)	(14 + (level) * MPQUEUE_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_SLOT(key)		((int)((key) & (MPQUEUE_WHEEL_SLOTS - 1)))
+
+static __inline__ void
+timer_queue_wheel_insert(
+	mpqueue_head_t		*queue,
+	call_entry_t		entry)
+{
+	struct mpqueue_wheel_slot	*slot;
+	uint64_t			key;
+	int				level, index;
+
+	for (level = 0; level < MPQUEUE_WHEEL_LEVELS; level++) {
+		key = entry->deadline >> TIMER_WHEEL_SHIFT(level);
+		index = TIMER_WHEEL_SLOT(key);
+		slot = &queue->wheel[level][index];
+
+		if (!bit_test(queue->wheel_map[level], index) || slot->key != key ||
+		    CE(slot->last)->deadline <= entry->deadline) {
+			bit_set(queue->wheel_map[level], index);
+			slot->key = key;
+			slot->last = qe(entry);
+		}
+	}
+}
+
+/* Called before the entry is unlinked from the queue */
+static __inline__ void
+timer_queue_wheel_remove(
+	mpqueue_head_t		*queue,
+	call_entry_t		entry)
+{
+	struct mpqueue_wheel_slot	*slot;
+	queue_entry_t			prev = queue_prev(qe(entry));
+	uint64_t			key;
+	int				level, index;
+
+	for (level = 0; level < MPQUEUE_WHEEL_LEVELS; level++) {
+		key = entry->deadline >> TIMER_WHEEL_SHIFT(level);
+		index = TIMER_WHEEL_SLOT(key);
+		slot = &queue->wheel[level][index];
+
+		if (!bit_test(queue->wheel_map[level], index) || slot->last != qe(entry))
+			continue;
+		if (!queue_end(&queue->head, prev) &&
+		    (CE(prev)->deadline >> TIMER_WHEEL_SHIFT(level)) == key)
+			slot->last = prev;
+		else
+			bit_clear(queue->wheel_map[level], index);
+	}
+}
+
+/*
+ * Returns the entry a new entry with this deadline is inserted after:
+ * the latest one with an earlier or equal deadline, or the queue head.
+ */
+static __inline__ queue_entry_t
+timer_queue_wheel_find(
+	mpqueue_head_t		*queue,
+	uint64_t		deadline)
+{
+	struct mpqueue_wheel_slot	*slot;
+	queue_entry_t			head = &queue->head, start = head, next;
+	uint64_t			key, map;
+	int				level, index;
+
+	if (queue_empty(head))
+		return (head);
+
+	/* Timers are usually armed beyond everything already queued */
+	if (CE(queue_last(head))->deadline <= deadline)
+		return (queue_last(head));
+
+	for (level = 0; level < MPQUEUE_WHEEL_LEVELS && start == head; level++) {
+		key = deadline >> TIMER_WHEEL_SHIFT(level);
+		index = TIMER_WHEEL_SLOT(key);
+		map = queue->wheel_map[level];
+		slot = &queue->wheel[level][index];
+
+		/*
+		 * The deadline's own slot; at coarser levels it's only
+		 * useful if we don't have to walk back through it.
+		 */
+		if (bit_test(map, index) && slot->key == key &&
+		    (level == 0 || CE(slot->last)->deadline <= deadline)) {
+			start = slot->last;
+			break;
+		}
+
+		/* Else the latest earlier slot within the same coarser slot */
+		map &= mask(index);
+		while ((index = bit_first(map)) >= 0) {
+			slot = &queue->wheel[level][index];
+			if (slot->key == ((key & ~(uint64_t)(MPQUEUE_WHEEL_SLOTS - 1)) | (uint64_t)index)) {
+				start = slot->last;
+				break;
+			}
+			bit_clear(map, index);
+		}
+	}
+
+	if (start != head && CE(start)->deadline > deadline) {
+		do {
+			start = queue_prev(start);
+		} while (!queue_end(head, start) && CE(start)->deadline > deadline);
+		return (start);
+	}
+
+	while (!queue_end(head, (next = queue_next(start))) && CE(next)->deadline <= deadline)
+		start = next;
+
+	return (start);
+}
+
+/*
+ * Equivalents of call_entry_enqueue_deadline() and call_entry_dequeue()
+ * for timer queues, keeping the wheel up to date.
+ */
+static __inline__ void
+timer_queue_entry_enqueue_deadline(
+	call_entry_t		entry,
+	mpqueue_head_t		*queue,
+	uint64_t		deadline)
+{
+	mpqueue_head_t	*old_queue = MPQUEUE(entry->queue);
+
+	if (old_queue == queue && entry->deadline == deadline)
+		return;
+
+	if (old_queue != NULL) {
+		timer_queue_wheel_remove(old_queue, entry);
+		(void)remque(qe(entry));
+	}
+
+	insque(qe(entry), timer_queue_wheel_find(queue, deadline));
+	entry->queue = QUEUE(queue);
+	entry->deadline = deadline;
+
+	timer_queue_wheel_insert(queue, entry);
+}
+
+static __inline__ void
+timer_queue_entry_dequeue(
+	call_entry_t		entry)
+{
+	if (entry->queue != NULL) {
+		timer_queue_wheel_remove(MPQUEUE(entry->queue), entry);
+		call_entry_dequeue(entry);
+	}
+}
+
 #if TIMER_ASSERT
 static __inline__ mpqueue_head_t *
 timer_call_entry_dequeue(
@@ -297,7 +470,7 @@ timer_call_entry_dequeue(
 		panic("_call_entry_dequeue() "
 			"queue %p is not locked\n", old_queue);
 
-	call_entry_dequeue(TCE(entry));
+	timer_queue_entry_dequeue(TCE(entry));
 	old_queue->count--;
 
 	return (old_queue);
@@ -322,7 +495,7 @@ timer_call_entry_enqueue_deadline(
 		panic("_call_entry_enqueue_deadline() "
 			"old_queue %p != queue", old_queue);
 
-	call_entry_enqueue_deadline(TCE(entry), QUEUE(queue), deadline);
+	timer_queue_entry_enqueue_deadline(TCE(entry), queue, deadline);
 
 /* For efficiency, track the earliest soft deadline on the queue, so that
  * fuzzy decisions can be made without lock acquisitions.
@@ -346,7 +519,7 @@ timer_call_entry_dequeue(
 {
 	mpqueue_head_t	*old_queue = MPQUEUE(TCE(entry)->queue);
 
-	call_entry_dequeue(TCE(entry));
+	timer_queue_entry_dequeue(TCE(entry));
 	old_queue->count--;
 
 	return old_queue;
@@ -360,7 +533,7 @@ timer_call_entry_enqueue_deadline(
 {
 	mpqueue_head_t	*old_queue = MPQUEUE(TCE(entry)->queue);
 
-	call_entry_enqueue_deadline(TCE(entry), QUEUE(queue), deadline);
+	timer_queue_entry_enqueue_deadline(TCE(entry), queue, deadline);
 
 	/* For efficiency, track the earliest soft deadline on the queue,
 	 * so that fuzzy decisions can be made without lock acquisitions.
@@ -399,6 +572,7 @@ timer_call_entry_dequeue_async(
 	mpqueue_head_t	*old_queue = MPQUEUE(TCE(entry)->queue);
 	if (old_queue) {
 		old_queue->count--;
+		timer_queue_wheel_remove(old_queue, TCE(entry));
 		(void) remque(qe(entry));
 		entry->async_dequeue = TRUE;
 	}
@@ -574,7 +748,8 @@ past_deadline_timer_handle(uint64_t deadline, uint64_t ctime)
 /*
  * Inlines timer_call_entry_dequeue() and timer_call_entry_enqueue_deadline()
  * cast between pointer types (mpqueue_head_t *) and (queue_t) so that
- * we can use the call_entry_dequeue() and call_entry_enqueue_deadline()
+ * we can use the timer_queue_entry_dequeue() and
+ * timer_queue_entry_enqueue_deadline()
  * methods to operate on timer_call structs as if they are call_entry structs.
  * These structures are identical except for their queue head pointer fields.
  *
@@ -5102,3 +5102,115 @@ waitq_wakeup64_identify(struct waitq    *waitq,
 	return thread;
 }
 
+
+/**
+ * move up to 'max' threads waiting on <waitq,event> over to
+ * <dst_waitq,dst_event> without waking them up
+ *
+ * Conditions:
+ *	'waitq' and 'dst_waitq' are irq-safe (e.g. global event queues)
+ *	neither waitq is locked
+ *	may disable and re-enable interrupts
+ *
+ * Notes:
+ *	'cb' (if non-NULL) is called for each thread moved, with the thread
+ *	locked, so that callers can update their per-thread wait state.
+ *	A 'max' of -1 moves all matching threads.
+ *
+ *	Returns the number of threads moved.
+ */
+int
+waitq_requeue64(struct waitq    *waitq,
+                event64_t       event,
+                struct waitq    *dst_waitq,
+                event64_t       dst_event,
+                int             max,
+                void            (*cb)(void *ctx, thread_t thread),
+                void            *ctx)
+{
+	uint32_t remaining_eventmask = 0;
+	thread_t thread;
+	int nmoved = 0;
+	spl_t s;
+
+	if (!waitq_valid(waitq))
+		panic("Invalid waitq: %p", waitq);
+	if (!waitq_valid(dst_waitq))
+		panic("Invalid waitq: %p", dst_waitq);
+	if (!waitq_irq_safe(waitq) || !waitq_irq_safe(dst_waitq))
+		panic("waitq_requeue64 on a non irq-safe waitq: %p -> %p",
+		      waitq, dst_waitq);
+
+	if (max == 0 || (waitq == dst_waitq && event == dst_event))
+		return 0;
+
+	s = splsched();
+
+	/* take both locks in address order */
+	if (waitq == dst_waitq) {
+		waitq_lock(waitq);
+	} else if (waitq < dst_waitq) {
+		waitq_lock(waitq);
+		waitq_lock(dst_waitq);
+	} else {
+		waitq_lock(dst_waitq);
+		waitq_lock(waitq);
+	}
+
+	if (!waitq_is_global(waitq) ||
+	    (waitq->waitq_eventmask & _CAST_TO_EVENT_MASK(event)) ==
+	    _CAST_TO_EVENT_MASK(event)) {
+
+		qe_foreach_element_safe(thread, &waitq->waitq_queue, wait_links) {
+			assert_thread_magic(thread);
+
+			if (thread->waitq != waitq || thread->wait_event != event ||
+			    (max > 0 && nmoved >= max)) {
+				remaining_eventmask |= (thread->waitq != waitq) ?
+				    _CAST_TO_EVENT_MASK(thread->waitq):
+				    _CAST_TO_EVENT_MASK(thread->wait_event);
+				continue;
+			}
+
+			thread_lock(thread);
+
+			if (dst_waitq != waitq) {
+				remqueue(&thread->wait_links);
+				enqueue_tail(&dst_waitq->waitq_queue, &thread->wait_links);
+			}
+			thread->waitq = dst_waitq;
+			thread->wait_event = dst_event;
+
+			if (cb)
+				cb(ctx, thread);
+
+			thread_unlock(thread);
+			nmoved++;
+		}
+
+		if (waitq_is_global(waitq)) {
+			if (queue_empty(&waitq->waitq_queue))
+				waitq->waitq_eventmask = 0;
+			else
+				waitq->waitq_eventmask = remaining_eventmask;
+		}
+
+		if (nmoved > 0 && waitq_is_global(dst_waitq))
+			dst_waitq->waitq_eventmask |= _CAST_TO_EVENT_MASK(dst_event);
+	}
+
+	/*
+	 * When both events hash to the same queue the moved threads are
+	 * still on it: put their (new) event back in the mask.
+	 */
+	if (waitq == dst_waitq && nmoved > 0 && waitq_is_global(waitq))
+		waitq->waitq_eventmask |= _CAST_TO_EVENT_MASK(dst_event);
+
+	if (waitq != dst_waitq)
+		waitq_unlock(dst_waitq);
+	waitq_unlock(waitq);
+
+	splx(s);
+
+	return nmoved;
+}
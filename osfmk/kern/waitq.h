@@ -531,6 +531,15 @@ waitq_wakeup64_identify(struct waitq    *waitq,
                         wait_result_t   result,
                         int             priority);
 
+/* move threads waiting on <waitq,event64> to <dst_waitq,dst_event> */
+extern int waitq_requeue64(struct waitq *waitq,
+			   event64_t event,
+			   struct waitq *dst_waitq,
+			   event64_t dst_event,
+			   int max,
+			   void (*cb)(void *ctx, thread_t thread),
+			   void *ctx);
+
 /* take the waitq lock */
 extern void waitq_unlock(struct waitq *wq);
 
@@ -113,6 +113,13 @@ extern mach_msg_return_t mach_msg_overwrite_trap(
 				mach_msg_header_t *rcv_msg,
 				mach_msg_size_t rcv_limit);
 
+extern mach_msg_return_t mach_msg_vector_trap(
+				mach_msg_vector_t *vector,
+				mach_msg_size_t count,
+				mach_msg_option_t option,
+				mach_port_name_t rcv_name,
+				mach_msg_timeout_t timeout);
+
 extern kern_return_t semaphore_signal_trap(
 				mach_port_name_t signal_name);
 					      
@@ -423,6 +430,16 @@ extern mach_msg_return_t mach_msg_trap(
 extern mach_msg_return_t mach_msg_overwrite_trap(
 				struct mach_msg_overwrite_trap_args *args);
 
+struct mach_msg_vector_trap_args {
+	PAD_ARG_(user_addr_t, vector);
+	PAD_ARG_(mach_msg_size_t, count);
+	PAD_ARG_(mach_msg_option_t, option);
+	PAD_ARG_(mach_port_name_t, rcv_name);
+	PAD_ARG_(mach_msg_timeout_t, timeout);
+};
+extern mach_msg_return_t mach_msg_vector_trap(
+				struct mach_msg_vector_trap_args *args);
+
 struct semaphore_signal_trap_args {
 	PAD_ARG_(mach_port_name_t, signal_name);
 };
@@ -951,6 +951,23 @@ typedef kern_return_t mach_msg_return_t;
                 /* Waiting for a peek. (Internal use only.) */
 #endif
 
+#ifdef PRIVATE
+/*
+ *  Entries of the vector passed to mach_msg_vector_trap: the messages
+ *  to send, or the buffers to receive messages into, and the result of
+ *  the operation on each.  The layout is the same for all ABIs.
+ */
+typedef struct {
+	uint64_t		msgv_data;	/* address of the message buffer */
+	mach_msg_size_t		msgv_send_size;	/* size of the message to send */
+	mach_msg_size_t		msgv_rcv_size;	/* size of the receive buffer */
+	mach_msg_return_t	msgv_return;	/* out: result for this entry */
+	mach_msg_size_t		msgv_size;	/* out: size of the received message */
+} mach_msg_vector_t;
+
+#define MACH_MSG_VECTOR_MAX	64	/* entries handled per trap */
+#endif /* PRIVATE */
+
 
 __BEGIN_DECLS
 
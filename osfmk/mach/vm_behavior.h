@@ -75,5 +75,9 @@ typedef int		vm_behavior_t;
 #define VM_BEHAVIOR_REUSE	((vm_behavior_t) 9)
 #define VM_BEHAVIOR_CAN_REUSE	((vm_behavior_t) 10)
 #define VM_BEHAVIOR_PAGEOUT	((vm_behavior_t) 11)
+#define VM_BEHAVIOR_SUPERPAGE	((vm_behavior_t) 12)	/* may use transparent superpages */
+#define VM_BEHAVIOR_NOSUPERPAGE	((vm_behavior_t) 13)	/* no transparent superpages */
+#define VM_BEHAVIOR_FAULTAROUND	((vm_behavior_t) 14)	/* map resident neighbors on fault (whole map) */
+#define VM_BEHAVIOR_NOFAULTAROUND	((vm_behavior_t) 15)	/* map only the faulting page (whole map) */
 
 #endif	/*_MACH_VM_BEHAVIOR_H_*/
@@ -162,6 +162,33 @@ struct c_sv_hash_entry {
 #define C_SV_CSEG_ID		((1 << 22) - 1)
 
 
+/*
+ * Pages whose compressed data is identical to that of other pages
+ * (forked processes, duplicated buffers...) share a single refcounted
+ * copy of it, kept in a small hash table outside of the c_segments.
+ * An entry is only seeded with the hash of the data the first time it
+ * is seen; the next page with the same hash gets the data copied out of
+ * line, and all the ones after that which really match it (the data is
+ * compared, not just the hash) map to the entry instead of a c_slot.
+ * Since the shared copy never lives in a c_segment, compaction, swapping
+ * and relocation of the segments never have to deal with it.
+ * An entry that no page maps to (its data was copied out but never
+ * shared, or all its sharers went away) can be evicted at any time.
+ */
+struct c_dd_entry {
+	uint32_t	dd_hash;	/* 0 if the entry was never used */
+	uint32_t	dd_size;	/* c_size of the shared data */
+	uint32_t	dd_ref;		/* slot mappings pointing at us */
+	boolean_t	dd_promoting;	/* dd_data being set up */
+	char		*dd_data;	/* shared data, NULL if just a hint */
+};
+
+#define C_DD_HASH_MAX_MISS	16
+#define C_DD_HASH_SIZE		((1 << 10))
+#define C_DD_HASH_MASK		((1 << 10) - 1)
+#define C_DD_CSEG_ID		((1 << 22) - 2)
+
+
 union c_segu {
 	c_segment_t	c_seg;
 	uintptr_t	c_segno;
@@ -306,6 +333,23 @@ int64_t		compressor_bytes_used __attribute__((aligned(8))) = 0;
 
 struct c_sv_hash_entry c_segment_sv_hash_table[C_SV_HASH_SIZE]  __attribute__ ((aligned (8)));
 
+struct c_dd_entry c_segment_dd_hash_table[C_DD_HASH_SIZE];
+lck_mtx_t	*c_dd_lock;
+
+boolean_t	vm_compressor_dedup_enabled = TRUE;
+uint32_t	vm_compressor_dedup_max_bytes = 16 * 1024 * 1024;
+
+/* protected by c_dd_lock */
+uint32_t	c_segment_dd_pages;		/* slot mappings into the table */
+uint32_t	c_segment_dd_entries;		/* entries holding shared data */
+uint64_t	c_segment_dd_bytes;		/* shared data allocated */
+int64_t		c_segment_dd_bytes_saved;	/* vs. a c_slot per page */
+uint64_t	c_segment_dd_hits;
+uint64_t	c_segment_dd_collisions;
+uint64_t	c_segment_dd_promotions;
+uint64_t	c_segment_dd_evictions;		/* unshared data reclaimed */
+static int	c_segment_dd_hand;		/* clock hand of the evictions */
+
 static boolean_t compressor_needs_to_swap(void);
 static void vm_compressor_swap_trigger_thread(void);
 static void vm_compressor_do_delayed_compactions(boolean_t);
@@ -492,6 +536,47 @@ static inline void cslot_copy(c_slot_t cdst, c_slot_t csrc) {
 #endif
 }
 
+/*
+ * c_slot_live mirrors "c_size != 0" for each slot so that compaction
+ * and tail trimming can skip runs of empty slots a word at a time
+ * instead of unpacking every c_slot... it is only changed with the
+ * c_seg locked or marked c_busy, the same as c_size
+ */
+#define C_SEG_SLOT_SET_LIVE(cseg, indx)		bitmap_set(&(cseg)->c_slot_live[0], (uint)(indx))
+#define C_SEG_SLOT_CLEAR_LIVE(cseg, indx)	bitmap_clear(&(cseg)->c_slot_live[0], (uint)(indx))
+#define C_SEG_SLOT_IS_LIVE(cseg, indx)		bitmap_test(&(cseg)->c_slot_live[0], (uint)(indx))
+
+/*
+ * returns the first slot at or after "indx" that holds data, -1 if none
+ */
+static inline int
+c_seg_next_live_slot(c_segment_t c_seg, int indx)
+{
+	int	next;
+
+	if (indx >= c_seg->c_nextslot)
+		return (-1);
+	if (indx == 0)
+		next = bitmap_lsb_first(&c_seg->c_slot_live[0], C_SLOT_MAX_INDEX);
+	else
+		next = bitmap_lsb_next(&c_seg->c_slot_live[0], C_SLOT_MAX_INDEX, (uint)(indx - 1));
+
+	if (next >= c_seg->c_nextslot)
+		return (-1);
+	return (next);
+}
+
+/*
+ * compaction cost... runs are the memcpys issued after coalescing
+ * slots whose data was already adjacent, reclaimed bytes are the
+ * buffer pages given back (depopulated or freed with the c_seg)
+ */
+int64_t		c_seg_minor_compactions __attribute__((aligned(8))) = 0;
+int64_t		c_seg_compact_moved_runs __attribute__((aligned(8))) = 0;
+int64_t		c_seg_compact_moved_bytes __attribute__((aligned(8))) = 0;
+int64_t		c_seg_compact_reclaimed_bytes __attribute__((aligned(8))) = 0;
+int64_t		c_seg_compact_abstime __attribute__((aligned(8))) = 0;
+
 vm_map_t compressor_map;
 uint64_t compressor_pool_max_size;
 uint64_t compressor_pool_size;
@@ -595,6 +680,7 @@ vm_compressor_init(void)
 	 */
 
 	c_list_lock = lck_mtx_alloc_init(&vm_compressor_lck_grp, &vm_compressor_lck_attr);
+	c_dd_lock = lck_mtx_alloc_init(&vm_compressor_lck_grp, &vm_compressor_lck_attr);
 
 	queue_init(&c_bad_list_head);
 	queue_init(&c_age_list_head);
@@ -805,6 +891,9 @@ c_seg_validate(c_segment_t c_seg, boolean_t must_be_compact)
 
 		bytes_used += c_rounded_size;
 
+		if ((c_size != 0) != C_SEG_SLOT_IS_LIVE(c_seg, c_indx))
+			panic("c_seg_validate: c_slot_live out of sync for slot %d (size %d)\n", c_indx, c_size);
+
 #if CHECKSUM_THE_COMPRESSED_DATA
 		unsigned csvhash;
 		if (c_size && cs->c_hash_compressed_data != (csvhash = vmc_hash((char *)&c_seg->c_store.c_buffer[cs->c_offset], c_size))) {
@@ -1304,38 +1393,38 @@ c_seg_trim_tail(c_segment_t c_seg)
 	uint32_t	c_rounded_size;
 	uint16_t	current_nextslot;
 	uint32_t	current_populated_offset;
+	int		last_slot;
 
 	if (c_seg->c_bytes_used == 0)
 		return;
 	current_nextslot = c_seg->c_nextslot;
 	current_populated_offset = c_seg->c_populated_offset;
-		
-	while (c_seg->c_nextslot) {
 
-		cs = C_SEG_SLOT_FROM_INDEX(c_seg, (c_seg->c_nextslot - 1));
+	last_slot = bitmap_first(&c_seg->c_slot_live[0], C_SLOT_MAX_INDEX);
+	assert(last_slot >= 0 && last_slot < current_nextslot);
+
+	c_seg->c_nextslot = last_slot + 1;
+
+	if (current_nextslot != c_seg->c_nextslot) {
+		cs = C_SEG_SLOT_FROM_INDEX(c_seg, last_slot);
 
 		c_size = UNPACK_C_SIZE(cs);
+		assert(c_size);
 
-		if (c_size) {
-			if (current_nextslot != c_seg->c_nextslot) {
-				c_rounded_size = (c_size + C_SEG_OFFSET_ALIGNMENT_MASK) & ~C_SEG_OFFSET_ALIGNMENT_MASK;
-				c_offset = cs->c_offset + C_SEG_BYTES_TO_OFFSET(c_rounded_size);
+		c_rounded_size = (c_size + C_SEG_OFFSET_ALIGNMENT_MASK) & ~C_SEG_OFFSET_ALIGNMENT_MASK;
+		c_offset = cs->c_offset + C_SEG_BYTES_TO_OFFSET(c_rounded_size);
 
-				c_seg->c_nextoffset = c_offset;
-				c_seg->c_populated_offset = (c_offset + (C_SEG_BYTES_TO_OFFSET(PAGE_SIZE) - 1)) &
-				                                       ~(C_SEG_BYTES_TO_OFFSET(PAGE_SIZE) - 1);
+		c_seg->c_nextoffset = c_offset;
+		c_seg->c_populated_offset = (c_offset + (C_SEG_BYTES_TO_OFFSET(PAGE_SIZE) - 1)) &
+		                                       ~(C_SEG_BYTES_TO_OFFSET(PAGE_SIZE) - 1);
 
-				if (c_seg->c_firstemptyslot > c_seg->c_nextslot)
-					c_seg->c_firstemptyslot = c_seg->c_nextslot;
+		if (c_seg->c_firstemptyslot > c_seg->c_nextslot)
+			c_seg->c_firstemptyslot = c_seg->c_nextslot;
 #if DEVELOPMENT || DEBUG
-				c_seg_trim_page_count += ((round_page_32(C_SEG_OFFSET_TO_BYTES(current_populated_offset)) -
-							   round_page_32(C_SEG_OFFSET_TO_BYTES(c_seg->c_populated_offset))) /
-							  PAGE_SIZE);
+		c_seg_trim_page_count += ((round_page_32(C_SEG_OFFSET_TO_BYTES(current_populated_offset)) -
+					   round_page_32(C_SEG_OFFSET_TO_BYTES(c_seg->c_populated_offset))) /
+					  PAGE_SIZE);
 #endif
-			}
-			break;
-		}		
-		c_seg->c_nextslot--;
 	}
 	assert(c_seg->c_nextslot);
 }
@@ -1349,6 +1438,8 @@ c_seg_minor_compaction_and_unlock(c_segment_t c_seg, boolean_t clear_busy)
 	uint32_t	old_populated_offset;
 	uint32_t	c_rounded_size;
 	uint32_t	c_size;
+	uint32_t	run_src, run_dst, run_len;
+	uint64_t	start;
 	int		c_indx = 0;
 	int		i;
 	c_slot_t	c_dst;
@@ -1360,6 +1451,7 @@ c_seg_minor_compaction_and_unlock(c_segment_t c_seg, boolean_t clear_busy)
 	c_seg_validate(c_seg, FALSE);
 #endif
 	if (c_seg->c_bytes_used == 0) {
+		OSAddAtomic64(C_SEG_OFFSET_TO_BYTES(c_seg->c_populated_offset), &c_seg_compact_reclaimed_bytes);
 		c_seg_free(c_seg);
 		return (1);
 	}
@@ -1377,24 +1469,44 @@ c_seg_minor_compaction_and_unlock(c_segment_t c_seg, boolean_t clear_busy)
 #if VALIDATE_C_SEGMENTS
 	c_seg->c_was_minor_compacted++;
 #endif
+	start = mach_absolute_time();
+
 	c_indx = c_seg->c_firstemptyslot;
 	c_dst = C_SEG_SLOT_FROM_INDEX(c_seg, c_indx);
 	
 	old_populated_offset = c_seg->c_populated_offset;
 	c_offset = c_dst->c_offset;
 
-	for (i = c_indx + 1; i < c_seg->c_nextslot && c_offset < c_seg->c_nextoffset; i++) {
+	/*
+	 * slots whose data is already adjacent in the buffer
+	 * are accumulated into a run and moved with one copy
+	 */
+	run_src = run_dst = c_offset;
+	run_len = 0;
+
+	for (i = c_seg_next_live_slot(c_seg, c_indx + 1);
+	     i != -1 && c_offset < c_seg->c_nextoffset;
+	     i = c_seg_next_live_slot(c_seg, i + 1)) {
 
 		c_src = C_SEG_SLOT_FROM_INDEX(c_seg, i);
 
 		c_size = UNPACK_C_SIZE(c_src);
-
-		if (c_size == 0)
-			continue;
+		assert(c_size);
 
 		c_rounded_size = (c_size + C_SEG_OFFSET_ALIGNMENT_MASK) & ~C_SEG_OFFSET_ALIGNMENT_MASK;
-/* N.B.: This memcpy may be an overlapping copy */
-		memcpy(&c_seg->c_store.c_buffer[c_offset], &c_seg->c_store.c_buffer[c_src->c_offset], c_rounded_size);
+
+		if (c_src->c_offset != run_src + run_len) {
+			if (run_len && run_src != run_dst) {
+/* N.B.: This may be an overlapping copy */
+				memmove(&c_seg->c_store.c_buffer[run_dst], &c_seg->c_store.c_buffer[run_src], C_SEG_OFFSET_TO_BYTES(run_len));
+				OSAddAtomic64(1, &c_seg_compact_moved_runs);
+				OSAddAtomic64(C_SEG_OFFSET_TO_BYTES(run_len), &c_seg_compact_moved_bytes);
+			}
+			run_src = c_src->c_offset;
+			run_dst = c_offset;
+			run_len = 0;
+		}
+		run_len += C_SEG_BYTES_TO_OFFSET(c_rounded_size);
 
 		cslot_copy(c_dst, c_src);
 		c_dst->c_offset = c_offset;
@@ -1404,10 +1516,17 @@ c_seg_minor_compaction_and_unlock(c_segment_t c_seg, boolean_t clear_busy)
 
 		c_offset += C_SEG_BYTES_TO_OFFSET(c_rounded_size);
 		PACK_C_SIZE(c_src, 0);
+		C_SEG_SLOT_CLEAR_LIVE(c_seg, i);
+		C_SEG_SLOT_SET_LIVE(c_seg, c_indx);
 		c_indx++;
 
 		c_dst = C_SEG_SLOT_FROM_INDEX(c_seg, c_indx);
 	}
+	if (run_len && run_src != run_dst) {
+		memmove(&c_seg->c_store.c_buffer[run_dst], &c_seg->c_store.c_buffer[run_src], C_SEG_OFFSET_TO_BYTES(run_len));
+		OSAddAtomic64(1, &c_seg_compact_moved_runs);
+		OSAddAtomic64(C_SEG_OFFSET_TO_BYTES(run_len), &c_seg_compact_moved_bytes);
+	}
 	c_seg->c_firstemptyslot = c_indx;
 	c_seg->c_nextslot = c_indx;
 	c_seg->c_nextoffset = c_offset;
@@ -1425,7 +1544,11 @@ c_seg_minor_compaction_and_unlock(c_segment_t c_seg, boolean_t clear_busy)
 		gc_ptr = &c_seg->c_store.c_buffer[c_seg->c_populated_offset];
 
 		kernel_memory_depopulate(compressor_map, (vm_offset_t)gc_ptr, gc_size, KMA_COMPRESSOR);
+
+		OSAddAtomic64(gc_size, &c_seg_compact_reclaimed_bytes);
 	}
+	OSAddAtomic64(1, &c_seg_minor_compactions);
+	OSAddAtomic64(mach_absolute_time() - start, &c_seg_compact_abstime);
 
 #if DEVELOPMENT || DEBUG
 	C_SEG_WRITE_PROTECT(c_seg);
@@ -1526,6 +1649,8 @@ c_seg_major_compact(
 	c_slot_mapping_t slot_ptr;
 	uint32_t	c_rounded_size;
 	uint32_t	c_size;
+	uint32_t	run_src, run_dst, run_len;
+	uint64_t	start;
 	uint16_t	dst_slot;
 	int		i;
 	c_slot_t	c_dst;
@@ -1549,18 +1674,23 @@ c_seg_major_compact(
 #endif
 	c_seg_major_compact_stats.compactions++;
 
+	start = mach_absolute_time();
+
 	dst_slot = c_seg_dst->c_nextslot;
 
-	for (i = 0; i < c_seg_src->c_nextslot; i++) {
+	/*
+	 * the destination is filled sequentially, so donor slots whose
+	 * data is adjacent are accumulated into a run and copied at once
+	 */
+	run_src = run_dst = 0;
+	run_len = 0;
+
+	for (i = c_seg_next_live_slot(c_seg_src, 0); i != -1; i = c_seg_next_live_slot(c_seg_src, i + 1)) {
 
 		c_src = C_SEG_SLOT_FROM_INDEX(c_seg_src, i);
 
 		c_size = UNPACK_C_SIZE(c_src);
-
-		if (c_size == 0) {
-			/* BATCH: move what we have so far; */
-			continue;
-		}
+		assert(c_size);
 
 		if (C_SEG_OFFSET_TO_BYTES(c_seg_dst->c_populated_offset - c_seg_dst->c_nextoffset) < (unsigned) c_size) {
 			int	size_to_populate;
@@ -1589,15 +1719,26 @@ c_seg_major_compact(
 
 		c_dst = C_SEG_SLOT_FROM_INDEX(c_seg_dst, c_seg_dst->c_nextslot);
 
-		memcpy(&c_seg_dst->c_store.c_buffer[c_seg_dst->c_nextoffset], &c_seg_src->c_store.c_buffer[c_src->c_offset], c_size);
-
 		c_rounded_size = (c_size + C_SEG_OFFSET_ALIGNMENT_MASK) & ~C_SEG_OFFSET_ALIGNMENT_MASK;
 
+		if (run_len == 0 || c_src->c_offset != run_src + run_len) {
+			if (run_len) {
+				memcpy(&c_seg_dst->c_store.c_buffer[run_dst], &c_seg_src->c_store.c_buffer[run_src], C_SEG_OFFSET_TO_BYTES(run_len));
+				OSAddAtomic64(1, &c_seg_compact_moved_runs);
+				OSAddAtomic64(C_SEG_OFFSET_TO_BYTES(run_len), &c_seg_compact_moved_bytes);
+			}
+			run_src = c_src->c_offset;
+			run_dst = c_seg_dst->c_nextoffset;
+			run_len = 0;
+		}
+		run_len += C_SEG_BYTES_TO_OFFSET(c_rounded_size);
+
 		c_seg_major_compact_stats.moved_slots++;
 		c_seg_major_compact_stats.moved_bytes += c_size;
 
 		cslot_copy(c_dst, c_src);
 		c_dst->c_offset = c_seg_dst->c_nextoffset;
+		C_SEG_SLOT_SET_LIVE(c_seg_dst, c_seg_dst->c_nextslot);
 
 		if (c_seg_dst->c_firstemptyslot == c_seg_dst->c_nextslot)
 			c_seg_dst->c_firstemptyslot++;
@@ -1607,6 +1748,7 @@ c_seg_major_compact(
 		c_seg_dst->c_nextoffset += C_SEG_BYTES_TO_OFFSET(c_rounded_size);
 
 		PACK_C_SIZE(c_src, 0);
+		C_SEG_SLOT_CLEAR_LIVE(c_seg_src, i);
 
 		c_seg_src->c_bytes_used -= c_rounded_size;
 		c_seg_src->c_bytes_unused += c_rounded_size;
@@ -1621,6 +1763,13 @@ c_seg_major_compact(
 			break;
 		}
 	}
+	if (run_len) {
+		memcpy(&c_seg_dst->c_store.c_buffer[run_dst], &c_seg_src->c_store.c_buffer[run_src], C_SEG_OFFSET_TO_BYTES(run_len));
+		OSAddAtomic64(1, &c_seg_compact_moved_runs);
+		OSAddAtomic64(C_SEG_OFFSET_TO_BYTES(run_len), &c_seg_compact_moved_bytes);
+	}
+	OSAddAtomic64(mach_absolute_time() - start, &c_seg_compact_abstime);
+
 #if DEVELOPMENT || DEBUG
 	C_SEG_WRITE_PROTECT(c_seg_dst);
 #endif
@@ -2808,6 +2957,21 @@ c_seg_allocate(c_segment_t *current_chead)
 	if ( (c_seg = *current_chead) == NULL ) {
 		uint32_t	c_segno;
 
+		/*
+		 * set the new segment up before going after the list
+		 * lock so that claiming a segment number and moving the
+		 * segment to the filling state is done in a single hold
+		 * of c_list_lock... the compressor threads all come
+		 * through here each time they fill their current segment
+		 */
+		c_seg = (c_segment_t)zalloc(compressor_segment_zone);
+		bzero((char *)c_seg, sizeof(struct c_segment));
+
+		lck_mtx_init(&c_seg->c_lock, &vm_compressor_lck_grp, &vm_compressor_lck_attr);
+
+		c_seg->c_state = C_IS_EMPTY;
+		c_seg->c_firstemptyslot = C_SLOT_MAX_INDEX;
+
 		lck_mtx_lock_spin_always(c_list_lock);
 
 		while (c_segments_busy == TRUE) {
@@ -2825,6 +2989,9 @@ c_seg_allocate(c_segment_t *current_chead)
 			if (c_segments_available >= c_segments_limit || c_segment_pages_compressed >= c_segment_pages_compressed_limit) {
 				lck_mtx_unlock_always(c_list_lock);
 
+				lck_mtx_destroy(&c_seg->c_lock, &vm_compressor_lck_grp);
+				zfree(compressor_segment_zone, c_seg);
+
 				return (NULL);
 			}
 			c_segments_busy = TRUE;
@@ -2865,20 +3032,9 @@ c_seg_allocate(c_segment_t *current_chead)
 		if (c_segment_count > c_segment_count_max)
 			c_segment_count_max = c_segment_count;
 
-		lck_mtx_unlock_always(c_list_lock);
-
-		c_seg = (c_segment_t)zalloc(compressor_segment_zone);
-		bzero((char *)c_seg, sizeof(struct c_segment));
-
 		c_seg->c_store.c_buffer = (int32_t *)C_SEG_BUFFER_ADDRESS(c_segno);
-
-		lck_mtx_init(&c_seg->c_lock, &vm_compressor_lck_grp, &vm_compressor_lck_attr);
-	
-		c_seg->c_state = C_IS_EMPTY;
-		c_seg->c_firstemptyslot = C_SLOT_MAX_INDEX;
 		c_seg->c_mysegno = c_segno;
 
-		lck_mtx_lock_spin_always(c_list_lock);
 		c_empty_count++;
 		c_seg_switch_state(c_seg, C_IS_FILLING, FALSE);
 		c_segments[c_segno].c_seg = c_seg;
@@ -3066,6 +3222,186 @@ c_seg_swapin_requeue(c_segment_t c_seg, boolean_t has_data, boolean_t minor_comp
 
 
 
+/*
+ * Swap-in readahead: when a fault has to bring a segment back from
+ * swap, the segments that follow it on the swapped out queue and were
+ * created within vm_swapin_readahead_window seconds of it (so most
+ * likely hold pages of the same working set) are queued for the
+ * readahead threads, which swap them in while the faulting thread
+ * waits for its own I/O.  The queue is protected by c_list_lock.
+ */
+#define	C_SWAPIN_READAHEAD_QLEN		64
+
+struct c_swapin_ra {
+	uint32_t	ra_segno;
+	uint64_t	ra_generation_id;	/* to catch a reused segno */
+};
+
+static struct c_swapin_ra c_swapin_ra_q[C_SWAPIN_READAHEAD_QLEN];
+static uint32_t	c_swapin_ra_head = 0;
+static uint32_t	c_swapin_ra_tail = 0;
+
+uint32_t	vm_swapin_readahead_max = 4;
+uint32_t	vm_swapin_readahead_window = 30;
+uint64_t	vm_swapin_readahead_queued = 0;
+int64_t		vm_swapin_readahead_done __attribute__((aligned(8))) = 0;
+int64_t		vm_swapin_readahead_hits __attribute__((aligned(8))) = 0;
+
+uint64_t	vm_swapin_fault_latency[C_SWAPIN_LATENCY_BUCKETS];
+uint64_t	vm_swapin_readahead_latency[C_SWAPIN_LATENCY_BUCKETS];
+
+static void
+c_seg_swapin_latency_record(uint64_t *histogram, uint64_t start)
+{
+	uint64_t	usecs;
+	int		bucket = 0;
+
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &usecs);
+	usecs /= NSEC_PER_USEC;
+
+	while (usecs > 1 && bucket < C_SWAPIN_LATENCY_BUCKETS - 1) {
+		usecs >>= 1;
+		bucket++;
+	}
+	OSAddAtomic64(1, (SInt64 *)&histogram[bucket]);
+}
+
+/*
+ * c_seg is locked, on disk and about to be swapped in by a fault
+ */
+static void
+c_seg_swapin_readahead(c_segment_t c_seg)
+{
+	c_segment_t	c_ra;
+	queue_head_t	*c_queue;
+	uint32_t	queued = 0;
+	uint32_t	next_tail;
+
+	if (vm_swapin_readahead_max == 0 || vm_swapin_readahead_threads == 0)
+		return;
+	/*
+	 * readahead pulls in segments nobody asked for yet...
+	 * don't add to the demand for pages when they're short
+	 */
+	if (vm_page_free_count < vm_page_free_target ||
+	    vm_compressor_thrashing_detected == TRUE)
+		return;
+	/*
+	 * the lock order is c_list_lock then c_seg's lock...
+	 * readahead isn't worth blocking for
+	 */
+	if ( !lck_mtx_try_lock_spin_always(c_list_lock))
+		return;
+
+	if (c_seg->c_state == C_ON_SWAPPEDOUT_Q)
+		c_queue = &c_swappedout_list_head;
+	else
+		c_queue = &c_swappedout_sparse_list_head;
+
+	c_ra = (c_segment_t) queue_next(&c_seg->c_age_list);
+
+	while ( !queue_end(c_queue, (queue_entry_t) c_ra) && queued < vm_swapin_readahead_max) {
+
+		if (c_ra->c_creation_ts > c_seg->c_creation_ts + vm_swapin_readahead_window ||
+		    c_ra->c_creation_ts + vm_swapin_readahead_window < c_seg->c_creation_ts)
+			break;
+
+		if ( !c_ra->c_busy) {
+			next_tail = (c_swapin_ra_tail + 1) % C_SWAPIN_READAHEAD_QLEN;
+
+			if (next_tail == c_swapin_ra_head)
+				break;
+			c_swapin_ra_q[c_swapin_ra_tail].ra_segno = c_ra->c_mysegno;
+			c_swapin_ra_q[c_swapin_ra_tail].ra_generation_id = c_ra->c_generation_id;
+			c_swapin_ra_tail = next_tail;
+
+			queued++;
+		}
+		c_ra = (c_segment_t) queue_next(&c_ra->c_age_list);
+	}
+	vm_swapin_readahead_queued += queued;
+
+	lck_mtx_unlock_always(c_list_lock);
+
+	if (queued)
+		thread_wakeup((event_t) &c_swapin_ra_head);
+}
+
+/*
+ * called by the readahead threads: swap in the next queued segment if
+ * it's still on disk and nobody else is working on it.  Returns FALSE
+ * with the thread asserted to wait if the queue is empty.
+ */
+boolean_t
+c_seg_swapin_readahead_next(void)
+{
+	c_segment_t	c_seg;
+	uint32_t	c_segno;
+	uint64_t	generation_id;
+	uint64_t	start;
+
+	PAGE_REPLACEMENT_DISALLOWED(TRUE);
+
+	lck_mtx_lock_spin_always(c_list_lock);
+
+	if (c_swapin_ra_head == c_swapin_ra_tail) {
+		assert_wait((event_t) &c_swapin_ra_head, THREAD_UNINT);
+
+		lck_mtx_unlock_always(c_list_lock);
+		PAGE_REPLACEMENT_DISALLOWED(FALSE);
+
+		return (FALSE);
+	}
+	c_segno = c_swapin_ra_q[c_swapin_ra_head].ra_segno;
+	generation_id = c_swapin_ra_q[c_swapin_ra_head].ra_generation_id;
+	c_swapin_ra_head = (c_swapin_ra_head + 1) % C_SWAPIN_READAHEAD_QLEN;
+
+	/*
+	 * memory got short since the segment was queued...
+	 * drop it, the fault will swap it in if it's needed
+	 */
+	if (vm_page_free_count < vm_page_free_target ||
+	    vm_compressor_thrashing_detected == TRUE) {
+		lck_mtx_unlock_always(c_list_lock);
+		PAGE_REPLACEMENT_DISALLOWED(FALSE);
+
+		return (TRUE);
+	}
+
+	/*
+	 * a free c_segments[] entry holds the next free segno
+	 * (or -1 at the end of the free list) instead of a c_seg
+	 */
+	if (c_segments[c_segno].c_segno < c_segments_available ||
+	    c_segments[c_segno].c_segno == (uint32_t)-1 ||
+	    c_segments[c_segno].c_seg->c_generation_id != generation_id) {
+		lck_mtx_unlock_always(c_list_lock);
+		PAGE_REPLACEMENT_DISALLOWED(FALSE);
+
+		return (TRUE);
+	}
+	c_seg = c_segments[c_segno].c_seg;
+
+	lck_mtx_lock_spin_always(&c_seg->c_lock);
+	lck_mtx_unlock_always(c_list_lock);
+
+	if (C_SEG_IS_ONDISK(c_seg) && !c_seg->c_busy) {
+		start = mach_absolute_time();
+
+		c_seg_swapin(c_seg, FALSE, TRUE);
+		c_seg->c_swapin_readahead = 1;
+
+		c_seg_swapin_latency_record(vm_swapin_readahead_latency, start);
+		OSAddAtomic64(1, &vm_swapin_readahead_done);
+	}
+	lck_mtx_unlock_always(&c_seg->c_lock);
+
+	PAGE_REPLACEMENT_DISALLOWED(FALSE);
+
+	return (TRUE);
+}
+
+
 /*
  * c_seg has to be locked and is returned locked if the c_seg isn't freed
  * PAGE_REPLACMENT_DISALLOWED has to be TRUE on entry and is returned TRUE
@@ -3089,6 +3425,7 @@ c_seg_swapin(c_segment_t c_seg, boolean_t force_minor_compaction, boolean_t age_
 
 	C_SEG_BUSY(c_seg);
 	c_seg->c_busy_swapping = 1;
+	c_seg->c_swapin_readahead = 0;
 
 	/*
 	 * This thread is likely going to block for I/O.
@@ -3227,6 +3564,268 @@ c_segment_sv_hash_insert(uint32_t data)
 }
 
 
+static uint32_t
+c_segment_dd_hash(char *data, int c_size)
+{
+	uint32_t	*wp = (uint32_t *)(uintptr_t)data;
+	uint32_t	hash = 2166136261U ^ (uint32_t)c_size;
+	int		i;
+
+	for (i = 0; i < c_size / (int)sizeof(uint32_t); i++)
+		hash = (hash ^ wp[i]) * 16777619U;
+
+	return (hash ? hash : 1);
+}
+
+
+/*
+ * Take the shared data away from an entry that no slot mapping
+ * references; its hash stays as a hint.  Called with c_dd_lock held,
+ * the caller frees the returned data once the lock is dropped.
+ */
+static char *
+c_segment_dd_evict(struct c_dd_entry *dd)
+{
+	char		*data = dd->dd_data;
+
+	assert(dd->dd_ref == 0 && dd->dd_promoting == FALSE && data != NULL);
+
+	dd->dd_data = NULL;
+	c_segment_dd_entries--;
+	c_segment_dd_evictions++;
+	c_segment_dd_bytes -= dd->dd_size;
+	c_segment_dd_bytes_saved += dd->dd_size;
+
+	return (data);
+}
+
+
+/*
+ * Find unshared data to evict when the table holds as much as
+ * vm_compressor_dedup_max_bytes: sweep a few entries from a clock
+ * hand, so that every entry gets its turn.  Called with c_dd_lock held.
+ */
+static struct c_dd_entry *
+c_segment_dd_reclaim_victim(void)
+{
+	struct c_dd_entry	*dd;
+	int		i;
+
+	for (i = 0; i < C_DD_HASH_MAX_MISS; i++) {
+		dd = &c_segment_dd_hash_table[c_segment_dd_hand];
+		c_segment_dd_hand = (c_segment_dd_hand + 1) & C_DD_HASH_MASK;
+
+		if (dd->dd_data != NULL && dd->dd_ref == 0 && dd->dd_promoting == FALSE)
+			return (dd);
+	}
+	return (NULL);
+}
+
+
+/*
+ * Look "data" up in the dedup table; called with the c_seg holding it
+ * locked.  Returns the index of an entry whose shared data matches, with
+ * a reference taken on it, or -1 if there's none.  If this is the second
+ * time we see that hash, the data is also copied to "scratch_buf" and
+ * "*promote_indx" is set to the entry that c_segment_dd_promote() should
+ * fill in once the c_seg has been unlocked.
+ *
+ * Unreferenced entries are recycled for new hashes, and their data is
+ * evicted to make room for a promotion when the table is full.
+ */
+static int
+c_segment_dd_lookup(char *data, int c_size, char *scratch_buf, int *promote_indx)
+{
+	struct c_dd_entry	*dd, *victim_dd;
+	char		*evicted = NULL;
+	uint32_t	evicted_size = 0;
+	uint32_t	hash;
+	int		hash_indx, misses;
+	int		victim = -1;
+
+	*promote_indx = -1;
+	hash = c_segment_dd_hash(data, c_size);
+	hash_indx = hash & C_DD_HASH_MASK;
+
+	lck_mtx_lock_spin_always(c_dd_lock);
+
+	for (misses = 0; misses < C_DD_HASH_MAX_MISS; misses++) {
+		dd = &c_segment_dd_hash_table[hash_indx];
+
+		if (dd->dd_hash == hash && dd->dd_size == (uint32_t)c_size) {
+			if (dd->dd_data != NULL) {
+				if (memcmp(dd->dd_data, data, c_size) == 0) {
+					dd->dd_ref++;
+					c_segment_dd_pages++;
+					c_segment_dd_hits++;
+					c_segment_dd_bytes_saved += c_size;
+
+					lck_mtx_unlock_always(c_dd_lock);
+					return (hash_indx);
+				}
+				c_segment_dd_collisions++;
+			} else if (dd->dd_promoting == FALSE) {
+				if (c_segment_dd_bytes + c_size > vm_compressor_dedup_max_bytes &&
+				    (victim_dd = c_segment_dd_reclaim_victim()) != NULL) {
+					evicted_size = victim_dd->dd_size;
+					evicted = c_segment_dd_evict(victim_dd);
+				}
+				if (c_segment_dd_bytes + c_size <= vm_compressor_dedup_max_bytes) {
+					dd->dd_promoting = TRUE;
+					*promote_indx = hash_indx;
+					memcpy(scratch_buf, data, c_size);
+				}
+				/* the hint is already there */
+				victim = -1;
+				break;
+			}
+		} else if (dd->dd_ref == 0 && dd->dd_promoting == FALSE &&
+			   (victim == -1 ||
+			    (dd->dd_data == NULL && c_segment_dd_hash_table[victim].dd_data != NULL))) {
+			/* prefer a bare hint over an entry with data to evict */
+			victim = hash_indx;
+		}
+		hash_indx = (hash_indx + 1) & C_DD_HASH_MASK;
+	}
+	if (victim != -1) {
+		/*
+		 * first sighting... just remember the hash
+		 */
+		dd = &c_segment_dd_hash_table[victim];
+		if (dd->dd_data != NULL) {
+			evicted_size = dd->dd_size;
+			evicted = c_segment_dd_evict(dd);
+		}
+		dd->dd_hash = hash;
+		dd->dd_size = c_size;
+	}
+	lck_mtx_unlock_always(c_dd_lock);
+
+	if (evicted)
+		kfree(evicted, evicted_size);
+
+	return (-1);
+}
+
+
+/*
+ * Give the entry picked by c_segment_dd_lookup() its own copy of the
+ * data, so that the next pages with the same content can share it.
+ * Called without any compressor lock held.
+ */
+static void
+c_segment_dd_promote(int hash_indx, char *scratch_buf, int c_size)
+{
+	struct c_dd_entry	*dd;
+	char		*data;
+
+	dd = &c_segment_dd_hash_table[hash_indx];
+
+	data = kalloc_noblock_tag(c_size, VM_KERN_MEMORY_COMPRESSOR);
+
+	if (data)
+		memcpy(data, scratch_buf, c_size);
+
+	lck_mtx_lock_spin_always(c_dd_lock);
+
+	assert(dd->dd_promoting == TRUE && dd->dd_data == NULL && dd->dd_ref == 0);
+	dd->dd_promoting = FALSE;
+
+	if (data) {
+		dd->dd_data = data;
+		c_segment_dd_entries++;
+		c_segment_dd_promotions++;
+		c_segment_dd_bytes += c_size;
+		c_segment_dd_bytes_saved -= c_size;
+	}
+	lck_mtx_unlock_always(c_dd_lock);
+}
+
+
+/*
+ * Drop a slot mapping's reference on a dedup entry.  The shared data
+ * is released with the last reference, the hash stays as a hint.
+ */
+static void
+c_segment_dd_drop_ref(int hash_indx)
+{
+	struct c_dd_entry	*dd;
+	char		*data = NULL;
+	uint32_t	c_size;
+
+	dd = &c_segment_dd_hash_table[hash_indx];
+
+	lck_mtx_lock_spin_always(c_dd_lock);
+
+	assert(dd->dd_ref > 0 && dd->dd_data != NULL);
+	c_size = dd->dd_size;
+	c_segment_dd_pages--;
+	c_segment_dd_bytes_saved -= c_size;
+
+	if (--dd->dd_ref == 0) {
+		data = dd->dd_data;
+		dd->dd_data = NULL;
+		c_segment_dd_entries--;
+		c_segment_dd_bytes -= c_size;
+		c_segment_dd_bytes_saved += c_size;
+	}
+	lck_mtx_unlock_always(c_dd_lock);
+
+	if (data)
+		kfree(data, c_size);
+}
+
+
+/*
+ * Decompress the shared data of a dedup entry into "dst".  The caller's
+ * slot mapping holds a reference, so the data can't go away under us.
+ * From the debugger (C_KDP), use the scratch buffer reserved for it.
+ */
+static void
+c_segment_dd_decompress(char *dst, int hash_indx, int flags)
+{
+	struct c_dd_entry	*dd;
+	char		*scratch_buf;
+	int		c_size;
+
+	dd = &c_segment_dd_hash_table[hash_indx];
+	c_size = dd->dd_size;
+
+	assert(dd->dd_ref > 0 && dd->dd_data != NULL);
+
+	if (c_size == PAGE_SIZE) {
+		memcpy(dst, dd->dd_data, PAGE_SIZE);
+		return;
+	}
+	/*
+	 * the per-cpu scratch buffers are only ours
+	 * while we can't be preempted
+	 */
+	disable_preemption();
+
+	if (__probable(!(flags & C_KDP)))
+		scratch_buf = &compressor_scratch_bufs[cpu_number() * vm_compressor_get_decode_scratch_size()];
+	else
+		scratch_buf = kdp_compressor_scratch_buf;
+
+#if defined(__arm64__)
+	__unreachable_ok_push
+	if (PAGE_SIZE == 4096)
+		WKdm_decompress_4k((WK_word *)(uintptr_t)dd->dd_data,
+				   (WK_word *)(uintptr_t)dst, (WK_word *)(uintptr_t)scratch_buf, c_size);
+	else {
+		WKdm_decompress_16k((WK_word *)(uintptr_t)dd->dd_data,
+				    (WK_word *)(uintptr_t)dst, (WK_word *)(uintptr_t)scratch_buf, c_size);
+	}
+	__unreachable_ok_pop
+#else
+	WKdm_decompress_new((WK_word *)(uintptr_t)dd->dd_data,
+			    (WK_word *)(uintptr_t)dst, (WK_word *)(uintptr_t)scratch_buf, c_size);
+#endif
+	enable_preemption();
+}
+
+
 #if RECORD_THE_COMPRESSED_DATA
 
 static void
@@ -3253,6 +3852,9 @@ c_compress_page(char *src, c_slot_mapping_t slot_ptr, c_segment_t *current_chead
 	int		max_csize;
 	c_slot_t	cs;
 	c_segment_t	c_seg;
+	int		dd_indx;
+	int		dd_promote_indx = -1;
+	int		dd_size = 0;
 
 	KERNEL_DEBUG(0xe0400000 | DBG_FUNC_START, *current_chead, 0, 0, 0, 0);
 retry:
@@ -3382,9 +3984,29 @@ retry:
 #if POPCOUNT_THE_COMPRESSED_DATA
 	cs->c_pop_cdata = vmc_pop((uintptr_t) &c_seg->c_store.c_buffer[cs->c_offset], c_size);
 #endif
+	if (c_size > 4 && vm_compressor_dedup_enabled &&
+	    vm_compressor_algorithm() == VM_COMPRESSOR_DEFAULT_CODEC) {
+
+		dd_indx = c_segment_dd_lookup((char *)&c_seg->c_store.c_buffer[cs->c_offset], c_size,
+					      scratch_buf, &dd_promote_indx);
+		if (dd_indx != -1) {
+			/*
+			 * identical to data we already share... the
+			 * c_slot we were going to use stays free
+			 */
+			slot_ptr->s_cindx = dd_indx;
+			slot_ptr->s_cseg = C_DD_CSEG_ID;
+
+			c_size = 0;
+			goto sv_compression;
+		}
+		if (dd_promote_indx != -1)
+			dd_size = c_size;
+	}
 	c_rounded_size = (c_size + C_SEG_OFFSET_ALIGNMENT_MASK) & ~C_SEG_OFFSET_ALIGNMENT_MASK;
 
 	PACK_C_SIZE(cs, c_size);
+	C_SEG_SLOT_SET_LIVE(c_seg, c_seg->c_nextslot);
 	c_seg->c_bytes_used += c_rounded_size;
 	c_seg->c_nextoffset += C_SEG_BYTES_TO_OFFSET(c_rounded_size);
 	c_seg->c_slots_used++;
@@ -3402,6 +4024,9 @@ sv_compression:
 
 	PAGE_REPLACEMENT_DISALLOWED(FALSE);
 
+	if (dd_promote_indx != -1)
+		c_segment_dd_promote(dd_promote_indx, scratch_buf, dd_size);
+
 #if RECORD_THE_COMPRESSED_DATA
 	if ((c_compressed_record_cptr - c_compressed_record_sbuf) >= C_SEG_ALLOCSIZE) {
 		c_compressed_record_write(c_compressed_record_sbuf, (int)(c_compressed_record_cptr - c_compressed_record_sbuf));
@@ -3600,12 +4225,23 @@ bypass_busy_check:
 		clock_nsec_t	cur_ts_nsec;
 
 		if (C_SEG_IS_ONDISK(c_seg)) {
+			uint64_t	start;
+
 			assert(kdp_mode == FALSE);
+			c_seg_swapin_readahead(c_seg);
+
+			start = mach_absolute_time();
 			retval = c_seg_swapin(c_seg, FALSE, TRUE);
 			assert(retval == 0);
 
+			c_seg_swapin_latency_record(vm_swapin_fault_latency, start);
+
 			retval = 1;
-		}		
+		} else if (c_seg->c_swapin_readahead) {
+			c_seg->c_swapin_readahead = 0;
+			OSAddAtomic64(1, &vm_swapin_readahead_hits);
+		}
+
 		if (c_seg->c_state == C_ON_BAD_Q) {
 			assert(c_seg->c_store.c_buffer == NULL);
 			*zeroslot = 0;
@@ -3725,6 +4361,7 @@ bypass_busy_check:
 	c_seg->c_slots_used--;
 
 	PACK_C_SIZE(cs, 0);
+	C_SEG_SLOT_CLEAR_LIVE(c_seg, c_indx);
 
 	if (c_indx < c_seg->c_firstemptyslot)
 		c_seg->c_firstemptyslot = c_indx;
@@ -3873,6 +4510,20 @@ vm_compressor_get(ppnum_t pn, int *slot, int flags)
 
 		return (0);
 	}
+	if (slot_ptr->s_cseg == C_DD_CSEG_ID) {
+		/*
+		 * page shares its compressed data with others
+		 */
+		c_segment_dd_decompress(dst, slot_ptr->s_cindx, flags);
+
+		if ( !(flags & C_KEEP)) {
+			c_segment_dd_drop_ref(slot_ptr->s_cindx);
+
+			OSAddAtomic(-1, &c_segment_pages_compressed);
+			*slot = 0;
+		}
+		return (0);
+	}
 
 	retval = c_decompress_page(dst, slot_ptr, flags, &zeroslot);
 
@@ -3912,6 +4563,14 @@ vm_compressor_free(int *slot, int flags)
 		*slot = 0;
 		return (0);
 	}
+	if (slot_ptr->s_cseg == C_DD_CSEG_ID) {
+
+		c_segment_dd_drop_ref(slot_ptr->s_cindx);
+		OSAddAtomic(-1, &c_segment_pages_compressed);
+
+		*slot = 0;
+		return (0);
+	}
 	retval = c_decompress_page(NULL, slot_ptr, flags, &zeroslot);
 	/*
 	 * returns 0 if we successfully freed the specified compressed page
@@ -3958,7 +4617,8 @@ vm_compressor_transfer(
 
 	src_slot = (c_slot_mapping_t) src_slot_p;
 
-	if (src_slot->s_cseg == C_SV_CSEG_ID) {
+	if (src_slot->s_cseg == C_SV_CSEG_ID ||
+	    src_slot->s_cseg == C_DD_CSEG_ID) {
 		*dst_slot_p = *src_slot_p;
 		*src_slot_p = 0;
 		return;
@@ -4045,11 +4705,12 @@ vm_compressor_relocate(
 
 	src_slot = (c_slot_mapping_t) slot_p;
 
-	if (src_slot->s_cseg == C_SV_CSEG_ID) {
+	if (src_slot->s_cseg == C_SV_CSEG_ID ||
+	    src_slot->s_cseg == C_DD_CSEG_ID) {
 		/*
 		 * no need to relocate... this is a page full of a single
-		 * value which is hashed to a single entry not contained
-		 * in a c_segment_t
+		 * value, or one sharing its compressed data, which is
+		 * hashed to a single entry not contained in a c_segment_t
 		 */
 		return (kr);
 	}
@@ -4176,6 +4837,7 @@ Relookup_src:
 
 	cslot_copy(c_dst, c_src);
 	c_dst->c_offset = c_seg_dst->c_nextoffset;
+	C_SEG_SLOT_SET_LIVE(c_seg_dst, c_seg_dst->c_nextslot);
 
 	if (c_seg_dst->c_firstemptyslot == c_seg_dst->c_nextslot)
 		c_seg_dst->c_firstemptyslot++;
@@ -4187,6 +4849,7 @@ Relookup_src:
 		
 
 	PACK_C_SIZE(c_src, 0);
+	C_SEG_SLOT_CLEAR_LIVE(c_seg_src, c_indx);
 
 	c_seg_src->c_bytes_used -= c_rounded_size;
 	c_seg_src->c_bytes_unused += c_rounded_size;
@@ -36,6 +36,7 @@
 #include <vm/vm_map.h>
 #include <machine/pmap.h>
 #include <kern/locks.h>
+#include <kern/bits.h>
 
 #include <sys/kdebug.h>
 
@@ -133,7 +134,8 @@ struct c_segment {
 
 		        c_state:4,		/* what state is the segment in which dictates which q to find it on */
 		        c_overage_swap:1,
-	                c_reserved:3;
+		        c_swapin_readahead:1,	/* swapped in ahead of any fault */
+	                c_reserved:2;
 
 	uint32_t	c_creation_ts;
 	uint64_t	c_generation_id;
@@ -170,6 +172,9 @@ struct c_segment {
 
 	int		c_slot_var_array_len;
 	struct	c_slot	*c_slot_var_array;
+
+#define C_SLOT_MAX_INDEX	(1 << 10)	/* this needs to track the size of s_cindx */
+	bitmap_t	c_slot_live[BITMAP_LEN(C_SLOT_MAX_INDEX)];	/* slots with a non-zero c_size */
 	struct	c_slot	c_slot_fixed_array[0];
 };
 
@@ -178,7 +183,6 @@ struct  c_slot_mapping {
         uint32_t        s_cseg:22, 	/* segment number + 1 */
 			s_cindx:10;	/* index in the segment */
 };
-#define C_SLOT_MAX_INDEX	(1 << 10)
 
 typedef struct c_slot_mapping *c_slot_mapping_t;
 
@@ -321,6 +325,7 @@ extern void		vm_swap_consider_defragmenting(void);
 
 extern void		c_seg_swapin_requeue(c_segment_t, boolean_t, boolean_t, boolean_t);
 extern int		c_seg_swapin(c_segment_t, boolean_t, boolean_t);
+extern boolean_t	c_seg_swapin_readahead_next(void);
 extern void		c_seg_wait_on_busy(c_segment_t);
 extern void		c_seg_trim_tail(c_segment_t);
 extern void		c_seg_switch_state(c_segment_t, int, boolean_t);
@@ -339,6 +344,8 @@ extern queue_head_t	c_swapout_list_head;
 extern queue_head_t	c_swappedout_list_head;
 extern queue_head_t	c_swappedout_sparse_list_head;
 
+extern int		vm_swapin_readahead_threads;
+
 extern uint32_t		c_age_count;
 extern uint32_t		c_swapout_count;
 extern uint32_t		c_swappedout_count;
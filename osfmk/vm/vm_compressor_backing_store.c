@@ -32,6 +32,7 @@
 #include <IOKit/IOHibernatePrivate.h>
 
 #include <kern/policy_internal.h>
+#include <pexpert/pexpert.h>
 
 boolean_t	compressor_store_stop_compaction = FALSE;
 boolean_t	vm_swapfile_create_needed = FALSE;
@@ -108,6 +109,11 @@ static void vm_swap_defragment(void);
 static void vm_swap_handle_delayed_trims(boolean_t);
 static void vm_swap_do_delayed_trim(struct swapfile *);
 static void vm_swap_wait_on_trim_handling_in_progress(void);
+static void vm_swapin_readahead_thread(void);
+
+#define	VM_SWAPIN_READAHEAD_THREADS_MAX	8
+
+int	vm_swapin_readahead_threads = 2;
 
 
 #if CONFIG_EMBEDDED
@@ -410,6 +416,7 @@ void
 vm_compressor_swap_init()
 {
 	thread_t	thread = NULL;
+	int		i;
 
 	lck_grp_attr_setdefault(&vm_swap_data_lock_grp_attr);
 	lck_grp_init(&vm_swap_data_lock_grp,
@@ -432,6 +439,18 @@ vm_compressor_swap_init()
 
 	thread_deallocate(thread);
 
+	PE_parse_boot_argn("vm_swapin_ra_threads", &vm_swapin_readahead_threads, sizeof (vm_swapin_readahead_threads));
+	if (vm_swapin_readahead_threads > VM_SWAPIN_READAHEAD_THREADS_MAX)
+		vm_swapin_readahead_threads = VM_SWAPIN_READAHEAD_THREADS_MAX;
+
+	for (i = 0; i < vm_swapin_readahead_threads; i++) {
+		if (kernel_thread_start_priority((thread_continue_t)vm_swapin_readahead_thread, NULL,
+						 BASEPRI_VM, &thread) != KERN_SUCCESS) {
+			panic("vm_swapin_readahead_thread: create failed");
+		}
+		thread_deallocate(thread);
+	}
+
 	if (kernel_thread_start_priority((thread_continue_t)vm_swapfile_create_thread, NULL,
 				 BASEPRI_VM, &thread) != KERN_SUCCESS) {
 		panic("vm_swapfile_create_thread: create failed");
@@ -880,6 +899,24 @@ done:
 }
 
 
+/*
+ * threads swapping in the segments queued for readahead by
+ * c_seg_swapin_readahead(), in parallel with the faulting threads
+ */
+static void
+vm_swapin_readahead_thread(void)
+{
+	thread_set_thread_name(current_thread(), "VM_swapin_readahead");
+
+	for (;;) {
+		while (c_seg_swapin_readahead_next() == TRUE)
+			;
+		thread_block(THREAD_CONTINUE_NULL);
+	}
+	/* NOTREACHED */
+}
+
+
 int vm_swapout_found_empty = 0;
 
 static void
@@ -76,6 +76,7 @@
 #include <mach/sdt.h>
 
 #include <kern/kern_types.h>
+#include <kern/clock.h>
 #include <kern/host_statistics.h>
 #include <kern/counters.h>
 #include <kern/task.h>
@@ -103,6 +104,7 @@
 #include <vm/memory_object.h>
 #include <vm/vm_purgeable_internal.h>	/* Needed by some vm_page.h macros */
 #include <vm/vm_shared_region.h>
+#include <vm/vm_superpage.h>
 
 #include <sys/codesign.h>
 #include <sys/reason.h>
@@ -2482,6 +2484,144 @@ backoff:
 	 (!(page)->cs_validated || (page)->wpmapped /*4*/))
 
 
+/*
+ * Fault-around: on a fault on a file mapping, also map the neighbors of
+ * the faulting page that are already resident, so that a process reading
+ * a cached file through a mapping takes one fault per window of
+ * "vm_fault_around_pages" pages instead of one per page.
+ *
+ * "vm_fault_around_prefaulted" counts the pages that were mapped for the
+ * first time this way; those that were then referenced by the time the
+ * page daemon or vm_page_free() looked at them again are counted in
+ * "vm_fault_around_used".
+ */
+#define VM_DEFAULT_FAULT_AROUND_PAGES	16
+
+unsigned int	vm_fault_around_pages = VM_DEFAULT_FAULT_AROUND_PAGES;
+unsigned int	vm_fault_around_prefaulted = 0;
+unsigned int	vm_fault_around_used = 0;
+
+#define VM_FAULT_AROUND_ENABLED(map, object, fault_info)		\
+	(vm_fault_around_pages > 1 &&					\
+	 (map) != kernel_map &&						\
+	 !(map)->no_fault_around &&					\
+	 !(object)->internal &&						\
+	 !(fault_info)->no_cache &&					\
+	 (fault_info)->behavior != VM_BEHAVIOR_RANDOM)
+
+/*
+ * vm_fault_around
+ *
+ * Map the resident pages of "object" in the window of pages around
+ * "offset", which has just been entered at "vaddr" in "pmap".
+ *
+ * Only pages that can be used as they are get mapped: nothing is paged
+ * in, copied, slid or code-signing validated here.  The mappings are
+ * read-only and non-executable, so that any other kind of access still
+ * goes through the regular fault path (and copy-on-write), and the pages
+ * are left on their paging queues as they are.
+ *
+ * "object" must be the top-level object of the mapping and be locked,
+ * shared is enough.  The map must be locked.
+ */
+static void
+vm_fault_around(
+	pmap_t			pmap,
+	vm_map_offset_t		vaddr,
+	vm_object_t		object,
+	vm_object_offset_t	offset,
+	vm_prot_t		prot,
+	vm_object_fault_info_t	fault_info)
+{
+	vm_object_offset_t	first, last, cur;
+	vm_object_offset_t	before;
+	vm_page_t		m;
+	ppnum_t			phys_page;
+	kern_return_t		kr;
+	unsigned int		window;
+	int			prefaulted = 0;
+
+	vm_object_lock_assert_held(object);
+
+	prot &= ~(VM_PROT_WRITE | VM_PROT_EXECUTE);
+	if (!(prot & VM_PROT_READ))
+		return;
+
+	window = vm_fault_around_pages;
+	if (window > VM_FAULT_AROUND_MAX)
+		window = VM_FAULT_AROUND_MAX;
+
+	/*
+	 * Use the naturally aligned window of virtual pages containing
+	 * "vaddr", clipped to what the map entry covers of the object.
+	 */
+	before = ptoa_64(atop_64(vaddr) % window);
+	last = offset + ptoa_64(window) - before;
+	if (before > offset - fault_info->lo_offset)
+		before = offset - fault_info->lo_offset;
+	first = offset - before;
+	if (last > fault_info->hi_offset)
+		last = fault_info->hi_offset;
+	if (last > object->vo_size)
+		last = object->vo_size;
+
+	for (cur = first; cur < last; cur += PAGE_SIZE_64) {
+		if (cur == offset)
+			continue;
+
+		m = vm_page_lookup(object, cur);
+
+		if (m == VM_PAGE_NULL ||
+		    m->busy || m->absent || m->error || m->unusual ||
+		    m->cleaning || m->fictitious || m->private ||
+		    m->cs_tainted ||
+		    VM_FAULT_NEED_CS_VALIDATION(pmap, m, object) ||
+		    vm_page_is_slideable(m))
+			continue;
+
+		if (pmap_find_phys(pmap, vaddr + (cur - offset)) != 0)
+			continue;
+
+		phys_page = VM_PAGE_GET_PHYS_PAGE(m);
+
+		if (m->clustered) {
+			/* came in with a cluster, see vm_fault_enter() */
+			VM_PAGE_COUNT_AS_PAGEIN(m);
+			VM_PAGE_CONSUME_CLUSTERED(m);
+		}
+		if (m->pmapped == FALSE) {
+			/*
+			 * First mapping of this page: start tracking
+			 * whether it gets used at all.
+			 */
+			if (m->reference == FALSE)
+				pmap_clear_refmod_options(phys_page, VM_MEM_REFERENCED, PMAP_OPTIONS_NOFLUSH, (void *)NULL);
+
+			pmap_lock_phys_page(phys_page);
+			if (m->pmapped == FALSE) {
+				m->pmapped = TRUE;
+				if (m->reference == FALSE) {
+					m->prefaulted = TRUE;
+					prefaulted++;
+				}
+			}
+			pmap_unlock_phys_page(phys_page);
+		}
+
+		PMAP_ENTER_OPTIONS(pmap, vaddr + (cur - offset), m, prot,
+				   VM_PROT_NONE, 0, FALSE,
+				   fault_info->pmap_options | PMAP_OPTIONS_NOWAIT,
+				   kr);
+		if (kr != KERN_SUCCESS) {
+			/* never wait for page table pages here */
+			break;
+		}
+	}
+	if (prefaulted)
+		OSAddAtomic(prefaulted, &vm_fault_around_prefaulted);
+}
+
+
 /*
  * page queue lock must NOT be held
  * m->object must be locked
@@ -2975,17 +3115,20 @@ vm_fault_enter(vm_page_t m,
 	}
 
 	boolean_t	page_queues_locked = FALSE;
+	uint64_t	page_queues_lock_time = 0;
 #define __VM_PAGE_LOCKSPIN_QUEUES_IF_NEEDED()	\
 MACRO_BEGIN			    		\
 	if (! page_queues_locked) {		\
 		page_queues_locked = TRUE;	\
 		vm_page_lockspin_queues();	\
+		page_queues_lock_time = mach_absolute_time(); \
 	}					\
 MACRO_END
 #define __VM_PAGE_UNLOCK_QUEUES_IF_NEEDED()	\
 MACRO_BEGIN			    		\
 	if (page_queues_locked) {		\
 		page_queues_locked = FALSE;	\
+		VM_PAGE_QUEUE_FAULT_LOCK_HOLD_UPDATE(page_queues_lock_time); \
 		vm_page_unlock_queues();	\
 	}					\
 MACRO_END
@@ -3101,6 +3244,16 @@ MACRO_END
 					 */
 					vm_page_reactivate_local(lid, FALSE, FALSE);
 				}
+			} else if (!no_cache &&
+				   (m->vm_page_q_state == VM_PAGE_ON_SPECULATIVE_Q ||
+				    m->vm_page_q_state == VM_PAGE_ON_INACTIVE_CLEANED_Q) &&
+				   vm_page_activate_deferred(object, m)) {
+				/*
+				 * the page is already on a global queue, so
+				 * it's still pageable until the batch gets
+				 * applied... no need to take the page queues
+				 * lock just to move it to the active queue
+				 */
 			} else {
 
 				__VM_PAGE_LOCKSPIN_QUEUES_IF_NEEDED();
@@ -3386,6 +3539,134 @@ extern uint64_t	get_current_unique_pid(void);
 unsigned long vm_fault_collapse_total = 0;
 unsigned long vm_fault_collapse_skipped = 0;
 
+#ifdef __x86_64__
+/*
+ * Transparent superpage promotion (see vm_superpage.h).
+ *
+ * First touch of a page in an eligible anonymous mapping: if nothing of
+ * the surrounding 2MB run has been populated yet, back the whole run
+ * with a pre-zeroed superpage from the pool and map it with a single
+ * level 2 entry, instead of zero-filling it 4K at a time.
+ *
+ * The pages of the run are wired (see vm_superpage.h), so they are
+ * charged to the map's wire limit like mlock()ed memory, and no run
+ * is promoted while the system is short of free pages.
+ *
+ * The map must be locked for reading and "object" locked exclusively;
+ * returns TRUE if the fault has been resolved.
+ */
+static boolean_t
+vm_fault_superpage_promote(
+	vm_map_t			map,
+	pmap_t				pmap,
+	vm_map_offset_t			vaddr,
+	vm_object_t			object,
+	vm_object_offset_t		offset,
+	vm_prot_t			prot,
+	struct vm_object_fault_info	*fault_info)
+{
+	vm_map_offset_t		run_vaddr;
+	vm_object_offset_t	run_offset, off;
+	vm_page_t		pages, first, m;
+	kern_return_t		kr;
+	unsigned int		total_wire_count;
+	vm_tag_t		tag;
+
+	vm_object_lock_assert_exclusive(object);
+
+	total_wire_count = vm_page_wire_count + vm_lopage_free_count;
+	if (vm_page_free_count < vm_page_free_target ||
+	    map->user_wire_size + SUPERPAGE_SIZE > MIN(map->user_wire_limit, vm_user_wire_limit) ||
+	    ptoa_64(total_wire_count) + SUPERPAGE_SIZE > vm_global_user_wire_limit ||
+	    ptoa_64(total_wire_count) + SUPERPAGE_SIZE > max_mem - vm_global_no_user_wire_amount)
+		return FALSE;
+
+	run_vaddr = vaddr & ~((vm_map_offset_t)SUPERPAGE_SIZE - 1);
+	run_offset = offset - (vaddr - run_vaddr);
+
+	/* the run must lie entirely within the map entry... */
+	if (offset < vaddr - run_vaddr ||
+	    run_offset < fault_info->lo_offset ||
+	    run_offset + SUPERPAGE_SIZE > fault_info->hi_offset)
+		return FALSE;
+
+	/* ... and the object must be private, anonymous and untouched there */
+	if (!object->internal ||
+	    object->pager_created ||
+	    object->shadow != VM_OBJECT_NULL ||
+	    object->copy != VM_OBJECT_NULL ||
+	    object->true_share ||
+	    object->phys_contiguous ||
+	    object->blocked_access ||
+	    object->purgable != VM_PURGABLE_DENY ||
+	    run_offset + SUPERPAGE_SIZE > object->vo_size)
+		return FALSE;
+	if (object->resident_page_count != 0) {
+		for (off = run_offset;
+		     off < run_offset + SUPERPAGE_SIZE;
+		     off += PAGE_SIZE) {
+			if (vm_page_lookup(object, off) != VM_PAGE_NULL)
+				return FALSE;
+		}
+	}
+
+	/* make sure the pmap has room for the level 2 entry without blocking */
+	kr = pmap_enter_options(pmap, run_vaddr, 0, 0, 0, VM_MEM_SUPERPAGE, FALSE,
+				PMAP_OPTIONS_NOENTER | PMAP_OPTIONS_NOWAIT, NULL);
+	if (kr != KERN_SUCCESS)
+		return FALSE;
+
+	pages = vm_superpage_pool_get();
+	if (pages == VM_PAGE_NULL) {
+		OSIncrementAtomic(&vm_superpage_promote_failures);
+		return FALSE;
+	}
+	first = pages;
+
+	/* account the run like mlock()ed memory, unless the object already has a tag */
+	tag = object->wire_tag;
+	if (tag == VM_KERN_MEMORY_NONE)
+		tag = VM_KERN_MEMORY_MLOCK;
+
+	for (off = run_offset; off < run_offset + SUPERPAGE_SIZE; off += PAGE_SIZE) {
+		m = pages;
+		pages = NEXT_PAGE(m);
+		*(NEXT_PAGE_PTR(m)) = VM_PAGE_NULL;
+		vm_page_insert_wired(m, object, off, tag);
+		m->in_superpage = TRUE;
+		m->dirty = TRUE;
+		m->pmapped = TRUE;
+		if (prot & VM_PROT_WRITE)
+			m->wpmapped = TRUE;
+	}
+	object->has_superpages = TRUE;
+
+	kr = pmap_enter_options(pmap, run_vaddr, VM_PAGE_GET_PHYS_PAGE(first),
+				prot, VM_PROT_NONE,
+				VM_MEM_SUPERPAGE | (object->wimg_bits & VM_WIMG_MASK),
+				FALSE,
+				fault_info->pmap_options | PMAP_OPTIONS_INTERNAL |
+				PMAP_OPTIONS_NOWAIT,
+				NULL);
+	if (kr != KERN_SUCCESS) {
+		/* keep the zeroed pages as ordinary ones, mapped 4K at a time */
+		vm_superpage_release(object, run_offset);
+		OSIncrementAtomic(&vm_superpage_promote_failures);
+		return FALSE;
+	}
+
+	/* the map is only locked for reading: charge it atomically */
+	OSAddAtomic64(SUPERPAGE_SIZE, (SInt64 *)&map->user_wire_size);
+	OSAddAtomic64(SUPERPAGE_SIZE, (SInt64 *)&map->superpage_wire_size);
+
+	OSIncrementAtomic(&vm_superpage_promotions);
+	VM_STAT_INCR_BY(zero_fill_count, SUPERPAGE_NBASEPAGES);
+	DTRACE_VM2(zfod, int, SUPERPAGE_NBASEPAGES, (uint64_t *), NULL);
+
+	return TRUE;
+}
+#endif /* __x86_64__ */
+
 
 kern_return_t
 vm_fault_external(
@@ -3582,6 +3863,45 @@ RetryFault:
 		}
 	}
 
+#ifdef __x86_64__
+	if (fault_info.superpage_ok &&
+	    !wired && !change_wiring &&
+	    caller_pmap == PMAP_NULL &&
+	    physpage_p == NULL &&
+	    map == original_map &&
+	    real_map == map &&
+	    object->internal &&
+	    object->shadow == VM_OBJECT_NULL &&
+	    vm_superpage_pool_runs != 0 &&
+	    vm_page_lookup(object, offset) == VM_PAGE_NULL) {
+		/*
+		 * First touch of a page in a run that may be backed
+		 * by a transparent superpage.
+		 */
+		if (object_lock_type == OBJECT_LOCK_SHARED) {
+
+		        object_lock_type = OBJECT_LOCK_EXCLUSIVE;
+
+			if (vm_object_lock_upgrade(object) == FALSE) {
+			        /*
+				 * couldn't upgrade, so explictly
+				 * take the lock exclusively
+				 */
+			        vm_object_lock(object);
+			}
+		}
+		if (vm_fault_superpage_promote(map, pmap, vaddr, object, offset,
+					       prot, &fault_info)) {
+			vm_object_unlock(object);
+			vm_map_unlock_read(map);
+
+			type_of_fault = DBG_ZERO_FILL_FAULT;
+			kr = KERN_SUCCESS;
+			goto done;
+		}
+	}
+#endif /* __x86_64__ */
+
 #if	VM_FAULT_CLASSIFY
 	/*
 	 *	Temporary data gathering code
@@ -4029,6 +4349,19 @@ FastPmapEnter:
 					}
 				}
 
+				if (kr == KERN_SUCCESS &&
+				    need_retry == FALSE &&
+				    top_object == VM_OBJECT_NULL &&
+				    !wired && !change_wiring &&
+				    caller_pmap == PMAP_NULL &&
+				    physpage_p == NULL &&
+				    map == original_map &&
+				    VM_FAULT_AROUND_ENABLED(map, object, &fault_info)) {
+					vm_fault_around(pmap, vaddr, object,
+							cur_offset, prot,
+							&fault_info);
+				}
+
 				if (top_object != VM_OBJECT_NULL) {
 					/*
 					 * It's safe to drop the top object
@@ -4948,6 +5281,13 @@ handle_copy_delay:
 				vm_object_lock_assert_exclusive(m_object);
 				m->dirty = TRUE;
 			}
+		} else if (m_object == object &&
+			   !wired && !change_wiring &&
+			   caller_pmap == PMAP_NULL &&
+			   map == original_map &&
+			   VM_FAULT_AROUND_ENABLED(map, object, &fault_info)) {
+			vm_fault_around(pmap, vaddr, object, m->offset,
+					prot, &fault_info);
 		}
 	} else {
 
@@ -82,6 +82,8 @@ typedef	kern_return_t	vm_fault_return_t;
 #define VM_FAULT_MEMORY_ERROR		5
 #define VM_FAULT_SUCCESS_NO_VM_PAGE	6	/* success but no VM page */
 
+#define VM_FAULT_AROUND_MAX		64	/* max pages mapped by fault-around */
+
 /*
  *	Page fault handling based on vm_map (or entries therein)
  */
@@ -108,6 +110,8 @@ extern void vm_pre_fault(vm_map_offset_t);
 
 extern void vm_fault_init(void);
 
+extern unsigned int	vm_fault_around_used;
+
 /* exported kext version */
 extern kern_return_t vm_fault_external(
 	vm_map_t	map,
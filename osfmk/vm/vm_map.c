@@ -109,6 +109,7 @@
 #include <vm/vm_protos.h>
 #include <vm/vm_shared_region.h>
 #include <vm/vm_map_store.h>
+#include <vm/vm_superpage.h>
 
 #include <san/kasan.h>
 
@@ -623,6 +624,9 @@ vm_map_apple_protected(
 		vm_object_reference(protected_object);
 
 		/* limit the map entry to the area we want to cover */
+#ifdef __x86_64__
+		vm_map_superpage_demote_edges(map, start_aligned, end_aligned);
+#endif /* __x86_64__ */
 		vm_map_clip_start(map, map_entry, start_aligned);
 		vm_map_clip_end(map, map_entry, end_aligned);
 
@@ -1000,6 +1004,7 @@ vm_map_create(
 	boolean_t		pageable)
 {
 	static int		color_seed = 0;
+	static uint64_t		map_serial_next __attribute__((aligned(8))) = 1;
 	vm_map_t	result;
 	struct vm_map_links	*hole_entry = NULL;
 
@@ -1021,6 +1026,7 @@ vm_map_create(
 	result->user_wire_size  = 0;
 #if __x86_64__
 	result->vmmap_high_start = 0;
+	result->superpage_wire_size = 0;
 #endif /* __x86_64__ */
 	result->ref_count = 1;
 #if	TASK_SWAPPER
@@ -1039,10 +1045,12 @@ vm_map_create(
 	result->map_disallow_data_exec = FALSE;
 	result->is_nested_map = FALSE;
 	result->map_disallow_new_exec = FALSE;
+	result->no_fault_around = FALSE;
 	result->highest_entry_end = 0;
 	result->first_free = vm_map_to_entry(result);
 	result->hint = vm_map_to_entry(result);
 	result->color_rr = (color_seed++) & vm_color_mask;
+	result->map_serial = OSAddAtomic64(1, (SInt64 *)&map_serial_next);
  	result->jit_entry_exists = FALSE;
 
 	if (vm_map_supports_hole_optimization) {
@@ -1756,6 +1764,7 @@ vm_map_find_space(
 		new_entry->vme_atomic = TRUE;
 	else
 		new_entry->vme_atomic = FALSE;
+	new_entry->vme_superpage_ok = FALSE;
 
 	VME_ALIAS_SET(new_entry, tag);
 
@@ -2003,6 +2012,7 @@ vm_map_enter(
 	boolean_t		clear_map_aligned = FALSE;
 	vm_map_entry_t		hole_entry;
 	vm_map_size_t		chunk_size = 0;
+	boolean_t		superpage_ok = FALSE;
 
 	assertf(vmk_flags.__vmkf_unused == 0, "vmk_flags unused=0x%x\n", vmk_flags.__vmkf_unused);
 
@@ -2040,6 +2050,26 @@ vm_map_enter(
 			return KERN_INVALID_ARGUMENT;
 		inheritance = VM_INHERIT_NONE;	/* fork() children won't inherit superpages */
 	}
+#ifdef __x86_64__
+	else if (vm_superpage_mode == VM_SUPERPAGE_ALWAYS &&
+		 anywhere &&
+		 object == VM_OBJECT_NULL &&
+		 !is_submap &&
+		 !purgable &&
+		 !entry_for_jit &&
+		 map->pmap != kernel_pmap &&
+		 size >= SUPERPAGE_SIZE &&
+		 mask < SUPERPAGE_SIZE-1) {
+		/*
+		 * Large anonymous allocation: align it so that its
+		 * 2MB runs can be backed by transparent superpages.
+		 * In "madvise" mode, the application has to align the
+		 * ranges it passes to MADV_SUPERPAGE itself.
+		 */
+		mask = SUPERPAGE_SIZE-1;
+		superpage_ok = TRUE;
+	}
+#endif /* __x86_64__ */
 
 
 #if CONFIG_EMBEDDED
@@ -2620,6 +2650,7 @@ StartAgain: ;
 		   (!entry->vme_resilient_codesign) &&
 		   (!entry->vme_resilient_media) &&
 		   (!entry->vme_atomic) &&
+		   (entry->vme_superpage_ok == superpage_ok) &&
 
 		   ((entry->vme_end - entry->vme_start) + size <=
 		    (user_alias == VM_MEMORY_REALLOC ?
@@ -2712,6 +2743,10 @@ StartAgain: ;
 				new_entry->vme_resilient_media = TRUE;
 			}
 
+			if (superpage_ok) {
+				new_entry->vme_superpage_ok = TRUE;
+			}
+
 			assert(!new_entry->iokit_acct);
 			if (!is_submap &&
 			    object != VM_OBJECT_NULL &&
@@ -4987,6 +5022,140 @@ vm_map_clip_unnest(
 }
 #endif	/* NO_NESTED_PMAP */
 
+#ifdef __x86_64__
+/*
+ *	vm_map_superpage_demote:	[ internal use only ]
+ *
+ *	Break up the transparent superpages (see vm_superpage.h)
+ *	mapped by "entry" in the [start, end) range: their 2MB
+ *	mappings are removed and their pages become ordinary
+ *	pageable pages, to be mapped again 4K at a time on the
+ *	next fault.  Runs partially in the range are demoted too.
+ */
+void
+vm_map_superpage_demote(
+	vm_map_t	map,
+	vm_map_entry_t	entry,
+	vm_map_offset_t	start,
+	vm_map_offset_t	end)
+{
+	vm_object_t		object;
+	vm_object_offset_t	run_offset;
+	vm_map_offset_t		va;
+
+	if (entry->is_sub_map || entry->superpage_size)
+		return;
+	object = VME_OBJECT(entry);
+	if (object == VM_OBJECT_NULL || !object->has_superpages)
+		return;
+
+	start = MAX(SUPERPAGE_ROUND_DOWN(start), entry->vme_start);
+	end = MIN(end, entry->vme_end);
+
+	vm_object_lock(object);
+	for (va = start; va < end; va = SUPERPAGE_ROUND_DOWN(va) + SUPERPAGE_SIZE) {
+		if ((va & (SUPERPAGE_SIZE - 1)) != 0 ||
+		    va + SUPERPAGE_SIZE > entry->vme_end)
+			continue;
+		run_offset = VME_OFFSET(entry) + (va - entry->vme_start);
+		if (!vm_superpage_promoted(object, run_offset))
+			continue;
+		pmap_remove(map->pmap, (addr64_t)va, (addr64_t)(va + SUPERPAGE_SIZE));
+		vm_superpage_release(object, run_offset);
+		OSIncrementAtomic(&vm_superpage_demotions);
+		/* the run no longer counts against the map's wire limit */
+		if (map->superpage_wire_size >= SUPERPAGE_SIZE) {
+			OSAddAtomic64(-(SInt64)SUPERPAGE_SIZE,
+				      (SInt64 *)&map->superpage_wire_size);
+			OSAddAtomic64(-(SInt64)SUPERPAGE_SIZE,
+				      (SInt64 *)&map->user_wire_size);
+		}
+	}
+	vm_object_unlock(object);
+}
+
+/*
+ *	vm_map_superpage_demote_all:
+ *
+ *	Demote all the transparent superpages of "map", so that
+ *	their pages can be paged out.  Used under memory pressure.
+ */
+void
+vm_map_superpage_demote_all(
+	vm_map_t	map)
+{
+	vm_map_entry_t	entry;
+
+	vm_map_lock_read(map);
+	for (entry = vm_map_first_entry(map);
+	     entry != vm_map_to_entry(map) && map->superpage_wire_size != 0;
+	     entry = entry->vme_next) {
+		vm_map_superpage_demote(map, entry,
+					entry->vme_start, entry->vme_end);
+	}
+	vm_map_unlock_read(map);
+}
+
+/*
+ * Demote all the transparent superpages in [start, end).
+ * The map must be locked.
+ */
+static void
+vm_map_superpage_demote_range_locked(
+	vm_map_t	map,
+	vm_map_offset_t	start,
+	vm_map_offset_t	end)
+{
+	vm_map_entry_t	entry;
+
+	if (!vm_map_lookup_entry(map, start, &entry))
+		entry = entry->vme_next;
+	for (;
+	     entry != vm_map_to_entry(map) && entry->vme_start < end;
+	     entry = entry->vme_next) {
+		vm_map_superpage_demote(map, entry, start, end);
+	}
+}
+
+/*
+ * Demote all the transparent superpages in [start, end), before
+ * an operation that acts on the individual pages of the range.
+ */
+static void
+vm_map_superpage_demote_range(
+	vm_map_t	map,
+	vm_map_offset_t	start,
+	vm_map_offset_t	end)
+{
+	vm_map_lock_read(map);
+	vm_map_superpage_demote_range_locked(map, start, end);
+	vm_map_unlock_read(map);
+}
+
+/*
+ *	vm_map_superpage_demote_edges:
+ *
+ *	Demote the transparent superpages straddling "start" and "end",
+ *	before the caller clips the map there: a run split between two
+ *	entries could no longer be demoted.  This keeps the object and
+ *	page queue locks out of vm_map_clip_start() and vm_map_clip_end().
+ *	The map must be locked.
+ */
+void
+vm_map_superpage_demote_edges(
+	vm_map_t	map,
+	vm_map_offset_t	start,
+	vm_map_offset_t	end)
+{
+	if (map->superpage_wire_size == 0)
+		return;
+	if (start & (SUPERPAGE_SIZE - 1))
+		vm_map_superpage_demote_range_locked(map, start, start + 1);
+	if ((end & (SUPERPAGE_SIZE - 1)) && end != start)
+		vm_map_superpage_demote_range_locked(map, end, end + 1);
+}
+#endif /* __x86_64__ */
+
 /*
  *	vm_map_clip_start:	[ internal use only ]
  *
@@ -5409,6 +5578,10 @@ vm_map_protect(
 	vm_prot_t			new_max;
 	int				pmap_options = 0;
 	kern_return_t			kr;
+	vm_map_offset_t			pending_start, pending_end;
+	vm_prot_t			pending_prot;
+	int				pending_options;
+	pmap_flush_context		pmap_flush_context_storage;
 
 	XPR(XPR_VM_MAP,
 	    "vm_map_protect, 0x%X start 0x%X end 0x%X, new 0x%X %d",
@@ -5561,11 +5734,25 @@ vm_map_protect(
 	 */
 
 	current = entry;
+#ifdef __x86_64__
+	vm_map_superpage_demote_edges(map, start, end);
+#endif /* __x86_64__ */
 	if (current != vm_map_to_entry(map)) {
 		/* clip and unnest if necessary */
 		vm_map_clip_start(map, current, start);
 	}
 
+	/*
+	 * Adjacent entries that end up with the same physical protection
+	 * are handed to the pmap layer as a single range, and the TLB
+	 * flushes for all of them are deferred to one pmap_flush() once
+	 * we're done.
+	 */
+	pending_start = pending_end = 0;
+	pending_prot = VM_PROT_NONE;
+	pending_options = 0;
+	pmap_flush_context_init(&pmap_flush_context_storage);
+
 	while ((current != vm_map_to_entry(map)) &&
 	       (current->vme_start < end)) {
 
@@ -5665,17 +5852,39 @@ vm_map_protect(
 					}
 				}
 
-				pmap_protect_options(map->pmap,
-						     current->vme_start,
-						     current->vme_end,
-						     prot,
-						     pmap_options,
-						     NULL);
+				if (current->vme_start == pending_end &&
+				    prot == pending_prot &&
+				    pmap_options == pending_options) {
+					pending_end = current->vme_end;
+				} else {
+					if (pending_start < pending_end) {
+						pmap_protect_options(map->pmap,
+								     pending_start,
+								     pending_end,
+								     pending_prot,
+								     pending_options | PMAP_OPTIONS_NOFLUSH,
+								     (void *)&pmap_flush_context_storage);
+					}
+					pending_start = current->vme_start;
+					pending_end = current->vme_end;
+					pending_prot = prot;
+					pending_options = pmap_options;
+				}
 			}
 		}
 		current = current->vme_next;
 	}
 
+	if (pending_start < pending_end) {
+		pmap_protect_options(map->pmap,
+				     pending_start,
+				     pending_end,
+				     pending_prot,
+				     pending_options | PMAP_OPTIONS_NOFLUSH,
+				     (void *)&pmap_flush_context_storage);
+	}
+	pmap_flush(&pmap_flush_context_storage);
+
 	current = entry;
 	while ((current != vm_map_to_entry(map)) &&
 	       (current->vme_start <= end)) {
@@ -5731,6 +5940,9 @@ vm_map_inherit(
 	}
 
 	entry = temp_entry;
+#ifdef __x86_64__
+	vm_map_superpage_demote_edges(map, start, end);
+#endif /* __x86_64__ */
 	if (entry != vm_map_to_entry(map)) {
 		/* clip and unnest if necessary */
 		vm_map_clip_start(map, entry, start);
@@ -6369,8 +6581,15 @@ vm_map_wire_nested(
 			assert(entry->use_pmap);
 		}
 
+#ifdef __x86_64__
+		vm_map_superpage_demote_edges(map, s, end);
+#endif /* __x86_64__ */
 		vm_map_clip_start(map, entry, s);
 		vm_map_clip_end(map, entry, end);
+#ifdef __x86_64__
+		/* wired pages are entered 4K at a time */
+		vm_map_superpage_demote(map, entry, s, end);
+#endif /* __x86_64__ */
 
 		/* re-compute "e" */
 		e = entry->vme_end;
@@ -7007,6 +7226,71 @@ vm_map_entry_delete(
 
 }
 
+/*
+ * Maximum number of entries vm_map_delete() unlinks before it drops the
+ * map lock to free them.
+ */
+#define VM_MAP_DELETE_BATCH	64
+
+/*
+ *	vm_map_delete_pmap_flush:	[ internal use only ]
+ *
+ *	Remove the translations for the range of entries vm_map_delete()
+ *	has accumulated so far.  Must be called before the map is unlocked.
+ */
+static void
+vm_map_delete_pmap_flush(
+	vm_map_t	map,
+	vm_map_offset_t	*startp,
+	vm_map_offset_t	*endp)
+{
+	if (*startp < *endp) {
+		pmap_remove_options(map->pmap,
+				    (addr64_t)*startp,
+				    (addr64_t)*endp,
+				    PMAP_OPTIONS_REMOVE);
+#if DEBUG
+		assert(vm_map_pmap_is_empty(map, *startp, *endp));
+#endif /* DEBUG */
+	}
+	*startp = *endp = 0;
+}
+
+/*
+ *	vm_map_delete_reap:	[ internal use only ]
+ *
+ *	Dispose of the entries vm_map_delete() has unlinked from the map
+ *	and drop their objects.  Their translations must already be gone.
+ *	The map is unlocked while the objects are deallocated and is
+ *	returned locked.
+ */
+static void
+vm_map_delete_reap(
+	vm_map_t	map,
+	vm_map_entry_t	*dead_entriesp,
+	int		*dead_countp)
+{
+	vm_map_entry_t	entry, next;
+	vm_object_t	object;
+
+	if (*dead_entriesp == VM_MAP_ENTRY_NULL)
+		return;
+
+	vm_map_unlock(map);
+	for (entry = *dead_entriesp;
+	     entry != VM_MAP_ENTRY_NULL;
+	     entry = next) {
+		next = entry->vme_next;
+		object = VME_OBJECT(entry);
+		vm_map_entry_dispose(map, entry);
+		vm_object_deallocate(object);
+	}
+	vm_map_lock(map);
+
+	*dead_entriesp = VM_MAP_ENTRY_NULL;
+	*dead_countp = 0;
+}
+
 void
 vm_map_submap_pmap_clean(
 	vm_map_t	map,
@@ -7130,6 +7414,10 @@ vm_map_delete(
 	boolean_t		need_wakeup;
 	unsigned int		last_timestamp = ~0; /* unlikely value */
 	int			interruptible;
+	vm_map_offset_t		pmap_start, pmap_end;
+	vm_map_entry_t		dead_entries;
+	int			dead_count;
+	boolean_t		batch_ok;
 
 	interruptible = (flags & VM_MAP_REMOVE_INTERRUPTIBLE) ?
 		THREAD_ABORTSAFE : THREAD_UNINT;
@@ -7147,6 +7435,10 @@ vm_map_delete(
 	 */
 	flags |= VM_MAP_REMOVE_WAIT_FOR_KWIRE;
 
+#ifdef __x86_64__
+	vm_map_superpage_demote_edges(map, start, end);
+#endif /* __x86_64__ */
+
 	while(1) {
 		/*
 		 *	Find the start of the region, and clip it
@@ -7222,6 +7514,22 @@ vm_map_delete(
 		end = SUPERPAGE_ROUND_UP(end);
 
 	need_wakeup = FALSE;
+
+	/*
+	 * Plain entries (see "batch_ok" below) are not torn down one at a
+	 * time: their translations are removed with one pmap call per run
+	 * of adjacent entries, and they are unlinked and set aside until
+	 * up to VM_MAP_DELETE_BATCH of them can be freed with a single
+	 * unlock of the map.  The pending pmap range must be flushed before
+	 * anything drops the map lock, and the dead entries reaped before
+	 * we return.
+	 */
+	pmap_start = pmap_end = 0;
+	dead_entries = VM_MAP_ENTRY_NULL;
+	dead_count = 0;
+	batch_ok = (!(flags & (VM_MAP_REMOVE_NO_PMAP_CLEANUP |
+			       VM_MAP_REMOVE_SAVE_ENTRIES)) &&
+		    !(map->mapped_in_other_pmaps && map->ref_count));
 	/*
 	 *	Step through all entries in this region
 	 */
@@ -7269,6 +7577,10 @@ vm_map_delete(
 				      entry,
 				      (uint64_t)s);
 			}
+#ifdef __x86_64__
+			/* the map may have been unlocked since we demoted */
+			vm_map_superpage_demote_edges(map, s, end);
+#endif /* __x86_64__ */
 			vm_map_clip_start(map, entry, s);
 		}
 		if (entry->vme_end <= end) {
@@ -7296,6 +7608,9 @@ vm_map_delete(
 				      entry,
 				      (uint64_t)end);
 			}
+#ifdef __x86_64__
+			vm_map_superpage_demote_edges(map, s, end);
+#endif /* __x86_64__ */
 			vm_map_clip_end(map, entry, end);
 		}
 
@@ -7355,6 +7670,8 @@ vm_map_delete(
 			assert(s == entry->vme_start);
 			entry->needs_wakeup = TRUE;
 
+			vm_map_delete_pmap_flush(map, &pmap_start, &pmap_end);
+
 			/*
 			 * wake up anybody waiting on entries that we have
 			 * already unwired/deleted.
@@ -7372,6 +7689,7 @@ vm_map_delete(
 				 * We do not clear the needs_wakeup flag,
 				 * since we cannot tell if we were the only one.
 				 */
+				vm_map_delete_reap(map, &dead_entries, &dead_count);
 				return KERN_ABORTED;
 			}
 
@@ -7396,6 +7714,8 @@ vm_map_delete(
 		if (entry->wired_count) {
 			boolean_t	user_wire;
 
+			vm_map_delete_pmap_flush(map, &pmap_start, &pmap_end);
+
 			user_wire = entry->user_wired_count > 0;
 
 			/*
@@ -7438,6 +7758,7 @@ vm_map_delete(
 						 * cannot tell if we were the
 						 * only one.
 						 */
+						vm_map_delete_reap(map, &dead_entries, &dead_count);
 						return KERN_ABORTED;
 					}
 
@@ -7462,6 +7783,7 @@ vm_map_delete(
 					continue;
 				}
 				else {
+					vm_map_delete_reap(map, &dead_entries, &dead_count);
 					return KERN_FAILURE;
 				}
 			}
@@ -7624,6 +7946,16 @@ vm_map_delete(
 		} else if (VME_OBJECT(entry) != kernel_object &&
 			   VME_OBJECT(entry) != compressor_object) {
 			object = VME_OBJECT(entry);
+#ifdef __x86_64__
+			/*
+			 * Unwire the superpage runs and give their charge
+			 * back to the map, even if the object is about to
+			 * go away with them.
+			 */
+			vm_map_superpage_demote(map, entry,
+						entry->vme_start,
+						entry->vme_end);
+#endif /* __x86_64__ */
 			if ((map->mapped_in_other_pmaps) && (map->ref_count)) {
 				vm_object_pmap_protect_options(
 					object, VME_OFFSET(entry),
@@ -7632,6 +7964,21 @@ vm_map_delete(
 					entry->vme_start,
 					VM_PROT_NONE,
 					PMAP_OPTIONS_REMOVE);
+			} else if (batch_ok && !entry->permanent) {
+				/*
+				 * Defer to vm_map_delete_pmap_flush(), as
+				 * one range with the adjacent entries.
+				 * An objectless, non-kernel range is not
+				 * expected to have any translations, so
+				 * covering it too is just a cheap no-op.
+				 */
+				if (entry->vme_start != pmap_end) {
+					vm_map_delete_pmap_flush(map,
+								 &pmap_start,
+								 &pmap_end);
+					pmap_start = entry->vme_start;
+				}
+				pmap_end = entry->vme_end;
 			} else if ((VME_OBJECT(entry) != VM_OBJECT_NULL) ||
 				   (map->pmap == kernel_pmap)) {
 				/* Remove translations associated
@@ -7668,10 +8015,11 @@ vm_map_delete(
 
 		/*
 		 * All pmap mappings for this map entry must have been
-		 * cleared by now.
+		 * cleared by now, unless they're part of the pending range.
 		 */
 #if DEBUG
-		assert(vm_map_pmap_is_empty(map,
+		assert(entry->vme_end == pmap_end ||
+		       vm_map_pmap_is_empty(map,
 					    entry->vme_start,
 					    entry->vme_end));
 #endif /* DEBUG */
@@ -7721,7 +8069,29 @@ vm_map_delete(
 			zap_map->size += entry_size;
 			/* we didn't unlock the map, so no timestamp increase */
 			last_timestamp--;
+		} else if (entry->vme_end == pmap_end) {
+			/*
+			 * Its translations are pending: set the entry
+			 * aside and free it with the rest of the batch.
+			 */
+			assert(!entry->is_sub_map);
+			vm_map_store_entry_unlink(map, entry);
+			map->size -= entry->vme_end - entry->vme_start;
+			entry->vme_next = dead_entries;
+			dead_entries = entry;
+			if (++dead_count < VM_MAP_DELETE_BATCH) {
+				/* we didn't unlock the map */
+				last_timestamp--;
+			} else {
+				vm_map_delete_pmap_flush(map,
+							 &pmap_start,
+							 &pmap_end);
+				/* vm_map_delete_reap unlocks the map */
+				vm_map_delete_reap(map, &dead_entries,
+						   &dead_count);
+			}
 		} else {
+			vm_map_delete_pmap_flush(map, &pmap_start, &pmap_end);
 			vm_map_entry_delete(map, entry);
 			/* vm_map_entry_delete unlocks the map */
 			vm_map_lock(map);
@@ -7758,6 +8128,9 @@ vm_map_delete(
 		last_timestamp = map->timestamp;
 	}
 
+	vm_map_delete_pmap_flush(map, &pmap_start, &pmap_end);
+	vm_map_delete_reap(map, &dead_entries, &dead_count);
+
 	if (map->wait_for_space)
 		thread_wakeup((event_t) map);
 	/*
@@ -8215,6 +8588,12 @@ start_pass_1:
 		vm_map_unlock(dst_map);
 		return(KERN_INVALID_ADDRESS);
 	}
+#ifdef __x86_64__
+	vm_map_superpage_demote_edges(dst_map,
+				      vm_map_trunc_page(dst_addr,
+							VM_MAP_PAGE_MASK(dst_map)),
+				      dst_end);
+#endif /* __x86_64__ */
 	vm_map_clip_start(dst_map,
 			  tmp_entry,
 			  vm_map_trunc_page(dst_addr,
@@ -8721,6 +9100,12 @@ start_overwrite:
 				break;
 			}
 		}
+#ifdef __x86_64__
+		vm_map_superpage_demote_edges(dst_map,
+					      vm_map_trunc_page(base_addr,
+								VM_MAP_PAGE_MASK(dst_map)),
+					      dst_end);
+#endif /* __x86_64__ */
 		vm_map_clip_start(dst_map,
 				  tmp_entry,
 				  vm_map_trunc_page(base_addr,
@@ -9309,6 +9694,11 @@ vm_map_copy_overwrite_aligned(
 				/* no longer map-aligned */
 				entry->map_aligned = FALSE;
 			}
+#ifdef __x86_64__
+			vm_map_superpage_demote_edges(dst_map,
+						      entry->vme_start + copy_size,
+						      entry->vme_start + copy_size);
+#endif /* __x86_64__ */
 			vm_map_clip_end(dst_map, entry, entry->vme_start + copy_size);
 			size = copy_size;
 		}
@@ -9642,6 +10032,9 @@ vm_map_copy_overwrite_aligned(
 					/* no longer map-aligned */
 					tmp_entry->map_aligned = FALSE;
 				}
+#ifdef __x86_64__
+				vm_map_superpage_demote_edges(dst_map, start, start);
+#endif /* __x86_64__ */
 				vm_map_clip_end(dst_map, tmp_entry, start);
 				tmp_entry = tmp_entry->vme_next;
 			} else {
@@ -9658,6 +10051,9 @@ vm_map_copy_overwrite_aligned(
 					/* no longer map-aligned */
 					tmp_entry->map_aligned = FALSE;
 				}
+#ifdef __x86_64__
+				vm_map_superpage_demote_edges(dst_map, start, start);
+#endif /* __x86_64__ */
 				vm_map_clip_start(dst_map, tmp_entry, start);
 			}
 		}
@@ -10633,6 +11029,9 @@ vm_map_copyin_internal(
 		 * "src_addr" to preserve map-alignment.  We'll adjust the
 		 * first copy entry at the end, if needed.
 		 */
+#ifdef __x86_64__
+		vm_map_superpage_demote_edges(src_map, src_start, src_end);
+#endif /* __x86_64__ */
 		vm_map_clip_start(src_map, tmp_entry, src_start);
 	}
 	if (src_start < tmp_entry->vme_start) {
@@ -10736,6 +11135,9 @@ vm_map_copyin_internal(
 							 &tmp_entry)) {
 					RETURN(KERN_INVALID_ADDRESS);
 				}
+#ifdef __x86_64__
+				vm_map_superpage_demote_edges(src_map, src_start, src_end);
+#endif /* __x86_64__ */
 				if (!tmp_entry->is_sub_map)
 					vm_map_clip_start(src_map, tmp_entry, src_start);
 				continue; /* restart w/ new tmp_entry */
@@ -10754,7 +11156,13 @@ vm_map_copyin_internal(
 		 *	Clip against the endpoints of the entire region.
 		 */
 
+#ifdef __x86_64__
+		vm_map_superpage_demote_edges(src_map, src_end, src_end);
+#endif /* __x86_64__ */
 		vm_map_clip_end(src_map, src_entry, src_end);
+#ifdef __x86_64__
+		vm_map_superpage_demote(src_map, src_entry, src_start, src_end);
+#endif /* __x86_64__ */
 
 		src_size = src_entry->vme_end - src_start;
 		src_object = VME_OBJECT(src_entry);
@@ -11015,6 +11423,9 @@ vm_map_copyin_internal(
 		}
 
 		src_entry = tmp_entry;
+#ifdef __x86_64__
+		vm_map_superpage_demote_edges(src_map, src_start, src_end);
+#endif /* __x86_64__ */
 		vm_map_clip_start(src_map, src_entry, src_start);
 
 		if ((((src_entry->protection & VM_PROT_READ) == VM_PROT_NONE) &&
@@ -11854,6 +12265,15 @@ vm_map_fork(
 
 		entry_size = old_entry->vme_end - old_entry->vme_start;
 
+#ifdef __x86_64__
+		if (old_entry->inheritance != VM_INHERIT_NONE) {
+			/* shared or copied: back to 4K pages */
+			vm_map_superpage_demote(old_map, old_entry,
+						old_entry->vme_start,
+						old_entry->vme_end);
+		}
+#endif /* __x86_64__ */
+
 		switch (old_entry->inheritance) {
 		case VM_INHERIT_NONE:
 			/*
@@ -12077,6 +12497,7 @@ vm_map_lookup_locked(
 	boolean_t			mask_protections;
 	boolean_t			force_copy;
 	vm_prot_t			original_fault_type;
+	struct vm_map_lookup_hint	*hint;
 
 	/*
 	 * VM_PROT_MASK means that the caller wants us to use "fault_type"
@@ -12094,29 +12515,50 @@ RetryLookup:
 	fault_type = original_fault_type;
 
 	/*
-	 *	If the map has an interesting hint, try it before calling
-	 *	full blown lookup routine.
+	 *	Threads faulting in parallel mostly keep hitting their own
+	 *	entries, so try the entry this thread found last, then the
+	 *	map's hint, before calling the full blown lookup routine.
+	 *	The thread's hint is only trusted if the map hasn't been
+	 *	write-locked since it was saved: the map is locked, so an
+	 *	unchanged generation means the entry can't have been
+	 *	clipped, unlinked or freed in the meantime.  The 32-bit
+	 *	timestamp could wrap back to the saved value while the
+	 *	thread sleeps, the 64-bit generation can't.
 	 */
-	entry = map->hint;
+	hint = &current_thread()->map_lookup_hint;
 
-	if ((entry == vm_map_to_entry(map)) ||
-	    (vaddr < entry->vme_start) || (vaddr >= entry->vme_end)) {
-		vm_map_entry_t	tmp_entry;
+	if (hint->serial == map->map_serial &&
+	    hint->generation == map->map_generation &&
+	    vaddr >= hint->start && vaddr < hint->end) {
+		entry = hint->entry;
+		assert(entry->vme_start == hint->start && entry->vme_end == hint->end);
+	} else {
+		entry = map->hint;
 
-		/*
-		 *	Entry was either not a valid hint, or the vaddr
-		 *	was not contained in the entry, so do a full lookup.
-		 */
-		if (!vm_map_lookup_entry(map, vaddr, &tmp_entry)) {
-			if((cow_sub_map_parent) && (cow_sub_map_parent != map))
-				vm_map_unlock(cow_sub_map_parent);
-			if((*real_map != map)
-			   && (*real_map != cow_sub_map_parent))
-				vm_map_unlock(*real_map);
-			return KERN_INVALID_ADDRESS;
-		}
+		if ((entry == vm_map_to_entry(map)) ||
+		    (vaddr < entry->vme_start) || (vaddr >= entry->vme_end)) {
+			vm_map_entry_t	tmp_entry;
 
-		entry = tmp_entry;
+			/*
+			 *	Entry was either not a valid hint, or the vaddr
+			 *	was not contained in the entry, so do a full lookup.
+			 */
+			if (!vm_map_lookup_entry(map, vaddr, &tmp_entry)) {
+				if((cow_sub_map_parent) && (cow_sub_map_parent != map))
+					vm_map_unlock(cow_sub_map_parent);
+				if((*real_map != map)
+				   && (*real_map != cow_sub_map_parent))
+					vm_map_unlock(*real_map);
+				return KERN_INVALID_ADDRESS;
+			}
+
+			entry = tmp_entry;
+		}
+		hint->serial = map->map_serial;
+		hint->generation = map->map_generation;
+		hint->start = entry->vme_start;
+		hint->end = entry->vme_end;
+		hint->entry = entry;
 	}
 	if(map == old_map) {
 		old_start = entry->vme_start;
@@ -12594,6 +13036,20 @@ submap_recurse:
 		}
 		fault_info->mark_zf_absent = FALSE;
 		fault_info->batch_pmap_op = FALSE;
+		fault_info->superpage_ok = FALSE;
+#ifdef __x86_64__
+		if (entry->vme_superpage_ok &&
+		    vm_superpage_mode != VM_SUPERPAGE_NEVER &&
+		    !entry->is_shared &&
+		    !entry->needs_copy &&
+		    !entry->superpage_size &&
+		    !entry->used_for_jit &&
+		    entry->wired_count == 0 &&
+		    entry->use_pmap &&
+		    !(prot & VM_PROT_EXECUTE)) {
+			fault_info->superpage_ok = TRUE;
+		}
+#endif /* __x86_64__ */
 	}
 
 	/*
@@ -13790,6 +14246,7 @@ vm_map_simplify_entry(
 	     this_entry->vme_resilient_codesign) &&
 	    (prev_entry->vme_resilient_media ==
 	     this_entry->vme_resilient_media) &&
+	    (prev_entry->vme_superpage_ok == this_entry->vme_superpage_ok) &&
 
 	    (prev_entry->wired_count == this_entry->wired_count) &&
 	    (prev_entry->user_wired_count == this_entry->user_wired_count) &&
@@ -14058,6 +14515,8 @@ vm_map_behavior_set(
 	case VM_BEHAVIOR_SEQUENTIAL:
 	case VM_BEHAVIOR_RSEQNTL:
 	case VM_BEHAVIOR_ZERO_WIRED_PAGES:
+	case VM_BEHAVIOR_SUPERPAGE:
+	case VM_BEHAVIOR_NOSUPERPAGE:
 		vm_map_lock(map);
 
 		/*
@@ -14069,6 +14528,9 @@ vm_map_behavior_set(
 		 */
 		if (vm_map_range_check(map, start, end, &temp_entry)) {
 			entry = temp_entry;
+#ifdef __x86_64__
+			vm_map_superpage_demote_edges(map, start, end);
+#endif /* __x86_64__ */
 			vm_map_clip_start(map, entry, start);
 		}
 		else {
@@ -14084,6 +14546,16 @@ vm_map_behavior_set(
 
 			if( new_behavior == VM_BEHAVIOR_ZERO_WIRED_PAGES ) {
 				entry->zero_wired_pages = TRUE;
+			} else if (new_behavior == VM_BEHAVIOR_SUPERPAGE) {
+				if (!entry->is_sub_map)
+					entry->vme_superpage_ok = TRUE;
+			} else if (new_behavior == VM_BEHAVIOR_NOSUPERPAGE) {
+				entry->vme_superpage_ok = FALSE;
+#ifdef __x86_64__
+				vm_map_superpage_demote(map, entry,
+							entry->vme_start,
+							entry->vme_end);
+#endif /* __x86_64__ */
 			} else {
 				entry->behavior = new_behavior;
 			}
@@ -14103,17 +14575,37 @@ vm_map_behavior_set(
 		return vm_map_willneed(map, start, end);
 
 	case VM_BEHAVIOR_DONTNEED:
+#ifdef __x86_64__
+		vm_map_superpage_demote_range(map, start, end);
+#endif /* __x86_64__ */
 		return vm_map_msync(map, start, end - start, VM_SYNC_DEACTIVATE | VM_SYNC_CONTIGUOUS);
 
 	case VM_BEHAVIOR_FREE:
+#ifdef __x86_64__
+		vm_map_superpage_demote_range(map, start, end);
+#endif /* __x86_64__ */
 		return vm_map_msync(map, start, end - start, VM_SYNC_KILLPAGES | VM_SYNC_CONTIGUOUS);
 
 	case VM_BEHAVIOR_REUSABLE:
+#ifdef __x86_64__
+		vm_map_superpage_demote_range(map, start, end);
+#endif /* __x86_64__ */
 		return vm_map_reusable_pages(map, start, end);
 
 	case VM_BEHAVIOR_REUSE:
 		return vm_map_reuse_pages(map, start, end);
 
+	case VM_BEHAVIOR_FAULTAROUND:
+	case VM_BEHAVIOR_NOFAULTAROUND:
+		/*
+		 * Fault-around is a property of the whole map, the
+		 * address range is ignored.
+		 */
+		vm_map_lock(map);
+		map->no_fault_around = (new_behavior == VM_BEHAVIOR_NOFAULTAROUND);
+		vm_map_unlock(map);
+		break;
+
 	case VM_BEHAVIOR_CAN_REUSE:
 		return vm_map_can_reuse(map, start, end);
 
@@ -14867,6 +15359,7 @@ vm_map_entry_insert(
 	new_entry->vme_resilient_codesign = FALSE;
 	new_entry->vme_resilient_media = FALSE;
 	new_entry->vme_atomic = FALSE;
+	new_entry->vme_superpage_ok = FALSE;
 
 	/*
 	 *	Insert the new entry into the list.
@@ -14980,6 +15473,12 @@ vm_map_remap_extract(
 		entry_size = (vm_map_size_t)(src_entry->vme_end -
 					     src_entry->vme_start);
 
+#ifdef __x86_64__
+		vm_map_superpage_demote(map, src_entry,
+					src_entry->vme_start,
+					src_entry->vme_end);
+#endif /* __x86_64__ */
+
 		if(src_entry->is_sub_map) {
 			vm_map_reference(VME_SUBMAP(src_entry));
 			object = VM_OBJECT_NULL;
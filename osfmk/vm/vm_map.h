@@ -331,7 +331,8 @@ struct vm_map_entry {
 	/* boolean_t */ vme_resilient_codesign:1,
 	/* boolean_t */ vme_resilient_media:1,
 	/* boolean_t */ vme_atomic:1, /* entry cannot be split/coalesced */
-		__unused:5;
+	/* boolean_t */ vme_superpage_ok:1, /* may use transparent superpages */
+		__unused:4;
 ;
 
 	unsigned short		wired_count;	/* can be paged if = 0 */
@@ -415,6 +416,7 @@ struct _vm_map {
 	vm_map_size_t		user_wire_size; /* current size of user locked memory in this map */
 #if __x86_64__
 	vm_map_offset_t		vmmap_high_start;
+	vm_map_size_t		superpage_wire_size; /* part of user_wire_size in transparent superpages */
 #endif /* __x86_64__ */
 
 	union {
@@ -462,9 +464,12 @@ struct _vm_map {
 	/* boolean_t */		holelistenabled:1,
 	/* boolean_t */		is_nested_map:1,
 	/* boolean_t */		map_disallow_new_exec:1, /* Disallow new executable code */
-	/* reserved */		pad:22;
+	/* boolean_t */		no_fault_around:1, /* Map only the faulting page */
+	/* reserved */		pad:21;
 	unsigned int		timestamp;	/* Version number */
 	unsigned int		color_rr;	/* next color (not protected by a lock) */
+	uint64_t		map_serial;	/* unique for the life of the system */
+	uint64_t		map_generation;	/* timestamp that doesn't wrap */
 
  	boolean_t		jit_entry_exists;
 } ;
@@ -580,15 +585,18 @@ struct vm_map_copy {
 
 #define vm_map_lock_init(map)						\
 	((map)->timestamp = 0 ,						\
+	(map)->map_generation = 0 ,					\
 	lck_rw_init(&(map)->lock, &vm_map_lck_grp, &vm_map_lck_rw_attr))
 
 #define vm_map_lock(map)		lck_rw_lock_exclusive(&(map)->lock)
 #define vm_map_unlock(map)						\
-		((map)->timestamp++ ,	lck_rw_done(&(map)->lock))
+		((map)->timestamp++ ,	(map)->map_generation++ ,		\
+		 lck_rw_done(&(map)->lock))
 #define vm_map_lock_read(map)		lck_rw_lock_shared(&(map)->lock)
 #define vm_map_unlock_read(map)		lck_rw_done(&(map)->lock)
 #define vm_map_lock_write_to_read(map)					\
-		((map)->timestamp++ ,	lck_rw_lock_exclusive_to_shared(&(map)->lock))
+		((map)->timestamp++ ,	(map)->map_generation++ ,		\
+		 lck_rw_lock_exclusive_to_shared(&(map)->lock))
 /* lock_read_to_write() returns FALSE on failure.  Macro evaluates to 
  * zero on success and non-zero value on failure.
  */
@@ -642,6 +650,19 @@ extern void vm_map_clip_end(
 	vm_map_t	map,
 	vm_map_entry_t	entry,
 	vm_map_offset_t	endaddr);
+#ifdef __x86_64__
+extern void vm_map_superpage_demote(
+	vm_map_t	map,
+	vm_map_entry_t	entry,
+	vm_map_offset_t	start,
+	vm_map_offset_t	end);
+extern void vm_map_superpage_demote_all(
+	vm_map_t	map);
+extern void vm_map_superpage_demote_edges(
+	vm_map_t	map,
+	vm_map_offset_t	start,
+	vm_map_offset_t	end);
+#endif /* __x86_64__ */
 extern boolean_t vm_map_entry_should_cow_for_true_share(
 	vm_map_entry_t	entry);
 
@@ -821,6 +842,7 @@ extern vm_object_t	vm_submap_object;
  */
 #define vm_map_entry_wait(map, interruptible)    	\
 	((map)->timestamp++ ,				\
+	 (map)->map_generation++ ,			\
 	 lck_rw_sleep(&(map)->lock, LCK_SLEEP_EXCLUSIVE|LCK_SLEEP_PROMOTED_PRI, \
 				  (event_t)&(map)->hdr,	interruptible))
 
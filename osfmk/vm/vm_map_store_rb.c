@@ -70,8 +70,7 @@ void vm_map_store_walk_rb( vm_map_t map, vm_map_entry_t *wrong_vme, vm_map_entry
 
 boolean_t vm_map_store_lookup_entry_rb( vm_map_t map, vm_map_offset_t address, vm_map_entry_t *vm_entry)
 {
-	struct vm_map_header hdr = map->hdr;
-	struct vm_map_store *rb_entry = RB_ROOT(&(hdr.rb_head_store));
+	struct vm_map_store *rb_entry = RB_ROOT(&(map->hdr.rb_head_store));
 	vm_map_entry_t cur = vm_map_to_entry(map);
 	vm_map_entry_t prev = VM_MAP_ENTRY_NULL;
 
@@ -530,6 +530,7 @@ vm_object_bootstrap(void)
 	vm_object_template.volatile_fault = FALSE;
 	vm_object_template.all_reusable = FALSE;
 	vm_object_template.blocked_access = FALSE;
+	vm_object_template.has_superpages = FALSE;
 	vm_object_template.__object2_unused_bits = 0;
 #if CONFIG_IOSCHED || UPL_DEBUG
 	vm_object_template.uplq.prev = NULL;
@@ -6485,6 +6486,7 @@ MACRO_END
 	__TRANSPOSE_FIELD(volatile_empty);
 	__TRANSPOSE_FIELD(volatile_fault);
 	__TRANSPOSE_FIELD(all_reusable);
+	__TRANSPOSE_FIELD(has_superpages);
 	assert(object1->blocked_access);
 	assert(object2->blocked_access);
 	assert(object1->__object2_unused_bits == 0);
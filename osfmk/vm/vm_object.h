@@ -128,7 +128,8 @@ struct vm_object_fault_info {
 	/* boolean_t */ cs_bypass:1,
 	/* boolean_t */	mark_zf_absent:1,
 	/* boolean_t */ batch_pmap_op:1,
-		__vm_object_fault_info_unused_bits:26;
+	/* boolean_t */ superpage_ok:1,
+		__vm_object_fault_info_unused_bits:25;
 	int		pmap_options;
 };
 
@@ -353,13 +354,14 @@ struct vm_object {
 		purgeable_queue_group:3,
 		io_tracking:1,
 		no_tag_update:1,	/*  */
+		has_superpages:1,	/* has transparent superpage runs */
 #if CONFIG_SECLUDED_MEMORY
 		eligible_for_secluded:1,
 		can_grab_secluded:1,
 #else /* CONFIG_SECLUDED_MEMORY */
 		__object3_unused_bits:2,
 #endif /* CONFIG_SECLUDED_MEMORY */
-		__object2_unused_bits:5;	/* for expansion */
+		__object2_unused_bits:4;	/* for expansion */
 
 	uint8_t			scan_collisions;
         vm_tag_t		wire_tag;
@@ -250,7 +250,7 @@ struct vm_page {
 					   (O) + the bucket lock */
 			fictitious:1,	/* Physical page doesn't exist (O) */
 	/*
-	 * IMPORTANT: the "pmapped", "xpmapped" and "clustered" bits can be modified while holding the
+	 * IMPORTANT: the "pmapped", "xpmapped", "clustered" and "prefaulted" bits can be modified while holding the
 	 * VM object "shared" lock + the page lock provided through the pmap_lock_phys_page function.
 	 * This is done in vm_fault_enter and the CONSUME_CLUSTERED macro.
 	 * It's also ok to modify them behind just the VM object "exclusive" lock.
@@ -287,7 +287,10 @@ struct vm_page {
 		        lopage:1,
 			slid:1,
 		        written_by_kernel:1,	/* page was written by kernel (i.e. decompressed) */
-			__unused_object_bits:7;  /* 7 bits available here */
+			in_superpage:1,	/* page is part of a transparent superpage (O) */
+			prefaulted:1,	/* first mapped by fault-around, not seen
+					 * referenced yet (O) or (O-shared AND pmap_page) */
+			__unused_object_bits:5;  /* 5 bits available here */
 
 #if    !defined(__arm__) && !defined(__arm64__)
 	ppnum_t		phys_page;	/* Physical address of page, passed
@@ -1025,11 +1028,21 @@ vm_map_size_t	vm_global_no_user_wire_amount;
 
 #define VPL_LOCK_SPIN 1
 
+/*
+ * Each local queue also carries a small batch of pages, already on
+ * one of the global queues, that faulting threads want activated:
+ * they're moved to the active queue all at once, by whoever fills the
+ * batch, under a single hold of the page queues lock.
+ */
+#define	VPL_BATCH_MAX	16
+
 struct vpl {
 	vm_page_queue_head_t	vpl_queue;
 	unsigned int	vpl_count;
 	unsigned int	vpl_internal_count;
 	unsigned int	vpl_external_count;
+	unsigned int	vpl_batch_count;
+	vm_page_packed_t vpl_batch[VPL_BATCH_MAX];
 #ifdef	VPL_LOCK_SPIN
 	lck_spin_t	vpl_lock;
 #else
@@ -1040,7 +1053,7 @@ struct vpl {
 
 struct	vplq {
 	union {
-		char   cache_line_pad[VM_VPLQ_ALIGNMENT];
+		char   cache_line_pad[2 * VM_VPLQ_ALIGNMENT];
 		struct vpl vpl;
 	} vpl_un;
 };
@@ -1262,6 +1275,10 @@ extern void		vm_page_release(
 	vm_page_t	page,
 	boolean_t	page_queues_locked);
 
+extern unsigned int	vm_page_free_local_count(void);
+extern void		vm_page_free_local_drain(void);
+extern void		vm_page_free_local_drain_all(void);
+
 extern boolean_t	vm_page_wait(
 					int		interruptible );
 
@@ -1311,6 +1328,12 @@ extern void		vm_page_reactivate_all_throttled(void);
 
 extern void		vm_page_reactivate_local(uint32_t lid, boolean_t force, boolean_t nolocks);
 
+extern boolean_t	vm_page_activate_deferred(
+					vm_object_t	object,
+					vm_page_t	page);
+
+extern void		vm_page_activate_batch_drain_all(void);
+
 extern void		vm_page_rename(
 					vm_page_t		page,
 					vm_object_t		new_object,
@@ -1509,6 +1532,23 @@ extern void memorystatus_pages_update(unsigned int pages_avail);
 #define vm_page_trylockspin_queues()	lck_mtx_try_lock_spin(&vm_page_queue_lock)
 #define vm_page_lockconvert_queues()	lck_mtx_convert_spin(&vm_page_queue_lock)
 
+/*
+ * How often, and for how long, the page fault path holds the page
+ * queues lock; protected by the page queues lock itself.
+ */
+extern uint64_t	vm_page_queue_fault_lock_count;
+extern uint64_t	vm_page_queue_fault_lock_abstime;
+extern uint64_t	vm_page_queue_fault_lock_max_abstime;
+
+#define VM_PAGE_QUEUE_FAULT_LOCK_HOLD_UPDATE(start)			\
+	MACRO_BEGIN							\
+	uint64_t __held = mach_absolute_time() - (start);		\
+	vm_page_queue_fault_lock_count++;				\
+	vm_page_queue_fault_lock_abstime += __held;			\
+	if (__held > vm_page_queue_fault_lock_max_abstime)		\
+		vm_page_queue_fault_lock_max_abstime = __held;		\
+	MACRO_END
+
 #ifdef	VPL_LOCK_SPIN
 #define VPL_LOCK_INIT(vlq, vpl_grp, vpl_attr) lck_spin_init(&vlq->vpl_lock, vpl_grp, vpl_attr)
 #define VPL_LOCK(vpl) lck_spin_lock(vpl)
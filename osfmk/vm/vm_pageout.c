@@ -107,6 +107,7 @@
 #include <vm/vm_purgeable_internal.h>
 #include <vm/vm_shared_region.h>
 #include <vm/vm_compressor.h>
+#include <vm/vm_superpage.h>
 
 #include <san/kasan.h>
 
@@ -318,6 +319,8 @@ struct cq {
 	void			*current_chead;
 	char			*scratch_buf;
 	int			id;
+	uint64_t		pages_compressed;
+	uint64_t		batches;
 };
 
 struct cq ciq[MAX_COMPRESSOR_THREAD_COUNT];
@@ -1885,6 +1888,13 @@ vm_pageout_scan(void)
 	vm_page_lock_queues();
 	delayed_unlock = 1;
 
+	/*
+	 *	Activate the pages the fault path left in partial batches,
+	 *	some of them on cpus that may not fault again for a while,
+	 *	before we start reclaiming from the queues they're on.
+	 */
+	vm_page_activate_batch_drain_all();
+
 	/*
 	 *	Calculate the max number of referenced pages on the inactive
 	 *	queue that we will reactivate.
@@ -3019,6 +3029,12 @@ reclaim_page:
 				SET_PAGE_DIRTY(m, FALSE);
 			}
 		}
+		if (m->prefaulted) {
+			/* first look at a page mapped by fault-around */
+			if (m->reference)
+				OSIncrementAtomic(&vm_fault_around_used);
+			m->prefaulted = FALSE;
+		}
 		
 		/*
 		 *   if (m->cleaning && !m->free_when_done)
@@ -3475,6 +3491,13 @@ vm_pageout_continue(void)
 	lck_mtx_unlock(&vm_page_queue_free_lock);
 #endif /* CONFIG_EMBEDDED */
 
+	/*
+	 * The per-processor free page magazines may hold pages that
+	 * vm_page_free_count doesn't show: return them before scanning.
+	 */
+	if (vm_page_free_count < vm_page_free_target)
+		vm_page_free_local_drain_all();
+
 	vm_pageout_scan();
 	/*
 	 * we hold both the vm_page_queue_free_lock
@@ -3746,6 +3769,10 @@ vm_pageout_iothread_internal_continue(struct cq *cq)
 		if (local_q == NULL)
 			break;
 
+		if (q->pgo_laundry > vm_compressor_queue_depth_max)
+			vm_compressor_queue_depth_max = q->pgo_laundry;
+		cq->batches++;
+
 		q->pgo_busy = TRUE;
 
 		if ((pgo_draining = q->pgo_draining) == FALSE) {
@@ -3773,6 +3800,7 @@ vm_pageout_iothread_internal_continue(struct cq *cq)
 
 			if (vm_pageout_compress_page(&cq->current_chead, cq->scratch_buf, m, FALSE) == KERN_SUCCESS) {
 				ncomps++;
+				cq->pages_compressed++;
 				m->snext = local_freeq;
 				local_freeq = m;
 				local_freed++;
@@ -4338,6 +4366,10 @@ vm_pageout_garbage_collect(int collect)
 
 			stack_collect();
 
+#ifdef __x86_64__
+			vm_superpage_pool_drain();
+			vm_superpage_reclaim();
+#endif /* __x86_64__ */
 			consider_machine_collect();
 			m_drain();
 
@@ -4530,6 +4562,10 @@ vm_pageout(void)
 
 	thread_deallocate(thread);
 
+#ifdef __x86_64__
+	vm_superpage_init();
+#endif /* __x86_64__ */
+
 #if VM_PRESSURE_EVENTS
 	result = kernel_thread_start_priority((thread_continue_t)vm_pressure_thread, NULL,
 						BASEPRI_DEFAULT,
@@ -4649,6 +4685,43 @@ int vm_compressor_thread_count = 1;
 int vm_compressor_thread_count = 2;
 #endif
 
+/*
+ * without a "vmcomp_threads" boot-arg, give large machines one
+ * compressor thread for every VM_COMPRESSOR_CPUS_PER_THREAD cpus
+ */
+#define VM_COMPRESSOR_CPUS_PER_THREAD	4
+
+/* protected by the page queues lock */
+uint32_t vm_compressor_queue_depth_max = 0;
+
+/*
+ * snapshot of the per-thread compressor stats... returns the
+ * number of threads reported, at most "count"
+ */
+int
+vm_compressor_thread_stats(
+	uint64_t	*pages,
+	uint64_t	*batches,
+	int		count)
+{
+	int	i;
+
+	if (count > vm_compressor_thread_count)
+		count = vm_compressor_thread_count;
+
+	for (i = 0; i < count; i++) {
+		pages[i] = ciq[i].pages_compressed;
+		batches[i] = ciq[i].batches;
+	}
+	return count;
+}
+
+unsigned int
+vm_compressor_queue_depth(void)
+{
+	return vm_pageout_queue_internal.pgo_laundry;
+}
+
 kern_return_t
 vm_pageout_internal_start(void)
 {
@@ -4664,7 +4737,12 @@ vm_pageout_internal_start(void)
 
 	assert(hinfo.max_cpus > 0);
 
-	PE_parse_boot_argn("vmcomp_threads", &vm_compressor_thread_count, sizeof(vm_compressor_thread_count));
+	if (!PE_parse_boot_argn("vmcomp_threads", &vm_compressor_thread_count, sizeof(vm_compressor_thread_count))) {
+#if !CONFIG_EMBEDDED
+		if (hinfo.max_cpus / VM_COMPRESSOR_CPUS_PER_THREAD > vm_compressor_thread_count)
+			vm_compressor_thread_count = hinfo.max_cpus / VM_COMPRESSOR_CPUS_PER_THREAD;
+#endif
+	}
 	if (vm_compressor_thread_count >= hinfo.max_cpus)
 		vm_compressor_thread_count = hinfo.max_cpus - 1;
 	if (vm_compressor_thread_count <= 0)
@@ -4681,6 +4759,8 @@ vm_pageout_internal_start(void)
 		ciq[i].q = &vm_pageout_queue_internal;
 		ciq[i].current_chead = NULL;
 		ciq[i].scratch_buf = kalloc(COMPRESSOR_SCRATCH_BUF_SIZE);
+		ciq[i].pages_compressed = 0;
+		ciq[i].batches = 0;
 
 		result = kernel_thread_start_priority((thread_continue_t)vm_pageout_iothread_internal, (void *)&ciq[i], BASEPRI_VM, &vm_pageout_internal_iothread);
 
@@ -6010,6 +6090,13 @@ REDISCOVER_ENTRY:
 		vm_map_lock_assert_exclusive(map);
 		assert(VME_OBJECT(entry) == local_object);
 
+#ifdef __x86_64__
+		vm_map_superpage_demote_edges(map,
+					      vm_map_trunc_page(offset,
+								VM_MAP_PAGE_MASK(map)),
+					      vm_map_round_page(offset + *upl_size,
+								VM_MAP_PAGE_MASK(map)));
+#endif /* __x86_64__ */
 		vm_map_clip_start(map,
 				  entry,
 				  vm_map_trunc_page(offset,
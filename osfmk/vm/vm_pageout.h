@@ -574,7 +574,11 @@ extern	struct vm_config	vm_config;
 #endif	/* KERNEL_PRIVATE */
 
 #ifdef XNU_KERNEL_PRIVATE
-#define MAX_COMPRESSOR_THREAD_COUNT      8
+#define MAX_COMPRESSOR_THREAD_COUNT      16
+
+extern uint32_t	vm_compressor_queue_depth_max;
+extern int	vm_compressor_thread_stats(uint64_t *pages, uint64_t *batches, int count);
+extern unsigned int vm_compressor_queue_depth(void);
 
 #if DEVELOPMENT || DEBUG
 typedef struct vmct_stats_s {
@@ -523,6 +523,15 @@ extern boolean_t vm_compressor_low_on_space(void);
 extern boolean_t vm_compressor_out_of_space(void);
 extern int	 vm_swap_low_on_space(void);
 void		 do_fastwake_warmup_all(void);
+
+/*
+ * swap-in latency histograms: bucket N counts the swap-ins that took
+ * between 2^N and 2^(N+1) usecs, the last one everything above that
+ */
+#define	C_SWAPIN_LATENCY_BUCKETS	20
+
+extern uint64_t	vm_swapin_fault_latency[C_SWAPIN_LATENCY_BUCKETS];
+extern uint64_t	vm_swapin_readahead_latency[C_SWAPIN_LATENCY_BUCKETS];
 #if CONFIG_JETSAM
 extern int proc_get_memstat_priority(struct proc*, boolean_t);
 #endif /* CONFIG_JETSAM */
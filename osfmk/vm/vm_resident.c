@@ -79,11 +79,13 @@
 #include <kern/zalloc.h>
 #include <kern/xpr.h>
 #include <kern/ledger.h>
+#include <kern/processor.h>
 #include <vm/pmap.h>
 #include <vm/vm_init.h>
 #include <vm/vm_map.h>
 #include <vm/vm_page.h>
 #include <vm/vm_pageout.h>
+#include <vm/vm_fault.h>
 #include <vm/vm_kern.h>			/* kernel_memory_allocate() */
 #include <kern/misc_protos.h>
 #include <zone_debug.h>
@@ -139,6 +141,9 @@ static void		vm_page_free_prepare(vm_page_t	page);
 static vm_page_t	vm_page_grab_fictitious_common(ppnum_t phys_addr);
 
 static void vm_tag_init(void);
+static unsigned int	vm_page_activate_batch_take(struct vpl *lq, vm_page_packed_t *batch);
+static void		vm_page_activate_batch_locked(vm_object_t object, vm_page_packed_t *batch,
+						      unsigned int count);
 
 uint64_t	vm_min_kernel_and_kext_address = VM_MIN_KERNEL_AND_KEXT_ADDRESS;
 uint32_t	vm_packed_from_vm_pages_array_mask = VM_PACKED_FROM_VM_PAGES_ARRAY;
@@ -298,6 +303,36 @@ unsigned int	vm_colors;
 unsigned int    vm_color_mask;			/* mask is == (vm_colors-1) */
 unsigned int	vm_cache_geometry_colors = 0;	/* set by hw dependent code during startup */
 unsigned int	vm_free_magazine_refill_limit = 0;
+unsigned int	vm_free_magazine_refill_min = 0;
+
+/*
+ * Per-processor free page magazines ("free_pages"): a processor that
+ * empties its magazine in less than VM_FREE_MAGAZINE_FAST_USECS gets a
+ * refill twice as big the next time, one that takes more than
+ * VM_FREE_MAGAZINE_SLOW_USECS gets one half as big, between
+ * vm_free_magazine_refill_min and vm_free_magazine_refill_limit pages.
+ */
+#define VM_FREE_MAGAZINE_FAST_USECS	1000
+#define VM_FREE_MAGAZINE_SLOW_USECS	10000
+
+static uint64_t	vm_free_magazine_fast_abstime = 0;
+static uint64_t	vm_free_magazine_slow_abstime = 0;
+
+/* protected by vm_page_queue_free_lock */
+uint64_t	vm_free_magazine_refills = 0;
+uint64_t	vm_free_magazine_refill_pages = 0;
+uint64_t	vm_free_magazine_drains = 0;
+uint64_t	vm_free_magazine_drain_pages = 0;
+uint64_t	vm_page_free_lock_hold_abstime = 0;
+uint64_t	vm_page_free_lock_hold_max_abstime = 0;
+
+#define VM_PAGE_FREE_LOCK_HOLD_UPDATE(start)				\
+	MACRO_BEGIN							\
+	uint64_t __held = mach_absolute_time() - (start);		\
+	vm_page_free_lock_hold_abstime += __held;			\
+	if (__held > vm_page_free_lock_hold_max_abstime)		\
+		vm_page_free_lock_hold_max_abstime = __held;		\
+	MACRO_END
 
 
 struct vm_page_queue_free_head {
@@ -336,6 +371,15 @@ unsigned int	vm_page_local_q_soft_limit = 250;
 unsigned int	vm_page_local_q_hard_limit = 500;
 struct vplq     *vm_page_local_q = NULL;
 
+unsigned int	vm_page_activate_batch_enabled = 1;
+/* protected by vm_page_queue_lock */
+uint64_t	vm_page_activate_batches = 0;
+uint64_t	vm_page_activate_batch_pages = 0;
+uint64_t	vm_page_activate_batch_skipped = 0;
+uint64_t	vm_page_queue_fault_lock_count = 0;
+uint64_t	vm_page_queue_fault_lock_abstime = 0;
+uint64_t	vm_page_queue_fault_lock_max_abstime = 0;
+
 /* N.B. Guard and fictitious pages must not
  * be assigned a zero phys_page value.
  */
@@ -566,11 +610,11 @@ vm_page_set_colors( void )
 	vm_color_mask = n - 1;
 
 	vm_free_magazine_refill_limit = vm_colors * COLOR_GROUPS_TO_STEAL;
+	vm_free_magazine_refill_min = vm_free_magazine_refill_limit;
 
 #if defined (__x86_64__)
-        /* adjust for reduction in colors due to clumping and multiple cores */
-	if (real_ncpus)
-		vm_free_magazine_refill_limit *= (vm_clump_size * real_ncpus);
+        /* adjust for reduction in colors due to clumping */
+	vm_free_magazine_refill_limit *= vm_clump_size;
 #endif
 }
 
@@ -638,6 +682,7 @@ vm_page_init_local_q()
 			lq->vpl_count = 0;
 			lq->vpl_internal_count = 0;
 			lq->vpl_external_count = 0;
+			lq->vpl_batch_count = 0;
 		}
 		vm_page_local_q_count = num_cpus;
 
@@ -737,6 +782,8 @@ vm_page_bootstrap(
 	m->slid = FALSE;
 	m->xpmapped = FALSE;
 	m->written_by_kernel = FALSE;
+	m->in_superpage = FALSE;
+	m->prefaulted = FALSE;
 	m->__unused_object_bits = 0;
 
 	/*
@@ -2627,6 +2674,47 @@ vm_page_grablo(void)
 }
 
 
+/*
+ * Size the next refill of "processor"'s free page magazine after the
+ * rate at which it has been emptying it.
+ *
+ * Called with preemption disabled.
+ */
+static unsigned int
+vm_free_magazine_resize(
+	processor_t	processor,
+	uint64_t	now)
+{
+	unsigned int	refill;
+	uint64_t	elapsed;
+
+	if (vm_free_magazine_fast_abstime == 0) {
+		nanoseconds_to_absolutetime(VM_FREE_MAGAZINE_FAST_USECS * NSEC_PER_USEC,
+					    &vm_free_magazine_fast_abstime);
+		nanoseconds_to_absolutetime(VM_FREE_MAGAZINE_SLOW_USECS * NSEC_PER_USEC,
+					    &vm_free_magazine_slow_abstime);
+	}
+	refill = PROCESSOR_DATA(processor, free_pages_refill);
+	elapsed = now - PROCESSOR_DATA(processor, free_pages_refill_time);
+
+	if (refill == 0)
+		refill = vm_free_magazine_refill_min;
+	else if (elapsed < vm_free_magazine_fast_abstime)
+		refill *= 2;
+	else if (elapsed > vm_free_magazine_slow_abstime)
+		refill /= 2;
+
+	if (refill > vm_free_magazine_refill_limit)
+		refill = vm_free_magazine_refill_limit;
+	if (refill < vm_free_magazine_refill_min)
+		refill = vm_free_magazine_refill_min;
+
+	PROCESSOR_DATA(processor, free_pages_refill) = refill;
+
+	return refill;
+}
+
+
 /*
  *	vm_page_grab:
  *
@@ -2681,6 +2769,7 @@ return_page_from_cpu_list:
 #endif /* HIBERNATION */
 	        PROCESSOR_DATA(current_processor(), page_grab_count) += 1;
 	        PROCESSOR_DATA(current_processor(), free_pages) = mem->snext;
+	        PROCESSOR_DATA(current_processor(), free_pages_count) -= 1;
 
 	        enable_preemption();
 		VM_PAGE_ZERO_PAGEQ_ENTRY(mem);
@@ -2758,8 +2847,11 @@ return_page_from_cpu_list:
 	       vm_page_t	head;
 	       vm_page_t	tail;
 	       unsigned int	pages_to_steal;
+	       unsigned int	pages_stolen;
+	       unsigned int	refill;
 	       unsigned int	color;
 	       unsigned int clump_end, sub_count;
+	       uint64_t		now;
 
 	       while ( vm_page_free_count == 0 ) {
 
@@ -2785,11 +2877,14 @@ return_page_from_cpu_list:
 			 */
 			goto return_page_from_cpu_list;
 		}
+		now = mach_absolute_time();
+		refill = vm_free_magazine_resize(current_processor(), now);
+
 		if (vm_page_free_count <= vm_page_free_reserved)
 		        pages_to_steal = 1;
 		else {
-			if (vm_free_magazine_refill_limit <= (vm_page_free_count - vm_page_free_reserved))
-				pages_to_steal = vm_free_magazine_refill_limit;
+			if (refill <= (vm_page_free_count - vm_page_free_reserved))
+				pages_to_steal = refill;
 			else
 			        pages_to_steal = (vm_page_free_count - vm_page_free_reserved);
 		}
@@ -2797,6 +2892,7 @@ return_page_from_cpu_list:
 		head = tail = NULL;
 
 		vm_page_free_count -= pages_to_steal;
+		pages_stolen = pages_to_steal;
 		clump_end = sub_count = 0;
 
 		while (pages_to_steal--) {
@@ -2861,6 +2957,10 @@ return_page_from_cpu_list:
 #if defined (__x86_64__) && (DEVELOPMENT || DEBUG)
 		vm_clump_update_stats(sub_count);
 #endif
+		vm_free_magazine_refills++;
+		vm_free_magazine_refill_pages += pages_stolen;
+		VM_PAGE_FREE_LOCK_HOLD_UPDATE(now);
+
 		lck_mtx_unlock(&vm_page_queue_free_lock);
 
 #if HIBERNATION
@@ -2869,6 +2969,8 @@ return_page_from_cpu_list:
 		}
 #endif /* HIBERNATION */
 		PROCESSOR_DATA(current_processor(), free_pages) = head->snext;
+		PROCESSOR_DATA(current_processor(), free_pages_count) = pages_stolen - 1;
+		PROCESSOR_DATA(current_processor(), free_pages_refill_time) = now;
 		PROCESSOR_DATA(current_processor(), start_color) = color;
 
 		/*
@@ -3051,6 +3153,327 @@ vm_page_grab_secluded(void)
 }
 #endif /* CONFIG_SECLUDED_MEMORY */
 
+/*
+ *	vm_page_free_local:
+ *
+ *	Stash the pages of "list" (chained through "snext", "*count" of
+ *	them) in the current processor's free page magazine, where the
+ *	next vm_page_grab() on this processor will find them without
+ *	taking the free queue lock.  This is only done while the free
+ *	count is healthy and nobody is waiting for a free page.
+ *	A full magazine gets half of its pages drained back along with
+ *	the pages that didn't fit, so that the next frees are cheap too.
+ *
+ *	Returns the pages to release to the global free queues and
+ *	updates "*count" accordingly; "*drained" is set to the number
+ *	of those that came out of the magazine.
+ */
+static vm_page_t
+vm_page_free_local(
+	vm_page_t	list,
+	unsigned int	*count,
+	unsigned int	*drained)
+{
+	processor_t	processor;
+	vm_page_t	mem;
+	unsigned int	n, max;
+
+	*drained = 0;
+
+	if (vm_page_free_count < vm_page_free_target ||
+	    vm_page_free_wanted != 0 ||
+	    vm_page_free_wanted_privileged != 0)
+		return list;
+#if CONFIG_SECLUDED_MEMORY
+	if (vm_page_free_wanted_secluded != 0)
+		return list;
+#endif /* CONFIG_SECLUDED_MEMORY */
+#if HIBERNATION
+	if (hibernate_rebuild_needed)
+		return list;
+#endif /* HIBERNATION */
+
+	disable_preemption();
+	processor = current_processor();
+
+	n = PROCESSOR_DATA(processor, free_pages_count);
+	max = 2 * PROCESSOR_DATA(processor, free_pages_refill);
+	if (max < 2 * vm_free_magazine_refill_min)
+		max = 2 * vm_free_magazine_refill_min;
+
+	while (list != VM_PAGE_NULL && n < max) {
+		mem = list;
+		list = mem->snext;
+
+		assert(mem->vm_page_q_state == VM_PAGE_NOT_ON_Q);
+		assert(mem->busy);
+		mem->lopage = FALSE;
+		mem->vm_page_q_state = VM_PAGE_ON_FREE_LOCAL_Q;
+		mem->snext = PROCESSOR_DATA(processor, free_pages);
+		PROCESSOR_DATA(processor, free_pages) = mem;
+		n++;
+		(*count)--;
+	}
+	if (list != VM_PAGE_NULL) {
+		while (n > max / 2) {
+			mem = PROCESSOR_DATA(processor, free_pages);
+			PROCESSOR_DATA(processor, free_pages) = mem->snext;
+
+			assert(mem->vm_page_q_state == VM_PAGE_ON_FREE_LOCAL_Q);
+			mem->vm_page_q_state = VM_PAGE_NOT_ON_Q;
+			mem->snext = list;
+			list = mem;
+			n--;
+			(*count)++;
+			(*drained)++;
+		}
+	}
+	PROCESSOR_DATA(processor, free_pages_count) = n;
+
+	enable_preemption();
+
+	return list;
+}
+
+/*
+ *	vm_page_free_local_count:
+ *
+ *	Number of free pages sitting in the per-processor magazines,
+ *	which vm_page_free_count doesn't include.  Only a snapshot.
+ */
+unsigned int
+vm_page_free_local_count(void)
+{
+	processor_t	processor;
+	unsigned int	count = 0;
+
+	for (processor = processor_list;
+	     processor != PROCESSOR_NULL;
+	     processor = processor->processor_list)
+		count += PROCESSOR_DATA(processor, free_pages_count);
+
+	return count;
+}
+
+/*
+ *	vm_page_release_list:
+ *
+ *	Put "pg_count" pages chained through "snext" on the global free
+ *	queues, taking the free queue lock only once, and wake up as many
+ *	waiters as these pages can satisfy.
+ */
+static void
+vm_page_release_list(
+	vm_page_t	mem,
+	unsigned int	pg_count,
+	unsigned int	drained)
+{
+	vm_page_t	nxt;
+	unsigned int	avail_free_count;
+	unsigned int	need_wakeup = 0;
+	unsigned int	need_priv_wakeup = 0;
+#if CONFIG_SECLUDED_MEMORY
+	unsigned int	need_wakeup_secluded = 0;
+#endif /* CONFIG_SECLUDED_MEMORY */
+	uint64_t	hold_start;
+
+	lck_mtx_lock_spin(&vm_page_queue_free_lock);
+	hold_start = mach_absolute_time();
+
+	while (mem) {
+		int	color;
+
+		nxt = mem->snext;
+
+		assert(mem->vm_page_q_state == VM_PAGE_NOT_ON_Q);
+		assert(mem->busy);
+		mem->lopage = FALSE;
+		mem->vm_page_q_state = VM_PAGE_ON_FREE_Q;
+
+		color = VM_PAGE_GET_COLOR(mem);
+#if defined(__x86_64__)
+		vm_page_queue_enter_clump(&vm_page_queue_free[color].qhead,
+					  mem,
+					  vm_page_t,
+					  pageq);
+#else
+		vm_page_queue_enter(&vm_page_queue_free[color].qhead,
+					  mem,
+					  vm_page_t,
+					  pageq);
+#endif
+		mem = nxt;
+	}
+	vm_page_free_count += pg_count;
+	avail_free_count = vm_page_free_count;
+
+	if (vm_page_free_wanted_privileged > 0 && avail_free_count > 0) {
+
+		if (avail_free_count < vm_page_free_wanted_privileged) {
+			need_priv_wakeup = avail_free_count;
+			vm_page_free_wanted_privileged -= avail_free_count;
+			avail_free_count = 0;
+		} else {
+			need_priv_wakeup = vm_page_free_wanted_privileged;
+			avail_free_count -= vm_page_free_wanted_privileged;
+			vm_page_free_wanted_privileged = 0;
+		}
+	}
+#if CONFIG_SECLUDED_MEMORY
+	if (vm_page_free_wanted_secluded > 0 &&
+	    avail_free_count > vm_page_free_reserved) {
+		unsigned int available_pages;
+		available_pages = (avail_free_count -
+				   vm_page_free_reserved);
+		if (available_pages <
+		    vm_page_free_wanted_secluded) {
+			need_wakeup_secluded = available_pages;
+			vm_page_free_wanted_secluded -=
+				available_pages;
+			avail_free_count -= available_pages;
+		} else {
+			need_wakeup_secluded =
+				vm_page_free_wanted_secluded;
+			avail_free_count -=
+				vm_page_free_wanted_secluded;
+			vm_page_free_wanted_secluded = 0;
+		}
+	}
+#endif /* CONFIG_SECLUDED_MEMORY */
+	if (vm_page_free_wanted > 0 && avail_free_count > vm_page_free_reserved) {
+		unsigned int  available_pages;
+
+		available_pages = avail_free_count - vm_page_free_reserved;
+
+		if (available_pages >= vm_page_free_wanted) {
+			need_wakeup = vm_page_free_wanted;
+			vm_page_free_wanted = 0;
+		} else {
+			need_wakeup = available_pages;
+			vm_page_free_wanted -= available_pages;
+		}
+	}
+	if (drained) {
+		vm_free_magazine_drains++;
+		vm_free_magazine_drain_pages += drained;
+	}
+	VM_PAGE_FREE_LOCK_HOLD_UPDATE(hold_start);
+
+	lck_mtx_unlock(&vm_page_queue_free_lock);
+
+	if (need_priv_wakeup != 0) {
+		/*
+		 * There shouldn't be that many VM-privileged threads,
+		 * so let's wake them all up, even if we don't quite
+		 * have enough pages to satisfy them all.
+		 */
+		thread_wakeup((event_t)&vm_page_free_wanted_privileged);
+	}
+#if CONFIG_SECLUDED_MEMORY
+	if (need_wakeup_secluded != 0 &&
+	    vm_page_free_wanted_secluded == 0) {
+		thread_wakeup((event_t)
+			      &vm_page_free_wanted_secluded);
+	} else {
+		for (;
+		     need_wakeup_secluded != 0;
+		     need_wakeup_secluded--) {
+			thread_wakeup_one(
+				(event_t)
+				&vm_page_free_wanted_secluded);
+		}
+	}
+#endif /* CONFIG_SECLUDED_MEMORY */
+	if (need_wakeup != 0 && vm_page_free_wanted == 0) {
+		/*
+		 * We don't expect to have any more waiters
+		 * after this, so let's wake them all up at
+		 * once.
+		 */
+		thread_wakeup((event_t) &vm_page_free_count);
+	} else for (; need_wakeup != 0; need_wakeup--) {
+		/*
+		 * Wake up one waiter per page we just released.
+		 */
+		thread_wakeup_one((event_t) &vm_page_free_count);
+	}
+
+	VM_CHECK_MEMORYSTATUS;
+}
+
+/*
+ *	vm_page_free_local_drain:
+ *
+ *	Give all the pages of the current processor's free page magazine
+ *	back to the global free queues, where vm_page_free_count accounts
+ *	for them and other processors can grab them.
+ */
+void
+vm_page_free_local_drain(void)
+{
+	processor_t	processor;
+	vm_page_t	list, mem;
+	unsigned int	count;
+
+#if HIBERNATION
+	if (hibernate_rebuild_needed)
+		return;
+#endif /* HIBERNATION */
+
+	disable_preemption();
+	processor = current_processor();
+
+	list = PROCESSOR_DATA(processor, free_pages);
+	count = PROCESSOR_DATA(processor, free_pages_count);
+	PROCESSOR_DATA(processor, free_pages) = VM_PAGE_NULL;
+	PROCESSOR_DATA(processor, free_pages_count) = 0;
+	/* start over from the smallest refill */
+	PROCESSOR_DATA(processor, free_pages_refill) = 0;
+
+	enable_preemption();
+
+	if (list == VM_PAGE_NULL)
+		return;
+
+	for (mem = list; mem != VM_PAGE_NULL; mem = mem->snext) {
+		assert(mem->vm_page_q_state == VM_PAGE_ON_FREE_LOCAL_Q);
+		mem->vm_page_q_state = VM_PAGE_NOT_ON_Q;
+	}
+	vm_page_release_list(list, count, count);
+}
+
+/*
+ *	vm_page_free_local_drain_all:
+ *
+ *	Drain the free page magazines of all the running processors,
+ *	by running on each of them in turn.  Called by the pageout
+ *	daemon when the free count falls below its target.
+ */
+void
+vm_page_free_local_drain_all(void)
+{
+	processor_t	processor, prev;
+
+	for (processor = processor_list;
+	     processor != PROCESSOR_NULL;
+	     processor = processor->processor_list) {
+		if (PROCESSOR_DATA(processor, free_pages_count) == 0)
+			continue;
+		if (processor->state != PROCESSOR_RUNNING &&
+		    processor->state != PROCESSOR_IDLE &&
+		    processor->state != PROCESSOR_DISPATCHING)
+			continue;
+
+		prev = thread_bind(processor);
+		thread_block(THREAD_CONTINUE_NULL);
+
+		vm_page_free_local_drain();
+
+		thread_bind(prev);
+	}
+	thread_block(THREAD_CONTINUE_NULL);
+}
+
 /*
  *	vm_page_release:
  *
@@ -3083,6 +3506,26 @@ vm_page_release(
 
 	pmap_clear_noencrypt(VM_PAGE_GET_PHYS_PAGE(mem));
 
+	if (mem->lopage == FALSE && vm_lopage_refill == FALSE
+#if CONFIG_SECLUDED_MEMORY
+	    && !(vm_page_secluded_count < vm_page_secluded_target &&
+		 num_tasks_can_use_secluded_mem == 0)
+#endif /* CONFIG_SECLUDED_MEMORY */
+	    ) {
+		unsigned int	pg_count = 1;
+		unsigned int	drained;
+
+		assert(mem->pageq.next == 0 && mem->pageq.prev == 0);
+
+		mem = vm_page_free_local(mem, &pg_count, &drained);
+		if (mem == VM_PAGE_NULL)
+			return;
+		if (pg_count > 1) {
+			vm_page_release_list(mem, pg_count, drained);
+			return;
+		}
+	}
+
 	lck_mtx_lock_spin(&vm_page_queue_free_lock);
 
 	assert(mem->vm_page_q_state == VM_PAGE_NOT_ON_Q);
@@ -3284,6 +3727,14 @@ vm_page_wait(
 	int          	need_wakeup = 0;
 	int		is_privileged = current_thread()->options & TH_OPT_VMPRIV;
 
+	/*
+	 * Pages in our processor's magazine aren't in vm_page_free_count:
+	 * put them back before deciding to wait.  The pageout daemon
+	 * drains the other processors' magazines.
+	 */
+	if (vm_page_free_count < vm_page_free_target)
+		vm_page_free_local_drain();
+
 	lck_mtx_lock_spin(&vm_page_queue_free_lock);
 
 	if (is_privileged && vm_page_free_count) {
@@ -3518,6 +3969,13 @@ vm_page_free_prepare_object(
 	vm_page_t	mem,
 	boolean_t	remove_from_hash)
 {
+	if (mem->prefaulted) {
+		/* mapped by fault-around: did anyone use it? */
+		if (mem->reference ||
+		    (pmap_get_refmod(VM_PAGE_GET_PHYS_PAGE(mem)) & VM_MEM_REFERENCED))
+			OSIncrementAtomic(&vm_fault_around_used);
+		mem->prefaulted = FALSE;
+	}
 	if (mem->tabled)
 		vm_page_remove(mem, remove_from_hash);	/* clears tabled, object, offset */
 
@@ -3602,7 +4060,7 @@ vm_page_free_list(
         vm_page_t	mem;
         vm_page_t	nxt;
 	vm_page_t	local_freeq;
-	int		pg_count;
+	unsigned int	pg_count;
 
 	LCK_MTX_ASSERT(&vm_page_queue_lock, LCK_MTX_ASSERT_NOTOWNED);
 	LCK_MTX_ASSERT(&vm_page_queue_free_lock, LCK_MTX_ASSERT_NOTOWNED);
@@ -3676,129 +4134,14 @@ vm_page_free_list(
 		}
 		freeq = mem;
 
-		if ( (mem = local_freeq) ) {
-			unsigned int	avail_free_count;
-			unsigned int	need_wakeup = 0;
-			unsigned int	need_priv_wakeup = 0;
-#if CONFIG_SECLUDED_MEMORY
-			unsigned int	need_wakeup_secluded = 0;
-#endif /* CONFIG_SECLUDED_MEMORY */
-	  
-			lck_mtx_lock_spin(&vm_page_queue_free_lock);
-
-			while (mem) {
-				int	color;
+		if (local_freeq != VM_PAGE_NULL) {
+			unsigned int	drained = 0;
 
-				nxt = mem->snext;
-
-				assert(mem->vm_page_q_state == VM_PAGE_NOT_ON_Q);
-				assert(mem->busy);
-				mem->lopage = FALSE;
-				mem->vm_page_q_state = VM_PAGE_ON_FREE_Q;
-
-				color = VM_PAGE_GET_COLOR(mem);
-#if defined(__x86_64__)
-				vm_page_queue_enter_clump(&vm_page_queue_free[color].qhead,
-							  mem,
-							  vm_page_t,
-							  pageq);
-#else
-				vm_page_queue_enter(&vm_page_queue_free[color].qhead,
-							  mem,
-							  vm_page_t,
-							  pageq);
-#endif
-				mem = nxt;
-			}
-			vm_page_free_count += pg_count;
-			avail_free_count = vm_page_free_count;
-
-			if (vm_page_free_wanted_privileged > 0 && avail_free_count > 0) {
-
-				if (avail_free_count < vm_page_free_wanted_privileged) {
-					need_priv_wakeup = avail_free_count;
-					vm_page_free_wanted_privileged -= avail_free_count;
-					avail_free_count = 0;
-				} else {
-					need_priv_wakeup = vm_page_free_wanted_privileged;
-					avail_free_count -= vm_page_free_wanted_privileged;
-					vm_page_free_wanted_privileged = 0;
-				}
-			}
-#if CONFIG_SECLUDED_MEMORY
-			if (vm_page_free_wanted_secluded > 0 &&
-			    avail_free_count > vm_page_free_reserved) {
-				unsigned int available_pages;
-				available_pages = (avail_free_count -
-						   vm_page_free_reserved);
-				if (available_pages <
-				    vm_page_free_wanted_secluded) {
-					need_wakeup_secluded = available_pages;
-					vm_page_free_wanted_secluded -=
-						available_pages;
-					avail_free_count -= available_pages;
-				} else {
-					need_wakeup_secluded =
-						vm_page_free_wanted_secluded;
-					avail_free_count -=
-						vm_page_free_wanted_secluded;
-					vm_page_free_wanted_secluded = 0;
-				}
-			}
-#endif /* CONFIG_SECLUDED_MEMORY */
-			if (vm_page_free_wanted > 0 && avail_free_count > vm_page_free_reserved) {
-				unsigned int  available_pages;
-
-				available_pages = avail_free_count - vm_page_free_reserved;
-
-				if (available_pages >= vm_page_free_wanted) {
-					need_wakeup = vm_page_free_wanted;
-					vm_page_free_wanted = 0;
-				} else {
-					need_wakeup = available_pages;
-					vm_page_free_wanted -= available_pages;
-				}
-			}
-			lck_mtx_unlock(&vm_page_queue_free_lock);
-
-			if (need_priv_wakeup != 0) {
-				/*
-				 * There shouldn't be that many VM-privileged threads,
-				 * so let's wake them all up, even if we don't quite
-				 * have enough pages to satisfy them all.
-				 */
-				thread_wakeup((event_t)&vm_page_free_wanted_privileged);
-			}
-#if CONFIG_SECLUDED_MEMORY
-			if (need_wakeup_secluded != 0 &&
-			    vm_page_free_wanted_secluded == 0) {
-				thread_wakeup((event_t)
-					      &vm_page_free_wanted_secluded);
-			} else {
-				for (;
-				     need_wakeup_secluded != 0;
-				     need_wakeup_secluded--) {
-					thread_wakeup_one(
-						(event_t)
-						&vm_page_free_wanted_secluded);
-				}
-			}
-#endif /* CONFIG_SECLUDED_MEMORY */
-			if (need_wakeup != 0 && vm_page_free_wanted == 0) {
-				/*
-				 * We don't expect to have any more waiters
-				 * after this, so let's wake them all up at
-				 * once.
-				 */
-				thread_wakeup((event_t) &vm_page_free_count);
-			} else for (; need_wakeup != 0; need_wakeup--) {
-				/*
-				 * Wake up one waiter per page we just released.
-				 */
-				thread_wakeup_one((event_t) &vm_page_free_count);
-			}
-
-			VM_CHECK_MEMORYSTATUS;
+			local_freeq = vm_page_free_local(local_freeq,
+							 &pg_count, &drained);
+			if (local_freeq != VM_PAGE_NULL)
+				vm_page_release_list(local_freeq, pg_count,
+						     drained);
 		}
 	}
 }
@@ -4444,6 +4787,8 @@ vm_page_reactivate_all_throttled(void)
 	extra_internal_count = 0;
 	extra_external_count = 0;
 	vm_page_lock_queues();
+	/* the pages held back in partial batches too */
+	vm_page_activate_batch_drain_all();
 	if (! vm_page_queue_empty(&vm_page_queue_throttled)) {
 		/*
 		 * Switch "throttled" pages to "active".
@@ -4520,6 +4865,8 @@ vm_page_reactivate_local(uint32_t lid, boolean_t force, boolean_t nolocks)
 	vm_page_t	first_active;
 	vm_page_t	m;
 	uint32_t	count = 0;
+	vm_page_packed_t batch[VPL_BATCH_MAX];
+	unsigned int	batch_count;
 
 	if (vm_page_local_q == NULL)
 		return;
@@ -4535,6 +4882,15 @@ vm_page_reactivate_local(uint32_t lid, boolean_t force, boolean_t nolocks)
 
 		VPL_LOCK(&lq->vpl_lock);
 	}
+	/*
+	 * the batch goes along with the local queue, full or not...
+	 * on the hibernate path, just drop it: its pages are still
+	 * on their global queues
+	 */
+	batch_count = vm_page_activate_batch_take(lq, batch);
+	if (nolocks == TRUE)
+		batch_count = 0;
+
 	if (lq->vpl_count) {
 		/*
 		 * Switch "local" pages to "active".
@@ -4593,10 +4949,182 @@ vm_page_reactivate_local(uint32_t lid, boolean_t force, boolean_t nolocks)
 
 	if (nolocks == FALSE) {
 		VPL_UNLOCK(&lq->vpl_lock);
+		if (batch_count)
+			vm_page_activate_batch_locked(VM_OBJECT_NULL, batch, batch_count);
 		vm_page_unlock_queues();
 	}
 }
 
+
+/*
+ * take the pages out of local queue "lq"'s batch, full or not, and
+ * return how many there were... the local queue's lock must be held
+ */
+static unsigned int
+vm_page_activate_batch_take(
+	struct vpl		*lq,
+	vm_page_packed_t	*batch)
+{
+	unsigned int	count;
+
+	count = lq->vpl_batch_count;
+	if (count)
+		bcopy(lq->vpl_batch, batch, count * sizeof (batch[0]));
+	lq->vpl_batch_count = 0;
+
+	return count;
+}
+
+/*
+ * apply a batch of deferred activations... the pages weren't pinned
+ * while they sat in the batch, so each one is only activated if it's
+ * still on one of the queues it was deferred from, and if we can get
+ * at least a shared lock on its object without waiting for it.
+ * "object" is the one the caller already holds locked, if any.
+ * The page queues lock must be held.
+ */
+static void
+vm_page_activate_batch_locked(
+	vm_object_t		object,
+	vm_page_packed_t	*batch,
+	unsigned int		count)
+{
+	vm_page_t	m;
+	vm_object_t	m_object;
+	unsigned int	i, skipped = 0;
+
+	LCK_MTX_ASSERT(&vm_page_queue_lock, LCK_MTX_ASSERT_OWNED);
+
+	for (i = 0; i < count; i++) {
+		m = (vm_page_t) VM_PAGE_UNPACK_PTR(batch[i]);
+
+		if ((m->vm_page_q_state != VM_PAGE_ON_SPECULATIVE_Q &&
+		     m->vm_page_q_state != VM_PAGE_ON_INACTIVE_CLEANED_Q) ||
+		    VM_PAGE_WIRED(m) || m->laundry || m->no_cache) {
+			/* already moved along by someone else */
+			skipped++;
+			continue;
+		}
+		m_object = VM_PAGE_OBJECT(m);
+
+		if (m_object != object) {
+			if (m_object == VM_OBJECT_NULL ||
+			    !vm_object_lock_try_shared(m_object)) {
+				skipped++;
+				continue;
+			}
+		}
+		if (m->vm_page_q_state == VM_PAGE_ON_INACTIVE_CLEANED_Q) {
+			vm_page_queues_remove(m, FALSE);
+
+			vm_pageout_cleaned_reactivated++;
+			vm_pageout_cleaned_fault_reactivated++;
+		}
+		vm_page_activate(m);
+
+		if (m_object != object)
+			vm_object_unlock(m_object);
+	}
+	vm_page_activate_batches++;
+	vm_page_activate_batch_pages += count - skipped;
+	vm_page_activate_batch_skipped += skipped;
+}
+
+/*
+ * apply a full batch from the fault path
+ */
+static void
+vm_page_activate_batch(
+	vm_object_t		object,
+	vm_page_packed_t	*batch,
+	unsigned int		count)
+{
+	uint64_t	start;
+
+	vm_page_lockspin_queues();
+	start = mach_absolute_time();
+
+	vm_page_activate_batch_locked(object, batch, count);
+
+	VM_PAGE_QUEUE_FAULT_LOCK_HOLD_UPDATE(start);
+	vm_page_unlock_queues();
+}
+
+/*
+ * apply every cpu's batch, full or not, so that pages don't stay
+ * behind in the batch of a cpu that has stopped faulting (idle, or
+ * going offline)... the page queues lock must be held
+ */
+void
+vm_page_activate_batch_drain_all(void)
+{
+	vm_page_packed_t	batch[VPL_BATCH_MAX];
+	struct vpl		*lq;
+	unsigned int		count;
+	uint32_t		lid;
+
+	if (vm_page_local_q == NULL)
+		return;
+
+	for (lid = 0; lid < vm_page_local_q_count; lid++) {
+		lq = &vm_page_local_q[lid].vpl_un.vpl;
+
+		if (lq->vpl_batch_count == 0)
+			continue;
+
+		VPL_LOCK(&lq->vpl_lock);
+		count = vm_page_activate_batch_take(lq, batch);
+		VPL_UNLOCK(&lq->vpl_lock);
+
+		if (count)
+			vm_page_activate_batch_locked(VM_OBJECT_NULL, batch, count);
+	}
+}
+
+/*
+ * queue "m" for activation on the current cpu's batch instead of
+ * moving it to the active queue right away, so that the fault path
+ * takes the page queues lock once every VPL_BATCH_MAX pages rather than
+ * for each of them.  The page must be on a global pageable queue and its
+ * object ("object") locked; returns FALSE if batching isn't available,
+ * in which case the caller has to activate the page itself.
+ */
+boolean_t
+vm_page_activate_deferred(
+	vm_object_t	object,
+	vm_page_t	m)
+{
+	vm_page_packed_t	batch[VPL_BATCH_MAX];
+	struct vpl		*lq;
+	unsigned int		count = 0;
+
+	if (vm_page_local_q == NULL || !vm_page_activate_batch_enabled)
+		return FALSE;
+
+	vm_object_lock_assert_held(object);
+	assert(VM_PAGE_OBJECT(m) == object);
+
+	lq = &vm_page_local_q[cpu_number()].vpl_un.vpl;
+
+	VPL_LOCK(&lq->vpl_lock);
+	lq->vpl_batch[lq->vpl_batch_count++] = VM_PAGE_PACK_PTR(m);
+
+	if (lq->vpl_batch_count == VPL_BATCH_MAX) {
+		/*
+		 * the page queues lock is taken before the
+		 * local queue's lock, so take the batch off
+		 * the local queue before applying it
+		 */
+		count = vm_page_activate_batch_take(lq, batch);
+	}
+	VPL_UNLOCK(&lq->vpl_lock);
+
+	if (count)
+		vm_page_activate_batch(object, batch, count);
+
+	return TRUE;
+}
+
 /*
  *	vm_page_part_zero_fill:
  *
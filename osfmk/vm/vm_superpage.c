@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2017 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#include <kern/kern_types.h>
+#include <kern/locks.h>
+#include <kern/processor.h>
+#include <kern/task.h>
+#include <kern/thread.h>
+#include <kern/sched_prim.h>
+
+#include <vm/cpm.h>
+#include <vm/pmap.h>
+#include <vm/vm_map.h>
+#include <vm/vm_object.h>
+#include <vm/vm_page.h>
+#include <vm/vm_pageout.h>
+#include <vm/vm_superpage.h>
+
+#include <libkern/OSAtomic.h>
+
+unsigned int	vm_superpage_mode = VM_SUPERPAGE_MADVISE;
+unsigned int	vm_superpage_pool_target = 4;
+unsigned int	vm_superpage_pool_runs = 0;
+unsigned int	vm_superpage_promotions = 0;
+unsigned int	vm_superpage_promote_failures = 0;
+unsigned int	vm_superpage_demotions = 0;
+
+/*
+ * Pre-zeroed runs of SUPERPAGE_NBASEPAGES wired pages, each one a list
+ * chained through NEXT_PAGE() as returned by cpm_allocate().
+ */
+static vm_page_t	vm_superpage_pool[VM_SUPERPAGE_POOL_MAX];
+
+static lck_grp_t	vm_superpage_lck_grp;
+decl_lck_mtx_data(static, vm_superpage_lock);
+
+/* position in the tasks list of the next map to reclaim from */
+static unsigned int	vm_superpage_reclaim_cursor = 0;
+
+/* back off for that long when no run could be assembled */
+#define	VM_SUPERPAGE_RETRY_MSECS	1000
+
+static void	vm_superpage_thread(void);
+static void	vm_superpage_run_free(vm_page_t pages);
+
+/*
+ * Only grow the pool while the free list can afford it: assembling a run
+ * relocates in-use pages and the runs are taken out of the free count.
+ */
+#define	VM_SUPERPAGE_CAN_FILL()						\
+	(vm_superpage_mode != VM_SUPERPAGE_NEVER &&			\
+	 vm_page_free_count > vm_page_free_target + 2 * SUPERPAGE_NBASEPAGES)
+
+void
+vm_superpage_init(void)
+{
+	thread_t	thread;
+	kern_return_t	result;
+
+	lck_grp_init(&vm_superpage_lck_grp, "vm_superpage", LCK_GRP_ATTR_NULL);
+	lck_mtx_init(&vm_superpage_lock, &vm_superpage_lck_grp, LCK_ATTR_NULL);
+
+	if (vm_superpage_pool_target > VM_SUPERPAGE_POOL_MAX)
+		vm_superpage_pool_target = VM_SUPERPAGE_POOL_MAX;
+
+	result = kernel_thread_start_priority((thread_continue_t)vm_superpage_thread,
+					      NULL, BASEPRI_DEFAULT, &thread);
+	if (result != KERN_SUCCESS)
+		panic("vm_superpage_thread: create failed");
+
+	thread_set_thread_name(thread, "VM_superpage");
+	thread_deallocate(thread);
+}
+
+/*
+ * Take a pre-zeroed run out of the pool; VM_PAGE_NULL if it is empty.
+ * The pool thread is woken up to replace it.
+ */
+vm_page_t
+vm_superpage_pool_get(void)
+{
+	vm_page_t	pages = VM_PAGE_NULL;
+
+	lck_mtx_lock(&vm_superpage_lock);
+	if (vm_superpage_pool_runs > 0) {
+		pages = vm_superpage_pool[--vm_superpage_pool_runs];
+		vm_superpage_pool[vm_superpage_pool_runs] = VM_PAGE_NULL;
+	}
+	lck_mtx_unlock(&vm_superpage_lock);
+
+	thread_wakeup((event_t) &vm_superpage_pool_runs);
+
+	return pages;
+}
+
+/*
+ * Give all the pooled runs back to the free list.
+ * Called from the garbage collection thread under memory pressure.
+ */
+void
+vm_superpage_pool_drain(void)
+{
+	vm_page_t	runs[VM_SUPERPAGE_POOL_MAX];
+	unsigned int	count, i;
+
+	if (vm_superpage_pool_runs == 0)
+		return;
+
+	lck_mtx_lock(&vm_superpage_lock);
+	count = vm_superpage_pool_runs;
+	for (i = 0; i < count; i++) {
+		runs[i] = vm_superpage_pool[i];
+		vm_superpage_pool[i] = VM_PAGE_NULL;
+	}
+	vm_superpage_pool_runs = 0;
+	lck_mtx_unlock(&vm_superpage_lock);
+
+	for (i = 0; i < count; i++)
+		vm_superpage_run_free(runs[i]);
+}
+
+/*
+ * Demote the promoted runs of every task, so that the pageout daemon
+ * can reclaim their pages.  Called from the garbage collection thread
+ * under memory pressure, after the pool has been drained; no run gets
+ * promoted again until the free count is back above its target.
+ */
+void
+vm_superpage_reclaim(void)
+{
+	task_t		task;
+	vm_map_t	map, first;
+	unsigned int	pos, first_pos;
+	int		passes;
+
+	if (vm_superpage_promotions == vm_superpage_demotions)
+		return;
+
+	/*
+	 * One map per pass: the tasks lock can't be held while demoting.
+	 * Each pass resumes after the map demoted last, wrapping around,
+	 * so that a map that keeps its runs can't starve the others.
+	 */
+	for (passes = 0; passes < tasks_count; passes++) {
+		map = first = VM_MAP_NULL;
+		pos = first_pos = 0;
+		lck_mtx_lock(&tasks_threads_lock);
+		queue_iterate(&tasks, task, task_t, tasks) {
+			if (task != kernel_task &&
+			    task->map != VM_MAP_NULL &&
+			    task->map->superpage_wire_size != 0) {
+				if (pos >= vm_superpage_reclaim_cursor) {
+					map = task->map;
+					break;
+				}
+				if (first == VM_MAP_NULL) {
+					first = task->map;
+					first_pos = pos;
+				}
+			}
+			pos++;
+		}
+		if (map == VM_MAP_NULL) {
+			map = first;
+			pos = first_pos;
+		}
+		if (map != VM_MAP_NULL) {
+			vm_map_reference(map);
+			vm_superpage_reclaim_cursor = pos + 1;
+		}
+		lck_mtx_unlock(&tasks_threads_lock);
+
+		if (map == VM_MAP_NULL)
+			break;
+		vm_map_superpage_demote_all(map);
+		vm_map_deallocate(map);
+	}
+}
+
+/*
+ * Is the run starting at "offset" in "object" mapped as a superpage?
+ * The object must be locked.
+ */
+boolean_t
+vm_superpage_promoted(
+	vm_object_t		object,
+	vm_object_offset_t	offset)
+{
+	vm_page_t	m;
+
+	vm_object_lock_assert_held(object);
+
+	if (!object->has_superpages)
+		return FALSE;
+	m = vm_page_lookup(object, offset);
+	return (m != VM_PAGE_NULL && m->in_superpage);
+}
+
+/*
+ * Turn the pages of the promoted run starting at "offset" back into
+ * ordinary pageable pages.  The caller has already removed the 2MB
+ * mapping; the object must be locked exclusively.
+ */
+void
+vm_superpage_release(
+	vm_object_t		object,
+	vm_object_offset_t	offset)
+{
+	vm_object_offset_t	end;
+	vm_page_t		m;
+
+	vm_object_lock_assert_exclusive(object);
+
+	vm_page_lockspin_queues();
+	for (end = offset + SUPERPAGE_SIZE; offset < end; offset += PAGE_SIZE) {
+		m = vm_page_lookup(object, offset);
+		if (m == VM_PAGE_NULL || !m->in_superpage)
+			continue;
+		m->in_superpage = FALSE;
+		vm_page_unwire(m, TRUE);
+	}
+	vm_page_unlock_queues();
+}
+
+static void
+vm_superpage_run_free(
+	vm_page_t	pages)
+{
+	vm_page_t	m;
+
+	vm_page_lock_queues();
+	while ((m = pages) != VM_PAGE_NULL) {
+		pages = NEXT_PAGE(m);
+		*(NEXT_PAGE_PTR(m)) = VM_PAGE_NULL;
+		vm_page_free(m);
+	}
+	vm_page_unlock_queues();
+}
+
+/*
+ * Keep "vm_superpage_pool_target" pre-zeroed runs around, so that
+ * promotion in the fault path never has to look for contiguous memory
+ * or zero 2MB itself.
+ */
+static void
+vm_superpage_thread(void)
+{
+	vm_page_t	pages, m;
+	kern_return_t	kr;
+	boolean_t	stored;
+
+	for (;;) {
+		while (vm_superpage_pool_runs < vm_superpage_pool_target &&
+		       vm_superpage_pool_runs < VM_SUPERPAGE_POOL_MAX &&
+		       VM_SUPERPAGE_CAN_FILL()) {
+			kr = cpm_allocate(SUPERPAGE_SIZE, &pages, 0,
+					  SUPERPAGE_NBASEPAGES - 1, TRUE, 0);
+			if (kr != KERN_SUCCESS)
+				break;
+
+			for (m = pages; m != VM_PAGE_NULL; m = NEXT_PAGE(m))
+				pmap_zero_page(VM_PAGE_GET_PHYS_PAGE(m));
+
+			stored = FALSE;
+			lck_mtx_lock(&vm_superpage_lock);
+			if (vm_superpage_pool_runs < vm_superpage_pool_target &&
+			    vm_superpage_pool_runs < VM_SUPERPAGE_POOL_MAX) {
+				vm_superpage_pool[vm_superpage_pool_runs++] = pages;
+				stored = TRUE;
+			}
+			lck_mtx_unlock(&vm_superpage_lock);
+
+			if (!stored)
+				vm_superpage_run_free(pages);
+		}
+
+		if (vm_superpage_pool_runs < vm_superpage_pool_target &&
+		    vm_superpage_pool_runs < VM_SUPERPAGE_POOL_MAX &&
+		    vm_superpage_mode != VM_SUPERPAGE_NEVER) {
+			/* short on (contiguous) memory: try again later */
+			assert_wait_timeout((event_t) &vm_superpage_pool_runs,
+					    THREAD_UNINT,
+					    VM_SUPERPAGE_RETRY_MSECS,
+					    1000 * NSEC_PER_USEC);
+		} else {
+			assert_wait((event_t) &vm_superpage_pool_runs,
+				    THREAD_UNINT);
+		}
+		thread_block(THREAD_CONTINUE_NULL);
+	}
+}
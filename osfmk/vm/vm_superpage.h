@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2017 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Transparent superpages.
+ *
+ * Unlike the explicit superpages requested with VM_FLAGS_SUPERPAGE_SIZE_2MB,
+ * these are never visible to the application: a 2MB aligned run of an
+ * eligible anonymous mapping is backed, at its first touch, by a physically
+ * contiguous run of pages taken from a small pool of pre-zeroed runs and
+ * entered in the pmap with a single level 2 entry.  The pages of a promoted
+ * run stay wired, and marked "in_superpage", until the run is demoted back
+ * to ordinary pageable 4K pages by any VM operation that cannot deal with
+ * the 2MB mapping (partial unmap or protect, copy-on-write, wiring...).
+ * Until then, the run is charged to its map's wire limit, and all runs get
+ * demoted when the system runs short of free pages.
+ *
+ * The pool is refilled by a background thread, which lets the contiguous
+ * allocator relocate pages to assemble the runs, and drained when the
+ * system runs short of free pages.
+ */
+
+#ifndef	_VM_VM_SUPERPAGE_H_
+#define	_VM_VM_SUPERPAGE_H_
+
+#include <mach/boolean.h>
+#include <vm/vm_page.h>
+
+#define	VM_SUPERPAGE_NEVER	0	/* no transparent superpages */
+#define	VM_SUPERPAGE_MADVISE	1	/* only in MADV_SUPERPAGE ranges */
+#define	VM_SUPERPAGE_ALWAYS	2	/* in all large anonymous mappings */
+
+#define	VM_SUPERPAGE_POOL_MAX	64	/* max pre-zeroed runs (128MB) */
+
+extern unsigned int	vm_superpage_mode;
+extern unsigned int	vm_superpage_pool_target;
+extern unsigned int	vm_superpage_pool_runs;
+extern unsigned int	vm_superpage_promotions;
+extern unsigned int	vm_superpage_promote_failures;
+extern unsigned int	vm_superpage_demotions;
+
+extern void		vm_superpage_init(void);
+extern vm_page_t	vm_superpage_pool_get(void);
+extern void		vm_superpage_pool_drain(void);
+extern void		vm_superpage_reclaim(void);
+extern boolean_t	vm_superpage_promoted(vm_object_t object,
+			    vm_object_offset_t offset);
+extern void		vm_superpage_release(vm_object_t object,
+			    vm_object_offset_t offset);
+
+#endif	/* _VM_VM_SUPERPAGE_H_ */
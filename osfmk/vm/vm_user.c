@@ -2740,6 +2740,16 @@ redo_lookup:
 		   }
 		}
 
+#ifdef __x86_64__
+		/*
+		 * The object is about to be shared through the memory
+		 * entry: its pages must be mapped 4K at a time.
+		 */
+		vm_map_superpage_demote(local_map, map_entry,
+					map_entry->vme_start,
+					map_entry->vme_end);
+#endif /* __x86_64__ */
+
 		/*
 		 * We found the VM map entry, lock the VM object again.
 		 */
@@ -13,6 +13,7 @@
 #include <mach/mach.h>
 #include <mach/mach_error.h>
 #include <mach/mach_time.h>
+#include <mach/mach_traps.h>
 #include <mach/notify.h>
 #include <servers/bootstrap.h>
 #include <sys/types.h>
@@ -24,6 +25,7 @@
 #include <libkern/OSAtomic.h>
 
 #define MAX(A, B) ((A) < (B) ? (B) : (A))
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
 
 
 typedef struct {
@@ -84,6 +86,7 @@ int			num_servers;
 int			client_delay;
 int			client_spin;
 int			client_pages;
+int			batch = 0;
 int			portcount = 1;
 int			setcount = 0;
 boolean_t		stress_prepost = FALSE;
@@ -129,6 +132,7 @@ void usage(const char *progname) {
 	fprintf(stderr, "    -set nset num\tcreate [nset] portsets and [num] ports in each server.\n");
 	fprintf(stderr, "                 \tEach port is connected to each set.\n");
 	fprintf(stderr, "    -prepost\t\tstress the prepost system (implies -threaded, requires -set X Y)\n");
+	fprintf(stderr, "    -batch num\t\tmove up to [num] messages per trap with mach_msg_vector_trap\n");
 	fprintf(stderr, "default values are:\n");
 	fprintf(stderr, "    . no affinity\n");
 	fprintf(stderr, "    . not timeshare\n");
@@ -143,6 +147,7 @@ void usage(const char *progname) {
 	fprintf(stderr, "    . no delay\n");
 	fprintf(stderr, "    . no sets / extra ports\n");
 	fprintf(stderr, "    . no prepost stress\n");
+	fprintf(stderr, "    . one message per mach_msg\n");
 	exit(1);
 }
 
@@ -247,12 +252,26 @@ void parse_args(int argc, char *argv[]) {
 			stress_prepost = TRUE;
 			threaded = TRUE;
 			argc--; argv++;
+		} else if (0 == strcmp("-batch", argv[0])) {
+			if (argc < 2)
+				usage(progname);
+			batch = strtoul(argv[1], NULL, 0);
+			if (batch < 1 || batch > MACH_MSG_VECTOR_MAX) {
+				fprintf(stderr, "batch must be between 1 and %d\n", MACH_MSG_VECTOR_MAX);
+				exit(1);
+			}
+			argc -= 2; argv += 2;
 		} else {
 			fprintf(stderr, "unknown option '%s'\n", argv[0]);
 			usage(progname);
 		}
 	}
 
+	if (batch && (stress_prepost || msg_type == msg_type_complex)) {
+		fprintf(stderr, "Batches don't mix with -prepost or complex messages\n");
+		exit(1);
+	}
+
 	if (stress_prepost) {
 		if (!threaded) {
 			fprintf(stderr, "Prepost stress test _must_ be threaded\n");
@@ -458,6 +477,82 @@ thread_setup(int tag) {
         }
 }
 
+/*
+ * Batched flavor of the server loop: take whatever requests are queued,
+ * up to the batch size, in one trap, and send all their replies in one
+ * more.
+ */
+static void
+server_batched(struct port_args *args, mach_port_t recv_port, int totalmsg)
+{
+	mach_msg_vector_t rcv_vec[MACH_MSG_VECTOR_MAX], send_vec[MACH_MSG_VECTOR_MAX];
+	mach_msg_header_t *req, *reply;
+	char *reqs, *replies;
+	mach_msg_return_t ret;
+	int idx, i, n, nreplies;
+
+	reqs = malloc(batch * args->req_size);
+	replies = malloc(batch * args->reply_size);
+	if (!reqs || !replies) {
+		fprintf(stderr, "malloc of %d message buffers failed\n", batch);
+		exit(1);
+	}
+	for (i = 0; i < batch; i++) {
+		rcv_vec[i].msgv_data = (uint64_t)(uintptr_t)(reqs + i * args->req_size);
+		rcv_vec[i].msgv_rcv_size = args->req_size;
+		send_vec[i].msgv_data = (uint64_t)(uintptr_t)(replies + i * args->reply_size);
+		send_vec[i].msgv_send_size = args->reply_size;
+	}
+
+	for (idx = 0; idx < totalmsg; idx += n) {
+		if (verbose > 2)
+			printf("server awaiting messages from %d\n", idx);
+		ret = mach_msg_vector_trap(rcv_vec, MIN(batch, totalmsg - idx),
+				MACH_RCV_MSG|MACH_RCV_LARGE,
+				recv_port,
+				MACH_MSG_TIMEOUT_NONE);
+		if (MACH_RCV_INTERRUPTED == ret) {
+			n = 0;
+			continue;
+		}
+		if (MACH_MSG_SUCCESS != ret) {
+			mach_error("mach_msg_vector_trap (receive): ", ret);
+			exit(1);
+		}
+
+		nreplies = 0;
+		for (n = 0; n < MIN(batch, totalmsg - idx); n++) {
+			if (rcv_vec[n].msgv_return != MACH_MSG_SUCCESS)
+				break;
+			req = (mach_msg_header_t *)(uintptr_t)rcv_vec[n].msgv_data;
+			if (1 != req->msgh_id)
+				continue;
+			reply = (mach_msg_header_t *)(uintptr_t)send_vec[nreplies++].msgv_data;
+			reply->msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_MOVE_SEND_ONCE, 0);
+			reply->msgh_size = args->reply_size;
+			reply->msgh_remote_port = req->msgh_remote_port;
+			reply->msgh_local_port = MACH_PORT_NULL;
+			reply->msgh_id = 2;
+		}
+		if (verbose > 2)
+			printf("server received %d messages, sending %d replies\n", n, nreplies);
+
+		if (nreplies > 0) {
+			ret = mach_msg_vector_trap(send_vec, nreplies,
+					MACH_SEND_MSG,
+					MACH_PORT_NULL,
+					MACH_MSG_TIMEOUT_NONE);
+			if (MACH_MSG_SUCCESS != ret) {
+				mach_error("mach_msg_vector_trap (send): ", ret);
+				exit(1);
+			}
+		}
+	}
+
+	free(reqs);
+	free(replies);
+}
+
 void *
 server(void *serverarg)
 {
@@ -477,6 +572,11 @@ server(void *serverarg)
 
 	recv_port = (useset) ? args->rcv_set : args->port;
 
+	if (batch) {
+		server_batched(args, recv_port, totalmsg);
+		return NULL;
+	}
+
 	for (idx = 0; idx < totalmsg; idx++) {
 		if (verbose > 2)
 			printf("server awaiting message %d\n", idx);
@@ -638,6 +738,91 @@ client_work(void)
 	return NULL;
 }
 
+/*
+ * Batched flavor of the client loop: send the requests in batches, each
+ * with one trap, then collect their replies, as many per trap as have
+ * come back.
+ */
+static void
+client_batched(struct port_args *args, mach_port_t servport)
+{
+	mach_msg_vector_t send_vec[MACH_MSG_VECTOR_MAX], rcv_vec[MACH_MSG_VECTOR_MAX];
+	mach_msg_header_t *req;
+	char *reqs, *replies;
+	mach_msg_return_t ret;
+	int idx, i, n, nreplies;
+
+	reqs = malloc(batch * args->req_size);
+	replies = malloc(batch * args->reply_size);
+	if (!reqs || !replies) {
+		fprintf(stderr, "malloc of %d message buffers failed\n", batch);
+		exit(1);
+	}
+	for (i = 0; i < batch; i++) {
+		send_vec[i].msgv_data = (uint64_t)(uintptr_t)(reqs + i * args->req_size);
+		send_vec[i].msgv_send_size = args->req_size;
+		rcv_vec[i].msgv_data = (uint64_t)(uintptr_t)(replies + i * args->reply_size);
+		rcv_vec[i].msgv_rcv_size = args->reply_size;
+	}
+
+	for (idx = 0; idx < num_msgs; idx += n) {
+		n = MIN(batch, num_msgs - idx);
+		for (i = 0; i < n; i++) {
+			req = (mach_msg_header_t *)(uintptr_t)send_vec[i].msgv_data;
+			req->msgh_size = args->req_size;
+			req->msgh_remote_port = servport;
+			if (oneway) {
+				req->msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0);
+				req->msgh_local_port = MACH_PORT_NULL;
+			} else {
+				req->msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND,
+								MACH_MSG_TYPE_MAKE_SEND_ONCE);
+				req->msgh_local_port = args->port;
+			}
+			req->msgh_id = oneway ? 0 : 1;
+		}
+		if (verbose > 2)
+			printf("client sending messages %d to %d to port %#x\n",
+			       idx, idx + n - 1, servport);
+		ret = mach_msg_vector_trap(send_vec, n,
+				MACH_SEND_MSG,
+				MACH_PORT_NULL,
+				MACH_MSG_TIMEOUT_NONE);
+		if (MACH_MSG_SUCCESS != ret) {
+			mach_error("mach_msg_vector_trap (send): ", ret);
+			fprintf(stderr, "bailing after %u iterations\n", idx);
+			exit(1);
+		}
+
+		for (nreplies = 0; !oneway && nreplies < n; ) {
+			ret = mach_msg_vector_trap(rcv_vec, n - nreplies,
+					MACH_RCV_MSG,
+					args->port,
+					MACH_MSG_TIMEOUT_NONE);
+			if (MACH_RCV_INTERRUPTED == ret)
+				continue;
+			if (MACH_MSG_SUCCESS != ret) {
+				mach_error("mach_msg_vector_trap (receive): ", ret);
+				fprintf(stderr, "bailing after %u iterations\n", idx);
+				exit(1);
+			}
+			for (i = 0; i < n - nreplies; i++) {
+				if (rcv_vec[i].msgv_return != MACH_MSG_SUCCESS)
+					break;
+			}
+			nreplies += i;
+		}
+		if (verbose > 2)
+			printf("client received replies to %d messages\n", n);
+
+		for (i = 0; i < n; i++)
+			client_work();
+	}
+
+	free(reqs);
+	free(replies);
+}
+
 void *client(void *threadarg) 
 {
 	struct port_args args;
@@ -684,6 +869,12 @@ void *client(void *threadarg)
 	}
 
 	uint64_t starttm, endtm;
+
+	if (batch) {
+		client_batched(&args, servport);
+		free(ints);
+		return NULL;
+	}
 	
 	/* start message loop */
 	for (idx = 0; idx < num_msgs; idx++) {
@@ -892,11 +1083,12 @@ int main(int argc, char *argv[])
 	 */
 	wait_for_servers();
 	
-	printf("%d server%s, %d client%s per server (%d total) %u messages...", 
+	printf("%d server%s, %d client%s per server (%d total) %u messages%s...", 
 			num_servers, (num_servers > 1)? "s" : "",
 			num_clients, (num_clients > 1)? "s" : "",
 			totalclients,
-			totalmsg);
+			totalmsg,
+			batch ? " in batches" : "");
 	fflush(stdout);
 
 	/* Call gettimeofday() once and throw away result; some implementations
@@ -954,8 +1146,15 @@ int main(int argc, char *argv[])
 
 	if (save_perfdata == TRUE) {
 		char name[256];
-		snprintf(name, sizeof(name), "%s_avg_msg_latency", basename(argv[0]));
-		record_perf_data(name, "usec", avg_msg_latency, "Message latency measured in microseconds. Lower is better", stderr);
+		if (batch) {
+			snprintf(name, sizeof(name), "%s_batch%d_avg_msg_latency", basename(argv[0]), batch);
+			record_perf_data(name, "usec", avg_msg_latency, "Message latency measured in microseconds. Lower is better", stderr);
+			snprintf(name, sizeof(name), "%s_batch%d_throughput", basename(argv[0]), batch);
+			record_perf_data(name, "msgs/sec", throughput_msg_p_sec, "Messages per second with batched traps. Higher is better", stderr);
+		} else {
+			snprintf(name, sizeof(name), "%s_avg_msg_latency", basename(argv[0]));
+			record_perf_data(name, "usec", avg_msg_latency, "Message latency measured in microseconds. Lower is better", stderr);
+		}
 	}
 
 	if (stress_prepost) {
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2017 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * compaction_bench: measure what the compressor pays to compact its
+ * segments per MB of memory it gets back.
+ *
+ * Fills a region with pages of varying compressibility, pushes them
+ * into the compressor, then frees a subset of them following one of
+ * several fragmentation patterns and reports the compaction counters
+ * (vm.compressor_compact_*) accumulated while the compactor cleans up.
+ *
+ * Pushing the pages into the compressor uses pid_hibernate(-2), which
+ * needs root and a kernel built with CONFIG_FREEZE... otherwise run
+ * this under memory pressure and give it time with -w.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+#include <sys/syscall.h>
+#include <mach/mach_time.h>
+
+typedef enum { PATTERN_ALTERNATE, PATTERN_RANDOM, PATTERN_RUNS, PATTERN_HALVES } pattern_t;
+
+struct compact_stats {
+	uint64_t	minor_compactions;
+	uint64_t	moved_runs;
+	uint64_t	moved_bytes;
+	uint64_t	reclaimed_bytes;
+	uint64_t	abstime;
+	uint64_t	bytes_used;
+};
+
+static size_t		page_size;
+
+static uint64_t
+sysctl_quad(const char *name)
+{
+	uint64_t	value = 0;
+	size_t		size = sizeof(value);
+
+	if (sysctlbyname(name, &value, &size, NULL, 0) != 0)
+		err(1, "sysctlbyname(%s)", name);
+	return value;
+}
+
+static void
+sample(struct compact_stats *s)
+{
+	s->minor_compactions = sysctl_quad("vm.compressor_minor_compactions");
+	s->moved_runs = sysctl_quad("vm.compressor_compact_moved_runs");
+	s->moved_bytes = sysctl_quad("vm.compressor_compact_moved_bytes");
+	s->reclaimed_bytes = sysctl_quad("vm.compressor_compact_reclaimed_bytes");
+	s->abstime = sysctl_quad("vm.compressor_compact_abstime");
+	s->bytes_used = sysctl_quad("vm.compressor_bytes_used");
+}
+
+/*
+ * the first "live" bytes of each page are random, the rest is zero,
+ * so pages compress to anything from a few dozen bytes to most of a page
+ */
+static void
+fill_pages(char *base, size_t npages)
+{
+	size_t		i, j, live;
+	uint32_t	*p;
+
+	for (i = 0; i < npages; i++) {
+		p = (uint32_t *)(base + i * page_size);
+		live = (arc4random_uniform(16) + 1) * (page_size / 20);
+
+		for (j = 0; j < live / sizeof(uint32_t); j++)
+			p[j] = arc4random();
+		memset((char *)p + live, 0, page_size - live);
+	}
+}
+
+static size_t
+count_compressed(char *base, size_t npages)
+{
+	char		*vec;
+	size_t		i, count = 0;
+
+	vec = malloc(npages);
+	if (vec == NULL)
+		err(1, "malloc");
+	if (mincore(base, npages * page_size, vec) != 0)
+		err(1, "mincore");
+	for (i = 0; i < npages; i++) {
+		if (vec[i] & MINCORE_PAGED_OUT)
+			count++;
+	}
+	free(vec);
+	return count;
+}
+
+static int
+should_free(pattern_t pattern, size_t i, size_t npages, int percent, size_t run)
+{
+	switch (pattern) {
+	case PATTERN_ALTERNATE:
+		return (i & 1);
+	case PATTERN_RANDOM:
+		return ((int)arc4random_uniform(100) < percent);
+	case PATTERN_RUNS:
+		return ((i / run) & 1);
+	case PATTERN_HALVES:
+		return (i < npages / 2);
+	}
+	return 0;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: compaction_bench [-s size_mb] [-p alternate|random|runs|halves]\n"
+			"                        [-f free_percent] [-r run_pages] [-w wait_secs]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct compact_stats	before, after;
+	mach_timebase_info_data_t tb;
+	pattern_t	pattern = PATTERN_RANDOM;
+	size_t		size_mb = 256, npages, i, freed = 0, compressed;
+	size_t		run = 16;
+	int		percent = 50, wait_secs = 5, ch;
+	char		*base;
+	double		reclaimed_mb, nsecs;
+
+	while ((ch = getopt(argc, argv, "s:p:f:r:w:")) != -1) {
+		switch (ch) {
+		case 's':
+			size_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			if (strcmp(optarg, "alternate") == 0)
+				pattern = PATTERN_ALTERNATE;
+			else if (strcmp(optarg, "random") == 0)
+				pattern = PATTERN_RANDOM;
+			else if (strcmp(optarg, "runs") == 0)
+				pattern = PATTERN_RUNS;
+			else if (strcmp(optarg, "halves") == 0)
+				pattern = PATTERN_HALVES;
+			else
+				usage();
+			break;
+		case 'f':
+			percent = atoi(optarg);
+			break;
+		case 'r':
+			run = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			wait_secs = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (size_mb == 0 || run == 0 || percent < 0 || percent > 100)
+		usage();
+
+	page_size = (size_t)getpagesize();
+	npages = (size_mb << 20) / page_size;
+	mach_timebase_info(&tb);
+
+	base = mmap(NULL, npages * page_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (base == MAP_FAILED)
+		err(1, "mmap");
+
+	fill_pages(base, npages);
+
+	if (syscall(SYS_pid_hibernate, -2) != 0)
+		warn("pid_hibernate(-2) failed, relying on memory pressure");
+	sleep(wait_secs);
+
+	compressed = count_compressed(base, npages);
+	printf("%zu of %zu pages compressed\n", compressed, npages);
+	if (compressed == 0)
+		errx(1, "nothing was compressed, nothing to measure");
+
+	sample(&before);
+
+	for (i = 0; i < npages; i++) {
+		if (should_free(pattern, i, npages, percent, run)) {
+			if (munmap(base + i * page_size, page_size) != 0)
+				err(1, "munmap");
+			freed++;
+		}
+	}
+	printf("freed %zu pages\n", freed);
+
+	/* let the compactor notice the holes and clean them up */
+	sleep(wait_secs);
+
+	sample(&after);
+
+	reclaimed_mb = (double)(after.reclaimed_bytes - before.reclaimed_bytes) / (1024 * 1024);
+	nsecs = (double)(after.abstime - before.abstime) * tb.numer / tb.denom;
+
+	printf("minor compactions:     %llu\n", after.minor_compactions - before.minor_compactions);
+	printf("copies (runs):         %llu\n", after.moved_runs - before.moved_runs);
+	printf("bytes moved:           %llu\n", after.moved_bytes - before.moved_bytes);
+	printf("compressor bytes used: %lld -> %lld\n", (long long)before.bytes_used, (long long)after.bytes_used);
+	printf("reclaimed:             %.2f MB\n", reclaimed_mb);
+	printf("compaction time:       %.3f ms\n", nsecs / 1000000.0);
+	if (reclaimed_mb > 0) {
+		printf("cost per reclaimed MB: %.1f us, %.2f MB moved\n",
+		       nsecs / 1000.0 / reclaimed_mb,
+		       (double)(after.moved_bytes - before.moved_bytes) / (1024 * 1024) / reclaimed_mb);
+	}
+	return 0;
+}
@@ -0,0 +1,255 @@
+/*
+ * cpu_topology_test: feed CPUID dumps through the AMD topology decoding
+ * used by osfmk/i386/cpu_threads.c and check the topology it builds:
+ * one processor set per L3 domain, grouped into packages.
+ *
+ * Each dump lists, for every logical cpu, lines of
+ *	<apic id> <leaf> <subleaf> <eax> <ebx> <ecx> <edx>
+ * for CPUID leaves 1, 0x80000008, 0x8000001D and 0x8000001E, plus
+ *	expect cpus|packages|llcs|llc_cpus <n>
+ * lines giving the topology the part is known to have.  '#' starts a
+ * comment.  The registers of the first cpu are decoded the way the kernel
+ * decodes them on the boot processor, then every cpu is placed by its
+ * APIC ID.
+ *
+ * usage: cpu_topology_test [-v] dump...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <err.h>
+
+#include <i386/cpu_amd_topology.h>
+
+#define MAX_CPUS	256
+
+struct cpu_regs {
+	uint32_t	apicid;
+	uint32_t	signature[4];
+	uint32_t	addr_sizes[4];
+	uint32_t	l3[4];
+	uint32_t	ids[4];
+	int		have;		/* leaves seen, one bit each */
+};
+
+#define HAVE_SIG	0x1
+#define HAVE_ADDR	0x2
+#define HAVE_L3		0x4
+#define HAVE_IDS	0x8
+#define HAVE_ALL	(HAVE_SIG | HAVE_ADDR | HAVE_L3 | HAVE_IDS)
+
+struct expect {
+	int	cpus, packages, llcs, llc_cpus;
+};
+
+static int	verbose;
+
+static struct cpu_regs *
+cpu_lookup(struct cpu_regs *cpus, int *ncpus, uint32_t apicid)
+{
+	int	i;
+
+	for (i = 0; i < *ncpus; i++) {
+		if (cpus[i].apicid == apicid)
+			return &cpus[i];
+	}
+	if (*ncpus == MAX_CPUS)
+		errx(1, "more than %d cpus", MAX_CPUS);
+	memset(&cpus[*ncpus], 0, sizeof(cpus[0]));
+	cpus[*ncpus].apicid = apicid;
+	return &cpus[(*ncpus)++];
+}
+
+static int
+load_dump(const char *path, struct cpu_regs *cpus, struct expect *expect)
+{
+	char		line[256], key[32];
+	uint32_t	apicid, leaf, subleaf, r[4];
+	struct cpu_regs	*cpu;
+	FILE		*f;
+	int		ncpus = 0, value, lineno = 0;
+
+	if ((f = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+
+	memset(expect, 0xff, sizeof(*expect));
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (sscanf(line, "expect %31s %d", key, &value) == 2) {
+			if (strcmp(key, "cpus") == 0)
+				expect->cpus = value;
+			else if (strcmp(key, "packages") == 0)
+				expect->packages = value;
+			else if (strcmp(key, "llcs") == 0)
+				expect->llcs = value;
+			else if (strcmp(key, "llc_cpus") == 0)
+				expect->llc_cpus = value;
+			else
+				errx(1, "%s:%d: unknown expectation %s", path, lineno, key);
+			continue;
+		}
+
+		if (sscanf(line, "%x %x %u %x %x %x %x", &apicid, &leaf, &subleaf,
+			   &r[0], &r[1], &r[2], &r[3]) != 7)
+			errx(1, "%s:%d: malformed line", path, lineno);
+
+		cpu = cpu_lookup(cpus, &ncpus, apicid);
+		switch (leaf) {
+		case 1:
+			memcpy(cpu->signature, r, sizeof(r));
+			cpu->have |= HAVE_SIG;
+			break;
+		case AMD_TOPO_LEAF_ADDR_SIZES:
+			memcpy(cpu->addr_sizes, r, sizeof(r));
+			cpu->have |= HAVE_ADDR;
+			break;
+		case AMD_TOPO_LEAF_CACHE:
+			/* keep the level 3 cache, the kernel stops there too */
+			if (AMD_TOPO_BITS(r[0], 7, 5) == 3) {
+				memcpy(cpu->l3, r, sizeof(r));
+				cpu->have |= HAVE_L3;
+			}
+			break;
+		case AMD_TOPO_LEAF_IDS:
+			memcpy(cpu->ids, r, sizeof(r));
+			cpu->have |= HAVE_IDS;
+			break;
+		default:
+			break;
+		}
+	}
+	fclose(f);
+
+	return ncpus;
+}
+
+/* number of distinct values in ids[0..n) */
+static int
+count_distinct(const uint32_t *ids, int n)
+{
+	int	i, j, count = 0;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < i; j++) {
+			if (ids[j] == ids[i])
+				break;
+		}
+		if (j == i)
+			count++;
+	}
+	return count;
+}
+
+static int
+check(const char *path, const char *what, int got, int expected)
+{
+	if (expected < 0)
+		return 0;
+	if (got != expected) {
+		printf("%s: FAIL %s: got %d, expected %d\n", path, what, got, expected);
+		return 1;
+	}
+	if (verbose)
+		printf("%s: %s %d\n", path, what, got);
+	return 0;
+}
+
+static int
+test_dump(const char *path)
+{
+	static struct cpu_regs	cpus[MAX_CPUS];
+	uint32_t	llc[MAX_CPUS], pkg[MAX_CPUS];
+	amd_topology_t	topo;
+	struct expect	expect;
+	int		ncpus, i, j, members, llc_cpus = -1, failed = 0;
+
+	ncpus = load_dump(path, cpus, &expect);
+	if (ncpus == 0) {
+		printf("%s: FAIL no cpus\n", path);
+		return 1;
+	}
+
+	for (i = 0; i < ncpus; i++) {
+		if (cpus[i].have != HAVE_ALL) {
+			printf("%s: FAIL apic 0x%x is missing leaves\n", path, cpus[i].apicid);
+			return 1;
+		}
+		/* 0x8000001E eax is the extended APIC ID of the cpu it ran on */
+		if (cpus[i].ids[0] != cpus[i].apicid) {
+			printf("%s: FAIL apic 0x%x reports extended APIC ID 0x%x\n",
+			       path, cpus[i].apicid, cpus[i].ids[0]);
+			failed = 1;
+		}
+	}
+
+	if (!amd_topo_decode(cpus[0].signature[0], cpus[0].addr_sizes,
+			     cpus[0].l3, cpus[0].ids, &topo)) {
+		printf("%s: FAIL leaves don't decode\n", path);
+		return 1;
+	}
+
+	if (verbose) {
+		printf("%s: shifts thread %u L3 %u package %u, %u cpus share an L3\n",
+		       path, topo.thread_shift, topo.llc_shift, topo.pkg_shift, topo.llc_sharing);
+	}
+
+	for (i = 0; i < ncpus; i++) {
+		llc[i] = amd_topo_llc_id(&topo, cpus[i].apicid);
+		pkg[i] = amd_topo_pkg_id(&topo, cpus[i].apicid);
+	}
+
+	/* every L3 domain must sit within one package and be equally sized */
+	for (i = 0; i < ncpus; i++) {
+		members = 0;
+		for (j = 0; j < ncpus; j++) {
+			if (llc[j] != llc[i])
+				continue;
+			members++;
+			if (pkg[j] != pkg[i]) {
+				printf("%s: FAIL L3 domain %u spans packages\n", path, llc[i]);
+				failed = 1;
+			}
+		}
+		if (llc_cpus < 0)
+			llc_cpus = members;
+		else if (members != llc_cpus)
+			llc_cpus = 0;
+	}
+
+	failed |= check(path, "cpus", ncpus, expect.cpus);
+	failed |= check(path, "packages", count_distinct(pkg, ncpus), expect.packages);
+	failed |= check(path, "llcs", count_distinct(llc, ncpus), expect.llcs);
+	failed |= check(path, "llc_cpus", llc_cpus, expect.llc_cpus);
+
+	if (!failed)
+		printf("%s: PASS %d cpus, %d packages, %d L3 domains\n", path, ncpus,
+		       count_distinct(pkg, ncpus), count_distinct(llc, ncpus));
+	return failed;
+}
+
+int
+main(int argc, char **argv)
+{
+	int	i, failed = 0;
+
+	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+		verbose = 1;
+		argc--;
+		argv++;
+	}
+	if (argc < 2) {
+		fprintf(stderr, "usage: cpu_topology_test [-v] dump...\n");
+		return 2;
+	}
+
+	for (i = 1; i < argc; i++)
+		failed |= test_dump(argv[i]);
+
+	return failed;
+}
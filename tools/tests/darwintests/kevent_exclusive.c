@@ -0,0 +1,218 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif /* T_NAMESPACE */
+
+#include <darwintest.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <unistd.h>
+
+T_GLOBAL_META(
+		T_META_NAMESPACE("xnu.kevent"),
+		T_META_CHECK_LEAKS(false));
+
+#define NKQ	8
+
+static int
+listen_socket(void)
+{
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int s;
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s, "socket");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(s, (struct sockaddr *)&sin, sizeof(sin)), "bind");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(listen(s, NKQ), "listen");
+	return s;
+}
+
+static int
+connect_to(int ls)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int s;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockname(ls, (struct sockaddr *)&sin, &len),
+			"getsockname");
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(s, "socket");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(s, (struct sockaddr *)&sin, len), "connect");
+	return s;
+}
+
+/* number of the kqueues with an event pending */
+static int
+kqueues_ready(int *kqs)
+{
+	struct timespec zero = { 0, 0 };
+	struct kevent kev;
+	int i, n, ready = 0;
+
+	for (i = 0; i < NKQ; i++) {
+		n = kevent(kqs[i], NULL, 0, &kev, 1, &zero);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "kevent");
+		ready += n;
+	}
+	return ready;
+}
+
+static void
+watch_listener(int *kqs, int ls, unsigned short flags)
+{
+	struct kevent kev;
+	int i;
+
+	for (i = 0; i < NKQ; i++) {
+		kqs[i] = kqueue();
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(kqs[i], "kqueue");
+		EV_SET(&kev, ls, EVFILT_READ, EV_ADD | flags, 0, 0, NULL);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(kevent(kqs[i], &kev, 1, NULL, 0, NULL),
+				"watch the listening socket");
+	}
+}
+
+T_DECL(kevent_exclusive, "a connection only wakes up one EV_EXCLUSIVE watcher")
+{
+	int kqs[NKQ], ls, cs, i;
+
+	ls = listen_socket();
+	watch_listener(kqs, ls, 0);
+	cs = connect_to(ls);
+	T_EXPECT_EQ(kqueues_ready(kqs), NKQ, "every plain watcher sees the connection");
+	close(cs);
+	for (i = 0; i < NKQ; i++)
+		close(kqs[i]);
+	close(ls);
+
+	ls = listen_socket();
+	watch_listener(kqs, ls, EV_EXCLUSIVE);
+	cs = connect_to(ls);
+	T_EXPECT_EQ(kqueues_ready(kqs), 1, "one exclusive watcher sees the connection");
+	close(cs);
+	for (i = 0; i < NKQ; i++)
+		close(kqs[i]);
+	close(ls);
+}
+
+T_DECL(kevent_exclusive_level_only, "EV_EXCLUSIVE needs a level triggered filter")
+{
+	struct kevent kev;
+	int kq = kqueue();
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+	EV_SET(&kev, 1, EVFILT_USER, EV_ADD | EV_EXCLUSIVE, 0, 0, NULL);
+	T_EXPECT_POSIX_FAILURE(kevent(kq, &kev, 1, NULL, 0, NULL), EINVAL,
+			"EV_EXCLUSIVE on EVFILT_USER");
+	close(kq);
+}
+
+T_DECL(kevent_activation_stats, "knote activation statistics")
+{
+	uint64_t stats[4];
+	size_t len = sizeof(stats);
+
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.kevent_activation_stats",
+			stats, &len, NULL, 0), "kern.kevent_activation_stats");
+	T_EXPECT_EQ(len, sizeof(stats), "four counters");
+	T_LOG("%llu contended, %llu abstime spinning, %llu deferred, %llu exclusive skipped",
+			stats[0], stats[1], stats[2], stats[3]);
+}
+
+#define VANISH_ROUNDS	2000
+
+static _Atomic bool vanish_done;
+
+/* keep the kqueue lock busy so that posts to it get queued */
+static void *
+kqueue_poller(void *arg)
+{
+	struct timespec zero = { 0, 0 };
+	struct kevent kev;
+	int kq = *(int *)arg;
+
+	while (!atomic_load(&vanish_done))
+		(void)kevent(kq, NULL, 0, &kev, 1, &zero);
+	return NULL;
+}
+
+static void *
+socket_writer(void *arg)
+{
+	_Atomic int *fdp = arg;
+	char c = 'x';
+	int fd;
+
+	while (!atomic_load(&vanish_done)) {
+		fd = atomic_load(fdp);
+		if (fd >= 0)
+			(void)write(fd, &c, 1);
+	}
+	return NULL;
+}
+
+T_DECL(kevent_vanished_activation,
+		"closing an EV_VANISHED socket with an activation pending")
+{
+	struct timespec zero = { 0, 0 };
+	_Atomic int wfd = -1;
+	pthread_t poller, writer;
+	struct kevent kev;
+	uint64_t stats[4];
+	size_t len = sizeof(stats);
+	int kq, fds[2], i, n, vanished = 0;
+
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&poller, NULL, kqueue_poller, &kq),
+			"pthread_create");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&writer, NULL, socket_writer,
+			(void *)&wfd), "pthread_create");
+
+	for (i = 0; i < VANISH_ROUNDS; i++) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(socketpair(AF_UNIX, SOCK_STREAM, 0, fds),
+				"socketpair");
+		EV_SET(&kev, fds[0], EVFILT_READ, EV_ADD | EV_DISPATCH2 | EV_VANISHED,
+				0, 0, (void *)(uintptr_t)(i + 1));
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(kevent(kq, &kev, 1, NULL, 0, NULL),
+				"watch the socket");
+
+		/* let the writer post to the knote, then close it under the posts */
+		atomic_store(&wfd, fds[1]);
+		usleep(50);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(close(fds[0]), "close");
+		atomic_store(&wfd, -1);
+		usleep(10);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(close(fds[1]), "close");
+	}
+
+	atomic_store(&vanish_done, true);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(poller, NULL), "pthread_join");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(writer, NULL), "pthread_join");
+
+	/* every knote reports its end of life, whatever got queued before */
+	while ((n = kevent(kq, NULL, 0, &kev, 1, &zero)) > 0) {
+		if (kev.flags & EV_VANISHED)
+			vanished++;
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "kevent");
+	T_LOG("%d vanished knotes left undelivered by the poller", vanished);
+
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.kevent_activation_stats",
+			stats, &len, NULL, 0), "kern.kevent_activation_stats");
+	T_LOG("%llu activations deferred", stats[2]);
+	T_PASS("closed %d sockets with posts in flight", VANISH_ROUNDS);
+	close(kq);
+}
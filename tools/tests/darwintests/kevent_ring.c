@@ -0,0 +1,294 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif /* T_NAMESPACE */
+
+#include <darwintest.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/event.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(
+		T_META_NAMESPACE("xnu.kevent"),
+		T_META_CHECK_LEAKS(false));
+
+#define RING_ENTRIES	256
+#define NUSER		64
+
+struct ring {
+	struct kevent_ring_header *hdr;
+	struct kevent_qos_s *sq;
+	struct kevent_qos_s *cq;
+	uint32_t mask;
+};
+
+static void
+ring_setup(int kq, uint32_t entries, struct ring *r)
+{
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kevent_ring_setup(kq, entries, &r->hdr),
+			"kevent_ring_setup");
+	T_QUIET; T_ASSERT_EQ(r->hdr->krh_entries, entries, "ring entries");
+	r->sq = (struct kevent_qos_s *)((uintptr_t)r->hdr + r->hdr->krh_sq_offset);
+	r->cq = (struct kevent_qos_s *)((uintptr_t)r->hdr + r->hdr->krh_cq_offset);
+	r->mask = entries - 1;
+}
+
+/* queue a change, the submission ring must have room for it */
+static void
+ring_submit(struct ring *r, const struct kevent_qos_s *kev)
+{
+	uint32_t tail = r->hdr->krh_sq_tail;
+
+	T_QUIET; T_ASSERT_LE(tail - r->hdr->krh_sq_head, r->mask, "submission ring has room");
+	r->sq[tail & r->mask] = *kev;
+	__atomic_store_n(&r->hdr->krh_sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* take the next event off the completion ring, if any */
+static bool
+ring_reap(struct ring *r, struct kevent_qos_s *kev)
+{
+	uint32_t head = r->hdr->krh_cq_head;
+
+	if (head == __atomic_load_n(&r->hdr->krh_cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+	*kev = r->cq[head & r->mask];
+	__atomic_store_n(&r->hdr->krh_cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static int
+ring_enter(int kq, unsigned int flags)
+{
+	return kevent_qos(kq, NULL, 0, NULL, 0, NULL, NULL, KEVENT_FLAG_RING | flags);
+}
+
+T_DECL(kevent_ring, "changes and events through the kqueue rings")
+{
+	struct kevent_qos_s kev;
+	struct kevent_ring_header *other;
+	uint64_t seen = 0;
+	struct ring r;
+	int kq, n, i;
+
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+
+	ring_setup(kq, RING_ENTRIES, &r);
+	T_EXPECT_POSIX_FAILURE(kevent_ring_setup(kq, RING_ENTRIES, &other), EBUSY,
+			"a kqueue only has one set of rings");
+
+	/* register the events, asking for receipts */
+	for (i = 0; i < NUSER; i++) {
+		kev = (struct kevent_qos_s){
+			.ident = (uint64_t)i,
+			.filter = EVFILT_USER,
+			.flags = EV_ADD | EV_CLEAR | EV_RECEIPT,
+		};
+		ring_submit(&r, &kev);
+	}
+	n = ring_enter(kq, KEVENT_FLAG_IMMEDIATE);
+	T_ASSERT_EQ(n, NUSER, "one receipt per change");
+	T_EXPECT_EQ(r.hdr->krh_sq_head, r.hdr->krh_sq_tail, "all changes consumed");
+	for (i = 0; i < NUSER; i++) {
+		T_QUIET; T_ASSERT_TRUE(ring_reap(&r, &kev), "receipt %d", i);
+		T_QUIET; T_EXPECT_TRUE(kev.flags & EV_ERROR, "receipts carry EV_ERROR");
+		T_QUIET; T_EXPECT_EQ(kev.data, 0LL, "receipts carry no error");
+	}
+	T_EXPECT_FALSE(ring_reap(&r, &kev), "completion ring drained");
+
+	/* trigger them all: the events come back in the same call */
+	for (i = 0; i < NUSER; i++) {
+		kev = (struct kevent_qos_s){
+			.ident = (uint64_t)i,
+			.filter = EVFILT_USER,
+			.fflags = NOTE_TRIGGER,
+		};
+		ring_submit(&r, &kev);
+	}
+	n = ring_enter(kq, 0);
+	T_ASSERT_EQ(n, NUSER, "every trigger posts an event");
+	while (ring_reap(&r, &kev)) {
+		T_QUIET; T_ASSERT_EQ(kev.filter, EVFILT_USER, "user event");
+		T_QUIET; T_ASSERT_LT(kev.ident, (uint64_t)NUSER, "known ident");
+		T_QUIET; T_ASSERT_FALSE(seen & (1ULL << kev.ident), "event posted once");
+		seen |= 1ULL << kev.ident;
+	}
+	T_EXPECT_EQ(seen, ~0ULL, "all events posted");
+
+	T_EXPECT_EQ(ring_enter(kq, KEVENT_FLAG_IMMEDIATE), 0, "nothing left pending");
+
+	/* errors are posted like receipts */
+	kev = (struct kevent_qos_s){
+		.ident = (uint64_t)-1,
+		.filter = EVFILT_READ,
+		.flags = EV_ADD,
+	};
+	ring_submit(&r, &kev);
+	T_EXPECT_EQ(ring_enter(kq, KEVENT_FLAG_IMMEDIATE), 1, "one error");
+	T_ASSERT_TRUE(ring_reap(&r, &kev), "error event");
+	T_EXPECT_TRUE(kev.flags & EV_ERROR, "error event has EV_ERROR");
+	T_EXPECT_EQ(kev.data, (int64_t)EBADF, "bad descriptor");
+
+	/* ring mode doesn't take lists */
+	T_EXPECT_POSIX_FAILURE(kevent_qos(kq, &kev, 1, NULL, 0, NULL, NULL, KEVENT_FLAG_RING),
+			EINVAL, "lists are rejected in ring mode");
+
+	close(kq);
+}
+
+T_DECL(kevent_ring_requires_setup, "ring mode needs rings")
+{
+	int kq = kqueue();
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+	T_EXPECT_POSIX_FAILURE(ring_enter(kq, KEVENT_FLAG_IMMEDIATE), EINVAL,
+			"kqueue without rings");
+	T_EXPECT_POSIX_FAILURE(kevent_ring_setup(kq, 100, NULL), EINVAL,
+			"ring size must be a power of two");
+	close(kq);
+}
+
+/*
+ * The rings outlive the kqueue: once it is closed, the process still owns
+ * the pages, and kqueues created afterwards get rings of their own rather
+ * than reusing them.
+ */
+T_DECL(kevent_ring_after_close, "rings stay the process's after close")
+{
+	struct kevent_qos_s pattern, kev;
+	struct ring r, fresh[16];
+	uint32_t i, j;
+	int kq;
+
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+	ring_setup(kq, RING_ENTRIES, &r);
+	T_ASSERT_POSIX_SUCCESS(close(kq), "close the kqueue");
+
+	/* the pages are still there, and still ours */
+	for (i = 0; i < RING_ENTRIES; i++) {
+		r.sq[i] = (struct kevent_qos_s){ .ident = i, .udata = ~(uint64_t)i };
+		r.cq[i] = (struct kevent_qos_s){ .ident = ~(uint64_t)i, .udata = i };
+	}
+	r.hdr->krh_sq_tail = 0x5a5a5a5a;
+
+	/* churn rings through the kernel, they must not land on ours */
+	for (j = 0; j < sizeof(fresh) / sizeof(fresh[0]); j++) {
+		kq = kqueue();
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+		ring_setup(kq, RING_ENTRIES, &fresh[j]);
+		T_QUIET; T_ASSERT_EQ(fresh[j].hdr->krh_sq_tail, 0U, "new rings start empty");
+		for (i = 0; i < RING_ENTRIES; i++) {
+			T_QUIET; T_ASSERT_EQ(fresh[j].sq[i].ident, 0ULL, "new rings are zeroed");
+		}
+
+		kev = (struct kevent_qos_s){
+			.ident = 1,
+			.filter = EVFILT_USER,
+			.flags = EV_ADD | EV_RECEIPT,
+		};
+		ring_submit(&fresh[j], &kev);
+		T_QUIET; T_ASSERT_EQ(ring_enter(kq, KEVENT_FLAG_IMMEDIATE), 1, "receipt");
+		close(kq);
+	}
+
+	for (i = 0; i < RING_ENTRIES; i++) {
+		pattern = (struct kevent_qos_s){ .ident = i, .udata = ~(uint64_t)i };
+		T_QUIET; T_ASSERT_EQ(memcmp(&r.sq[i], &pattern, sizeof(pattern)), 0,
+				"submission entry %u intact", i);
+		pattern = (struct kevent_qos_s){ .ident = ~(uint64_t)i, .udata = i };
+		T_QUIET; T_ASSERT_EQ(memcmp(&r.cq[i], &pattern, sizeof(pattern)), 0,
+				"completion entry %u intact", i);
+	}
+	T_EXPECT_EQ(r.hdr->krh_sq_tail, 0x5a5a5a5aU, "header intact");
+	T_PASS("closed kqueue's rings untouched by %zu new kqueues",
+			sizeof(fresh) / sizeof(fresh[0]));
+}
+
+/*
+ * Trigger and collect RING_ENTRIES user events per round, once by passing
+ * lists to kevent_qos() and once through the rings, and report the rate.
+ */
+#define ROUNDS	20000
+
+static double
+abs_to_secs(uint64_t abs)
+{
+	static mach_timebase_info_data_t tb;
+
+	if (tb.denom == 0) {
+		mach_timebase_info(&tb);
+	}
+	return (double)abs * tb.numer / tb.denom / NSEC_PER_SEC;
+}
+
+static int
+user_kqueue(struct kevent_qos_s *changes)
+{
+	int kq, i;
+
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+	for (i = 0; i < RING_ENTRIES; i++) {
+		changes[i] = (struct kevent_qos_s){
+			.ident = (uint64_t)i,
+			.filter = EVFILT_USER,
+			.flags = EV_ADD | EV_CLEAR,
+		};
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kevent_qos(kq, changes, RING_ENTRIES, NULL, 0,
+			NULL, NULL, KEVENT_FLAG_IMMEDIATE), "register user events");
+	for (i = 0; i < RING_ENTRIES; i++) {
+		changes[i].flags = 0;
+		changes[i].fflags = NOTE_TRIGGER;
+	}
+	return kq;
+}
+
+T_DECL(perf_kevent_ring, "user event rate, lists vs. rings")
+{
+	static struct kevent_qos_s changes[RING_ENTRIES], events[RING_ENTRIES];
+	struct kevent_qos_s kev;
+	uint64_t start, events_seen;
+	double lists, rings;
+	struct ring r;
+	int kq, n, i, round;
+
+	kq = user_kqueue(changes);
+	events_seen = 0;
+	start = mach_absolute_time();
+	for (round = 0; round < ROUNDS; round++) {
+		n = kevent_qos(kq, changes, RING_ENTRIES, events, RING_ENTRIES,
+				NULL, NULL, KEVENT_FLAG_IMMEDIATE);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "kevent_qos");
+		events_seen += (uint64_t)n;
+	}
+	lists = (double)events_seen / abs_to_secs(mach_absolute_time() - start);
+	close(kq);
+
+	kq = user_kqueue(changes);
+	ring_setup(kq, RING_ENTRIES, &r);
+	events_seen = 0;
+	start = mach_absolute_time();
+	for (round = 0; round < ROUNDS; round++) {
+		for (i = 0; i < RING_ENTRIES; i++) {
+			ring_submit(&r, &changes[i]);
+		}
+		n = ring_enter(kq, KEVENT_FLAG_IMMEDIATE);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "kevent_qos ring");
+		while (ring_reap(&r, &kev)) {
+			events_seen++;
+		}
+	}
+	rings = (double)events_seen / abs_to_secs(mach_absolute_time() - start);
+	close(kq);
+
+	T_LOG("%.0f events/s with lists, %.0f events/s with rings", lists, rings);
+	T_PERF("lists", lists, "events/s", "kevent_qos with change and event lists");
+	T_PERF("rings", rings, "events/s", "kevent_qos with shared rings");
+}
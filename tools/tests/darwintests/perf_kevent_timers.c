@@ -0,0 +1,109 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <errno.h>
+#include <libproc.h>
+#include <stdlib.h>
+#include <sys/event.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.perf.kevent"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * One kqueue holding a very large number of repeating EVFILT_TIMERs with
+ * intervals spread over a range.  The process just collects events, so
+ * what it costs is the price of keeping that many timers running: report
+ * the events delivered per return from kevent, the process's wakeups and
+ * the CPU it used, per second.
+ */
+#define NTIMERS		100000
+#define INTERVAL_MIN_MS	50
+#define INTERVAL_RANGE_MS	950
+#define RUN_SECS	5
+#define NEVENTS		1024
+
+static double
+abs_to_secs(uint64_t abs)
+{
+	static mach_timebase_info_data_t tb;
+
+	if (tb.denom == 0) {
+		mach_timebase_info(&tb);
+	}
+	return (double)abs * tb.numer / tb.denom / NSEC_PER_SEC;
+}
+
+static void
+run_timers(const char *name, uint32_t fflags, int64_t leeway_ms)
+{
+	struct rusage_info_v3 before, after;
+	struct kevent64_s *kevs;
+	uint64_t events = 0, returns = 0, end;
+	double cpu, wakeups;
+	int kq, n, i;
+
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+
+	kevs = calloc(NTIMERS, sizeof(*kevs));
+	T_QUIET; T_ASSERT_NOTNULL(kevs, "calloc");
+
+	for (i = 0; i < NTIMERS; i++) {
+		EV_SET64(&kevs[i], i, EVFILT_TIMER, EV_ADD | EV_ENABLE, fflags,
+		         INTERVAL_MIN_MS + arc4random_uniform(INTERVAL_RANGE_MS), 0, 0, leeway_ms);
+	}
+	T_ASSERT_POSIX_SUCCESS(kevent64(kq, kevs, NTIMERS, NULL, 0, 0, NULL),
+	                       "add %d timers", NTIMERS);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(proc_pid_rusage(getpid(), RUSAGE_INFO_V3,
+	                                (rusage_info_t *)&before), "proc_pid_rusage");
+
+	end = mach_absolute_time() + (uint64_t)(RUN_SECS / abs_to_secs(1));
+	while (mach_absolute_time() < end) {
+		struct timespec timeout = { .tv_sec = 1, .tv_nsec = 0 };
+
+		n = kevent64(kq, NULL, 0, kevs, NEVENTS, 0, &timeout);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "kevent64");
+		returns++;
+		for (i = 0; i < n; i++) {
+			events += (uint64_t)kevs[i].data;
+		}
+	}
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(proc_pid_rusage(getpid(), RUSAGE_INFO_V3,
+	                                (rusage_info_t *)&after), "proc_pid_rusage");
+
+	cpu = abs_to_secs((after.ri_user_time - before.ri_user_time) +
+	                  (after.ri_system_time - before.ri_system_time));
+	wakeups = (double)((after.ri_interrupt_wkups - before.ri_interrupt_wkups) +
+	                   (after.ri_pkg_idle_wkups - before.ri_pkg_idle_wkups));
+
+	T_LOG("%s: %llu timer pops in %llu returns from kevent, %.0f wakeups, %.3fs of cpu",
+	      name, events, returns, wakeups, cpu);
+
+	T_PERF("wakeups", wakeups / RUN_SECS, "wakeups/s", name);
+	T_PERF("cpu", cpu / RUN_SECS * 100, "%", name);
+	T_PERF("events_per_return", (double)events / (double)(returns ? returns : 1),
+	       "events", name);
+
+	free(kevs);
+	close(kq);
+}
+
+T_DECL(kevent_timers_massive, "CPU and wakeups for 100k repeating kqueue timers")
+{
+	run_timers("no leeway", 0, 0);
+}
+
+T_DECL(kevent_timers_massive_leeway, "CPU and wakeups for 100k repeating kqueue timers with 10ms leeway")
+{
+	run_timers("10ms leeway", NOTE_LEEWAY, 10);
+}
@@ -0,0 +1,272 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <os/lock.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/sysctl.h>
+
+/* from <sys/ulock.h>, which isn't installed */
+#define UL_COMPARE_AND_WAIT	1
+#define ULF_WAKE_ALL		0x00000100
+#define ULF_WAKE_REQUEUE	0x00000800
+
+extern int __ulock_wait(uint32_t operation, void *addr, uint64_t value, uint32_t timeout);
+extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.perf.ulock"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Pairs of threads hammer their own group of os_unfair_locks, so every
+ * lock is contended (and goes through ulock_wait/ulock_wake) but no two
+ * pairs ever touch the same lock: the kernel's ulock table is the only
+ * thing they share.
+ */
+#define NLOCKS		4096
+#define ITERATIONS	20000
+
+static os_unfair_lock locks[NLOCKS];
+static volatile uint64_t counters[NLOCKS];
+static int nthreads;
+static int locks_per_pair;
+
+static void *
+hammer(void *arg)
+{
+	int pair = (int)(uintptr_t)arg / 2;
+	int first = pair * locks_per_pair;
+
+	for (int i = 0; i < ITERATIONS; i++) {
+		int l = first + (i % locks_per_pair);
+
+		os_unfair_lock_lock(&locks[l]);
+		counters[l]++;
+		os_unfair_lock_unlock(&locks[l]);
+	}
+	return NULL;
+}
+
+static void
+run_pairs(void)
+{
+	pthread_t threads[nthreads];
+
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL, hammer, (void *)(uintptr_t)i), NULL);
+	}
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), NULL);
+	}
+}
+
+static int
+bucket_stats(uint64_t stats[3])
+{
+	size_t size = 3 * sizeof(uint64_t);
+
+	return sysctlbyname("kern.ulock_bucket_stats", stats, &size, NULL, 0);
+}
+
+T_DECL(ulock_contended_pairs, "contended os_unfair_locks, independent per pair of threads")
+{
+	uint64_t before[3], after[3];
+	int ncpu;
+	size_t size = sizeof(ncpu);
+	int have_stats;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpu, &size, NULL, 0), NULL);
+	nthreads = 2 * ncpu;
+	locks_per_pair = NLOCKS / (nthreads / 2);
+	for (int i = 0; i < NLOCKS; i++) {
+		locks[i] = OS_UNFAIR_LOCK_INIT;
+	}
+
+	have_stats = (bucket_stats(before) == 0);
+
+	dt_stat_time_t s = dt_stat_time_create("time for all pairs to finish");
+	while (!dt_stat_stable(s)) {
+		T_STAT_MEASURE(s) {
+			run_pairs();
+		}
+	}
+	dt_stat_finalize(s);
+
+	if (have_stats && bucket_stats(after) == 0) {
+		T_LOG("ulock bucket locks: %llu acquired, %llu contended, %llu in the worst bucket",
+		      after[0] - before[0], after[1] - before[1], after[2]);
+	}
+}
+
+/*
+ * One producer broadcasts a condition variable, built directly on
+ * ulocks, to a crowd of consumers that all need the mutex when they
+ * wake up.  With ULF_WAKE_ALL they stampede onto the mutex, with
+ * ULF_WAKE_REQUEUE only one is woken and the others are moved onto
+ * the mutex's wait queue, to be woken one at a time as it's released.
+ */
+#define BROADCAST_ROUNDS	200
+
+static _Atomic uint32_t mtx;		/* 0: unlocked, 1: locked, 2: locked with waiters */
+static _Atomic uint32_t cv_seq;
+static _Atomic uint32_t ack_seq;
+static uint32_t generation;		/* protected by mtx */
+static int nconsumed;			/* protected by mtx */
+static bool done;			/* protected by mtx */
+static bool use_requeue;
+static int nconsumers;
+
+static void
+mtx_lock_contended(void)
+{
+	while (atomic_exchange(&mtx, 2) != 0) {
+		__ulock_wait(UL_COMPARE_AND_WAIT, &mtx, 2, 0);
+	}
+}
+
+static void
+mtx_lock(void)
+{
+	uint32_t unlocked = 0;
+
+	if (!atomic_compare_exchange_strong(&mtx, &unlocked, 1)) {
+		mtx_lock_contended();
+	}
+}
+
+static void
+mtx_unlock(void)
+{
+	if (atomic_exchange(&mtx, 0) == 2) {
+		__ulock_wake(UL_COMPARE_AND_WAIT, &mtx, 0);
+	}
+}
+
+static void
+cv_wait(_Atomic uint32_t *cv)
+{
+	uint32_t seq = atomic_load(cv);
+
+	mtx_unlock();
+	__ulock_wait(UL_COMPARE_AND_WAIT, cv, seq, 0);
+	/* we may have been requeued behind other waiters: lock as contended */
+	mtx_lock_contended();
+}
+
+/* called with mtx held */
+static void
+cv_broadcast(_Atomic uint32_t *cv)
+{
+	atomic_fetch_add(cv, 1);
+	if (use_requeue) {
+		/* whoever gets moved onto mtx must be woken by its unlock */
+		atomic_store(&mtx, 2);
+		__ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_REQUEUE, cv, (uint64_t)(uintptr_t)&mtx);
+	} else {
+		__ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_ALL, cv, 0);
+	}
+}
+
+static void *
+consumer(__unused void *arg)
+{
+	uint32_t seen = 0;
+
+	mtx_lock();
+	for (;;) {
+		while (generation == seen && !done) {
+			cv_wait(&cv_seq);
+		}
+		if (done) {
+			break;
+		}
+		seen = generation;
+		if (++nconsumed == nconsumers) {
+			atomic_fetch_add(&ack_seq, 1);
+			__ulock_wake(UL_COMPARE_AND_WAIT, &ack_seq, 0);
+		}
+	}
+	mtx_unlock();
+	return NULL;
+}
+
+static void
+produce(int rounds)
+{
+	for (int i = 0; i < rounds; i++) {
+		mtx_lock();
+		generation++;
+		nconsumed = 0;
+		cv_broadcast(&cv_seq);
+		while (nconsumed < nconsumers) {
+			uint32_t seq = atomic_load(&ack_seq);
+
+			mtx_unlock();
+			__ulock_wait(UL_COMPARE_AND_WAIT, &ack_seq, seq, 0);
+			mtx_lock();
+		}
+		mtx_unlock();
+	}
+}
+
+static void
+run_broadcast(bool requeue, const char *name)
+{
+	int ncpu;
+	size_t size = sizeof(ncpu);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpu, &size, NULL, 0), NULL);
+	nconsumers = 4 * ncpu;
+	use_requeue = requeue;
+	generation = 0;
+	done = false;
+
+	pthread_t threads[nconsumers];
+
+	for (int i = 0; i < nconsumers; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL, consumer, NULL), NULL);
+	}
+
+	dt_stat_time_t s = dt_stat_time_create("%s: time for %d broadcasts to %d consumers",
+	                                       name, BROADCAST_ROUNDS, nconsumers);
+	while (!dt_stat_stable(s)) {
+		T_STAT_MEASURE(s) {
+			produce(BROADCAST_ROUNDS);
+		}
+	}
+	dt_stat_finalize(s);
+
+	mtx_lock();
+	done = true;
+	cv_broadcast(&cv_seq);
+	mtx_unlock();
+
+	for (int i = 0; i < nconsumers; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), NULL);
+	}
+}
+
+T_DECL(ulock_broadcast_wake_all, "condition variable broadcast with ULF_WAKE_ALL")
+{
+	run_broadcast(false, "wake all");
+}
+
+T_DECL(ulock_broadcast_requeue, "condition variable broadcast with ULF_WAKE_REQUEUE")
+{
+	_Atomic uint32_t probe = 0, probe_dst = 0;
+
+	/* nobody waits on probe: ENOENT if requeue is supported, EINVAL if not */
+	if (__ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_REQUEUE, &probe,
+	                 (uint64_t)(uintptr_t)&probe_dst) == -1 && errno == EINVAL) {
+		T_SKIP("ULF_WAKE_REQUEUE is not supported");
+	}
+
+	run_broadcast(true, "requeue");
+}
@@ -0,0 +1,185 @@
+/*
+ * Large blocking writes to a pipe are handed to the reader straight from
+ * the writer's pages (see PIPE_MINDIRECT in <sys/pipe.h>).  Check that the
+ * data survives reads of any size, that a signal ends the write with the
+ * count the reader actually got, and that EVFILT_WRITE fires once the
+ * direct write is over.
+ */
+
+#include <darwintest.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/event.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.pipe"));
+
+/* well above PIPE_MINDIRECT, so that the write goes direct */
+#define DIRECT_WRITE_SIZE	(1024 * 1024)
+#define PARTIAL_READ_SIZE	4096
+
+struct writer {
+	int	fd;
+	char	*buf;
+	ssize_t	written;
+	int	error;
+};
+
+static char *
+pattern_alloc(void)
+{
+	char *buf = malloc(DIRECT_WRITE_SIZE);
+	size_t i;
+
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	for (i = 0; i < DIRECT_WRITE_SIZE; i++)
+		buf[i] = (char)(i % 251);
+	return buf;
+}
+
+/* read exactly "len" bytes at offset "off" of the stream, and check them */
+static void
+read_and_check(int fd, size_t off, size_t len, size_t chunk)
+{
+	char *buf = malloc(chunk);
+	ssize_t n;
+	size_t i;
+
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	while (len > 0) {
+		n = read(fd, buf, MIN(chunk, len));
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "read");
+		T_QUIET; T_ASSERT_GT(n, 0L, "read before the end of the write");
+		for (i = 0; i < (size_t)n; i++) {
+			if (buf[i] != (char)((off + i) % 251))
+				T_ASSERT_FAIL("wrong data at offset %zu", off + i);
+		}
+		off += (size_t)n;
+		len -= (size_t)n;
+	}
+	free(buf);
+}
+
+static void *
+writer_thread(void *arg)
+{
+	struct writer *w = arg;
+
+	w->written = write(w->fd, w->buf, DIRECT_WRITE_SIZE);
+	w->error = (w->written < 0) ? errno : 0;
+	return NULL;
+}
+
+static void
+sigusr1_handler(__unused int signo)
+{
+}
+
+T_DECL(pipe_direct_write_partial_reads, "reads of any size see all of a direct write")
+{
+	static const size_t chunks[] = { 1, 1000, PARTIAL_READ_SIZE, 70000, DIRECT_WRITE_SIZE };
+	struct writer w;
+	pthread_t thread;
+	size_t off, len, chunk, i;
+	int fds[2];
+
+	T_ASSERT_POSIX_SUCCESS(pipe(fds), "pipe");
+	w.fd = fds[1];
+	w.buf = pattern_alloc();
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&thread, NULL, writer_thread, &w), NULL);
+	/* a few reads of each size in turn, none of them lined up with pages */
+	for (off = 0, i = 0; off < DIRECT_WRITE_SIZE; off += len, i++) {
+		chunk = chunks[i % (sizeof(chunks) / sizeof(chunks[0]))];
+		len = MIN(7 * chunk, DIRECT_WRITE_SIZE - off);
+		read_and_check(fds[0], off, len, chunk);
+	}
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(thread, NULL), NULL);
+
+	T_EXPECT_EQ(w.written, (ssize_t)DIRECT_WRITE_SIZE, "write() moved everything");
+
+	close(fds[1]);
+	T_EXPECT_EQ(read(fds[0], w.buf, 1), 0L, "nothing after the write");
+	close(fds[0]);
+	free(w.buf);
+}
+
+T_DECL(pipe_direct_write_signal, "a signal ends a direct write with what the reader got")
+{
+	struct sigaction sa = { .sa_handler = sigusr1_handler }; /* no SA_RESTART */
+	struct writer w;
+	pthread_t thread;
+	int fds[2];
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sigaction(SIGUSR1, &sa, NULL), "sigaction");
+
+	T_ASSERT_POSIX_SUCCESS(pipe(fds), "pipe");
+	w.fd = fds[1];
+	w.buf = pattern_alloc();
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&thread, NULL, writer_thread, &w), NULL);
+	read_and_check(fds[0], 0, PARTIAL_READ_SIZE, PARTIAL_READ_SIZE);
+
+	/* the writer is now waiting for us to take the rest */
+	usleep(100 * 1000);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_kill(thread, SIGUSR1), "pthread_kill");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(thread, NULL), NULL);
+
+	T_ASSERT_GE(w.written, (ssize_t)PARTIAL_READ_SIZE, "write() counts what was read");
+	T_ASSERT_LT(w.written, (ssize_t)DIRECT_WRITE_SIZE, "write() was interrupted");
+
+	/* whatever the write reported, and nothing more, is in the pipe */
+	close(fds[1]);
+	read_and_check(fds[0], PARTIAL_READ_SIZE, (size_t)w.written - PARTIAL_READ_SIZE,
+			PARTIAL_READ_SIZE);
+	T_EXPECT_EQ(read(fds[0], w.buf, 1), 0L, "nothing past the reported count");
+	close(fds[0]);
+	free(w.buf);
+}
+
+T_DECL(pipe_direct_write_kevent, "EVFILT_WRITE fires when a direct write is over")
+{
+	struct timespec timeout = { .tv_sec = 5, .tv_nsec = 0 };
+	struct timespec poll_ts = { 0, 0 };
+	struct kevent kev;
+	struct writer w;
+	pthread_t thread;
+	int fds[2], kq;
+
+	T_ASSERT_POSIX_SUCCESS(pipe(fds), "pipe");
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+
+	/* an empty pipe is writable: consume that first event */
+	EV_SET(&kev, fds[1], EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kevent(kq, &kev, 1, NULL, 0, NULL), "kevent(EV_ADD)");
+	T_QUIET; T_ASSERT_EQ(kevent(kq, NULL, 0, &kev, 1, &poll_ts), 1, "pipe starts writable");
+
+	w.fd = fds[1];
+	w.buf = pattern_alloc();
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&thread, NULL, writer_thread, &w), NULL);
+	read_and_check(fds[0], 0, PARTIAL_READ_SIZE, PARTIAL_READ_SIZE);
+
+	T_EXPECT_EQ(kevent(kq, NULL, 0, &kev, 1, &poll_ts), 0,
+			"not writable during the direct write");
+
+	read_and_check(fds[0], PARTIAL_READ_SIZE, DIRECT_WRITE_SIZE - PARTIAL_READ_SIZE,
+			DIRECT_WRITE_SIZE);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(thread, NULL), NULL);
+	T_EXPECT_EQ(w.written, (ssize_t)DIRECT_WRITE_SIZE, "write() moved everything");
+
+	T_ASSERT_EQ(kevent(kq, NULL, 0, &kev, 1, &timeout), 1,
+			"writable once the direct write is over");
+	T_EXPECT_EQ((int)kev.filter, EVFILT_WRITE, "EVFILT_WRITE fired");
+	T_EXPECT_GT((long)kev.data, 0L, "with room in the buffer");
+
+	close(kq);
+	close(fds[0]);
+	close(fds[1]);
+	free(w.buf);
+}
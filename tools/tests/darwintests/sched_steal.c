@@ -0,0 +1,147 @@
+/*
+ * Check cross-pset work stealing: start more spinning threads than one
+ * processor set has processors, all in one affinity set so they are
+ * placed on the same pset, and check that idle processors in another
+ * package (another steal domain) take some of them.
+ */
+
+#include <darwintest.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/param.h>
+#include <sys/sysctl.h>
+#include <stdatomic.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
+
+#include <os/tsd.h> /* private header for _os_cpu_number */
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.scheduler"));
+
+/* any tag will do, as long as every spinner uses the same one */
+#define STEAL_AFFINITY_TAG	1
+
+static _Atomic bool g_done = false;
+static _Atomic int g_ready = 0;
+static _Atomic bool *g_cpu_seen;
+static uint32_t g_ncpu;
+
+static uint64_t
+steal_stat(const char *name)
+{
+	uint64_t value = 0;
+	size_t size = sizeof(value);
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(sysctlbyname(name, &value, &size, NULL, 0), "%s", name);
+	return value;
+}
+
+/* logical processors sharing the last level cache, i.e. in one pset */
+static uint32_t
+pset_cpu_count(void)
+{
+	uint64_t config[10] = { 0 };
+	size_t size = sizeof(config);
+	int i;
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(sysctlbyname("hw.cacheconfig", config, &size, NULL, 0),
+			"hw.cacheconfig");
+	for (i = (int)(size / sizeof(config[0])) - 1; i > 0; i--) {
+		if (config[i] != 0)
+			return (uint32_t)config[i];
+	}
+	return (uint32_t)config[0];
+}
+
+static void *
+spinner(__unused void *arg)
+{
+	thread_affinity_policy_data_t policy = { STEAL_AFFINITY_TAG };
+	mach_port_t self = mach_thread_self();
+	kern_return_t kr;
+	uint32_t cpu;
+
+	kr = thread_policy_set(self, THREAD_AFFINITY_POLICY,
+			(thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT);
+	mach_port_deallocate(mach_task_self(), self);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "thread_policy_set(THREAD_AFFINITY_POLICY)");
+
+	/* let the affinity set place us before we start to run for real */
+	atomic_fetch_add(&g_ready, 1);
+	while (!atomic_load(&g_done) && atomic_load(&g_ready) > 0)
+		usleep(1000);
+
+	while (!atomic_load_explicit(&g_done, memory_order_relaxed)) {
+		cpu = _os_cpu_number();
+		if (cpu < g_ncpu)
+			atomic_store_explicit(&g_cpu_seen[cpu], true, memory_order_relaxed);
+	}
+	return NULL;
+}
+
+T_DECL(sched_steal_remote, "an idle package steals threads queued on a busy pset")
+{
+	uint64_t remote, migrations;
+	pthread_t *threads;
+	uint32_t per_pset, seen, i;
+	int packages = 0, nthreads;
+	size_t size = sizeof(packages);
+
+	if (sysctlbyname("kern.sched_steal_remote", NULL, &size, NULL, 0) != 0) {
+		T_QUIET; T_ASSERT_EQ(errno, ENOENT, "sysctlbyname(kern.sched_steal_remote)");
+		T_SKIP("kernel does not report work stealing statistics");
+	}
+
+	size = sizeof(packages);
+	T_QUIET; T_ASSERT_POSIX_ZERO(sysctlbyname("hw.packages", &packages, &size, NULL, 0),
+			"hw.packages");
+	if (packages < 2)
+		T_SKIP("needs processors in more than one package");
+
+	size = sizeof(g_ncpu);
+	T_QUIET; T_ASSERT_POSIX_ZERO(sysctlbyname("hw.logicalcpu_max", &g_ncpu, &size, NULL, 0),
+			"hw.logicalcpu_max");
+	per_pset = pset_cpu_count();
+	T_LOG("%d packages, %u processors, %u per pset", packages, g_ncpu, per_pset);
+
+	g_cpu_seen = calloc(g_ncpu, sizeof(g_cpu_seen[0]));
+	T_QUIET; T_ASSERT_NOTNULL(g_cpu_seen, "calloc");
+
+	/* twice what the pset can run, and still less than the whole machine */
+	nthreads = (int)MIN(2 * per_pset, g_ncpu - 1);
+	threads = calloc((size_t)nthreads, sizeof(pthread_t));
+	T_QUIET; T_ASSERT_NOTNULL(threads, "calloc");
+
+	remote = steal_stat("kern.sched_steal_remote");
+	migrations = steal_stat("kern.sched_steal_migrations");
+
+	for (i = 0; i < (uint32_t)nthreads; i++)
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL, spinner, NULL), NULL);
+	while (atomic_load(&g_ready) < nthreads)
+		usleep(1000);
+	atomic_store(&g_ready, 0);
+
+	sleep(2);
+	atomic_store(&g_done, true);
+
+	for (i = 0; i < (uint32_t)nthreads; i++)
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), NULL);
+	free(threads);
+
+	for (seen = 0, i = 0; i < g_ncpu; i++)
+		seen += atomic_load(&g_cpu_seen[i]) ? 1 : 0;
+	free(g_cpu_seen);
+
+	T_LOG("%d threads ran on %u processors", nthreads, seen);
+	T_EXPECT_GT(seen, per_pset, "threads queued on one pset ran outside of it");
+	T_EXPECT_GT(steal_stat("kern.sched_steal_remote"), remote,
+			"another package stole from the busy pset");
+	T_EXPECT_GT(steal_stat("kern.sched_steal_migrations"), migrations,
+			"threads were moved between psets");
+}
@@ -0,0 +1,227 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <errno.h>
+#include <mach/mach.h>
+#include <pthread.h>
+#include <pthread/qos.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/* from <sys/ulock.h>, which isn't installed */
+#define UL_COMPARE_AND_WAIT	1
+#define UL_UNFAIR_LOCK		2
+#define UL_RW_LOCK		3
+#define ULF_WAKE_ALL		0x00000100
+#define ULF_WAKE_N		0x00000400
+#define ULF_WAKE_REQUEUE	0x00000800
+#define ULF_WAIT_READ_HELD	0x00020000
+
+extern int __ulock_wait(uint32_t operation, void *addr, uint64_t value, uint32_t timeout);
+extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.ulock"),
+	T_META_CHECK_LEAKS(false)
+);
+
+#define NWAITERS	4
+/* long enough for the waiters to block in the kernel */
+#define SETTLE_USECS	100000
+
+static _Atomic uint32_t cv;
+static _Atomic uint32_t mtx;
+static _Atomic int nready;
+static _Atomic int nwoken;
+
+static void *
+cv_waiter(void *arg)
+{
+	uint32_t *addr = arg;
+	int ret;
+
+	atomic_fetch_add(&nready, 1);
+	do {
+		ret = __ulock_wait(UL_COMPARE_AND_WAIT, addr, 0, 0);
+	} while (ret == -1 && errno == EINTR);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ret, "__ulock_wait");
+	atomic_fetch_add(&nwoken, 1);
+	return NULL;
+}
+
+static void
+start_waiters(pthread_t *threads, _Atomic uint32_t *addr)
+{
+	int i;
+
+	atomic_store(&nready, 0);
+	atomic_store(&nwoken, 0);
+	for (i = 0; i < NWAITERS; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+				cv_waiter, (void *)addr), "pthread_create");
+	}
+	while (atomic_load(&nready) < NWAITERS)
+		usleep(1000);
+	usleep(SETTLE_USECS);
+}
+
+static void
+join_waiters(pthread_t *threads)
+{
+	int i;
+
+	for (i = 0; i < NWAITERS; i++)
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), "pthread_join");
+}
+
+T_DECL(ulock_wake_n, "ULF_WAKE_N wakes up at most that many waiters")
+{
+	pthread_t threads[NWAITERS];
+	int ret;
+
+	start_waiters(threads, &cv);
+
+	ret = __ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_N, &cv, 2);
+	T_ASSERT_EQ(ret, 2, "two waiters woken");
+	usleep(SETTLE_USECS);
+	T_EXPECT_EQ(atomic_load(&nwoken), 2, "the others still wait");
+
+	ret = __ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_N, &cv, 10);
+	T_ASSERT_EQ(ret, NWAITERS - 2, "only the remaining waiters woken");
+	join_waiters(threads);
+	T_EXPECT_EQ(atomic_load(&nwoken), NWAITERS, "all the waiters returned");
+
+	T_EXPECT_POSIX_FAILURE(__ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_N, &cv, 0),
+			EINVAL, "ULF_WAKE_N of nobody");
+}
+
+T_DECL(ulock_wake_requeue, "ULF_WAKE_REQUEUE wakes one waiter and moves the others")
+{
+	pthread_t threads[NWAITERS];
+	int ret;
+
+	start_waiters(threads, &cv);
+
+	ret = __ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_REQUEUE, &cv,
+			(uint64_t)(uintptr_t)&mtx);
+	T_ASSERT_EQ(ret, NWAITERS - 1, "all but one waiter moved");
+	usleep(SETTLE_USECS);
+	T_EXPECT_EQ(atomic_load(&nwoken), 1, "one waiter woken");
+
+	T_EXPECT_POSIX_FAILURE(__ulock_wake(UL_COMPARE_AND_WAIT, &cv, 0), ENOENT,
+			"nobody waits on the condition any more");
+
+	ret = __ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_N, &mtx, 1);
+	T_ASSERT_EQ(ret, 1, "a moved waiter is woken from the mutex");
+	ret = __ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_ALL, &mtx, 0);
+	T_ASSERT_POSIX_SUCCESS(ret, "wake the rest from the mutex");
+	join_waiters(threads);
+	T_EXPECT_EQ(atomic_load(&nwoken), NWAITERS, "all the waiters returned");
+
+	T_EXPECT_POSIX_FAILURE(__ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_REQUEUE,
+			&cv, (uint64_t)(uintptr_t)&cv), EINVAL, "requeue onto itself");
+}
+
+static _Atomic uint32_t rwlock;
+static _Atomic int rw_wait_ret;
+
+static void *
+rw_writer_waiter(void *arg __unused)
+{
+	int ret;
+
+	atomic_fetch_add(&nready, 1);
+	do {
+		ret = __ulock_wait(UL_RW_LOCK, &rwlock, atomic_load(&rwlock), 0);
+	} while (ret == -1 && errno == EINTR);
+	atomic_store(&rw_wait_ret, ret == -1 ? errno : 0);
+	return NULL;
+}
+
+static int
+current_priority(void)
+{
+	struct thread_extended_info info;
+	mach_msg_type_number_t count = THREAD_EXTENDED_INFO_COUNT;
+	mach_port_t self = mach_thread_self();
+	kern_return_t kr;
+
+	kr = thread_info(self, THREAD_EXTENDED_INFO, (thread_info_t)&info, &count);
+	mach_port_deallocate(mach_task_self(), self);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "thread_info");
+	return info.pth_curpri;
+}
+
+T_DECL(ulock_rw_writer_promotion,
+		"a writer storing its raw port name is promoted by UL_RW_LOCK waiters")
+{
+	pthread_attr_t attr;
+	pthread_t waiter;
+	mach_port_t self;
+	int base, promoted;
+
+	T_ASSERT_POSIX_ZERO(pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0),
+			"run the writer at utility QoS");
+	base = current_priority();
+
+	/* the port name as mach_thread_self() returns it, low bits set */
+	self = mach_thread_self();
+	atomic_store(&rwlock, (uint32_t)self);
+
+	atomic_store(&nready, 0);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_attr_init(&attr), "pthread_attr_init");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_attr_set_qos_class_np(&attr,
+			QOS_CLASS_USER_INTERACTIVE, 0), "pthread_attr_set_qos_class_np");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&waiter, &attr,
+			rw_writer_waiter, NULL), "pthread_create");
+	while (atomic_load(&nready) < 1)
+		usleep(1000);
+	usleep(SETTLE_USECS);
+
+	promoted = current_priority();
+	T_EXPECT_GT(promoted, base, "the writer runs above its base priority (%d > %d)",
+			promoted, base);
+
+	atomic_store(&rwlock, 0);
+	T_ASSERT_POSIX_SUCCESS(__ulock_wake(UL_RW_LOCK, &rwlock, 0), "write unlock");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(waiter, NULL), "pthread_join");
+	T_EXPECT_EQ(atomic_load(&rw_wait_ret), 0, "the waiter was woken");
+	T_EXPECT_EQ(current_priority(), base, "the promotion is dropped on unlock");
+
+	mach_port_deallocate(mach_task_self(), self);
+}
+
+static void *
+park(void *arg __unused)
+{
+	pause();
+	return NULL;
+}
+
+T_DECL(ulock_rw_read_held, "waiting on a read-held UL_RW_LOCK promotes nobody")
+{
+	/* a reader count kept in the upper bits, which names no port */
+	uint32_t readers = 0xfffff000;
+	_Atomic uint32_t lock = readers;
+	pthread_t writer;
+	uint32_t name;
+
+	T_EXPECT_POSIX_FAILURE(__ulock_wait(UL_RW_LOCK | ULF_WAIT_READ_HELD, &lock,
+			readers, 10000), ETIMEDOUT, "read-held: wait until the timeout");
+	T_EXPECT_POSIX_FAILURE(__ulock_wait(UL_RW_LOCK, &lock, readers, 10000),
+			EOWNERDEAD, "without ULF_WAIT_READ_HELD the value must be a writer");
+
+	/* a writer's name with bit 1 set is still a writer */
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&writer, NULL, park, NULL),
+			"pthread_create");
+	name = (uint32_t)pthread_mach_thread_np(writer) | 0x2;
+	atomic_store(&lock, name);
+	T_EXPECT_POSIX_FAILURE(__ulock_wait(UL_RW_LOCK, &lock, name, 10000),
+			ETIMEDOUT, "write-held by a thread: wait until the timeout");
+
+	T_EXPECT_POSIX_FAILURE(__ulock_wait(UL_UNFAIR_LOCK | ULF_WAIT_READ_HELD, &lock,
+			name, 10000), EINVAL, "ULF_WAIT_READ_HELD is for UL_RW_LOCK only");
+}
@@ -0,0 +1,139 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif /* T_NAMESPACE */
+
+#include <darwintest.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+#include <unistd.h>
+
+T_GLOBAL_META(
+		T_META_NAMESPACE("xnu.vm"),
+		T_META_CHECK_LEAKS(false));
+
+/* small enough for a couple of rounds to fill it many times over */
+#define DEDUP_CAP	(64 * 1024)
+#define NCONTENTS	512
+#define NOISE_BYTES	1024
+
+static uint32_t saved_max_bytes;
+
+static uint64_t
+dedup_stat(const char *name)
+{
+	uint64_t value = 0;
+	size_t len = sizeof(value);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(name, &value, &len, NULL, 0), "%s", name);
+	return value;
+}
+
+static void
+restore_max_bytes(void)
+{
+	sysctlbyname("vm.compressor_dedup_max_bytes", NULL, NULL,
+			&saved_max_bytes, sizeof(saved_max_bytes));
+}
+
+/* a page that compresses to about NOISE_BYTES, unique to (round, content) */
+static void
+fill_page(char *page, size_t pgsz, uint32_t round, uint32_t content)
+{
+	uint32_t x = (round << 16) ^ content ^ 0x9e3779b9U;
+	size_t i;
+
+	memset(page, 0, pgsz);
+	for (i = 0; i < NOISE_BYTES / sizeof(uint32_t); i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		((uint32_t *)(void *)page)[i] = x;
+	}
+}
+
+/*
+ * Push "copies" identical pages for each of NCONTENTS contents through
+ * the compressor, and check that they all read back intact.
+ */
+static void
+compress_round(uint32_t round, int copies)
+{
+	size_t pgsz = (size_t)getpagesize();
+	size_t size = pgsz * NCONTENTS * (size_t)copies;
+	char *buf, *expect;
+	uint32_t c;
+	int k;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE((void *)buf, MAP_FAILED, "mmap");
+	expect = malloc(pgsz);
+	T_QUIET; T_ASSERT_NOTNULL(expect, "malloc");
+
+	for (c = 0; c < NCONTENTS; c++)
+		for (k = 0; k < copies; k++)
+			fill_page(buf + ((size_t)c * (size_t)copies + (size_t)k) * pgsz, pgsz, round, c);
+
+	if (madvise(buf, size, MADV_PAGEOUT) == -1) {
+		if (errno == ENOTSUP)
+			T_SKIP("MADV_PAGEOUT needs a development kernel");
+		T_ASSERT_FAIL("madvise(MADV_PAGEOUT): %s", strerror(errno));
+	}
+	/* the compressor thread works asynchronously */
+	sleep(2);
+
+	for (c = 0; c < NCONTENTS; c++) {
+		fill_page(expect, pgsz, round, c);
+		for (k = 0; k < copies; k++) {
+			T_QUIET; T_ASSERT_EQ(memcmp(buf + ((size_t)c * (size_t)copies + (size_t)k) * pgsz,
+					expect, pgsz), 0, "content %u copy %d", c, k);
+		}
+	}
+	free(expect);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(munmap(buf, size), "munmap");
+}
+
+T_DECL(vm_compressor_dedup_churn,
+		"dedup keeps sharing after unshared data filled the table past its cap",
+		T_META_ASROOT(true))
+{
+	uint32_t cap = DEDUP_CAP;
+	size_t len = sizeof(saved_max_bytes);
+	uint64_t evictions, hits;
+	uint32_t round;
+	int enabled = 0;
+	size_t elen = sizeof(enabled);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("vm.compressor_dedup_enabled",
+			&enabled, &elen, NULL, 0), "vm.compressor_dedup_enabled");
+	if (!enabled)
+		T_SKIP("compressor dedup is disabled");
+
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("vm.compressor_dedup_max_bytes",
+			&saved_max_bytes, &len, &cap, sizeof(cap)), "lower vm.compressor_dedup_max_bytes");
+	T_ATEND(restore_max_bytes);
+
+	evictions = dedup_stat("vm.compressor_dedup_evictions");
+
+	/*
+	 * Two copies of each content: the first one seeds a hint, the
+	 * second one gets its data copied into the table, and nothing
+	 * ever shares it.  Each round is several times the cap.
+	 */
+	for (round = 0; round < 4; round++)
+		compress_round(round, 2);
+
+	T_EXPECT_GT(dedup_stat("vm.compressor_dedup_evictions"), evictions,
+			"unshared data was evicted");
+	T_EXPECT_LE(dedup_stat("vm.compressor_dedup_bytes"), (uint64_t)DEDUP_CAP,
+			"shared data stays under the cap");
+
+	/* new contents seen three times must still be shared */
+	hits = dedup_stat("vm.compressor_dedup_hits");
+	compress_round(round, 3);
+	T_EXPECT_GT(dedup_stat("vm.compressor_dedup_hits"), hits,
+			"pages still share data once the table has churned");
+}
@@ -0,0 +1,10 @@
+#include "perf_index.h"
+#include "test_range_helper.h"
+
+DECL_SETUP {
+    return test_range_setup(TESTMPROTECT);
+}
+
+DECL_TEST {
+    return test_range_helper(thread_id, num_threads, length, TESTMPROTECT);
+}
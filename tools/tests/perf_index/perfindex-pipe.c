@@ -0,0 +1,111 @@
+#include "perf_index.h"
+#include "fail.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* default size of each write(2), big enough for direct pipe writes */
+#define DEFAULT_WRITESIZE (1L<<20)
+
+static long writesize = DEFAULT_WRITESIZE;
+static char** writebufs;
+
+typedef struct {
+    int fd;
+    char* buf;
+    char expected;
+    long long received;
+    long long corrupted;
+} reader_t;
+
+/* drains the pipe until the writer closes it, the way a consumer in a
+ * shell pipeline would, and checks that every byte is the writer's */
+static void* pipe_reader(void* arg) {
+    reader_t* reader = (reader_t*)arg;
+    ssize_t retval, i;
+
+    while((retval = read(reader->fd, reader->buf, writesize)) > 0) {
+        for(i = 0; i < retval; i++) {
+            if(reader->buf[i] != reader->expected)
+                reader->corrupted++;
+        }
+        reader->received += retval;
+    }
+
+    return NULL;
+}
+
+DECL_SETUP {
+    int i;
+
+    if(test_argc > 0) {
+        writesize = strtol(test_argv[0], NULL, 0);
+        VERIFY(writesize > 0, "invalid write size");
+    }
+
+    /* one buffer per writer, one per reader */
+    writebufs = (char**)calloc(2 * num_threads, sizeof(char*));
+    VERIFY(writebufs != NULL, "calloc failed");
+
+    for(i = 0; i < 2 * num_threads; i++) {
+        writebufs[i] = (char*)malloc(writesize);
+        VERIFY(writebufs[i] != NULL, "malloc failed");
+        memset(writebufs[i], i, writesize);
+    }
+
+    return PERFINDEX_SUCCESS;
+}
+
+/*
+ * each thread streams its share of length bytes through its own pipe
+ * to a reader thread, and is done once the reader has received them
+ */
+DECL_TEST {
+    long long left = length / num_threads;
+    int fds[2];
+    pthread_t thread;
+    reader_t reader;
+    ssize_t retval;
+    long size;
+
+    if(thread_id < length % num_threads)
+        left++;
+
+    VERIFY(pipe(fds) == 0, "pipe failed");
+
+    reader.fd = fds[0];
+    reader.buf = writebufs[num_threads + thread_id];
+    reader.expected = (char)thread_id;
+    reader.received = 0;
+    reader.corrupted = 0;
+    VERIFY(pthread_create(&thread, NULL, pipe_reader, &reader) == 0, "pthread_create failed");
+
+    length = left;
+    while(left > 0) {
+        size = left < writesize ? left : writesize;
+        retval = write(fds[1], writebufs[thread_id], size);
+        VERIFY(retval > 0, "write failed");
+        left -= retval;
+    }
+
+    close(fds[1]);
+    VERIFY(pthread_join(thread, NULL) == 0, "pthread_join failed");
+    close(fds[0]);
+
+    VERIFY(reader.received == length, "reader got short data");
+    VERIFY(reader.corrupted == 0, "reader got corrupted data");
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_CLEANUP {
+    int i;
+
+    for(i = 0; i < 2 * num_threads; i++) {
+        free(writebufs[i]);
+    }
+    free(writebufs);
+
+    return PERFINDEX_SUCCESS;
+}
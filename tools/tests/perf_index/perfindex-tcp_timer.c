@@ -0,0 +1,127 @@
+#include "perf_index.h"
+#include "fail.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * number of loopback connections kept open for the length of the test;
+ * each one is two file descriptors, so going much past this needs a
+ * higher kern.maxfilesperproc, or several clients in remote mode
+ */
+#define DEFAULT_CONNECTIONS 10000
+
+/* keepalive idle time, so that every idle connection has a timer pending */
+#define KEEPALIVE_SECS 60
+
+static long connections = DEFAULT_CONNECTIONS;
+static int* client_fds;
+static int* server_fds;
+
+static int set_sockopts(int fd) {
+    int on = 1;
+    int idle = KEEPALIVE_SECS;
+
+    if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) != 0)
+        return -1;
+    if(setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) != 0)
+        return -1;
+    return setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &idle, sizeof(idle));
+}
+
+DECL_SETUP {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    struct rlimit rl;
+    int listen_fd;
+    long i;
+
+    if(test_argc > 0) {
+        connections = strtol(test_argv[0], NULL, 0);
+        VERIFY(connections > 0, "invalid number of connections");
+    }
+    VERIFY(connections >= num_threads, "fewer connections than threads");
+
+    /* room for both ends of every connection, and then some */
+    VERIFY(getrlimit(RLIMIT_NOFILE, &rl) == 0, "getrlimit failed");
+    if(rl.rlim_cur < (rlim_t)(2 * connections + 64)) {
+        rl.rlim_cur = (rlim_t)(2 * connections + 64);
+        VERIFY(setrlimit(RLIMIT_NOFILE, &rl) == 0, "setrlimit failed, raise kern.maxfilesperproc");
+    }
+
+    client_fds = (int*)calloc(connections, sizeof(int));
+    server_fds = (int*)calloc(connections, sizeof(int));
+    VERIFY(client_fds != NULL && server_fds != NULL, "calloc failed");
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    VERIFY(listen_fd >= 0, "socket failed");
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_len = sizeof(sin);
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = 0;
+    VERIFY(bind(listen_fd, (struct sockaddr*)&sin, sizeof(sin)) == 0, "bind failed");
+    VERIFY(getsockname(listen_fd, (struct sockaddr*)&sin, &len) == 0, "getsockname failed");
+    VERIFY(listen(listen_fd, SOMAXCONN) == 0, "listen failed");
+
+    for(i = 0; i < connections; i++) {
+        client_fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+        VERIFY(client_fds[i] >= 0, "socket failed");
+        VERIFY(connect(client_fds[i], (struct sockaddr*)&sin, sizeof(sin)) == 0, "connect failed");
+        server_fds[i] = accept(listen_fd, NULL, NULL);
+        VERIFY(server_fds[i] >= 0, "accept failed");
+        VERIFY(set_sockopts(client_fds[i]) == 0, "setsockopt failed");
+        VERIFY(set_sockopts(server_fds[i]) == 0, "setsockopt failed");
+    }
+    close(listen_fd);
+
+    return PERFINDEX_SUCCESS;
+}
+
+/*
+ * each thread goes round its share of the connections, sending one byte
+ * over each and reading it back on the other end, until it has done
+ * length/num_threads of them: every send arms a retransmit timer that
+ * the ack cancels, and every receive a delayed ack, while all the other
+ * connections keep their keepalive timers pending
+ */
+DECL_TEST {
+    long long left = length / num_threads;
+    long first, count, i;
+    char byte = 0;
+
+    if(thread_id < length % num_threads)
+        left++;
+
+    count = connections / num_threads;
+    first = thread_id * count;
+    if(thread_id == num_threads - 1)
+        count = connections - first;
+
+    for(i = 0; left > 0; left--, i = (i + 1) % count) {
+        VERIFY(write(client_fds[first + i], &byte, 1) == 1, "write failed");
+        VERIFY(read(server_fds[first + i], &byte, 1) == 1, "read failed");
+    }
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_CLEANUP {
+    long i;
+
+    for(i = 0; i < connections; i++) {
+        close(client_fds[i]);
+        close(server_fds[i]);
+    }
+    free(client_fds);
+    free(server_fds);
+
+    return PERFINDEX_SUCCESS;
+}
@@ -0,0 +1,142 @@
+#include "perf_index.h"
+#include "fail.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <mach/mach.h>
+#include <mach/semaphore.h>
+
+/*
+ * number of threads parked in timed waits for the length of the test,
+ * keeping that many timers pending on the cpus' timer queues
+ */
+#define DEFAULT_PENDING 1000
+
+/* timed waits last from 1ms to just under 1s, short of longterm timers */
+#define TIMEOUT_MIN_NS (1000 * 1000)
+#define TIMEOUT_RANGE_NS (998 * 1000 * 1000)
+
+static long pending = DEFAULT_PENDING;
+static pthread_t* parked_threads;
+static semaphore_t park_sem;
+static volatile bool parked_done;
+
+typedef struct {
+    semaphore_t ping;
+    semaphore_t pong;
+    pthread_t thread;
+    volatile bool done;
+} partner_t;
+
+static partner_t* partners;
+
+/* signals signal, if any, and waits on wait with a random timeout */
+static kern_return_t timed_wait_signal(semaphore_t wait, semaphore_t signal) {
+    unsigned int ns = TIMEOUT_MIN_NS + arc4random_uniform(TIMEOUT_RANGE_NS);
+
+    if(signal == SEMAPHORE_NULL)
+        return semaphore_timedwait(wait, (mach_timespec_t){ 0, ns });
+    return semaphore_timedwait_signal(wait, signal, 0, ns);
+}
+
+/* keeps waiting, each time with a fresh timeout, until wait is signalled */
+static void wait_signal(semaphore_t wait, semaphore_t signal) {
+    kern_return_t kr = timed_wait_signal(wait, signal);
+
+    while(kr == KERN_OPERATION_TIMED_OUT)
+        kr = timed_wait_signal(wait, SEMAPHORE_NULL);
+}
+
+/* re-arms a timed wait every time the previous one times out */
+static void* parked_thread(void* arg) {
+    while(!parked_done)
+        timed_wait_signal(park_sem, SEMAPHORE_NULL);
+    return NULL;
+}
+
+/* answers each ping, waiting for the next one */
+static void* partner_thread(void* arg) {
+    partner_t* partner = (partner_t*)arg;
+
+    wait_signal(partner->ping, SEMAPHORE_NULL);
+    while(!partner->done)
+        wait_signal(partner->ping, partner->pong);
+    return NULL;
+}
+
+DECL_SETUP {
+    pthread_attr_t attr;
+    int i;
+
+    if(test_argc > 0) {
+        pending = strtol(test_argv[0], NULL, 0);
+        VERIFY(pending >= 0, "invalid number of pending timers");
+    }
+
+    VERIFY(semaphore_create(mach_task_self(), &park_sem, SYNC_POLICY_FIFO, 0) == KERN_SUCCESS, "semaphore_create failed");
+
+    VERIFY(pthread_attr_init(&attr) == 0, "pthread_attr_init failed");
+    VERIFY(pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN) == 0, "pthread_attr_setstacksize failed");
+
+    parked_threads = (pthread_t*)calloc(pending, sizeof(pthread_t));
+    VERIFY(parked_threads != NULL || pending == 0, "calloc failed");
+    for(i = 0; i < pending; i++) {
+        VERIFY(pthread_create(&parked_threads[i], &attr, parked_thread, NULL) == 0, "pthread_create failed");
+    }
+
+    partners = (partner_t*)calloc(num_threads, sizeof(partner_t));
+    VERIFY(partners != NULL, "calloc failed");
+    for(i = 0; i < num_threads; i++) {
+        VERIFY(semaphore_create(mach_task_self(), &partners[i].ping, SYNC_POLICY_FIFO, 0) == KERN_SUCCESS, "semaphore_create failed");
+        VERIFY(semaphore_create(mach_task_self(), &partners[i].pong, SYNC_POLICY_FIFO, 0) == KERN_SUCCESS, "semaphore_create failed");
+        VERIFY(pthread_create(&partners[i].thread, &attr, partner_thread, &partners[i]) == 0, "pthread_create failed");
+    }
+
+    pthread_attr_destroy(&attr);
+
+    return PERFINDEX_SUCCESS;
+}
+
+/*
+ * each thread ping-pongs with its partner thread, both sides blocking
+ * with random timeouts, so every round trip arms and cancels two timers
+ * among the pending ones
+ */
+DECL_TEST {
+    long long rounds = length / num_threads;
+    partner_t* partner = &partners[thread_id];
+    long long i;
+
+    if(thread_id < length % num_threads)
+        rounds++;
+
+    for(i = 0; i < rounds; i++) {
+        wait_signal(partner->pong, partner->ping);
+    }
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_CLEANUP {
+    int i;
+
+    for(i = 0; i < num_threads; i++) {
+        partners[i].done = true;
+        semaphore_signal(partners[i].ping);
+        VERIFY(pthread_join(partners[i].thread, NULL) == 0, "pthread_join failed");
+        semaphore_destroy(mach_task_self(), partners[i].ping);
+        semaphore_destroy(mach_task_self(), partners[i].pong);
+    }
+    free(partners);
+
+    parked_done = true;
+    semaphore_signal_all(park_sem);
+    for(i = 0; i < pending; i++) {
+        VERIFY(pthread_join(parked_threads[i], NULL) == 0, "pthread_join failed");
+    }
+    free(parked_threads);
+    semaphore_destroy(mach_task_self(), park_sem);
+
+    return PERFINDEX_SUCCESS;
+}
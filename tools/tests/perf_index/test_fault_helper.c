@@ -1,6 +1,7 @@
 #include "test_fault_helper.h"
 #include "fail.h"
 #include <sys/mman.h>
+#include <mach/vm_statistics.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
@@ -12,6 +13,9 @@
 #define MEMSIZE (1L<<30)
 #endif
 
+/* read_fault splits memblock into many map entries of this size */
+#define ENTRYSIZE (1L<<20)
+
 static char* memblock;
 
 int test_fault_setup() {
@@ -37,6 +41,41 @@ int test_fault_setup() {
     return PERFINDEX_SUCCESS;
 }
 
+int test_read_fault_setup() {
+    char *ptr;
+    int pgsz = getpagesize();
+    int retval;
+    long i;
+
+    memblock = (char *)mmap(NULL, MEMSIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    VERIFY(memblock != MAP_FAILED, "mmap failed");
+
+    /*
+     * remap it one ENTRYSIZE chunk at a time, alternating the tag so
+     * that neighbouring chunks can't be coalesced: every thread then
+     * faults on a map with MEMSIZE/ENTRYSIZE entries to look through
+     */
+    for(i = 0; i < MEMSIZE / ENTRYSIZE; i++) {
+        ptr = mmap(memblock + i * ENTRYSIZE, ENTRYSIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_FIXED,
+                   VM_MAKE_TAG(VM_MEMORY_APPLICATION_SPECIFIC_1 + (i & 1)), 0);
+        VERIFY(ptr != MAP_FAILED, "mmap failed");
+    }
+
+    /* make sure memory is paged */
+    for(ptr = memblock; ptr<memblock+MEMSIZE; ptr+= pgsz) {
+        *ptr = 1;
+    }
+
+    /* drop the translations, the pages stay resident */
+    retval = mprotect(memblock, MEMSIZE, PROT_NONE);
+    VERIFY(retval == 0, "mprotect failed");
+
+    retval = mprotect(memblock, MEMSIZE, PROT_READ);
+    VERIFY(retval == 0, "mprotect failed");
+
+    return PERFINDEX_SUCCESS;
+}
+
 int test_fault_helper(int thread_id, int num_threads, long long length, testtype_t testtype) {
     char *ptr;
     int pgsz = getpagesize();
@@ -63,7 +102,10 @@ int test_fault_helper(int thread_id, int num_threads, long long length, testtype
 
     while(1) {
         for(ptr = memblock+region_start; ptr<memblock+region_end; ptr+= pgsz) {
-            *ptr = 1;
+            if(testtype == TESTREADFAULT)
+                (void)*(volatile char *)ptr;
+            else
+                *ptr = 1;
             left--;
             if(left==0)
                 break;
@@ -79,6 +121,13 @@ int test_fault_helper(int thread_id, int num_threads, long long length, testtype
             VERIFY(retval == 0, "mprotect failed");
         }
 
+        else if(testtype == TESTREADFAULT) {
+            retval = mprotect(memblock+region_start, region_len, PROT_NONE);
+            VERIFY(retval == 0, "mprotect failed");
+            retval = mprotect(memblock+region_start, region_len, PROT_READ);
+            VERIFY(retval == 0, "mprotect failed");
+        }
+
         else if(testtype == TESTZFOD) {
             retval = munmap(memblock+region_start, region_len) == 0;
             VERIFY(retval == 0, "munmap failed");
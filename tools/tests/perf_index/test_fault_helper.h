@@ -3,10 +3,12 @@
 
 typedef enum {
   TESTZFOD,
-  TESTFAULT
+  TESTFAULT,
+  TESTREADFAULT
 } testtype_t;
 
 int test_fault_setup();
+int test_read_fault_setup();
 int test_fault_helper(int thread_id, int num_threads, long long length, testtype_t testtype);
 
 #endif
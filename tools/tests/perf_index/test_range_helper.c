@@ -0,0 +1,97 @@
+#include "test_range_helper.h"
+#include "fail.h"
+#include <sys/mman.h>
+#include <mach/vm_statistics.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <TargetConditionals.h>
+
+#if TARGET_OS_EMBEDDED
+#define MEMSIZE (1L<<26)
+#else
+#define MEMSIZE (1L<<28)
+#endif
+
+/* memblock is made of many small map entries of this many pages */
+#define REGIONPAGES 4
+
+static char* memblock;
+
+/*
+ * map [start, end) one small region at a time, alternating the tag so
+ * that neighbouring regions can't be coalesced into a single entry,
+ * the way an allocator's runs end up in the map, and page it in
+ */
+static int map_regions(char *start, char *end) {
+    char *ptr, *region;
+    long regionsize = REGIONPAGES * getpagesize();
+    long i;
+
+    for(i = 0, ptr = start; ptr < end; i++, ptr += regionsize) {
+        region = mmap(ptr, regionsize, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_FIXED,
+                      VM_MAKE_TAG(VM_MEMORY_APPLICATION_SPECIFIC_1 + (i & 1)), 0);
+        VERIFY(region != MAP_FAILED, "mmap failed");
+    }
+
+    for(ptr = start; ptr < end; ptr += getpagesize()) {
+        *ptr = 1;
+    }
+
+    return PERFINDEX_SUCCESS;
+}
+
+int test_range_setup(rangetype_t rangetype) {
+    memblock = (char *)mmap(NULL, MEMSIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    VERIFY(memblock != MAP_FAILED, "mmap failed");
+
+    if(rangetype == TESTMPROTECT)
+        return map_regions(memblock, memblock + MEMSIZE);
+
+    return PERFINDEX_SUCCESS;
+}
+
+/*
+ * each call covers all the regions of the thread's share of memblock,
+ * length counts the regions operated on
+ */
+int test_range_helper(int thread_id, int num_threads, long long length, rangetype_t rangetype) {
+    long regionsize = REGIONPAGES * getpagesize();
+    long long num_regions = MEMSIZE / regionsize;
+    long long region_len = num_regions/num_threads;
+    long long region_start = region_len * thread_id;
+    long long left = length;
+    int prot = PROT_READ;
+    int retval;
+
+    if(thread_id < num_regions % num_threads) {
+        region_start += thread_id;
+        region_len++;
+    }
+    else {
+        region_start += num_regions % num_threads;
+    }
+
+    region_start *= regionsize;
+    region_len *= regionsize;
+
+    while(left > 0) {
+        if(rangetype == TESTMPROTECT) {
+            /* the pages stay resident: every call changes the protection of all their translations */
+            retval = mprotect(memblock+region_start, region_len, prot);
+            VERIFY(retval == 0, "mprotect failed");
+            prot ^= PROT_WRITE;
+        }
+
+        else if(rangetype == TESTMUNMAP) {
+            retval = map_regions(memblock+region_start, memblock+region_start+region_len);
+            if(retval != PERFINDEX_SUCCESS)
+                return retval;
+            retval = munmap(memblock+region_start, region_len);
+            VERIFY(retval == 0, "munmap failed");
+        }
+
+        left -= region_len / regionsize;
+    }
+
+    return PERFINDEX_SUCCESS;
+}
@@ -0,0 +1,12 @@
+#ifndef __TEST_RANGE_HELPER_H_
+#define __TEST_RANGE_HELPER_H_
+
+typedef enum {
+  TESTMPROTECT,
+  TESTMUNMAP
+} rangetype_t;
+
+int test_range_setup(rangetype_t rangetype);
+int test_range_helper(int thread_id, int num_threads, long long length, rangetype_t rangetype);
+
+#endif
@@ -15,6 +15,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/sysctl.h>
 
 #define SUPERPAGE_SIZE (2*1024*1024)
 #define SUPERPAGE_MASK (-SUPERPAGE_SIZE)
@@ -572,6 +573,56 @@ test_mmap() {
 	return TRUE;
 }
 
+unsigned int
+superpage_promotions() {
+	unsigned int value = 0;
+	size_t len = sizeof(value);
+
+	if (sysctlbyname("vm.superpage_promotions", &value, &len, NULL, 0))
+		return 0;
+	return value;
+}
+
+/*
+ * Transparent superpages: a range marked with MADV_SUPERPAGE must behave
+ * exactly like ordinary memory, including after a sub-page of it has been
+ * unmapped (which demotes the 2 MB mapping back to 4 KB pages).
+ */
+boolean_t
+test_madvise() {
+	int kr, ret, res;
+	uintptr_t base, addr;
+	int size = 2*SUPERPAGE_SIZE;
+	unsigned int promotions;
+	
+	base = (uintptr_t)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (base == (uintptr_t)MAP_FAILED) {
+		sprintf(error, "mmap()");
+		return FALSE;
+	}
+	kr = madvise((void*)base, size, MADV_SUPERPAGE);
+	if (!(ret = check_kr(kr, "madvise"))) return ret;
+	addr = (base + SUPERPAGE_SIZE - 1) & SUPERPAGE_MASK;
+	promotions = superpage_promotions();
+	if (!(ret = check_rw(addr, SUPERPAGE_SIZE))) return ret;
+	if (superpage_promotions() == promotions) {
+		sprintf(error, "range was not promoted to a superpage");
+		return FALSE;
+	}
+	kr = munmap((void*)(addr + PAGE_SIZE), PAGE_SIZE);
+	if (!(ret = check_kr(kr, "munmap"))) return ret;
+	if (!(ret = check_r(addr + 2*PAGE_SIZE, SUPERPAGE_SIZE - 2*PAGE_SIZE, &res))) return ret;
+	if (!(ret = check_nr(addr + PAGE_SIZE, PAGE_SIZE, NULL))) return ret;
+	if (*(volatile char *)(addr + PAGE_SIZE - 1) != (char)((PAGE_SIZE - 1) & 0xFF)) {
+		sprintf(error, "data lost on demotion");
+		return FALSE;
+	}
+	kr = munmap((void*)base, size);
+	if (!(ret = check_kr(kr, "munmap"))) return ret;
+
+	return TRUE;
+}
+
 /*
  * Tests one allocation/deallocaton cycle; used in a loop this tests for leaks
  */
@@ -605,6 +656,7 @@ test_t test[] = {
 	{ "make sub-page readonly", test_readonlysubpage },
 	{ "file I/O", test_fileio },
 	{ "mmap()", test_mmap },
+	{ "madvise(MADV_SUPERPAGE)", test_madvise },
 	{ "fork", test_fork },
 };
 #define TESTS ((int)(sizeof(test)/sizeof(*test)))